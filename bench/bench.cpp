@@ -0,0 +1,265 @@
+// lab4_bench runner: calibrates each benchmark's iteration count to --benchmark_min_time, prints a table,
+// and writes Google Benchmark style JSON. With --benchmark_baseline=FILE (an earlier JSON report) it exits
+// with status 1 if any benchmark's real time got more than --benchmark_max_regression percent slower.
+#include "bench.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+namespace {
+
+struct Registration {
+    std::string name;
+    Function function;
+};
+
+struct Result {
+    std::string name;
+    uint64_t iterations = 0;
+    double realNs = 0, cpuNs = 0; // Per iteration
+    double bytesPerSecond = 0, itemsPerSecond = 0;
+    std::map<std::string, double> counters;
+    std::string error;
+};
+
+// Function-local statics: registration runs from other translation units' initializers
+std::vector<Registration>& registry() {
+    static std::vector<Registration> benchmarks;
+    return benchmarks;
+}
+
+std::vector<std::pair<std::string, std::string>>& context() {
+    static std::vector<std::pair<std::string, std::string>> entries;
+    return entries;
+}
+
+const uint64_t MAX_ITERATIONS = 1000000000;
+
+Result run_one(const Registration& registration, double minSeconds) {
+    Result result;
+    result.name = registration.name;
+    uint64_t iterations = 1;
+    while (true) {
+        State state(iterations);
+        try {
+            registration.function(state);
+        } catch (const std::exception& e) {
+            result.error = e.what();
+            return result;
+        }
+        if (!state.skipped().empty()) {
+            result.error = state.skipped();
+            return result;
+        }
+        double seconds = state.real_time().count();
+        if (seconds >= minSeconds || iterations >= MAX_ITERATIONS) {
+            result.iterations = iterations;
+            result.realNs = seconds * 1e9 / iterations;
+            result.cpuNs = state.cpu_seconds() * 1e9 / iterations;
+            if (seconds > 0) {
+                result.bytesPerSecond = state.bytes_processed() / seconds;
+                result.itemsPerSecond = state.items_processed() / seconds;
+            }
+            result.counters = state.user_counters();
+            return result;
+        }
+        // Aim past the target so the next run is usually the last; at most 10x per step
+        double scale = seconds > 0 ? minSeconds * 1.4 / seconds : 10.0;
+        uint64_t next = (uint64_t)(iterations * std::min(10.0, std::max(1.0, scale)));
+        iterations = std::min(MAX_ITERATIONS, std::max(iterations + 1, next));
+    }
+}
+
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if ((unsigned char)c < 0x20) { quoted += ' '; continue; }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// One benchmark per line, so read_baseline() needs no JSON parser
+void write_json(std::ostream& out, const std::string& executable, const std::vector<Result>& results) {
+    std::time_t now = std::time(nullptr);
+    char date[64];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out << "{\n  \"context\": {\n";
+    out << "    \"date\": " << json_string(date) << ",\n";
+    out << "    \"executable\": " << json_string(executable) << ",\n";
+    out << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+    for (const auto& entry : context()) out << "    " << json_string(entry.first) << ": " << json_string(entry.second) << ",\n";
+#ifdef NDEBUG
+    out << "    \"library_build_type\": \"release\"\n";
+#else
+    out << "    \"library_build_type\": \"debug\"\n";
+#endif
+    out << "  },\n  \"benchmarks\": [\n";
+    out << std::setprecision(10);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"name\": " << json_string(r.name) << ", \"run_name\": " << json_string(r.name)
+            << ", \"run_type\": \"iteration\", \"repetitions\": 1, \"repetition_index\": 0, \"threads\": 1";
+        if (!r.error.empty()) {
+            out << ", \"error_occurred\": true, \"error_message\": " << json_string(r.error);
+        } else {
+            out << ", \"iterations\": " << r.iterations << ", \"real_time\": " << r.realNs << ", \"cpu_time\": " << r.cpuNs
+                << ", \"time_unit\": \"ns\"";
+            if (r.bytesPerSecond > 0) out << ", \"bytes_per_second\": " << r.bytesPerSecond;
+            if (r.itemsPerSecond > 0) out << ", \"items_per_second\": " << r.itemsPerSecond;
+            for (const auto& counter : r.counters) out << ", " << json_string(counter.first) << ": " << counter.second;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+std::string human_rate(double perSecond, const char* unit) {
+    const char* prefixes[] = {"", "k", "M", "G", "T"};
+    int p = 0;
+    while (perSecond >= 1000 && p < 4) { perSecond /= 1000; ++p; }
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << perSecond << " " << prefixes[p] << unit << "/s";
+    return text.str();
+}
+
+void write_console_header(std::ostream& out, size_t width) {
+    out << std::left << std::setw(width) << "Benchmark" << std::right << std::setw(15) << "Time" << std::setw(15) << "CPU"
+        << std::setw(12) << "Iterations" << "  Rate\n";
+    out << std::string(width + 56, '-') << std::endl;
+}
+
+void write_console_row(std::ostream& out, size_t width, const Result& r) {
+    out << std::left << std::setw(width) << r.name << std::right;
+    if (!r.error.empty()) { out << "  SKIPPED: " << r.error << std::endl; return; }
+    out << std::fixed << std::setprecision(0) << std::setw(12) << r.realNs << " ns" << std::setw(12) << r.cpuNs << " ns"
+        << std::setw(12) << r.iterations;
+    if (r.bytesPerSecond > 0) out << "  " << human_rate(r.bytesPerSecond, "B");
+    else if (r.itemsPerSecond > 0) out << "  " << human_rate(r.itemsPerSecond, "items");
+    out << std::endl;
+}
+
+// name -> real_time, from a report written by write_json()
+std::map<std::string, double> read_baseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot read baseline " + path);
+    std::map<std::string, double> times;
+    std::regex entry("\"name\": \"([^\"]*)\".*\"real_time\": ([0-9.eE+-]+)");
+    std::string line;
+    std::smatch match;
+    while (std::getline(in, line)) {
+        if (std::regex_search(line, match, entry)) times[match[1]] = std::stod(match[2]);
+    }
+    return times;
+}
+
+} // namespace
+
+bool add(const std::string& name, Function function) {
+    registry().push_back(Registration{name, std::move(function)});
+    return true;
+}
+
+void set_context(const std::string& key, const std::string& value) {
+    context().emplace_back(key, value);
+}
+
+} // namespace bench
+
+int main(int argc, char* argv[]) {
+    std::string filter = ".", format = "console", outPath, baselinePath;
+    double minSeconds = 0.5, maxRegression = 10;
+    bool list = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg.rfind("--benchmark_filter=", 0) == 0) { filter = arg.substr(19); continue; }
+            if (arg.rfind("--benchmark_format=", 0) == 0) { format = arg.substr(19); continue; }
+            if (arg.rfind("--benchmark_out=", 0) == 0) { outPath = arg.substr(16); continue; }
+            if (arg.rfind("--benchmark_min_time=", 0) == 0) { minSeconds = std::stod(arg.substr(21)); continue; }
+            if (arg.rfind("--benchmark_baseline=", 0) == 0) { baselinePath = arg.substr(21); continue; }
+            if (arg.rfind("--benchmark_max_regression=", 0) == 0) { maxRegression = std::stod(arg.substr(27)); continue; }
+            if (arg == "--benchmark_list_tests") { list = true; continue; }
+        } catch (...) {
+            std::cerr << "Invalid value in option: " << arg << std::endl;
+            return 2;
+        }
+        std::cerr << "Unknown option: " << arg << "\n"
+                  << "Usage: lab4_bench [--benchmark_filter=REGEX] [--benchmark_format=console|json] [--benchmark_out=FILE]\n"
+                  << "                  [--benchmark_min_time=SECONDS] [--benchmark_baseline=FILE]\n"
+                  << "                  [--benchmark_max_regression=PERCENT] [--benchmark_list_tests]" << std::endl;
+        return 2;
+    }
+    if (format != "console" && format != "json") {
+        std::cerr << "Unknown --benchmark_format: " << format << std::endl;
+        return 2;
+    }
+
+    std::unique_ptr<std::regex> pattern;
+    try {
+        pattern = std::make_unique<std::regex>(filter);
+    } catch (const std::regex_error&) {
+        std::cerr << "Invalid --benchmark_filter: " << filter << std::endl;
+        return 2;
+    }
+
+    std::vector<const bench::Registration*> selected;
+    size_t width = 9;
+    for (const bench::Registration& registration : bench::registry()) {
+        if (!std::regex_search(registration.name, *pattern)) continue;
+        selected.push_back(&registration);
+        width = std::max(width, registration.name.size());
+    }
+    if (list) {
+        for (const bench::Registration* registration : selected) std::cout << registration->name << "\n";
+        return 0;
+    }
+
+    // The table is printed as the benchmarks finish; JSON only once all have run
+    std::vector<bench::Result> results;
+    if (format == "console") bench::write_console_header(std::cout, width);
+    for (const bench::Registration* registration : selected) {
+        results.push_back(bench::run_one(*registration, minSeconds));
+        if (format == "console") bench::write_console_row(std::cout, width, results.back());
+    }
+    if (format == "json") bench::write_json(std::cout, argv[0], results);
+    if (!outPath.empty()) {
+        std::ofstream out(outPath);
+        bench::write_json(out, argv[0], results);
+        if (!out) { std::cerr << "Cannot write " << outPath << std::endl; return 2; }
+    }
+
+    if (baselinePath.empty()) return 0;
+    std::map<std::string, double> baseline;
+    try {
+        baseline = bench::read_baseline(baselinePath);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    int regressions = 0;
+    for (const bench::Result& r : results) {
+        auto it = baseline.find(r.name);
+        if (!r.error.empty() || it == baseline.end() || it->second <= 0) continue;
+        double change = (r.realNs / it->second - 1) * 100;
+        if (change <= maxRegression) continue;
+        std::cerr << "REGRESSION " << r.name << ": " << it->second << " ns -> " << r.realNs << " ns (+"
+                  << std::fixed << std::setprecision(1) << change << "%)" << std::endl;
+        ++regressions;
+    }
+    if (regressions > 0) return 1;
+    std::cerr << "No regressions above " << maxRegression << "% against " << baselinePath << std::endl;
+    return 0;
+}
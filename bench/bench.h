@@ -0,0 +1,93 @@
+// Minimal benchmark harness for lab4_bench. Registration and loop style follow Google Benchmark, and so do
+// the command-line flags and the JSON schema, so its tooling (compare.py) reads the output; nothing here
+// needs more than the standard library.
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace bench {
+
+class State {
+public:
+    explicit State(uint64_t iterations) : target(iterations) {}
+
+    // Loop condition: `while (state.next()) { ... }`. The clock runs from the first call to the last.
+    bool next() {
+        if (done == 0 && !running) start();
+        if (done == target) { stop(); return false; }
+        ++done;
+        return true;
+    }
+
+    uint64_t iterations() const { return target; }
+
+    // Excludes setup inside the loop (refilling a buffer) from the timing
+    void pause_timing() { stop(); }
+    void resume_timing() { start(); }
+
+    // Totals over all iterations; reported per second
+    void set_bytes_processed(uint64_t bytes) { bytesProcessed = bytes; }
+    void set_items_processed(uint64_t items) { itemsProcessed = items; }
+    void set_counter(const std::string& name, double value) { counters[name] = value; }
+
+    // The benchmark cannot run here (unsupported kernel, no server); reported as an error, never timed
+    void skip(const std::string& reason) { skipReason = reason; target = 0; }
+
+    // Results, read by the runner
+    std::chrono::duration<double> real_time() const { return realElapsed; }
+    double cpu_seconds() const { return cpuElapsed; }
+    const std::string& skipped() const { return skipReason; }
+    uint64_t bytes_processed() const { return bytesProcessed; }
+    uint64_t items_processed() const { return itemsProcessed; }
+    const std::map<std::string, double>& user_counters() const { return counters; }
+
+private:
+    void start() {
+        running = true;
+        realStart = std::chrono::steady_clock::now();
+        cpuStart = std::clock();
+    }
+    void stop() {
+        if (!running) return;
+        running = false;
+        realElapsed += std::chrono::steady_clock::now() - realStart;
+        cpuElapsed += (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC; // The whole process: pool threads count
+    }
+
+    uint64_t target;
+    uint64_t done = 0;
+    bool running = false;
+    std::chrono::steady_clock::time_point realStart;
+    std::clock_t cpuStart = 0;
+    std::chrono::duration<double> realElapsed{0};
+    double cpuElapsed = 0;
+    uint64_t bytesProcessed = 0, itemsProcessed = 0;
+    std::map<std::string, double> counters;
+    std::string skipReason;
+};
+
+typedef std::function<void(State&)> Function;
+
+// Registers a benchmark; returns true so it can run from a namespace-scope initializer
+bool add(const std::string& name, Function function);
+
+// Extra "context" entry of the JSON report (e.g. the reduction kernels picked on this CPU)
+void set_context(const std::string& key, const std::string& value);
+
+// Keeps the compiler from discarding a computation whose result is otherwise unused
+template <typename T>
+inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+} // namespace bench
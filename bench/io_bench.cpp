@@ -0,0 +1,125 @@
+// Socket benchmarks over loopback: the client's framing helpers against an in-process echo peer, and
+// whole CMD_SUBMIT_JOB round trips against a lab4 server at SERVER_IP:SERVER_PORT (skipped if none runs).
+#include "lab4_client.h"
+#include "bench.h"
+
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+const size_t FRAME_FLOATS[] = {1, 1024, 256 * 1024, 4 * 1024 * 1024};
+const uint32_t JOB_SIZES[] = {16, 256, 1024};
+
+void ensure_sockets() {
+#ifdef _WIN32
+    static bool started = [] { WSADATA wsaData; return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0; }();
+    if (!started) throw std::runtime_error("WSAStartup failed");
+#endif
+}
+
+// A connected loopback TCP pair; socketpair() would not exist on Windows
+void loopback_pair(SOCKET& client, SOCKET& peer) {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) throw std::runtime_error("socket() failed");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addrSize = sizeof(addr);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (sockaddr*)&addr, &addrSize) == SOCKET_ERROR) {
+        closesocket(listener);
+        throw std::runtime_error("loopback listener setup failed");
+    }
+    client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    apply_socket_options(client, SocketOptions());
+    if (connect(client, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(client);
+        closesocket(listener);
+        throw std::runtime_error("loopback connect failed");
+    }
+    peer = accept(listener, nullptr, nullptr);
+    closesocket(listener);
+    if (peer == INVALID_SOCKET) { closesocket(client); throw std::runtime_error("loopback accept failed"); }
+    apply_socket_options(peer, SocketOptions());
+}
+
+// [count][floats] out, the same floats back: send_frame_or_throw and recv_floats_or_throw on both ends
+void bench_frame_round_trip(bench::State& state, size_t count) {
+    ensure_sockets();
+    SOCKET client, peer;
+    loopback_pair(client, peer);
+    std::thread echo([peer] {
+        std::vector<float> buffer;
+        try {
+            while (uint32_t floats = recv_uint32_or_throw(peer, "echo header")) {
+                recv_floats_or_throw(peer, buffer, floats, "echo payload");
+                send_frame_or_throw(peer, {}, buffer, "echo reply");
+            }
+        } catch (const std::exception&) { /* client side went away */ }
+        closesocket(peer);
+    });
+    std::vector<float> payload(count, 1.5f), reply;
+    try {
+        while (state.next()) {
+            send_frame_or_throw(client, {(uint32_t)count}, payload, "frame");
+            recv_floats_or_throw(client, reply, count, "frame reply");
+        }
+        send_uint32_or_throw(client, 0, "echo stop");
+    } catch (...) {
+        closesocket(client);
+        echo.join();
+        throw;
+    }
+    echo.join();
+    closesocket(client);
+    state.set_bytes_processed(state.iterations() * count * sizeof(float) * 2);
+}
+
+// One pipelined job at a time, so this is the latency of a job including the server's compute
+void bench_server_job(bench::State& state, uint32_t size) {
+    ensure_sockets();
+    SOCKET sock;
+    try {
+        sock = connect_or_throw(SocketOptions());
+    } catch (const std::exception&) {
+        state.skip("no lab4 server at " SERVER_IP ":" + std::to_string(SERVER_PORT));
+        return;
+    }
+    std::vector<float> matrix((size_t)size * size), result;
+    std::mt19937 generator(size);
+    std::uniform_real_distribution<float> values(-1000.0f, 1000.0f);
+    for (float& value : matrix) value = values(generator);
+    uint32_t jobId = 0;
+    try {
+        while (state.next()) {
+            matrix[1] = (float)++jobId; // A new matrix every time, or the server's result cache would answer
+            send_frame_or_throw(sock, {CMD_SUBMIT_JOB, jobId, size, 1}, matrix, "job");
+            uint32_t response = recv_uint32_or_throw(sock, "job response");
+            uint32_t echoedId = recv_uint32_or_throw(sock, "job ID");
+            if (response != RESP_JOB_RESULT || echoedId != jobId) throw std::runtime_error("server refused or failed the job");
+            recv_uint32_or_throw(sock, "job size");
+            recv_floats_or_throw(sock, result, matrix.size(), "job result");
+        }
+    } catch (...) {
+        closesocket(sock);
+        throw;
+    }
+    closesocket(sock);
+    state.set_bytes_processed(state.iterations() * matrix.size() * sizeof(float) * 2);
+}
+
+[[maybe_unused]] const bool registered = [] {
+    for (size_t count : FRAME_FLOATS) {
+        bench::add("frame_round_trip/" + std::to_string(count * sizeof(float)),
+                   [count](bench::State& state) { bench_frame_round_trip(state, count); });
+    }
+    for (uint32_t size : JOB_SIZES) {
+        bench::add("server_job/" + std::to_string(size), [size](bench::State& state) { bench_server_job(state, size); });
+    }
+    return true;
+}();
+
+} // namespace
@@ -0,0 +1,162 @@
+// Server-side benchmarks: the reduction kernels, whole jobs through the compute pool, and what a job costs
+// to dispatch (pool tasks against spawning a thread per slice, as the server once did).
+// Built from server.cpp itself, so the numbers are for exactly the code that ships.
+#define LAB4_NO_MAIN
+#include "../server.cpp"
+
+#include "bench.h"
+
+namespace {
+
+const uint32_t KERNEL_SIZES[] = {64, 256, 1024, 4096};
+const uint32_t JOB_SIZES[] = {256, 1024, 4096};
+const uint32_t TYPED_KERNEL_SIZE = 1024; // Element types other than f32 are measured at this size only
+const char* const OP_NAMES[OP_COUNT] = {"max", "min", "sum", "mean"};
+const char* const ELEMENT_NAMES[ELEMENT_TYPE_COUNT] = {"f32", "f64", "i32", "i16"};
+
+// The pool and buffer pool main() would have set up; created on first use so --benchmark_list_tests stays cheap
+void ensure_server_runtime() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        select_kernels("auto"); // NUMA stays off: placement is not what these benchmarks measure
+        g_bufferPool.configure((size_t)256 << 20, false);
+        unsigned hwThreads = std::thread::hardware_concurrency();
+        g_computePool = std::make_unique<ThreadPool>(hwThreads ? hwThreads : 4);
+    });
+}
+
+std::vector<float> random_matrix(uint32_t size) {
+    std::vector<float> matrix((size_t)size * size);
+    std::mt19937 generator(size);
+    std::uniform_real_distribution<float> values(-1000.0f, 1000.0f);
+    for (float& value : matrix) value = values(generator);
+    return matrix;
+}
+
+// Thread counts for job benchmarks: powers of two up to the pool size, and the pool size itself
+std::vector<uint32_t> thread_counts() {
+    unsigned hwThreads = std::thread::hardware_concurrency();
+    uint32_t poolSize = hwThreads ? hwThreads : 4;
+    std::vector<uint32_t> counts;
+    for (uint32_t t = 1; t < poolSize; t *= 2) counts.push_back(t);
+    counts.push_back(poolSize);
+    return counts;
+}
+
+// random_matrix() in another element type; values of -1000..1000 fit all of them
+std::vector<char> typed_matrix(uint32_t size, uint32_t elementType) {
+    std::vector<float> values = random_matrix(size);
+    size_t elementSize = element_bytes(elementType);
+    std::vector<char> matrix(values.size() * elementSize);
+    for (size_t i = 0; i < values.size(); ++i) {
+        char* at = &matrix[i * elementSize];
+        switch (elementType) {
+            case ELEMENT_F32: std::memcpy(at, &values[i], elementSize); break;
+            case ELEMENT_F64: { double v = values[i]; std::memcpy(at, &v, elementSize); break; }
+            case ELEMENT_I32: { int32_t v = (int32_t)values[i]; std::memcpy(at, &v, elementSize); break; }
+            case ELEMENT_I16: { int16_t v = (int16_t)values[i]; std::memcpy(at, &v, elementSize); break; }
+        }
+    }
+    return matrix;
+}
+
+// process_matrix_rows or process_matrix_columns over a whole matrix with one ISA's kernel, on the calling
+// thread. Results go to a side vector, so a sum never feeds into the next iteration.
+void bench_kernel(bench::State& state, const ReductionKernels& kernels, uint32_t elementType, uint32_t op, bool columns,
+                  uint32_t size) {
+    if (!kernels.supported()) { state.skip(std::string(kernels.name) + " is not supported by this CPU"); return; }
+    std::vector<char> matrix = typed_matrix(size, elementType);
+    std::vector<double> results(size); // Room for any element type
+    const ReductionKernels* previous = g_kernels;
+    g_kernels = &kernels;
+    while (state.next()) {
+        if (columns) process_matrix_columns(matrix.data(), size, 0, size, op, elementType, results.data());
+        else process_matrix_rows(matrix.data(), size, 0, size, op, elementType, results.data());
+        bench::do_not_optimize(results[0]);
+    }
+    g_kernels = previous;
+    state.set_bytes_processed(state.iterations() * matrix.size());
+}
+
+// One job end to end on the pool: plan_job's split, the tasks, and the completion wait
+void bench_job(bench::State& state, uint32_t size, uint32_t threads) {
+    ensure_server_runtime();
+    auto job = std::make_shared<ClientState>();
+    job->matrixSize = size;
+    job->numThreads = threads;
+    job->matrixData.resize((size_t)size * size);
+    std::vector<float> matrix = random_matrix(size);
+    std::copy(matrix.begin(), matrix.end(), job->matrixData.data());
+    while (state.next()) {
+        job->processingStarted = true; job->processingDone = false; job->errorOccurred = false;
+        perform_computation(job, job->matrixData.data());
+        job->wait_for_computation();
+    }
+    if (job->errorOccurred) state.skip("job failed");
+    state.set_bytes_processed(state.iterations() * matrix.size() * sizeof(float));
+    state.set_items_processed(state.iterations() * size); // Rows
+}
+
+// Cost of starting and joining `threads` threads that do nothing, per job
+void bench_spawn(bench::State& state, uint32_t threads) {
+    std::vector<std::thread> workers(threads);
+    while (state.next()) {
+        for (auto& worker : workers) worker = std::thread([] {});
+        for (auto& worker : workers) worker.join();
+    }
+}
+
+// Cost of handing `tasks` empty tasks to the pool and waiting for all of them
+void bench_dispatch(bench::State& state, uint32_t tasks) {
+    ensure_server_runtime();
+    std::mutex mutex;
+    std::condition_variable allDone;
+    uint32_t remaining = 0;
+    while (state.next()) {
+        { std::lock_guard<std::mutex> lock(mutex); remaining = tasks; }
+        for (uint32_t i = 0; i < tasks; ++i) {
+            g_computePool->submit([&] {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0) allDone.notify_one();
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [&] { return remaining == 0; });
+    }
+}
+
+[[maybe_unused]] const bool registered = [] {
+    select_kernels("auto");
+    bench::set_context("reduction_kernels", g_kernels->name);
+    // row_max/avx2/1024 is f32; other element types are named like row_max_i16/avx2/1024
+    for (const ReductionKernels& kernels : REDUCTION_KERNELS) {
+        for (uint32_t type = 0; type < ELEMENT_TYPE_COUNT; ++type) {
+            for (bool columns : {false, true}) {
+                for (uint32_t op = 0; op < OP_COUNT; ++op) {
+                    for (uint32_t size : KERNEL_SIZES) {
+                        if (type != ELEMENT_F32 && size != TYPED_KERNEL_SIZE) continue;
+                        std::string name = std::string(columns ? "column_" : "row_") + OP_NAMES[op] +
+                                           (type != ELEMENT_F32 ? std::string("_") + ELEMENT_NAMES[type] : "") + "/" +
+                                           kernels.name + "/" + std::to_string(size);
+                        bench::add(name, [&kernels, type, op, columns, size](bench::State& state) {
+                            bench_kernel(state, kernels, type, op, columns, size);
+                        });
+                    }
+                }
+            }
+        }
+    }
+    for (uint32_t size : JOB_SIZES) {
+        for (uint32_t threads : thread_counts()) {
+            bench::add("job/" + std::to_string(size) + "/threads:" + std::to_string(threads),
+                       [size, threads](bench::State& state) { bench_job(state, size, threads); });
+        }
+    }
+    for (uint32_t threads : thread_counts()) {
+        bench::add("spawn_threads/" + std::to_string(threads), [threads](bench::State& state) { bench_spawn(state, threads); });
+        bench::add("pool_dispatch/" + std::to_string(threads), [threads](bench::State& state) { bench_dispatch(state, threads); });
+    }
+    return true;
+}();
+
+} // namespace
@@ -0,0 +1,406 @@
+#include "lab4_client.h"
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+std::string GetWSAErrorStringClient(int errorCode) {
+#ifdef _WIN32
+    char* s = nullptr;
+    FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                   NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&s, 0, NULL);
+    std::string msg = (s ? s : "Unknown error");
+    if(s) LocalFree(s);
+#else
+    std::string msg = std::strerror(errorCode);
+#endif
+    return msg + " (" + std::to_string(errorCode) + ")";
+}
+
+void send_uint32_or_throw(SOCKET sock, uint32_t value, const std::string& context) {
+    uint32_t netValue = htonl(value);
+    int bytesSent = send(sock, (const char*)&netValue, sizeof(netValue), MSG_NOSIGNAL);
+    if (bytesSent == SOCKET_ERROR) {
+        int error_code = WSAGetLastError();
+        throw std::runtime_error(LOG_PREFIX + std::string("send_uint32 failed (") + context + "): " + GetWSAErrorStringClient(error_code));
+    }
+    if (bytesSent != sizeof(netValue)) {
+        throw std::runtime_error(LOG_PREFIX + std::string("send_uint32 sent incomplete data (") + context + "): " + std::to_string(bytesSent) + "/" + std::to_string(sizeof(netValue)));
+    }
+}
+
+uint32_t recv_uint32_or_throw(SOCKET sock, const std::string& context) {
+    uint32_t value;
+    int bytesReceived = recv(sock, (char*)&value, sizeof(value), MSG_WAITALL);
+    if (bytesReceived == sizeof(value)) {
+        return ntohl(value);
+    }
+    if (bytesReceived == 0) {
+        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 (") + context + "): Server disconnected gracefully.");
+    } else if (bytesReceived == SOCKET_ERROR) {
+        int error_code = WSAGetLastError();
+        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 failed (") + context + "): " + GetWSAErrorStringClient(error_code));
+    } else {
+        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 received incomplete data (") + context + "): " + std::to_string(bytesReceived) + "/" + std::to_string(sizeof(value)));
+    }
+}
+
+void send_frame_or_throw(SOCKET sock, const std::vector<uint32_t>& header, const void* payload, size_t payloadBytes, const std::string& context) {
+    std::vector<uint32_t> netHeader(header.size());
+    for (size_t i = 0; i < header.size(); ++i) netHeader[i] = htonl(header[i]);
+    const char* parts[2] = {reinterpret_cast<const char*>(netHeader.data()), static_cast<const char*>(payload)};
+    size_t remaining[2] = {netHeader.size() * sizeof(uint32_t), payloadBytes};
+    while (remaining[0] + remaining[1] > 0) {
+        int first = remaining[0] > 0 ? 0 : 1;
+        long long sent;
+#ifdef _WIN32
+        WSABUF bufs[2];
+        DWORD count = 0, bytesSent = 0;
+        for (int i = first; i < 2; ++i) {
+            bufs[count].buf = const_cast<CHAR*>(parts[i]);
+            bufs[count].len = (ULONG)std::min<size_t>(remaining[i], 1u << 30);
+            ++count;
+        }
+        sent = (WSASend(sock, bufs, count, &bytesSent, 0, NULL, NULL) == SOCKET_ERROR) ? -1 : (long long)bytesSent;
+#else
+        iovec iov[2];
+        int count = 0;
+        for (int i = first; i < 2; ++i) {
+            iov[count].iov_base = const_cast<char*>(parts[i]);
+            iov[count].iov_len = remaining[i];
+            ++count;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+#endif
+        if (sent < 0) {
+            int error_code = WSAGetLastError();
+            throw std::runtime_error(LOG_PREFIX + std::string("send_frame failed (") + context + "): " + GetWSAErrorStringClient(error_code));
+        }
+        for (int i = first; i < 2 && sent > 0; ++i) {
+            size_t used = std::min<size_t>(remaining[i], (size_t)sent);
+            parts[i] += used;
+            remaining[i] -= used;
+            sent -= (long long)used;
+        }
+    }
+}
+
+void send_frame_or_throw(SOCKET sock, const std::vector<uint32_t>& header, const std::vector<float>& payload, const std::string& context) {
+    send_frame_or_throw(sock, header, payload.data(), payload.size() * sizeof(float), context);
+}
+
+void apply_socket_options(SOCKET sock, const SocketOptions& options) {
+    int noDelay = options.noDelay ? 1 : 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    // Set before connect() so the window scale negotiated in the handshake can use the larger buffer
+    if (options.sendBufferBytes > 0) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBufferBytes, sizeof(int));
+    if (options.recvBufferBytes > 0) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&options.recvBufferBytes, sizeof(int));
+}
+
+void recv_bytes_or_throw(SOCKET sock, char* buffer, size_t totalBytes, const std::string& context) {
+    size_t bytesReceived = 0;
+    while (bytesReceived < totalBytes) {
+        int result = recv(sock, buffer + bytesReceived, (int)std::min<size_t>(totalBytes - bytesReceived, 1u << 30), 0);
+        if (result == SOCKET_ERROR) {
+            int error_code = WSAGetLastError();
+            throw std::runtime_error(LOG_PREFIX + std::string("recv failed (") + context + "): " + GetWSAErrorStringClient(error_code));
+        }
+        if (result == 0) {
+            throw std::runtime_error(LOG_PREFIX + std::string("recv (") + context + "): Server disconnected before all data received ("
+                                     + std::to_string(bytesReceived) + "/" + std::to_string(totalBytes) + ").");
+        }
+        bytesReceived += result;
+    }
+}
+
+void recv_floats_or_throw(SOCKET sock, std::vector<float>& data, size_t count, const std::string& context) {
+    if (count == 0) { data.clear(); return; }
+    data.resize(count);
+    recv_bytes_or_throw(sock, reinterpret_cast<char*>(data.data()), count * sizeof(float), context);
+}
+
+SOCKET connect_or_throw(const SocketOptions& socketOptions) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) {
+        throw std::runtime_error(LOG_PREFIX "Socket creation failed: " + GetWSAErrorStringClient(WSAGetLastError()));
+    }
+    apply_socket_options(sock, socketOptions);
+
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(SERVER_PORT);
+    if (inet_pton(AF_INET, SERVER_IP, &serverAddr.sin_addr) <= 0) {
+        closesocket(sock);
+        throw std::runtime_error(LOG_PREFIX "Invalid server IP address format");
+    }
+    if (connect(sock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        int error_code = WSAGetLastError();
+        closesocket(sock);
+        throw std::runtime_error(LOG_PREFIX "Connect failed: " + GetWSAErrorStringClient(error_code));
+    }
+    return sock;
+}
+
+// --- AsyncClient ---
+struct AsyncClient::Channel {
+    struct Request {
+        uint32_t id;
+        uint32_t size;
+        uint32_t numThreads;
+        std::vector<float> matrix;
+    };
+
+    SOCKET socket = INVALID_SOCKET;
+    mutable std::mutex mutex;
+    std::condition_variable requestQueued;
+    std::deque<Request> outbox;                                            // Not yet written
+    std::unordered_map<uint32_t, std::promise<std::vector<float>>> waiting; // Queued or on the server
+    bool stopping = false;
+    std::string failure;                                                   // Set once the connection is unusable
+    std::thread writer, reader;
+
+    // Fails every outstanding job; later submits to this channel fail at once
+    void fail(const std::string& reason) {
+        std::unordered_map<uint32_t, std::promise<std::vector<float>>> failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (failure.empty()) failure = reason;
+            failed.swap(waiting);
+            outbox.clear();
+        }
+        requestQueued.notify_all();
+        for (auto& entry : failed) entry.second.set_exception(std::make_exception_ptr(std::runtime_error(failure)));
+    }
+};
+
+AsyncClient::AsyncClient(size_t connections, const SocketOptions& socketOptions) {
+    try {
+        for (size_t i = 0; i < std::max<size_t>(1, connections); ++i) {
+            channels.push_back(std::make_unique<Channel>());
+            Channel& channel = *channels.back();
+            channel.socket = connect_or_throw(socketOptions);
+            channel.writer = std::thread(&AsyncClient::writer_loop, this, std::ref(channel));
+            channel.reader = std::thread(&AsyncClient::reader_loop, this, std::ref(channel));
+        }
+    } catch (...) {
+        close_channels(); // The destructor does not run for a constructor that throws
+        throw;
+    }
+}
+
+AsyncClient::~AsyncClient() {
+    close_channels();
+}
+
+void AsyncClient::close_channels() {
+    for (auto& channel : channels) {
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            channel->stopping = true;
+        }
+        channel->requestQueued.notify_all();
+        if (channel->socket != INVALID_SOCKET) shutdown(channel->socket, SD_BOTH); // Unblocks both threads
+        if (channel->writer.joinable()) channel->writer.join();
+        if (channel->reader.joinable()) channel->reader.join();
+        channel->fail(LOG_PREFIX "Client closed before the job completed.");
+        if (channel->socket != INVALID_SOCKET) closesocket(channel->socket);
+        channel->socket = INVALID_SOCKET;
+    }
+}
+
+std::future<std::vector<float>> AsyncClient::submit(std::vector<float> matrix, uint32_t size, uint32_t numThreads) {
+    std::promise<std::vector<float>> promise;
+    std::future<std::vector<float>> future = promise.get_future();
+    if (matrix.size() != (size_t)size * size || size == 0) {
+        promise.set_exception(std::make_exception_ptr(std::runtime_error(LOG_PREFIX "Matrix does not match its size.")));
+        return future;
+    }
+    Channel* target = nullptr;
+    size_t fewest = SIZE_MAX;
+    for (auto& channel : channels) {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        if (channel->failure.empty() && channel->waiting.size() < fewest) {
+            target = channel.get();
+            fewest = channel->waiting.size();
+        }
+    }
+    if (!target) {
+        std::lock_guard<std::mutex> lock(channels.front()->mutex);
+        promise.set_exception(std::make_exception_ptr(std::runtime_error(channels.front()->failure)));
+        return future;
+    }
+    uint32_t id = nextJobId.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(target->mutex);
+        if (!target->failure.empty()) { // Failed since it was picked
+            promise.set_exception(std::make_exception_ptr(std::runtime_error(target->failure)));
+            return future;
+        }
+        target->waiting.emplace(id, std::move(promise));
+        target->outbox.push_back(Channel::Request{id, size, numThreads, std::move(matrix)});
+    }
+    target->requestQueued.notify_one();
+    return future;
+}
+
+size_t AsyncClient::outstanding() const {
+    size_t count = 0;
+    for (auto& channel : channels) {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        count += channel->waiting.size();
+    }
+    return count;
+}
+
+void AsyncClient::writer_loop(Channel& channel) {
+    try {
+        for (;;) {
+            Channel::Request request;
+            {
+                std::unique_lock<std::mutex> lock(channel.mutex);
+                channel.requestQueued.wait(lock, [&] { return channel.stopping || !channel.failure.empty() || !channel.outbox.empty(); });
+                if (channel.stopping || !channel.failure.empty()) return;
+                request = std::move(channel.outbox.front());
+                channel.outbox.pop_front();
+            }
+            send_frame_or_throw(channel.socket, {CMD_SUBMIT_JOB, request.id, request.size, request.numThreads}, request.matrix, "send job");
+        }
+    } catch (const std::exception& e) {
+        channel.fail(e.what());
+        shutdown(channel.socket, SD_BOTH); // The reader would otherwise wait for replies that never come
+    }
+}
+
+void AsyncClient::reader_loop(Channel& channel) {
+    try {
+        for (;;) {
+            uint32_t response = recv_uint32_or_throw(channel.socket, "recv job reply");
+            if (response != RESP_JOB_RESULT && response != RESP_JOB_ERROR && response != RESP_JOB_BUSY) {
+                throw std::runtime_error(LOG_PREFIX "Received unexpected response: " + std::to_string(response));
+            }
+            uint32_t id = recv_uint32_or_throw(channel.socket, "recv job id");
+            std::vector<float> result;
+            if (response == RESP_JOB_RESULT) {
+                uint32_t size = recv_uint32_or_throw(channel.socket, "recv job size");
+                recv_floats_or_throw(channel.socket, result, (size_t)size * size, "recv job result");
+            }
+            std::promise<std::vector<float>> promise;
+            {
+                std::lock_guard<std::mutex> lock(channel.mutex);
+                auto found = channel.waiting.find(id);
+                if (found == channel.waiting.end()) throw std::runtime_error(LOG_PREFIX "Reply for unknown job " + std::to_string(id));
+                promise = std::move(found->second);
+                channel.waiting.erase(found);
+            }
+            if (response == RESP_JOB_RESULT) promise.set_value(std::move(result));
+            else if (response == RESP_JOB_BUSY) promise.set_exception(std::make_exception_ptr(std::runtime_error(LOG_PREFIX "Server busy, job " + std::to_string(id) + " not admitted")));
+            else promise.set_exception(std::make_exception_ptr(std::runtime_error(LOG_PREFIX "Server reported an error for job " + std::to_string(id))));
+        }
+    } catch (const std::exception& e) {
+        channel.fail(e.what());
+    }
+}
+// ----------------------
+
+// --- SharedRingClient ---
+const uint64_t SHM_RING_MAGIC = 0x31304D533442414CULL; // "LAB4SM01"
+
+// Mirrors the server's ShmRingHeader at offset 0 of the region, host byte order
+struct ShmRingHeader {
+    uint64_t magic;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotBytes;
+    uint64_t firstSlot;
+};
+
+SharedRingClient::SharedRingClient(SOCKET sock, uint32_t slots, uint64_t slotBytes) : sock(sock) {
+    send_frame_or_throw(sock, {CMD_SHM_ATTACH, slots, (uint32_t)(slotBytes >> 32), (uint32_t)slotBytes}, nullptr, 0, "send shm attach");
+    uint32_t response = recv_uint32_or_throw(sock, "recv shm attach response");
+    if (response != RESP_SHM_READY) throw std::runtime_error(LOG_PREFIX "Server refused the shared-memory ring. Response: " + std::to_string(response));
+    uint32_t nameLength = recv_uint32_or_throw(sock, "recv shm name length");
+    if (nameLength == 0 || nameLength > 256) throw std::runtime_error(LOG_PREFIX "Implausible shared-memory name length");
+    std::string name(nameLength, '\0');
+    recv_bytes_or_throw(sock, &name[0], nameLength, "recv shm name");
+
+#ifdef _WIN32
+    mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    if (!mapping) throw std::runtime_error(LOG_PREFIX "Cannot open " + name + ": " + GetWSAErrorStringClient(GetLastError()));
+    view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!view) {
+        int error = GetLastError();
+        CloseHandle(mapping);
+        throw std::runtime_error(LOG_PREFIX "Cannot map " + name + ": " + GetWSAErrorStringClient(error));
+    }
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(view, &info, sizeof(info));
+    length = info.RegionSize;
+#else
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) throw std::runtime_error(LOG_PREFIX "Cannot open " + name + ": " + GetWSAErrorStringClient(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ShmRingHeader)) {
+        ::close(fd);
+        throw std::runtime_error(LOG_PREFIX "Cannot size " + name);
+    }
+    length = (size_t)st.st_size;
+    view = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd); // The mapping stays
+    if (view == MAP_FAILED) { view = nullptr; throw std::runtime_error(LOG_PREFIX "Cannot map " + name + ": " + GetWSAErrorStringClient(error)); }
+#endif
+    const ShmRingHeader* header = static_cast<const ShmRingHeader*>(view);
+    count = header->slotCount;
+    bytesPerSlot = header->slotBytes;
+    firstSlot = header->firstSlot;
+    if (header->magic != SHM_RING_MAGIC || count != slots || bytesPerSlot < slotBytes || firstSlot + count * bytesPerSlot > length) {
+        unmap();
+        throw std::runtime_error(LOG_PREFIX "Unexpected shared-memory ring layout in " + name);
+    }
+}
+
+SharedRingClient::~SharedRingClient() { unmap(); }
+
+void SharedRingClient::unmap() {
+#ifdef _WIN32
+    if (view) UnmapViewOfFile(view);
+    if (mapping) CloseHandle(mapping);
+    mapping = nullptr;
+#else
+    if (view) munmap(view, length);
+#endif
+    view = nullptr;
+}
+
+float* SharedRingClient::slot(uint32_t i) const {
+    return reinterpret_cast<float*>(static_cast<char*>(view) + firstSlot + i * bytesPerSlot);
+}
+
+void SharedRingClient::submit(uint32_t jobId, uint32_t slot, uint32_t size, uint32_t numThreads) {
+    send_frame_or_throw(sock, {CMD_SHM_SUBMIT, jobId, slot, size, numThreads}, nullptr, 0, "send shm submit");
+}
+
+bool SharedRingClient::wait(uint32_t& jobId, uint32_t& slot) {
+    uint32_t response = recv_uint32_or_throw(sock, "recv shm reply");
+    jobId = recv_uint32_or_throw(sock, "recv shm job id");
+    if (response == RESP_JOB_ERROR || response == RESP_JOB_BUSY) return false;
+    if (response != RESP_SHM_DONE) throw std::runtime_error(LOG_PREFIX "Unexpected shared-memory reply: " + std::to_string(response));
+    slot = recv_uint32_or_throw(sock, "recv shm slot");
+    return true;
+}
+// ----------------------
@@ -0,0 +1,182 @@
+// Client side of the lab4 protocol: blocking socket helpers, and AsyncClient, which pipelines jobs
+// over a set of connections and hands back a future per job. On Windows, call WSAStartup() first.
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <future>
+#include <memory>
+#include <atomic>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#define MSG_NOSIGNAL 0 // No SIGPIPE on Winsock
+#else
+// Winsock names used throughout, mapped onto BSD sockets
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+inline int WSAGetLastError() { return errno; }
+inline void WSACleanup() {}
+#endif
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 65001
+#define LOG_PREFIX "[Client] "
+
+const uint32_t CMD_CONFIG_DATA = 1;
+const uint32_t CMD_START_COMP = 2;
+const uint32_t CMD_GET_STATUS = 3;
+const uint32_t CMD_START_AND_WAIT = 4;
+const uint32_t CMD_STREAM_COMP = 5;
+const uint32_t CMD_GET_METRICS = 6;
+const uint32_t CMD_CHUNKED_COMP = 7;
+const uint32_t CMD_FILE_COMP = 8;
+const uint32_t CMD_CONFIG_EX = 9;
+const uint32_t RESP_ACK = 10;
+const uint32_t RESP_STATUS_PENDING = 11;
+const uint32_t RESP_RESULT = 12;
+const uint32_t RESP_ERROR = 13;
+const uint32_t RESP_METRICS = 14;
+const uint32_t RESP_BLOCK = 15;
+const uint32_t CMD_SUBMIT_JOB = 16;
+const uint32_t RESP_JOB_RESULT = 17;
+const uint32_t RESP_JOB_ERROR = 18;
+const uint32_t CMD_BATCH = 19;
+const uint32_t RESP_BATCH = 20;
+const uint32_t RESP_BUSY = 21;
+const uint32_t RESP_JOB_BUSY = 22;
+const uint32_t CMD_SET_PRIORITY = 23;
+const uint32_t CMD_SHARD_COMP = 24;    // Between servers; mirrored so the numbers stay taken
+const uint32_t RESP_SHARD_RESULT = 25;
+const uint32_t CMD_UPDATE_ROWS = 26;
+const uint32_t RESP_ROWS_RESULT = 27;
+const uint32_t CMD_SESSION = 28;
+const uint32_t RESP_SESSION = 29;
+const uint32_t SESSION_OPEN = 0;
+const uint32_t SESSION_RESUME = 1;
+const uint32_t SESSION_CLOSE = 2;
+const uint32_t SESSION_HAS_MATRIX = 1;
+const uint32_t SESSION_HAS_RESULT = 2;
+const uint32_t SESSION_EXTENDED = 4;
+const uint32_t CMD_SHM_ATTACH = 30;
+const uint32_t RESP_SHM_READY = 31;
+const uint32_t CMD_SHM_SUBMIT = 32;
+const uint32_t RESP_SHM_DONE = 33;
+
+// CMD_CONFIG_EX format word
+const uint32_t FORMAT_ENCODING_MASK = 0xFF;
+const uint32_t ENCODING_F32 = 0;
+const uint32_t ENCODING_F16 = 1;
+const uint32_t ENCODING_BF16 = 2;
+const uint32_t ENCODING_F64 = 3;
+const uint32_t ENCODING_I32 = 4;
+const uint32_t ENCODING_I16 = 5;
+const uint32_t FORMAT_LZ4 = 1u << 8;
+const uint32_t FORMAT_FULL_RESULT = 1u << 9;
+const uint32_t FORMAT_COLUMNS = 1u << 10;
+const uint32_t FORMAT_SIDE_VECTOR = 1u << 11;
+const uint32_t FORMAT_OP_SHIFT = 16;
+const uint32_t FORMAT_OP_MASK = 0xFFu << FORMAT_OP_SHIFT;
+const uint32_t OP_MAX = 0;
+const uint32_t OP_MIN = 1;
+const uint32_t OP_SUM = 2;
+const uint32_t OP_MEAN = 3;
+
+// Socket tuning, from --sndbuf=BYTES --rcvbuf=BYTES --nodelay=0|1
+struct SocketOptions {
+    int sendBufferBytes = 0; // 0 keeps the OS default
+    int recvBufferBytes = 0;
+    bool noDelay = true;     // Requests are whole frames, Nagle only delays them
+};
+
+std::string GetWSAErrorStringClient(int errorCode);
+void send_uint32_or_throw(SOCKET sock, uint32_t value, const std::string& context);
+uint32_t recv_uint32_or_throw(SOCKET sock, const std::string& context);
+// Sends the header words (host order, converted here) and the payload bytes as one framed message.
+// Everything is handed to the kernel in a single gather call; only a short write needs another.
+void send_frame_or_throw(SOCKET sock, const std::vector<uint32_t>& header, const void* payload, size_t payloadBytes, const std::string& context);
+void send_frame_or_throw(SOCKET sock, const std::vector<uint32_t>& header, const std::vector<float>& payload, const std::string& context);
+void apply_socket_options(SOCKET sock, const SocketOptions& options);
+void recv_bytes_or_throw(SOCKET sock, char* buffer, size_t totalBytes, const std::string& context);
+void recv_floats_or_throw(SOCKET sock, std::vector<float>& data, size_t count, const std::string& context);
+SOCKET connect_or_throw(const SocketOptions& socketOptions);
+
+// Jobs go out as CMD_SUBMIT_JOB on whichever connection has the fewest outstanding, without waiting for
+// earlier ones; every connection has a writer thread draining its queue and a reader thread completing
+// futures by job ID, in whatever order the server finishes them. submit() never blocks on the network.
+// A failed or refused (server busy) job, or a connection that drops, fails the affected futures with
+// std::runtime_error.
+class AsyncClient {
+public:
+    explicit AsyncClient(size_t connections = 1, const SocketOptions& socketOptions = SocketOptions());
+    ~AsyncClient(); // Fails any future still outstanding
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    // `matrix` is size x size, row-major; the future yields the result matrix
+    std::future<std::vector<float>> submit(std::vector<float> matrix, uint32_t size, uint32_t numThreads);
+
+    size_t outstanding() const; // Submitted, future not yet completed
+
+private:
+    struct Channel;
+    void close_channels();
+    void writer_loop(Channel& channel);
+    void reader_loop(Channel& channel);
+
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::atomic<uint32_t> nextJobId{0};
+};
+
+// Same-host transport (CMD_SHM_ATTACH on `sock`, which the ring then belongs to): the server creates a ring of
+// matrix slots that both sides map, so matrices never cross the socket. Write a size x size matrix into a
+// slot, submit() it and collect the reply with wait(); the result has then replaced the slot's contents.
+// The server must run as the same user, with --shm-max-mb at least slots x slotBytes. Throws
+// std::runtime_error on socket or mapping failures.
+class SharedRingClient {
+public:
+    SharedRingClient(SOCKET sock, uint32_t slots, uint64_t slotBytes);
+    ~SharedRingClient();
+    SharedRingClient(const SharedRingClient&) = delete;
+    SharedRingClient& operator=(const SharedRingClient&) = delete;
+
+    float* slot(uint32_t i) const;
+    uint32_t slots() const { return count; }
+    uint64_t slot_bytes() const { return bytesPerSlot; } // At least what was asked for
+
+    // Rings for job `jobId`, the matrix in `slot`; the slot is the server's until wait() hands it back
+    void submit(uint32_t jobId, uint32_t slot, uint32_t size, uint32_t numThreads);
+    // Next reply, in completion order. False if that job failed or was refused as busy; `slot` is then
+    // not set, and the caller finds it from `jobId`.
+    bool wait(uint32_t& jobId, uint32_t& slot);
+
+private:
+    void unmap();
+
+    SOCKET sock;
+    void* view = nullptr;
+    size_t length = 0;
+    uint32_t count = 0;
+    uint64_t bytesPerSlot = 0;
+    uint64_t firstSlot = 0;
+#ifdef _WIN32
+    void* mapping = nullptr; // HANDLE
+#endif
+};
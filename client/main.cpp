@@ -1,5 +1,5 @@
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "lab4_client.h"
+
 #include <iostream>
 #include <vector>
 #include <random>
@@ -7,104 +7,107 @@
 #include <thread>
 #include <string>
 #include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
 
-#pragma comment(lib, "ws2_32.lib")
-
-#define SERVER_IP "127.0.0.1"
-#define SERVER_PORT 65001
-#define LOG_PREFIX "[Client] "
 #define DEFAULT_MATRIX_SIZE 5
 #define DEFAULT_NUM_THREADS 2
 
-const uint32_t CMD_CONFIG_DATA = 1;
-const uint32_t CMD_START_COMP = 2;
-const uint32_t CMD_GET_STATUS = 3;
-const uint32_t RESP_ACK = 10;
-const uint32_t RESP_STATUS_PENDING = 11;
-const uint32_t RESP_RESULT = 12;
-const uint32_t RESP_ERROR = 13;
-
-std::string GetWSAErrorStringClient(int errorCode) {
-    char* s = nullptr;
-    FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                   NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&s, 0, NULL);
-    std::string msg = (s ? s : "Unknown error");
-    if(s) LocalFree(s);
-    return msg + " (" + std::to_string(errorCode) + ")";
-}
-
-void send_uint32_or_throw(SOCKET sock, uint32_t value, const std::string& context) {
-    uint32_t netValue = htonl(value);
-    int bytesSent = send(sock, (const char*)&netValue, sizeof(netValue), 0);
-    if (bytesSent == SOCKET_ERROR) {
-        int error_code = WSAGetLastError();
-        throw std::runtime_error(LOG_PREFIX + std::string("send_uint32 failed (") + context + "): " + GetWSAErrorStringClient(error_code));
-    }
-    if (bytesSent != sizeof(netValue)) {
-        throw std::runtime_error(LOG_PREFIX + std::string("send_uint32 sent incomplete data (") + context + "): " + std::to_string(bytesSent) + "/" + std::to_string(sizeof(netValue)));
-    }
-}
-
-uint32_t recv_uint32_or_throw(SOCKET sock, const std::string& context) {
-    uint32_t value;
-    int bytesReceived = recv(sock, (char*)&value, sizeof(value), MSG_WAITALL);
-    if (bytesReceived == sizeof(value)) {
-        return ntohl(value);
-    }
-    if (bytesReceived == 0) {
-        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 (") + context + "): Server disconnected gracefully.");
-    } else if (bytesReceived == SOCKET_ERROR) {
-        int error_code = WSAGetLastError();
-        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 failed (") + context + "): " + GetWSAErrorStringClient(error_code));
-    } else {
-        throw std::runtime_error(LOG_PREFIX + std::string("recv_uint32 received incomplete data (") + context + "): " + std::to_string(bytesReceived) + "/" + std::to_string(sizeof(value)));
-    }
-}
+// --- Matrix Generation ---
+// Values come from a counter-based generator (Philox4x32-10): element i of a matrix is a pure function of
+// (seed, i), so any block of rows can be generated, or regenerated to check a result, on any thread.
+const uint32_t PHILOX_LANES = 16;            // Counters advanced together; the round loops vectorize across them
+const size_t PARALLEL_MIN_VALUES = 1u << 20; // Below this a single thread is faster than starting more
 
-void send_floats_or_throw(SOCKET sock, const std::vector<float>& data, const std::string& context) {
-    size_t totalBytes = data.size() * sizeof(float);
-    if (totalBytes == 0) return;
-    size_t bytesSent = 0;
-    const char* buffer = reinterpret_cast<const char*>(data.data());
-    while (bytesSent < totalBytes) {
-        int result = send(sock, buffer + bytesSent, (int)(totalBytes - bytesSent), 0);
-        if (result == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            throw std::runtime_error(LOG_PREFIX + std::string("send_floats failed (") + context + "): " + GetWSAErrorStringClient(error_code));
+// Fills out[0, count) with element first.. of the stream `seed`, uniform in [0, 100)
+void philox_fill(float* out, uint64_t first, size_t count, uint64_t seed) {
+    float block[4 * PHILOX_LANES];
+    uint64_t group = first / 4; // Each counter yields 4 values
+    size_t skip = (size_t)(first % 4);
+    while (count > 0) {
+        uint32_t c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+        for (uint32_t l = 0; l < PHILOX_LANES; ++l) {
+            c0[l] = (uint32_t)(group + l); c1[l] = (uint32_t)((group + l) >> 32); c2[l] = 0; c3[l] = 0;
+        }
+        uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+        for (int round = 0; round < 10; ++round) {
+            for (uint32_t l = 0; l < PHILOX_LANES; ++l) {
+                uint64_t p0 = (uint64_t)0xD2511F53u * c0[l], p1 = (uint64_t)0xCD9E8D57u * c2[l];
+                uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[l] ^ k0, n2 = (uint32_t)(p0 >> 32) ^ c3[l] ^ k1;
+                c1[l] = (uint32_t)p1; c3[l] = (uint32_t)p0; c0[l] = n0; c2[l] = n2;
+            }
+            k0 += 0x9E3779B9u; k1 += 0xBB67AE85u;
         }
-        bytesSent += result;
+        const float scale = 100.0f / 16777216.0f; // 24 random bits, exact in a float
+        for (uint32_t l = 0; l < PHILOX_LANES; ++l) {
+            block[4 * l] = (c0[l] >> 8) * scale; block[4 * l + 1] = (c1[l] >> 8) * scale;
+            block[4 * l + 2] = (c2[l] >> 8) * scale; block[4 * l + 3] = (c3[l] >> 8) * scale;
+        }
+        size_t n = std::min(count, 4 * PHILOX_LANES - skip);
+        std::copy(block + skip, block + skip + n, out);
+        out += n; count -= n; skip = 0;
+        group += PHILOX_LANES;
     }
 }
 
-void recv_floats_or_throw(SOCKET sock, std::vector<float>& data, size_t count, const std::string& context) {
-    if (count == 0) { data.clear(); return; }
-    data.resize(count);
-    size_t totalBytes = count * sizeof(float);
-    size_t bytesReceived = 0;
-    char* buffer = reinterpret_cast<char*>(data.data());
-    while (bytesReceived < totalBytes) {
-        int result = recv(sock, buffer + bytesReceived, (int)(totalBytes - bytesReceived), 0);
-        if (result == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            throw std::runtime_error(LOG_PREFIX + std::string("recv_floats failed (") + context + "): " + GetWSAErrorStringClient(error_code));
-        }
-        if (result == 0) {
-            throw std::runtime_error(LOG_PREFIX + std::string("recv_floats (") + context + "): Server disconnected before all data received ("
-                                     + std::to_string(bytesReceived) + "/" + std::to_string(totalBytes) + ").");
-        }
-        bytesReceived += result;
+// Calls body(firstRow, endRow) for slices of [0, rows) on up to one thread per core; on this thread alone
+// for small matrices
+template <typename Body>
+void parallel_rows(uint32_t rows, uint32_t size, Body body) {
+    size_t values = (size_t)rows * size;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned)std::min<size_t>({threads, rows, std::max<size_t>(1, values / PARALLEL_MIN_VALUES)});
+    if (threads <= 1) { body(0u, rows); return; }
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(body, (uint32_t)((uint64_t)rows * t / threads), (uint32_t)((uint64_t)rows * (t + 1) / threads));
     }
+    body(0u, (uint32_t)(rows / threads));
+    for (std::thread& worker : workers) worker.join();
+}
+
+// Rows [firstRow, firstRow + rowCount) of the size x size matrix generated from `seed`
+void generate_rows(float* out, uint32_t size, uint32_t firstRow, uint32_t rowCount, uint64_t seed) {
+    parallel_rows(rowCount, size, [&](uint32_t first, uint32_t end) {
+        philox_fill(out + (size_t)first * size, (uint64_t)(firstRow + first) * size, (size_t)(end - first) * size, seed);
+    });
+}
+
+void generate_row_block(std::vector<float>& block, uint32_t size, uint32_t firstRow, uint32_t rowCount, uint64_t seed) {
+    block.resize((size_t)rowCount * size);
+    generate_rows(block.data(), size, firstRow, rowCount, seed);
 }
 
 void generate_random_matrix(std::vector<float>& matrix, uint32_t size) {
-    if (size == 0) { matrix.clear(); return; }
-    matrix.resize((size_t)size * size);
     std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<float> distrib(0.0f, 100.0f);
-    for (size_t i = 0; i < matrix.size(); ++i) matrix[i] = distrib(gen);
+    generate_row_block(matrix, size, 0, size, ((uint64_t)rd() << 32) | rd());
+}
+
+// Rows of `result` whose diagonal is not the max of the same row of `original` (the matrix sent)
+uint64_t count_max_mismatches(const float* result, const float* original, uint32_t size) {
+    std::atomic<uint64_t> mismatches{0};
+    parallel_rows(size, size, [&](uint32_t first, uint32_t end) {
+        uint64_t local = 0;
+        for (uint32_t r = first; r < end; ++r) {
+            const float* row = original + (size_t)r * size;
+            local += (*std::max_element(row, row + size) != result[(size_t)r * size + r]);
+        }
+        mismatches += local;
+    });
+    return mismatches;
 }
 
+uint64_t count_max_mismatches(const std::vector<float>& result, const std::vector<float>& original, uint32_t size) {
+    if (result.size() != (size_t)size * size || original.size() != result.size()) return size;
+    return count_max_mismatches(result.data(), original.data(), size);
+}
+// ----------------------
+
 void print_matrix(const std::vector<float>& matrix, uint32_t size, const std::string& title) {
     std::cout << "\n--- " << title << " (Size: " << size << "x" << size << ") ---\n";
     if (size == 0 || matrix.empty()) { std::cout << "(Empty Matrix)\n"; return; }
@@ -122,13 +125,1010 @@ void print_matrix(const std::vector<float>& matrix, uint32_t size, const std::st
     std::cout << "--------------------------------------\n";
 }
 
+// --- Wire Encodings ---
+// Same formats as the server's CMD_CONFIG_EX: half-size encodings, f64/i32/i16 elements and byte shuffle + LZ4 blocks
+size_t encoding_bytes(uint32_t encoding) {
+    switch (encoding) {
+        case ENCODING_F64: return sizeof(double);
+        case ENCODING_F16: case ENCODING_BF16: case ENCODING_I16: return sizeof(uint16_t);
+        default: return sizeof(float);
+    }
+}
+
+// Results come back in the element type; f16 and bf16 matrices are reduced, and answered, as f32
+uint32_t result_encoding(uint32_t encoding) { return (encoding == ENCODING_F16 || encoding == ENCODING_BF16) ? ENCODING_F32 : encoding; }
+
+double read_element(const uint8_t* p, uint32_t encoding) {
+    switch (encoding) {
+        case ENCODING_F64: { double v; std::memcpy(&v, p, sizeof(v)); return v; }
+        case ENCODING_I32: { int32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+        case ENCODING_I16: { int16_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+        default: { float v; std::memcpy(&v, p, sizeof(v)); return v; }
+    }
+}
+
+// What the server makes of a double result in an integer type: saturated, rounded to nearest
+double narrow_integer(double value, uint32_t encoding) {
+    double lowest = encoding == ENCODING_I16 ? -32768.0 : -2147483648.0;
+    double highest = encoding == ENCODING_I16 ? 32767.0 : 2147483647.0;
+    return value <= lowest ? lowest : value >= highest ? highest : (double)std::llround(value);
+}
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F, mantissa = h & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) bits = sign | 0x7F800000 | (mantissa << 13); // Inf / NaN
+    else if (exponent != 0) bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0) bits = sign;
+    else { // Subnormal half: normalize it
+        exponent = 113;
+        while (!(mantissa & 0x400)) { mantissa <<= 1; --exponent; }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Round to nearest even, like the hardware conversions
+uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t absBits = bits & 0x7FFFFFFF;
+    if (absBits > 0x7F800000) return sign | 0x7E00;  // NaN stays a (quiet) NaN
+    if (absBits >= 0x477FF000) return sign | 0x7C00; // Rounds past 65504: infinity
+    if (absBits < 0x38800000) {                      // Below 2^-14: subnormal half or zero
+        if (absBits < 0x33000000) return sign;
+        uint32_t full = (absBits & 0x7FFFFF) | 0x800000;
+        uint32_t shift = 126 - (absBits >> 23);
+        uint32_t half = full >> shift, rest = full & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+        return sign | (uint16_t)half;
+    }
+    uint32_t half = (absBits - 0x38000000) >> 13, rest = absBits & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return sign | (uint16_t)half;
+}
+
+float bf16_to_float(uint16_t b) {
+    uint32_t bits = (uint32_t)b << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) return (uint16_t)((bits >> 16) | 0x40);
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+// Groups byte k of every element together, so slowly varying exponents form long runs
+void byte_shuffle(const uint8_t* src, uint8_t* dst, size_t count, size_t elementSize) {
+    for (size_t e = 0; e < count; ++e)
+        for (size_t b = 0; b < elementSize; ++b) dst[b * count + e] = src[e * elementSize + b];
+}
+
+void byte_unshuffle(const uint8_t* src, uint8_t* dst, size_t count, size_t elementSize) {
+    for (size_t e = 0; e < count; ++e)
+        for (size_t b = 0; b < elementSize; ++b) dst[e * elementSize + b] = src[b * count + e];
+}
+
+// LZ4 block format (no frame header), so any LZ4 implementation can produce or read the payloads
+size_t lz4_bound(size_t size) { return size + size / 255 + 16; }
+
+static void lz4_put_length(std::vector<uint8_t>& out, size_t length) {
+    for (; length >= 255; length -= 255) out.push_back(255);
+    out.push_back((uint8_t)length);
+}
+
+void lz4_compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out) {
+    const int HASH_BITS = 16;
+    const size_t MAX_OFFSET = 65535, MIN_MATCH = 4;
+    out.clear();
+    out.reserve(lz4_bound(size));
+    std::vector<uint32_t> table((size_t)1 << HASH_BITS, 0);
+    auto read32 = [src](size_t pos) { uint32_t v; std::memcpy(&v, src + pos, sizeof(v)); return v; };
+    auto emit = [&out, src](size_t literalStart, size_t literals, size_t offset, size_t matchLength) {
+        uint8_t token = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+        if (matchLength) token |= (uint8_t)std::min<size_t>(matchLength - MIN_MATCH, 15);
+        out.push_back(token);
+        if (literals >= 15) lz4_put_length(out, literals - 15);
+        out.insert(out.end(), src + literalStart, src + literalStart + literals);
+        if (!matchLength) return;
+        out.push_back((uint8_t)offset);
+        out.push_back((uint8_t)(offset >> 8));
+        if (matchLength - MIN_MATCH >= 15) lz4_put_length(out, matchLength - MIN_MATCH - 15);
+    };
+    size_t anchor = 0, pos = 0;
+    if (size > 12) {
+        size_t matchLimit = size - 12; // The format ends with at least 5 literals; matches start 12+ bytes before the end
+        while (pos < matchLimit) {
+            uint32_t sequence = read32(pos);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t)pos;
+            if (candidate < pos && pos - candidate <= MAX_OFFSET && read32(candidate) == sequence) {
+                size_t end = pos + MIN_MATCH;
+                while (end < size - 5 && src[end] == src[candidate + (end - pos)]) ++end;
+                emit(anchor, pos - anchor, pos - candidate, end - pos);
+                pos = anchor = end;
+            } else {
+                pos += 1 + ((pos - anchor) >> 6); // Skip faster through data that does not compress
+            }
+        }
+    }
+    emit(anchor, size - anchor, 0, 0);
+}
+
+// Fails on any malformed input instead of reading or writing out of bounds
+bool lz4_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dstSize) {
+    size_t in = 0, out = 0;
+    auto read_length = [&](size_t& length) {
+        uint8_t b;
+        do {
+            if (in >= size) return false;
+            b = src[in++];
+            length += b;
+        } while (b == 255);
+        return true;
+    };
+    while (in < size) {
+        uint8_t token = src[in++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(literals)) return false;
+        if (literals > size - in || literals > dstSize - out) return false;
+        std::memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if (in == size) break; // Last sequence: literals only
+        if (size - in < 2) return false;
+        size_t offset = src[in] | ((size_t)src[in + 1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !read_length(matchLength)) return false;
+        matchLength += 4;
+        if (offset == 0 || offset > out || matchLength > dstSize - out) return false;
+        for (size_t i = 0; i < matchLength; ++i, ++out) dst[out] = dst[out - offset]; // May overlap itself
+    }
+    return out == dstSize;
+}
+
+// Wire options, from --encoding=f32|f16|bf16|f64|i32|i16 --compress=none|lz4 --result=diagonal|full|side (may repeat)
+// --op=max|min|sum|mean --layout=rows|columns
+struct WireOptions {
+    bool extended = false; // Any of the options given: use CMD_CONFIG_EX
+    uint32_t format = 0;
+};
+
+// The matrix as it goes on the wire, and `decoded` as the server will see it (for checking the result)
+std::vector<uint8_t> encode_matrix(const std::vector<float>& matrix, uint32_t format, std::vector<float>& decoded) {
+    uint32_t encoding = format & FORMAT_ENCODING_MASK;
+    std::vector<uint8_t> encoded(matrix.size() * encoding_bytes(encoding));
+    decoded = matrix;
+    if (encoding == ENCODING_F32) {
+        std::memcpy(encoded.data(), matrix.data(), encoded.size());
+    } else if (encoding == ENCODING_F64 || encoding == ENCODING_I32 || encoding == ENCODING_I16) {
+        for (size_t i = 0; i < matrix.size(); ++i) {
+            uint8_t* at = &encoded[i * encoding_bytes(encoding)];
+            if (encoding == ENCODING_F64) { double v = matrix[i]; std::memcpy(at, &v, sizeof(v)); continue; }
+            double rounded = narrow_integer(matrix[i], encoding);
+            decoded[i] = (float)rounded; // Exact: every generated value is far below 2^24
+            if (encoding == ENCODING_I32) { int32_t v = (int32_t)rounded; std::memcpy(at, &v, sizeof(v)); }
+            else { int16_t v = (int16_t)rounded; std::memcpy(at, &v, sizeof(v)); }
+        }
+    } else {
+        for (size_t i = 0; i < matrix.size(); ++i) {
+            uint16_t value = (encoding == ENCODING_F16) ? float_to_half(matrix[i]) : float_to_bf16(matrix[i]);
+            std::memcpy(&encoded[i * sizeof(value)], &value, sizeof(value));
+            decoded[i] = (encoding == ENCODING_F16) ? half_to_float(value) : bf16_to_float(value);
+        }
+    }
+    if (!(format & FORMAT_LZ4)) return encoded;
+    std::vector<uint8_t> shuffled(encoded.size()), compressed;
+    byte_shuffle(encoded.data(), shuffled.data(), matrix.size(), encoding_bytes(encoding));
+    lz4_compress(shuffled.data(), shuffled.size(), compressed);
+    return compressed;
+}
+
+// Reads what follows RESP_RESULT on a CONFIG_EX connection and checks it against `decoded`
+int receive_extended_result(SOCKET sock, uint32_t matrixSize, const std::vector<float>& decoded) {
+    uint32_t resultSize = recv_uint32_or_throw(sock, "recv result size");
+    uint32_t format = recv_uint32_or_throw(sock, "recv result format");
+    uint64_t bytes = (uint64_t)recv_uint32_or_throw(sock, "recv result bytes") << 32;
+    bytes |= recv_uint32_or_throw(sock, "recv result bytes");
+    if (resultSize != matrixSize) throw std::runtime_error(LOG_PREFIX "Result size differs from the matrix sent: " + std::to_string(resultSize));
+    bool full = (format & FORMAT_FULL_RESULT) != 0;
+    bool side = (format & FORMAT_SIDE_VECTOR) != 0;
+    size_t matrixCount = (size_t)matrixSize * matrixSize;
+    size_t count = full ? matrixCount + (side ? matrixSize : 0) : matrixSize;
+    uint32_t encoding = result_encoding(format & FORMAT_ENCODING_MASK);
+    size_t elementSize = encoding_bytes(encoding);
+    if (bytes > lz4_bound(count * elementSize)) throw std::runtime_error(LOG_PREFIX "Implausible result payload size");
+    std::vector<uint8_t> wire((size_t)bytes);
+    recv_bytes_or_throw(sock, reinterpret_cast<char*>(wire.data()), wire.size(), "recv result payload");
+    std::vector<uint8_t> raw(count * elementSize);
+    if (format & FORMAT_LZ4) {
+        std::vector<uint8_t> shuffled(raw.size());
+        if (!lz4_decompress(wire.data(), wire.size(), shuffled.data(), shuffled.size())) {
+            throw std::runtime_error(LOG_PREFIX "Corrupt compressed result");
+        }
+        byte_unshuffle(shuffled.data(), raw.data(), count, elementSize);
+    } else {
+        if (bytes != raw.size()) throw std::runtime_error(LOG_PREFIX "Unexpected result payload size");
+        raw = std::move(wire);
+    }
+    std::vector<double> values(count);
+    for (size_t i = 0; i < count; ++i) values[i] = read_element(&raw[i * elementSize], encoding);
+    std::cout << LOG_PREFIX << "Result payload: " << bytes << " bytes for " << count << " values ("
+              << (full ? (side ? "full matrix and side vector" : "full matrix") : "results") << ((format & FORMAT_LZ4) ? ", lz4" : "") << ")" << std::endl;
+    if (full) print_matrix(std::vector<float>(values.begin(), values.begin() + matrixCount), matrixSize, "Result Matrix (Server)");
+
+    // Max and min must match exactly, and so must integer sums; floating-point sums may differ from this
+    // order of addition by rounding only
+    bool integer = encoding == ENCODING_I32 || encoding == ENCODING_I16;
+    double tolerance = encoding == ENCODING_F64 ? 1e-12 : 1e-6;
+    uint32_t op = (format & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT;
+    bool columns = (format & FORMAT_COLUMNS) != 0;
+    size_t step = columns ? matrixSize : 1; // Between the elements of one row (column)
+    uint64_t mismatches = 0;
+    for (uint32_t i = 0; i < matrixSize; ++i) {
+        const float* first = decoded.data() + (columns ? i : (size_t)i * matrixSize);
+        double best = first[0], sum = 0, magnitude = 0;
+        for (uint32_t j = 0; j < matrixSize; ++j) {
+            float x = first[j * step];
+            if (op == OP_MIN ? x < best : x > best) best = x;
+            sum += x;
+            magnitude += std::fabs(x);
+        }
+        if (op == OP_MEAN) { sum /= matrixSize; magnitude /= matrixSize; }
+        size_t at = !full ? i : side ? matrixCount + i : (size_t)i * matrixSize + i;
+        bool ok;
+        if (op == OP_MAX || op == OP_MIN) ok = values[at] == best;
+        else if (integer) ok = values[at] == narrow_integer(sum, encoding);
+        else ok = std::fabs(values[at] - sum) <= tolerance * magnitude + 1e-30;
+        mismatches += !ok;
+    }
+    std::cout << LOG_PREFIX << "Result check: " << mismatches << " mismatching values." << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// Reads the size and matrix that follow a RESP_RESULT code
+void receive_result(SOCKET sock, uint32_t matrixSize, std::vector<float>& resultMatrix, bool verbose = true) {
+    uint32_t resultSize = recv_uint32_or_throw(sock, "recv result size");
+    if (resultSize != matrixSize) {
+        std::cerr << LOG_PREFIX << "Warning: Result matrix size (" << resultSize
+                  << ") differs from original (" << matrixSize << ")" << std::endl;
+    }
+    if (resultSize > 0 && (size_t)resultSize * resultSize <= 100000000) {
+        recv_floats_or_throw(sock, resultMatrix, (size_t)resultSize * resultSize, "recv result data");
+        if (verbose) print_matrix(resultMatrix, resultSize, "Result Matrix (Server)");
+    } else if (resultSize == 0) {
+        if (verbose) std::cout << LOG_PREFIX << "Received empty result matrix (0x0)." << std::endl;
+        resultMatrix.clear();
+    } else {
+        throw std::runtime_error(LOG_PREFIX "Received implausible result matrix size: " + std::to_string(resultSize));
+    }
+}
+
+
+// "client metrics": prints the server's counters and latency histograms (Prometheus text format)
+void print_server_metrics(SOCKET sock) {
+    send_uint32_or_throw(sock, CMD_GET_METRICS, "send get-metrics");
+    uint32_t response = recv_uint32_or_throw(sock, "recv metrics response");
+    if (response != RESP_METRICS) throw std::runtime_error(LOG_PREFIX "Unexpected metrics response: " + std::to_string(response));
+    uint32_t length = recv_uint32_or_throw(sock, "recv metrics length");
+    std::string text(length, '\0');
+    if (length) recv_bytes_or_throw(sock, &text[0], length, "recv metrics text");
+    std::cout << text;
+}
+
+// --- Chunked Mode ---
+// "client <size> <threads> chunked": the matrix goes out and comes back in row blocks, so neither side ever
+// holds it whole. Each block is generated from (seed, firstRow), which lets the receiver regenerate it to check the result.
+int run_chunked(SOCKET sock, uint32_t matrixSize, uint32_t numThreads, uint32_t blockRows) {
+    if (blockRows == 0) blockRows = std::max<uint32_t>(1, (uint32_t)((64u << 20) / ((size_t)matrixSize * sizeof(float))));
+    blockRows = std::min(blockRows, matrixSize);
+    uint32_t seed = std::random_device{}();
+    std::cout << LOG_PREFIX << "Chunked job (Size=" << matrixSize << ", Threads=" << numThreads << ", BlockRows=" << blockRows << ")..." << std::endl;
+    send_frame_or_throw(sock, {CMD_CHUNKED_COMP, matrixSize, numThreads, blockRows}, {}, "send chunked config");
+    uint32_t response = recv_uint32_or_throw(sock, "recv chunked ack");
+    if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server rejected the chunked config. Response: " + std::to_string(response));
+
+    auto started = std::chrono::steady_clock::now();
+    std::exception_ptr sendError;
+    std::thread sender([&] {
+        try {
+            std::vector<float> block;
+            for (uint32_t firstRow = 0; firstRow < matrixSize; firstRow += blockRows) {
+                uint32_t rowCount = std::min(blockRows, matrixSize - firstRow);
+                generate_row_block(block, matrixSize, firstRow, rowCount, seed);
+                uint64_t bytes = (uint64_t)block.size() * sizeof(float);
+                send_frame_or_throw(sock, {firstRow, rowCount, (uint32_t)(bytes >> 32), (uint32_t)bytes}, block, "send row block");
+            }
+        } catch (...) {
+            sendError = std::current_exception();
+        }
+    });
+
+    uint64_t mismatches = 0;
+    try {
+        std::vector<float> expected, result;
+        for (uint32_t nextRow = 0; nextRow < matrixSize; ) {
+            response = recv_uint32_or_throw(sock, "recv block response");
+            if (response == RESP_ERROR) throw std::runtime_error(LOG_PREFIX "Server reported an error during processing.");
+            if (response != RESP_BLOCK) throw std::runtime_error(LOG_PREFIX "Received unexpected response: " + std::to_string(response));
+            uint32_t firstRow = recv_uint32_or_throw(sock, "recv block first row");
+            uint32_t rowCount = recv_uint32_or_throw(sock, "recv block row count");
+            uint64_t bytes = (uint64_t)recv_uint32_or_throw(sock, "recv block bytes") << 32;
+            bytes |= recv_uint32_or_throw(sock, "recv block bytes");
+            if (firstRow != nextRow || rowCount == 0 || rowCount > matrixSize - firstRow ||
+                bytes != (uint64_t)rowCount * matrixSize * sizeof(float)) {
+                throw std::runtime_error(LOG_PREFIX "Received malformed block header at row " + std::to_string(nextRow));
+            }
+            recv_floats_or_throw(sock, result, (size_t)(bytes / sizeof(float)), "recv block data");
+            generate_row_block(expected, matrixSize, firstRow, rowCount, seed);
+            for (uint32_t r = 0; r < rowCount; ++r) {
+                float* row = expected.data() + (size_t)r * matrixSize;
+                row[firstRow + r] = *std::max_element(row, row + matrixSize);
+            }
+            for (size_t i = 0; i < expected.size(); ++i) mismatches += (expected[i] != result[i]);
+            nextRow += rowCount;
+        }
+    } catch (...) {
+        shutdown(sock, SD_BOTH); // Unblocks the sender
+        sender.join();
+        throw;
+    }
+    sender.join();
+    if (sendError) std::rethrow_exception(sendError);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double gigabytes = 2.0 * matrixSize * matrixSize * sizeof(float) / 1e9;
+    std::cout << LOG_PREFIX << "Status: All " << matrixSize << " rows received in " << seconds << " s ("
+              << gigabytes / seconds << " GB/s both ways), " << mismatches << " mismatching values." << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// --- Pipelined Mode ---
+// "client <size> <threads> pipeline --jobs=N [--connections=C]": N matrices are handed to an AsyncClient at
+// once, which pipelines them over C connections; the futures are then checked as they complete.
+int run_pipelined(const SocketOptions& socketOptions, size_t connections, uint32_t matrixSize, uint32_t numThreads, uint32_t jobCount) {
+    uint32_t seed = std::random_device{}();
+    std::cout << LOG_PREFIX << "Pipelining " << jobCount << " jobs over " << connections << " connection(s) (Size="
+              << matrixSize << ", Threads=" << numThreads << ")..." << std::endl;
+    AsyncClient client(connections, socketOptions);
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::future<std::vector<float>>> results;
+    std::vector<float> matrix;
+    for (uint32_t id = 0; id < jobCount; ++id) {
+        generate_row_block(matrix, matrixSize, 0, matrixSize, seed + id);
+        results.push_back(client.submit(matrix, matrixSize, numThreads));
+    }
+
+    uint64_t mismatches = 0, failed = 0;
+    std::vector<float> expected;
+    for (uint32_t id = 0; id < jobCount; ++id) {
+        std::vector<float> result;
+        try {
+            result = results[id].get();
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "Job " << id << " failed: " << e.what() << std::endl;
+            failed++;
+            continue;
+        }
+        generate_row_block(expected, matrixSize, 0, matrixSize, seed + id);
+        for (uint32_t r = 0; r < matrixSize; ++r) {
+            float* row = expected.data() + (size_t)r * matrixSize;
+            row[r] = *std::max_element(row, row + matrixSize);
+        }
+        for (size_t i = 0; i < expected.size(); ++i) mismatches += (expected[i] != result[i]);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << LOG_PREFIX << "Status: " << jobCount << " jobs done in " << seconds << " s (" << jobCount / seconds << " jobs/s), "
+              << failed << " failed, " << mismatches << " mismatching values." << std::endl;
+    return (mismatches == 0 && failed == 0) ? 0 : 1;
+}
+// ----------------------
+
+// --- Batch Mode ---
+// "client <maxSize> <threads> batch --count=N": N matrices of random sizes up to maxSize go out in one
+// CMD_BATCH frame and come back in one RESP_BATCH frame.
+int run_batch(SOCKET sock, uint32_t maxSize, uint32_t numThreads, uint32_t count) {
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<uint32_t> sizeDistrib(std::min(8u, maxSize), maxSize);
+    std::vector<uint32_t> header{CMD_BATCH, count, numThreads};
+    std::vector<float> matrices;
+    std::vector<float> matrix;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t size = sizeDistrib(gen);
+        header.push_back(size);
+        generate_row_block(matrix, size, 0, size, (uint32_t)gen());
+        matrices.insert(matrices.end(), matrix.begin(), matrix.end());
+    }
+    std::cout << LOG_PREFIX << "Batch of " << count << " matrices (up to " << maxSize << "x" << maxSize << ", "
+              << matrices.size() * sizeof(float) << " bytes, Threads=" << numThreads << ")..." << std::endl;
+
+    auto started = std::chrono::steady_clock::now();
+    send_frame_or_throw(sock, header, matrices, "send batch frame");
+    uint32_t response = recv_uint32_or_throw(sock, "recv batch reply");
+    if (response == RESP_BUSY) throw std::runtime_error(LOG_PREFIX "Server busy, job not admitted; retry later.");
+    if (response == RESP_ERROR) throw std::runtime_error(LOG_PREFIX "Server reported an error during processing.");
+    if (response != RESP_BATCH) throw std::runtime_error(LOG_PREFIX "Received unexpected response: " + std::to_string(response));
+    if (recv_uint32_or_throw(sock, "recv batch count") != count) throw std::runtime_error(LOG_PREFIX "Batch reply has the wrong count.");
+    std::vector<float> results;
+    recv_floats_or_throw(sock, results, matrices.size(), "recv batch results");
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    uint64_t mismatches = 0;
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t size = header[3 + i];
+        for (uint32_t r = 0; r < size; ++r, offset += size) {
+            const float* row = matrices.data() + offset;
+            for (uint32_t c = 0; c < size; ++c) {
+                float expected = (c == r) ? *std::max_element(row, row + size) : row[c];
+                mismatches += (results[offset + c] != expected);
+            }
+        }
+    }
+    std::cout << LOG_PREFIX << "Status: " << count << " matrices in " << seconds * 1e3 << " ms (" << count / seconds
+              << " matrices/s), " << mismatches << " mismatching values." << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// --- Update Mode ---
+// "client <size> <threads> update --updates=R --rows=K": the matrix is uploaded and reduced once, then R
+// times K random rows are replaced with CMD_UPDATE_ROWS; only those rows go out and only their results
+// come back. A final GET_STATUS checks that the server's whole matrix matches the client's copy.
+int run_updates(SOCKET sock, uint32_t matrixSize, uint32_t numThreads, uint32_t updates, uint32_t rowsPerUpdate) {
+    rowsPerUpdate = std::max(1u, std::min(rowsPerUpdate, matrixSize));
+    std::vector<float> matrix;
+    generate_random_matrix(matrix, matrixSize);
+    send_frame_or_throw(sock, {CMD_CONFIG_DATA, matrixSize, numThreads}, matrix, "send config frame");
+    if (recv_uint32_or_throw(sock, "recv config ack") != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK config.");
+    send_uint32_or_throw(sock, CMD_START_AND_WAIT, "send command start-and-wait");
+    uint32_t response = recv_uint32_or_throw(sock, "recv pushed result");
+    if (response != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "Initial job failed. Response: " + std::to_string(response));
+    receive_result(sock, matrixSize, matrix, false); // From here on the client's copy holds the results too
+    std::cout << LOG_PREFIX << updates << " updates of " << rowsPerUpdate << " rows (Size=" << matrixSize << ", Threads=" << numThreads << ")..." << std::endl;
+
+    std::mt19937 gen(std::random_device{}());
+    std::vector<uint32_t> rowOrder(matrixSize);
+    for (uint32_t i = 0; i < matrixSize; ++i) rowOrder[i] = i;
+    std::vector<float> rows, row, results;
+    uint64_t mismatches = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (uint32_t update = 0; update < updates; ++update) {
+        std::vector<uint32_t> header{CMD_UPDATE_ROWS, rowsPerUpdate, numThreads};
+        rows.clear();
+        for (uint32_t k = 0; k < rowsPerUpdate; ++k) { // Partial shuffle: distinct rows
+            std::swap(rowOrder[k], rowOrder[std::uniform_int_distribution<uint32_t>(k, matrixSize - 1)(gen)]);
+            header.push_back(rowOrder[k]);
+            generate_row_block(row, matrixSize, 0, 1, (uint32_t)gen());
+            rows.insert(rows.end(), row.begin(), row.end());
+        }
+        send_frame_or_throw(sock, header, rows, "send row update");
+        response = recv_uint32_or_throw(sock, "recv update reply");
+        if (response == RESP_BUSY) throw std::runtime_error(LOG_PREFIX "Server busy, update not admitted; retry later.");
+        if (response != RESP_ROWS_RESULT) throw std::runtime_error(LOG_PREFIX "Update failed. Response: " + std::to_string(response));
+        if (recv_uint32_or_throw(sock, "recv update count") != rowsPerUpdate) throw std::runtime_error(LOG_PREFIX "Update reply has the wrong count.");
+        recv_floats_or_throw(sock, results, rowsPerUpdate, "recv update results");
+        for (uint32_t k = 0; k < rowsPerUpdate; ++k) {
+            float* target = matrix.data() + (size_t)header[3 + k] * matrixSize;
+            std::copy(rows.begin() + (size_t)k * matrixSize, rows.begin() + (size_t)(k + 1) * matrixSize, target);
+            target[header[3 + k]] = *std::max_element(target, target + matrixSize);
+            mismatches += (results[k] != target[header[3 + k]]);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    send_uint32_or_throw(sock, CMD_GET_STATUS, "send command status");
+    if (recv_uint32_or_throw(sock, "recv status response") != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "Updated matrix has no result.");
+    std::vector<float> serverMatrix;
+    receive_result(sock, matrixSize, serverMatrix, false);
+    for (size_t i = 0; i < matrix.size(); ++i) mismatches += (serverMatrix[i] != matrix[i]);
+    std::cout << LOG_PREFIX << "Status: " << updates << " updates in " << seconds * 1e3 << " ms (" << updates / seconds
+              << " updates/s), " << mismatches << " mismatching values." << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// --- Session Mode ---
+// "client <size> <threads> session [--resume=TOKEN] [--close]": without --resume, opens a session, uploads
+// a matrix and computes it, then prints the token. With it, picks the session up again (also after a server
+// restart) and fetches the result without uploading anything, if the server still has the matrix. The
+// original diagonal is gone by then, so the check is that each diagonal value is the largest in its row.
+int run_session(SOCKET sock, uint32_t matrixSize, uint32_t numThreads, uint64_t resumeToken, bool closeSession) {
+    send_frame_or_throw(sock, {CMD_SESSION, resumeToken ? SESSION_RESUME : SESSION_OPEN, (uint32_t)(resumeToken >> 32), (uint32_t)resumeToken},
+                        nullptr, 0, "send session request");
+    uint32_t response = recv_uint32_or_throw(sock, "recv session reply");
+    if (response != RESP_SESSION) throw std::runtime_error(LOG_PREFIX "Server refused the session. Response: " + std::to_string(response));
+    uint64_t token = (uint64_t)recv_uint32_or_throw(sock, "recv session token") << 32;
+    token |= recv_uint32_or_throw(sock, "recv session token");
+    uint32_t heldSize = recv_uint32_or_throw(sock, "recv session size");
+    recv_uint32_or_throw(sock, "recv session format");
+    uint32_t flags = recv_uint32_or_throw(sock, "recv session flags");
+    std::ostringstream tokenText;
+    tokenText << std::hex << std::setw(16) << std::setfill('0') << token;
+    std::cout << LOG_PREFIX << "Session " << tokenText.str() << (resumeToken ? " resumed" : " opened") << ": "
+              << (flags & SESSION_HAS_RESULT ? "result held" : flags & SESSION_HAS_MATRIX ? "matrix held" : "nothing held")
+              << (heldSize ? " (Size=" + std::to_string(heldSize) + ")" : "") << std::endl;
+    if (flags & SESSION_EXTENDED) throw std::runtime_error(LOG_PREFIX "The session holds a CONFIG_EX matrix; only plain ones are checked here.");
+
+    auto started = std::chrono::steady_clock::now();
+    if (flags & (SESSION_HAS_RESULT | SESSION_HAS_MATRIX)) {
+        matrixSize = heldSize;
+        send_uint32_or_throw(sock, (flags & SESSION_HAS_RESULT) ? CMD_GET_STATUS : CMD_START_AND_WAIT, "send result request");
+    } else {
+        std::vector<float> matrix;
+        generate_random_matrix(matrix, matrixSize);
+        send_frame_or_throw(sock, {CMD_CONFIG_DATA, matrixSize, numThreads}, matrix, "send config frame");
+        if (recv_uint32_or_throw(sock, "recv config ack") != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK config.");
+        send_uint32_or_throw(sock, CMD_START_AND_WAIT, "send command start-and-wait");
+    }
+    response = recv_uint32_or_throw(sock, "recv result");
+    if (response == RESP_BUSY) throw std::runtime_error(LOG_PREFIX "Server busy, job not admitted; retry later.");
+    if (response != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "No result. Response: " + std::to_string(response));
+    std::vector<float> result;
+    receive_result(sock, matrixSize, result, false);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    uint64_t mismatches = count_max_mismatches(result, result, matrixSize); // A resumed session's matrix is not here
+    if (closeSession) {
+        send_frame_or_throw(sock, {CMD_SESSION, SESSION_CLOSE, 0, 0}, nullptr, 0, "send session close");
+        if (recv_uint32_or_throw(sock, "recv session close ack") != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not close the session.");
+    }
+    std::cout << LOG_PREFIX << "Status: Result in " << seconds * 1e3 << " ms, " << mismatches << " rows whose diagonal is not their max."
+              << (closeSession ? " Session closed." : " Resume with --resume=" + tokenText.str()) << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// --- Shared Memory Mode ---
+// "client <size> <threads> shm --jobs=N --slots=S": the matrices are generated straight into a ring of S slots
+// shared with the server (which must be on this host) and computed there in place; only the doorbell
+// frames and replies use the socket. Each result is checked against its regenerated matrix.
+int run_shared_memory(SOCKET sock, uint32_t matrixSize, uint32_t numThreads, uint32_t jobCount, uint32_t slots) {
+    SharedRingClient ring(sock, slots, (uint64_t)matrixSize * matrixSize * sizeof(float));
+    std::cout << LOG_PREFIX << "Shared-memory ring: " << ring.slots() << " slots of " << ring.slot_bytes() << " bytes." << std::endl;
+    uint64_t seed = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+    std::vector<uint32_t> freeSlots, jobSlot(jobCount);
+    for (uint32_t i = ring.slots(); i-- > 0; ) freeSlots.push_back(i);
+    std::vector<float> expected((size_t)matrixSize * matrixSize);
+    uint64_t mismatches = 0, failed = 0;
+    uint32_t submitted = 0, done = 0;
+    auto started = std::chrono::steady_clock::now();
+    while (done < jobCount) {
+        if (submitted < jobCount && !freeSlots.empty()) {
+            uint32_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            generate_rows(ring.slot(slot), matrixSize, 0, matrixSize, seed + submitted);
+            jobSlot[submitted] = slot;
+            ring.submit(submitted++, slot, matrixSize, numThreads);
+            continue;
+        }
+        uint32_t id = 0, slot = 0;
+        bool ok = ring.wait(id, slot);
+        if (id >= submitted) throw std::runtime_error(LOG_PREFIX "Reply for unknown job " + std::to_string(id));
+        slot = jobSlot[id];
+        if (ok) {
+            generate_rows(expected.data(), matrixSize, 0, matrixSize, seed + id);
+            mismatches += count_max_mismatches(ring.slot(slot), expected.data(), matrixSize);
+        } else {
+            std::cerr << LOG_PREFIX << "Job " << id << " failed or was refused." << std::endl;
+            failed++;
+        }
+        freeSlots.push_back(slot);
+        done++;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << LOG_PREFIX << "Status: " << jobCount << " jobs done in " << seconds << " s (" << jobCount / seconds << " jobs/s), "
+              << failed << " failed, " << mismatches << " rows whose diagonal is not their max." << std::endl;
+    return (mismatches == 0 && failed == 0) ? 0 : 1;
+}
+// ----------------------
+
+// --- File Mode ---
+// "client <size> <threads> file --input=PATH [--output=PATH]": the server maps the files itself, so
+// nothing but the request goes over the socket. Paths are relative to the server's --file-root;
+// --file-root=DIR here is where the same files are visible to the client (for --generate and checking).
+struct FileOptions {
+    std::string input, output;   // Output empty: the server writes the result into the input in place
+    uint64_t offset = 0;         // --offset=BYTES of the matrix within the input file
+    std::string root = ".";
+    bool generate = false;       // --generate: write a random input first, so the result can be verified
+};
+
+int run_file_job(SOCKET sock, uint32_t matrixSize, uint32_t numThreads, const FileOptions& file) {
+    if (file.input.empty()) throw std::runtime_error(LOG_PREFIX "File mode needs --input=PATH");
+    uint32_t seed = std::random_device{}();
+    size_t rowFloats = matrixSize;
+    std::vector<float> row;
+    if (file.generate) {
+        // Keep any bytes before the offset, replace the matrix itself
+        std::fstream out(file.root + "/" + file.input, std::ios::in | std::ios::out | std::ios::binary);
+        if (!out) out.open(file.root + "/" + file.input, std::ios::out | std::ios::binary);
+        if (!out) throw std::runtime_error(LOG_PREFIX "Cannot write input file " + file.input);
+        out.seekp((std::streamoff)file.offset);
+        for (uint32_t i = 0; i < matrixSize; ++i) {
+            generate_row_block(row, matrixSize, i, 1, seed);
+            out.write(reinterpret_cast<const char*>(row.data()), rowFloats * sizeof(float));
+        }
+        if (!out) throw std::runtime_error(LOG_PREFIX "Failed writing input file " + file.input);
+    }
+
+    std::cout << LOG_PREFIX << "File job (Size=" << matrixSize << ", Threads=" << numThreads << ", " << file.input
+              << " -> " << (file.output.empty() ? "in place" : file.output) << ")..." << std::endl;
+    auto started = std::chrono::steady_clock::now();
+    std::string paths = file.input + file.output;
+    send_frame_or_throw(sock, {CMD_FILE_COMP, matrixSize, numThreads, (uint32_t)(file.offset >> 32), (uint32_t)file.offset,
+                               (uint32_t)file.input.size(), (uint32_t)file.output.size()}, {}, "send file request");
+    if (send(sock, paths.data(), (int)paths.size(), MSG_NOSIGNAL) != (int)paths.size()) {
+        throw std::runtime_error(LOG_PREFIX "send file paths failed: " + GetWSAErrorStringClient(WSAGetLastError()));
+    }
+    uint32_t response = recv_uint32_or_throw(sock, "recv file job response");
+    if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server reported an error for the file job: " + std::to_string(response));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << LOG_PREFIX << "Status: Result written in " << seconds << " s." << std::endl;
+    if (!file.generate) return 0;
+
+    std::ifstream in(file.root + "/" + (file.output.empty() ? file.input : file.output), std::ios::binary);
+    in.seekg((std::streamoff)(file.output.empty() ? file.offset : 0));
+    std::vector<float> result(rowFloats);
+    uint64_t mismatches = 0;
+    for (uint32_t i = 0; i < matrixSize && in; ++i) {
+        generate_row_block(row, matrixSize, i, 1, seed);
+        row[i] = *std::max_element(row.begin(), row.end());
+        in.read(reinterpret_cast<char*>(result.data()), rowFloats * sizeof(float));
+        for (size_t j = 0; j < rowFloats; ++j) mismatches += (row[j] != result[j]);
+    }
+    if (!in) throw std::runtime_error(LOG_PREFIX "Result file is shorter than the matrix");
+    std::cout << LOG_PREFIX << "Verified result file: " << mismatches << " mismatching values." << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+// ----------------------
+
+// --- Benchmark Mode ---
+// "client bench [options]": K connections submit jobs concurrently for every (size, threads) point of a sweep.
+struct BenchConfig {
+    uint32_t connections = 4;                    // --connections=K
+    std::vector<uint32_t> sizes{64, 256, 1024};  // --sizes=64,256,1024
+    std::vector<uint32_t> threads{1, 4};         // --threads=1,4
+    uint64_t requests = 200;                     // --requests=N per sweep point, across all connections
+    double durationSec = 0;                      // --duration=SECONDS per sweep point, overrides --requests
+    std::string mode = "push";                   // --mode=poll|push
+    int pollIntervalMs = 1;                      // --poll-ms=MS between CMD_GET_STATUS in poll mode
+    std::string csvPath;                         // --csv=FILE, appended
+    std::string jsonPath;                        // --json=FILE, rewritten
+};
+
+struct PhaseStats {
+    size_t count = 0;
+    double mean = 0, p50 = 0, p90 = 0, p99 = 0, p999 = 0; // Microseconds
+};
+
+struct BenchResult {
+    uint32_t size = 0, threads = 0, connections = 0;
+    uint64_t jobs = 0, errors = 0;
+    double seconds = 0, jobsPerSec = 0, gbPerSec = 0;
+    PhaseStats config, start, result, total;
+};
+
+// Per connection; merged once the sweep point is done, so the hot loop never shares anything but a counter
+struct BenchSamples {
+    std::vector<double> config, start, result, total;
+    uint64_t bytes = 0, errors = 0;
+};
+
+std::vector<uint32_t> parse_uint_list(const std::string& text) {
+    std::vector<uint32_t> values;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) values.push_back((uint32_t)std::stoul(item));
+    }
+    return values;
+}
+
+// Nearest-rank percentiles
+PhaseStats summarize(std::vector<double>& samples) {
+    PhaseStats stats;
+    stats.count = samples.size();
+    if (samples.empty()) return stats;
+    std::sort(samples.begin(), samples.end());
+    auto rank = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)std::ceil(p * samples.size()) - 1)]; };
+    double sum = 0;
+    for (double v : samples) sum += v;
+    stats.mean = sum / samples.size();
+    stats.p50 = rank(0.50); stats.p90 = rank(0.90); stats.p99 = rank(0.99); stats.p999 = rank(0.999);
+    return stats;
+}
+
+double elapsed_us(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+// One connection's share of a sweep point
+void bench_connection(const BenchConfig& bench, const SocketOptions& socketOptions, uint32_t matrixSize, uint32_t numThreads,
+                      std::atomic<uint64_t>& claimed, std::chrono::steady_clock::time_point deadline, BenchSamples& out) {
+    typedef std::chrono::steady_clock Clock;
+    SOCKET sock = INVALID_SOCKET;
+    try {
+        sock = connect_or_throw(socketOptions);
+        std::vector<float> matrix, result;
+        generate_random_matrix(matrix, matrixSize);
+        size_t payloadBytes = matrix.size() * sizeof(float);
+
+        while (true) {
+            if (bench.durationSec > 0) { if (Clock::now() >= deadline) break; }
+            else if (claimed.fetch_add(1) >= bench.requests) break;
+
+            Clock::time_point t0 = Clock::now();
+            send_frame_or_throw(sock, {CMD_CONFIG_DATA, matrixSize, numThreads}, matrix, "bench config");
+            uint32_t response = recv_uint32_or_throw(sock, "bench config ack");
+            if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Config not acknowledged: " + std::to_string(response));
+            Clock::time_point t1 = Clock::now();
+            Clock::time_point t2 = t1;
+
+            if (bench.mode == "push") {
+                send_uint32_or_throw(sock, CMD_START_AND_WAIT, "bench start-and-wait");
+                response = recv_uint32_or_throw(sock, "bench pushed result");
+            } else {
+                send_uint32_or_throw(sock, CMD_START_COMP, "bench start");
+                response = recv_uint32_or_throw(sock, "bench start ack");
+                if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Start not acknowledged: " + std::to_string(response));
+                t2 = Clock::now();
+                while (true) {
+                    send_uint32_or_throw(sock, CMD_GET_STATUS, "bench status");
+                    response = recv_uint32_or_throw(sock, "bench status response");
+                    if (response != RESP_STATUS_PENDING) break;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(bench.pollIntervalMs));
+                }
+            }
+            if (response != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "Job failed: " + std::to_string(response));
+            receive_result(sock, matrixSize, result, false);
+            Clock::time_point t3 = Clock::now();
+            if (count_max_mismatches(result, matrix, matrixSize) != 0) out.errors++; // Outside the timed span
+
+            out.config.push_back(elapsed_us(t0, t1));
+            if (bench.mode != "push") out.start.push_back(elapsed_us(t1, t2));
+            out.result.push_back(elapsed_us(t2, t3));
+            out.total.push_back(elapsed_us(t0, t3));
+            out.bytes += 2 * payloadBytes;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "Bench connection error: " << e.what() << std::endl;
+        out.errors++;
+    }
+    if (sock != INVALID_SOCKET) {
+        shutdown(sock, SD_BOTH);
+        closesocket(sock);
+    }
+}
+
+BenchResult run_bench_point(const BenchConfig& bench, const SocketOptions& socketOptions, uint32_t matrixSize, uint32_t numThreads) {
+    typedef std::chrono::steady_clock Clock;
+    std::atomic<uint64_t> claimed{0};
+    std::vector<BenchSamples> samples(bench.connections);
+    std::vector<std::thread> workers;
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = begin + std::chrono::microseconds((long long)(bench.durationSec * 1e6));
+    for (uint32_t i = 0; i < bench.connections; ++i) {
+        workers.emplace_back(bench_connection, std::cref(bench), std::cref(socketOptions), matrixSize, numThreads,
+                             std::ref(claimed), deadline, std::ref(samples[i]));
+    }
+    for (auto& t : workers) t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    BenchSamples merged;
+    for (BenchSamples& part : samples) {
+        merged.config.insert(merged.config.end(), part.config.begin(), part.config.end());
+        merged.start.insert(merged.start.end(), part.start.begin(), part.start.end());
+        merged.result.insert(merged.result.end(), part.result.begin(), part.result.end());
+        merged.total.insert(merged.total.end(), part.total.begin(), part.total.end());
+        merged.bytes += part.bytes;
+        merged.errors += part.errors;
+    }
+    BenchResult result;
+    result.size = matrixSize; result.threads = numThreads; result.connections = bench.connections;
+    result.jobs = merged.total.size();
+    result.errors = merged.errors;
+    result.seconds = seconds;
+    result.jobsPerSec = seconds > 0 ? result.jobs / seconds : 0;
+    result.gbPerSec = seconds > 0 ? merged.bytes / seconds / 1e9 : 0;
+    result.config = summarize(merged.config);
+    result.start = summarize(merged.start);
+    result.result = summarize(merged.result);
+    result.total = summarize(merged.total);
+    return result;
+}
+
+void write_bench_csv(const std::string& path, const std::string& mode, const std::vector<BenchResult>& results) {
+    bool exists = std::ifstream(path).good();
+    std::ofstream out(path, std::ios::app);
+    if (!out) throw std::runtime_error(LOG_PREFIX "Cannot open CSV file " + path);
+    const char* phases[] = {"config", "start", "result", "total"};
+    if (!exists) {
+        out << "mode,size,threads,connections,jobs,errors,seconds,jobs_per_s,gb_per_s";
+        for (const char* phase : phases) out << "," << phase << "_p50_us," << phase << "_p90_us," << phase << "_p99_us," << phase << "_p999_us";
+        out << "\n";
+    }
+    for (const BenchResult& r : results) {
+        out << mode << "," << r.size << "," << r.threads << "," << r.connections << "," << r.jobs << "," << r.errors << ","
+            << r.seconds << "," << r.jobsPerSec << "," << r.gbPerSec;
+        for (const PhaseStats* p : {&r.config, &r.start, &r.result, &r.total}) {
+            out << "," << p->p50 << "," << p->p90 << "," << p->p99 << "," << p->p999;
+        }
+        out << "\n";
+    }
+}
+
+void write_bench_json(const std::string& path, const std::string& mode, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error(LOG_PREFIX "Cannot open JSON file " + path);
+    auto phase = [&](const char* name, const PhaseStats& p) {
+        out << "\"" << name << "\": {\"count\": " << p.count << ", \"mean_us\": " << p.mean << ", \"p50_us\": " << p.p50
+            << ", \"p90_us\": " << p.p90 << ", \"p99_us\": " << p.p99 << ", \"p999_us\": " << p.p999 << "}";
+    };
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "  {\"mode\": \"" << mode << "\", \"size\": " << r.size << ", \"threads\": " << r.threads
+            << ", \"connections\": " << r.connections << ", \"jobs\": " << r.jobs << ", \"errors\": " << r.errors
+            << ", \"seconds\": " << r.seconds << ", \"jobs_per_s\": " << r.jobsPerSec << ", \"gb_per_s\": " << r.gbPerSec << ", ";
+        phase("config", r.config); out << ", ";
+        phase("start", r.start); out << ", ";
+        phase("result", r.result); out << ", ";
+        phase("total", r.total);
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+int run_benchmark(const BenchConfig& bench, const SocketOptions& socketOptions) {
+    std::cout << LOG_PREFIX << "Benchmark: " << bench.connections << " connections, mode " << bench.mode << ", "
+              << (bench.durationSec > 0 ? std::to_string(bench.durationSec) + " s" : std::to_string(bench.requests) + " jobs")
+              << " per point" << std::endl;
+    std::cout << std::setw(6) << "size" << std::setw(8) << "threads" << std::setw(8) << "jobs" << std::setw(7) << "errors"
+              << std::setw(11) << "jobs/s" << std::setw(9) << "GB/s" << std::setw(12) << "total p50" << std::setw(12) << "p90"
+              << std::setw(12) << "p99" << std::setw(12) << "p99.9" << "  (us)" << std::endl;
+    std::vector<BenchResult> results;
+    uint64_t errors = 0;
+    for (uint32_t size : bench.sizes) {
+        for (uint32_t threads : bench.threads) {
+            BenchResult r = run_bench_point(bench, socketOptions, size, threads);
+            errors += r.errors;
+            std::cout << std::fixed << std::setprecision(1) << std::setw(6) << r.size << std::setw(8) << r.threads
+                      << std::setw(8) << r.jobs << std::setw(7) << r.errors << std::setw(11) << r.jobsPerSec
+                      << std::setprecision(3) << std::setw(9) << r.gbPerSec << std::setprecision(0)
+                      << std::setw(12) << r.total.p50 << std::setw(12) << r.total.p90 << std::setw(12) << r.total.p99
+                      << std::setw(12) << r.total.p999 << std::endl;
+            std::cout.unsetf(std::ios::floatfield);
+            results.push_back(r);
+        }
+    }
+    if (!bench.csvPath.empty()) write_bench_csv(bench.csvPath, bench.mode, results);
+    if (!bench.jsonPath.empty()) write_bench_json(bench.jsonPath, bench.mode, results);
+    return errors == 0 ? 0 : 1;
+}
+// ----------------------
+
 int main(int argc, char* argv[]) {
     uint32_t matrixSize = DEFAULT_MATRIX_SIZE;
     uint32_t numThreads = DEFAULT_NUM_THREADS;
+    SocketOptions socketOptions;
+    BenchConfig bench;
+    uint32_t blockRows = 0; // Chunked mode; 0 picks about 64 MB per block
+    uint32_t jobCount = 32; // Pipelined mode
+    uint32_t batchCount = 1000; // Batch mode
+    uint32_t updateCount = 100, updateRows = 1; // Update mode
+    uint64_t resumeToken = 0; // Session mode
+    uint32_t shmSlots = 4; // Shared memory mode
+    bool closeSession = false;
+    uint32_t priorityClass = 1, weight = 1; // Single-job modes, sent with CMD_SET_PRIORITY when not the defaults
+    FileOptions fileOptions;
+    WireOptions wire;
+
+    // "--name=value" options may appear anywhere; the rest are positional: size, threads, mode (or "bench")
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) { positional.push_back(arg); continue; }
+        try {
+            if (arg.rfind("--sndbuf=", 0) == 0) socketOptions.sendBufferBytes = std::stoi(arg.substr(9));
+            else if (arg.rfind("--rcvbuf=", 0) == 0) socketOptions.recvBufferBytes = std::stoi(arg.substr(9));
+            else if (arg.rfind("--nodelay=", 0) == 0) socketOptions.noDelay = std::stoi(arg.substr(10)) != 0;
+            else if (arg.rfind("--connections=", 0) == 0) bench.connections = std::max(1ul, std::stoul(arg.substr(14)));
+            else if (arg.rfind("--sizes=", 0) == 0) bench.sizes = parse_uint_list(arg.substr(8));
+            else if (arg.rfind("--threads=", 0) == 0) bench.threads = parse_uint_list(arg.substr(10));
+            else if (arg.rfind("--requests=", 0) == 0) bench.requests = std::stoull(arg.substr(11));
+            else if (arg.rfind("--duration=", 0) == 0) bench.durationSec = std::stod(arg.substr(11));
+            else if (arg.rfind("--mode=", 0) == 0) bench.mode = arg.substr(7);
+            else if (arg.rfind("--poll-ms=", 0) == 0) bench.pollIntervalMs = std::stoi(arg.substr(10));
+            else if (arg.rfind("--csv=", 0) == 0) bench.csvPath = arg.substr(6);
+            else if (arg.rfind("--json=", 0) == 0) bench.jsonPath = arg.substr(7);
+            else if (arg.rfind("--block-rows=", 0) == 0) blockRows = std::stoul(arg.substr(13));
+            else if (arg.rfind("--jobs=", 0) == 0) jobCount = std::stoul(arg.substr(7));
+            else if (arg.rfind("--priority=", 0) == 0) priorityClass = std::stoul(arg.substr(11));
+            else if (arg.rfind("--weight=", 0) == 0) weight = std::stoul(arg.substr(9));
+            else if (arg.rfind("--count=", 0) == 0) batchCount = std::max(1ul, std::stoul(arg.substr(8)));
+            else if (arg.rfind("--updates=", 0) == 0) updateCount = std::stoul(arg.substr(10));
+            else if (arg.rfind("--rows=", 0) == 0) updateRows = std::max(1ul, std::stoul(arg.substr(7)));
+            else if (arg.rfind("--resume=", 0) == 0) resumeToken = std::stoull(arg.substr(9), nullptr, 16);
+            else if (arg == "--close") closeSession = true;
+            else if (arg.rfind("--slots=", 0) == 0) shmSlots = std::max(1ul, std::stoul(arg.substr(8)));
+            else if (arg.rfind("--input=", 0) == 0) fileOptions.input = arg.substr(8);
+            else if (arg.rfind("--output=", 0) == 0) fileOptions.output = arg.substr(9);
+            else if (arg.rfind("--offset=", 0) == 0) fileOptions.offset = std::stoull(arg.substr(9));
+            else if (arg.rfind("--file-root=", 0) == 0) fileOptions.root = arg.substr(12);
+            else if (arg == "--generate") fileOptions.generate = true;
+            else if (arg.rfind("--encoding=", 0) == 0 || arg.rfind("--compress=", 0) == 0 || arg.rfind("--result=", 0) == 0) {
+                std::string value = arg.substr(arg.find('=') + 1);
+                wire.extended = true;
+                if (value == "f16") wire.format |= ENCODING_F16;
+                else if (value == "bf16") wire.format |= ENCODING_BF16;
+                else if (value == "f64") wire.format |= ENCODING_F64;
+                else if (value == "i32") wire.format |= ENCODING_I32;
+                else if (value == "i16") wire.format |= ENCODING_I16;
+                else if (value == "lz4") wire.format |= FORMAT_LZ4;
+                else if (value == "full") wire.format |= FORMAT_FULL_RESULT;
+                else if (value == "side") wire.format |= FORMAT_SIDE_VECTOR;
+                else if (value != "f32" && value != "none" && value != "diagonal") throw std::invalid_argument(value);
+            }
+            else if (arg.rfind("--op=", 0) == 0) {
+                std::string value = arg.substr(5);
+                const char* names[] = {"max", "min", "sum", "mean"};
+                uint32_t op = 0;
+                while (op < 4 && value != names[op]) ++op;
+                if (op == 4) throw std::invalid_argument(value);
+                wire.extended = true;
+                wire.format = (wire.format & ~FORMAT_OP_MASK) | (op << FORMAT_OP_SHIFT);
+            }
+            else if (arg == "--layout=columns") { wire.extended = true; wire.format |= FORMAT_COLUMNS; }
+            else if (arg == "--layout=rows") wire.format &= ~FORMAT_COLUMNS;
+            else std::cerr << LOG_PREFIX << "Warning: Unknown option " << arg << " ignored" << std::endl;
+        } catch (...) {
+            std::cerr << LOG_PREFIX << "Warning: Invalid value in " << arg << " ignored" << std::endl;
+        }
+    }
 
-    if (argc > 1) try { matrixSize = std::stoul(argv[1]); } catch (...) { }
-    if (argc > 2) try { numThreads = std::stoul(argv[2]); } catch (...) { }
-    if (matrixSize == 0 || matrixSize > 5000) {
+    bool benchMode = !positional.empty() && positional[0] == "bench";
+    if (benchMode && bench.mode != "poll" && bench.mode != "push") {
+        std::cerr << LOG_PREFIX << "Warning: Unknown bench mode '" << bench.mode << "', using push" << std::endl;
+        bench.mode = "push";
+    }
+    bool metricsMode = !positional.empty() && positional[0] == "metrics";
+    if (benchMode || metricsMode) positional.clear();
+    if (positional.size() > 0) try { matrixSize = std::stoul(positional[0]); } catch (...) { }
+    if (positional.size() > 1) try { numThreads = std::stoul(positional[1]); } catch (...) { }
+    // "push": server delivers the result itself, no CMD_GET_STATUS polling.
+    // "stream": rows are computed and sent back while the matrix is still being uploaded.
+    // "chunked": like stream, but in row blocks of --block-rows=N, for matrices too big to hold whole.
+    // "file": the server reads and writes the matrix in files it can map (see FileOptions).
+    // "pipeline": --jobs=N matrices in flight at once through AsyncClient, over --connections=C sockets.
+    // "batch": --count=N small matrices of random sizes up to <size>, all in one request.
+    // "update": the matrix stays on the server; --updates=R requests each replace --rows=K of its rows.
+    // "session": the matrix is kept in a server session, picked up again with --resume=TOKEN.
+    // "shm": --jobs=N matrices through a ring of --slots=S shared-memory slots, for a server on this host.
+    std::string mode = "poll";
+    if (positional.size() > 2) {
+        mode = positional[2];
+        if (mode != "poll" && mode != "push" && mode != "stream" && mode != "chunked" && mode != "file" && mode != "pipeline" && mode != "batch" &&
+            mode != "update" && mode != "session" && mode != "shm") {
+            std::cerr << LOG_PREFIX << "Warning: Unknown mode '" << mode << "', using poll" << std::endl;
+            mode = "poll";
+        }
+    }
+    if (matrixSize == 0 || (matrixSize > 5000 && mode != "chunked" && mode != "file")) {
         std::cerr << LOG_PREFIX << "Warning: Invalid or large matrix size provided (" << matrixSize <<"), using default " << DEFAULT_MATRIX_SIZE << std::endl;
         matrixSize = DEFAULT_MATRIX_SIZE;
     }
@@ -139,101 +1139,157 @@ int main(int argc, char* argv[]) {
 
     SOCKET connectSocket = INVALID_SOCKET;
     int exitCode = 0;
-    WSADATA wsaData;
     bool wsaStarted = false;
 
     try {
+#ifdef _WIN32
+        WSADATA wsaData;
         int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
         if (iResult != 0) {
             throw std::runtime_error(LOG_PREFIX "WSAStartup failed: " + std::to_string(iResult));
         }
         wsaStarted = true;
+#endif
 
-        connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (connectSocket == INVALID_SOCKET) {
-            throw std::runtime_error(LOG_PREFIX "Socket creation failed: " + GetWSAErrorStringClient(WSAGetLastError()));
-        }
-
-        sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(SERVER_PORT);
-        if (inet_pton(AF_INET, SERVER_IP, &serverAddr.sin_addr) <= 0) {
-            closesocket(connectSocket);
-            throw std::runtime_error(LOG_PREFIX "Invalid server IP address format");
-        }
+        if (benchMode) {
+            exitCode = run_benchmark(bench, socketOptions);
+        } else if (metricsMode) {
+            connectSocket = connect_or_throw(socketOptions);
+            print_server_metrics(connectSocket);
+        } else if (mode == "chunked") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_chunked(connectSocket, matrixSize, numThreads, blockRows);
+        } else if (mode == "file") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_file_job(connectSocket, matrixSize, numThreads, fileOptions);
+        } else if (mode == "pipeline") {
+            exitCode = run_pipelined(socketOptions, bench.connections, matrixSize, numThreads, jobCount);
+        } else if (mode == "batch") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_batch(connectSocket, matrixSize, numThreads, batchCount);
+        } else if (mode == "update") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_updates(connectSocket, matrixSize, numThreads, updateCount, updateRows);
+        } else if (mode == "session") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_session(connectSocket, matrixSize, numThreads, resumeToken, closeSession);
+        } else if (mode == "shm") {
+            connectSocket = connect_or_throw(socketOptions);
+            exitCode = run_shared_memory(connectSocket, matrixSize, numThreads, jobCount, shmSlots);
+        } else {
 
         std::cout << LOG_PREFIX << "Connecting to server " << SERVER_IP << ":" << SERVER_PORT << "..." << std::endl;
-        if (connect(connectSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            closesocket(connectSocket);
-            throw std::runtime_error(LOG_PREFIX "Connect failed: " + GetWSAErrorStringClient(error_code));
-        }
+        connectSocket = connect_or_throw(socketOptions);
         std::cout << LOG_PREFIX << "Connected." << std::endl;
+        if (priorityClass != 1 || weight != 1) {
+            send_frame_or_throw(connectSocket, {CMD_SET_PRIORITY, priorityClass, weight}, nullptr, 0, "send priority");
+            uint32_t reply = recv_uint32_or_throw(connectSocket, "recv priority ack");
+            if (reply != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server rejected priority " + std::to_string(priorityClass) + " / weight " + std::to_string(weight));
+        }
 
         std::vector<float> originalMatrix;
         generate_random_matrix(originalMatrix, matrixSize);
         print_matrix(originalMatrix, matrixSize, "Original Matrix (Client)");
 
-        std::cout << LOG_PREFIX << "Sending configuration (Size=" << matrixSize << ", Threads=" << numThreads << ")..." << std::endl;
-        send_uint32_or_throw(connectSocket, CMD_CONFIG_DATA, "send command config");
-        send_uint32_or_throw(connectSocket, matrixSize, "send matrix size");
-        send_uint32_or_throw(connectSocket, numThreads, "send num threads");
-        send_floats_or_throw(connectSocket, originalMatrix, "send matrix data");
+        std::vector<float> resultMatrix;
+        std::vector<float> decodedMatrix; // CONFIG_EX: the matrix as the server decodes it
+        uint32_t response;
+        if (mode == "stream") {
+            // Upload on a second thread so the result can be read while the matrix is still going out
+            std::cout << LOG_PREFIX << "Streaming matrix (Size=" << matrixSize << ", Threads=" << numThreads << ")..." << std::endl;
+            std::exception_ptr sendError;
+            std::thread sender([&] {
+                try {
+                    send_frame_or_throw(connectSocket, {CMD_STREAM_COMP, matrixSize, numThreads}, originalMatrix, "send stream frame");
+                } catch (...) {
+                    sendError = std::current_exception();
+                }
+            });
+            try {
+                response = recv_uint32_or_throw(connectSocket, "recv streamed result");
+                if (response == RESP_ERROR) throw std::runtime_error(LOG_PREFIX "Server rejected the streamed matrix.");
+                if (response != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "Received unexpected response: " + std::to_string(response));
+                receive_result(connectSocket, matrixSize, resultMatrix);
+            } catch (...) {
+                shutdown(connectSocket, SD_BOTH); // Unblocks the sender
+                sender.join();
+                throw;
+            }
+            sender.join();
+            if (sendError) std::rethrow_exception(sendError);
+            std::cout << LOG_PREFIX << "Status: Result received!" << std::endl;
+        } else {
+            std::cout << LOG_PREFIX << "Sending configuration (Size=" << matrixSize << ", Threads=" << numThreads << ")..." << std::endl;
+            if (wire.extended) {
+                std::vector<uint8_t> payload = encode_matrix(originalMatrix, wire.format, decodedMatrix);
+                uint64_t bytes = payload.size();
+                std::cout << LOG_PREFIX << "Payload: " << bytes << " bytes (format " << wire.format << ")" << std::endl;
+                send_frame_or_throw(connectSocket, {CMD_CONFIG_EX, matrixSize, numThreads, wire.format, (uint32_t)(bytes >> 32), (uint32_t)bytes},
+                                    payload.data(), payload.size(), "send extended config frame");
+            } else {
+                send_frame_or_throw(connectSocket, {CMD_CONFIG_DATA, matrixSize, numThreads}, originalMatrix, "send config frame");
+            }
 
-        uint32_t response = recv_uint32_or_throw(connectSocket, "recv config ack");
-        if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK config. Response: " + std::to_string(response));
-        std::cout << LOG_PREFIX << "Server acknowledged config." << std::endl;
+            response = recv_uint32_or_throw(connectSocket, "recv config ack");
+            if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK config. Response: " + std::to_string(response));
+            std::cout << LOG_PREFIX << "Server acknowledged config." << std::endl;
+        }
 
-        std::cout << LOG_PREFIX << "Sending start command..." << std::endl;
-        send_uint32_or_throw(connectSocket, CMD_START_COMP, "send command start");
-        response = recv_uint32_or_throw(connectSocket, "recv start ack");
-        if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK start. Response: " + std::to_string(response));
-        std::cout << LOG_PREFIX << "Server acknowledged start." << std::endl;
+        if (mode == "push") {
+            std::cout << LOG_PREFIX << "Sending start-and-wait command..." << std::endl;
+            send_uint32_or_throw(connectSocket, CMD_START_AND_WAIT, "send command start-and-wait");
+            response = recv_uint32_or_throw(connectSocket, "recv pushed result");
+            if (response == RESP_BUSY) throw std::runtime_error(LOG_PREFIX "Server busy, job not admitted; retry later.");
+            if (response == RESP_ERROR) throw std::runtime_error(LOG_PREFIX "Server reported an error during processing.");
+            if (response != RESP_RESULT) throw std::runtime_error(LOG_PREFIX "Received unexpected response: " + std::to_string(response));
+            std::cout << LOG_PREFIX << "Status: Result received!" << std::endl;
+            if (wire.extended) exitCode = receive_extended_result(connectSocket, matrixSize, decodedMatrix);
+            else receive_result(connectSocket, matrixSize, resultMatrix);
+        } else if (mode == "poll") {
+            std::cout << LOG_PREFIX << "Sending start command..." << std::endl;
+            send_uint32_or_throw(connectSocket, CMD_START_COMP, "send command start");
+            response = recv_uint32_or_throw(connectSocket, "recv start ack");
+            if (response == RESP_BUSY) throw std::runtime_error(LOG_PREFIX "Server busy, job not admitted; retry later.");
+            if (response != RESP_ACK) throw std::runtime_error(LOG_PREFIX "Server did not ACK start. Response: " + std::to_string(response));
+            std::cout << LOG_PREFIX << "Server acknowledged start." << std::endl;
 
-        std::cout << LOG_PREFIX << "Waiting for result (polling server)..." << std::endl;
-        std::vector<float> resultMatrix;
-        uint32_t resultSize = 0;
-        bool result_received = false;
-        int poll_attempts = 0;
-        const int max_poll_attempts = 120;
-        const int poll_interval_ms = 500;
-
-        while (!result_received && poll_attempts < max_poll_attempts) {
-            poll_attempts++;
-            send_uint32_or_throw(connectSocket, CMD_GET_STATUS, "send command status");
-            response = recv_uint32_or_throw(connectSocket, "recv status response");
-
-            if (response == RESP_RESULT) {
-                std::cout << LOG_PREFIX << "Status: Result received!" << std::endl;
-                resultSize = recv_uint32_or_throw(connectSocket, "recv result size");
-                if (resultSize != matrixSize) {
-                    std::cerr << LOG_PREFIX << "Warning: Result matrix size (" << resultSize
-                              << ") differs from original (" << matrixSize << ")" << std::endl;
-                }
-                if (resultSize > 0 && (size_t)resultSize * resultSize <= 100000000) {
-                    recv_floats_or_throw(connectSocket, resultMatrix, (size_t)resultSize * resultSize, "recv result data");
-                    print_matrix(resultMatrix, resultSize, "Result Matrix (Server)");
-                } else if (resultSize == 0) {
-                    std::cout << LOG_PREFIX << "Received empty result matrix (0x0)." << std::endl;
-                    resultMatrix.clear();
+            std::cout << LOG_PREFIX << "Waiting for result (polling server)..." << std::endl;
+            bool result_received = false;
+            int poll_attempts = 0;
+            const int max_poll_attempts = 120;
+            const int poll_interval_ms = 500;
+
+            while (!result_received && poll_attempts < max_poll_attempts) {
+                poll_attempts++;
+                send_uint32_or_throw(connectSocket, CMD_GET_STATUS, "send command status");
+                response = recv_uint32_or_throw(connectSocket, "recv status response");
+
+                if (response == RESP_RESULT) {
+                    std::cout << LOG_PREFIX << "Status: Result received!" << std::endl;
+                    if (wire.extended) exitCode = receive_extended_result(connectSocket, matrixSize, decodedMatrix);
+                    else receive_result(connectSocket, matrixSize, resultMatrix);
+                    result_received = true;
+
+                } else if (response == RESP_STATUS_PENDING) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
+                } else if (response == RESP_ERROR) {
+                    throw std::runtime_error(LOG_PREFIX "Server reported an error during processing.");
                 } else {
-                    throw std::runtime_error(LOG_PREFIX "Received implausible result matrix size: " + std::to_string(resultSize));
+                    throw std::runtime_error(LOG_PREFIX "Received unexpected status response: " + std::to_string(response));
                 }
-                result_received = true;
+            }
 
-            } else if (response == RESP_STATUS_PENDING) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
-            } else if (response == RESP_ERROR) {
-                throw std::runtime_error(LOG_PREFIX "Server reported an error during processing.");
-            } else {
-                throw std::runtime_error(LOG_PREFIX "Received unexpected status response: " + std::to_string(response));
+            if (!result_received) {
+                std::cerr << LOG_PREFIX << "Error: Did not receive result after " << max_poll_attempts << " attempts." << std::endl;
+                exitCode = 1;
             }
         }
-
-        if (!result_received) {
-            std::cerr << LOG_PREFIX << "Error: Did not receive result after " << max_poll_attempts << " attempts." << std::endl;
-            exitCode = 1;
+        if (!wire.extended && !resultMatrix.empty()) {
+            uint64_t mismatches = count_max_mismatches(resultMatrix, originalMatrix, matrixSize);
+            std::cout << LOG_PREFIX << "Result check: " << mismatches << " rows whose diagonal is not their max." << std::endl;
+            if (mismatches) exitCode = 1;
         }
+        } // Single job
 
     } catch (const std::exception& e) {
         std::cerr << LOG_PREFIX << "Error: " << e.what() << std::endl;
@@ -1,321 +1,5979 @@
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <cerrno>
+#endif
 #include <iostream>
+#include <cstring>
 #include <vector>
 #include <thread>
 #include <atomic>
 #include <chrono>
 #include <limits>
 #include <string>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <unordered_map>
+#include <sstream>
+#include <new>
+#include <list>
+#include <random>
+#include <fstream>
+#include <array>
+#include <cmath>
+#include <type_traits>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define LAB4_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define LAB4_NEON 1
+#include <arm_neon.h>
+#endif
+
+// GCC/Clang need per-function target attributes to emit AVX code from a baseline build; MSVC does not
+#if defined(LAB4_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LAB4_TARGET(isa) __attribute__((target(isa)))
+#else
+#define LAB4_TARGET(isa)
+#endif
+
+#ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
+#define MSG_NOSIGNAL 0 // No SIGPIPE on Winsock
+#else
+// Winsock names used throughout, mapped onto BSD sockets
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+#define WSAEINTR EINTR
+#define WSAECONNRESET ECONNRESET
+#define WSAECONNABORTED ECONNABORTED
+#define WSAEMFILE EMFILE
+#define WSAENOBUFS ENOBUFS
+inline int WSAGetLastError() { return errno; }
+inline void WSACleanup() {}
+#endif
+
+#define SERVER_PORT 65001
+#define LOG_PREFIX "[Server] "
+
+// Protocol Commands
+const uint32_t CMD_CONFIG_DATA = 1;
+const uint32_t CMD_START_COMP = 2;
+const uint32_t CMD_GET_STATUS = 3;
+const uint32_t CMD_START_AND_WAIT = 4; // Like START_COMP, but the reply is the final RESP_RESULT/RESP_ERROR
+const uint32_t CMD_STREAM_COMP = 5;    // CONFIG_DATA layout; rows are computed and sent back while still arriving
+const uint32_t CMD_GET_METRICS = 6;    // Reply: RESP_METRICS, byte length, Prometheus text exposition
+// Large matrices, never held whole: [size][threads][blockRows], answered with RESP_ACK, then row blocks
+// [firstRow][rowCount][bytesHigh][bytesLow][floats] in order. Each block comes back as a RESP_BLOCK frame
+// with the same layout as soon as it is computed.
+const uint32_t CMD_CHUNKED_COMP = 7;
+// Matrix in a file under --file-root: [size][threads][offsetHigh][offsetLow][inputLen][outputLen][input][output]
+// (paths relative to the root, no terminators). The result matrix is written to the output file, or in place
+// when outputLen is 0; an output naming the input file is refused, and the offset must be a multiple of 4.
+// Neither file may be truncated or replaced until the reply: RESP_ACK once it is written, or RESP_ERROR.
+const uint32_t CMD_FILE_COMP = 8;
+// CONFIG_DATA with a format word: [size][threads][format][bytesHigh][bytesLow][payload]. The payload is the
+// matrix in the chosen encoding, compressed if asked. Results on such a connection are RESP_RESULT [size]
+// [format][bytesHigh][bytesLow][payload], holding the N results unless FORMAT_FULL_RESULT is set. Results
+// replace the diagonal, or with FORMAT_SIDE_VECTOR leave the matrix alone: a full reply is then the
+// unchanged matrix followed by the N results. Results of an F64, I32 or I16 matrix are of that type,
+// all others f32.
+const uint32_t CMD_CONFIG_EX = 9;
+const uint32_t RESP_ACK = 10;
+const uint32_t RESP_STATUS_PENDING = 11;
+const uint32_t RESP_RESULT = 12;
+const uint32_t RESP_ERROR = 13;
+const uint32_t RESP_METRICS = 14;
+const uint32_t RESP_BLOCK = 15;
+// Pipelined jobs: [jobId][size][threads][floats], sent back-to-back without waiting for a reply. Each one is run
+// as soon as it has arrived and answered when it is done, in completion order: RESP_JOB_RESULT [jobId][size]
+// [floats], or RESP_JOB_ERROR [jobId]. IDs are chosen by the client and only echoed back. At most
+// --pipeline-depth jobs are held per connection; beyond that the server stops reading until results go out,
+// so a client must keep reading results while it submits.
+const uint32_t CMD_SUBMIT_JOB = 16;
+const uint32_t RESP_JOB_RESULT = 17;
+const uint32_t RESP_JOB_ERROR = 18;
+// Many matrices in one frame: [count][threads][size x count][floats of every matrix, in order]. One reply
+// once all are done: RESP_BATCH [count][floats of every result matrix, in order], or RESP_ERROR.
+const uint32_t CMD_BATCH = 19;
+const uint32_t RESP_BATCH = 20;
+const uint32_t MAX_BATCH_MATRICES = 1u << 16;
+// Overload: the job was not admitted because the server's backlog is full; retry later. RESP_BUSY answers
+// START_COMP, START_AND_WAIT, FILE_COMP and BATCH; a pipelined job gets RESP_JOB_BUSY [jobId].
+const uint32_t RESP_BUSY = 21;
+const uint32_t RESP_JOB_BUSY = 22;
+// Scheduling of this connection's later jobs: [priorityClass][weight], answered with RESP_ACK, or RESP_ERROR
+// if the class is not below PRIORITY_CLASSES or the weight is not 1..MAX_CLIENT_WEIGHT
+const uint32_t CMD_SET_PRIORITY = 23;
+// Between servers, from a --shards coordinator: a run of rows of one job, [jobId][rowCount][size][threads]
+// [format][rowCount x size values]. The format word is CONFIG_EX's, with an F32, F64, I32 or I16 encoding and
+// no flags. Pipelined like CMD_SUBMIT_JOB: RESP_SHARD_RESULT [jobId][rowCount][the rowCount results, of the
+// element type], or RESP_JOB_ERROR / RESP_JOB_BUSY [jobId].
+const uint32_t CMD_SHARD_COMP = 24;
+const uint32_t RESP_SHARD_RESULT = 25;
+// Delta update of the matrix this connection holds (CONFIG_DATA / CONFIG_EX, not widened, reduced by rows):
+// [count][threads][count row indices][the count rows, in index order, of the matrix's element type]. Only
+// those rows are replaced and reduced again. Reply: RESP_ROWS_RESULT [count][their results, in the same
+// order], or RESP_ERROR / RESP_BUSY. A later GET_STATUS sees the whole updated matrix if it had a result
+// before. Sum and mean need FORMAT_SIDE_VECTOR, since in place they consume the row.
+const uint32_t CMD_UPDATE_ROWS = 26;
+const uint32_t RESP_ROWS_RESULT = 27;
+// Sessions, with --session-dir: [op][tokenHigh][tokenLow]. SESSION_OPEN starts a new session on this connection
+// (token ignored); SESSION_RESUME takes over one from an earlier connection, or an earlier run of the server,
+// with the matrix (and result) it held; SESSION_CLOSE deletes this connection's session. The first two are answered
+// with RESP_SESSION [tokenHigh][tokenLow][matrixSize][format][SESSION_HAS_* flags], the last with RESP_ACK.
+// Any of them fails with RESP_ERROR while a job of this connection is running, or for an unknown or attached token.
+const uint32_t CMD_SESSION = 28;
+const uint32_t RESP_SESSION = 29;
+const uint32_t SESSION_OPEN = 0;
+const uint32_t SESSION_RESUME = 1;
+const uint32_t SESSION_CLOSE = 2;
+const uint32_t SESSION_HAS_MATRIX = 1;    // START_COMP / UPDATE_ROWS work without a new CONFIG_DATA
+const uint32_t SESSION_HAS_RESULT = 2;    // GET_STATUS answers with the result right away
+const uint32_t SESSION_EXTENDED = 4;      // The matrix came with CONFIG_EX, so results are sent in its format
+// Same-host clients, with --shm-max-mb: CMD_SHM_ATTACH [slotCount][slotBytesHigh][slotBytesLow] makes the server
+// create a shared-memory ring of slotCount slots of at least slotBytes each, answered with RESP_SHM_READY
+// [nameLength][name], or RESP_ERROR. The client maps the region by that name (shm_open on POSIX,
+// OpenFileMapping on Windows) and reads its layout from the ShmRingHeader at its start. CMD_SHM_SUBMIT
+// [jobId][slot][size][threads] is then the doorbell for a size x size f32 matrix the client has written into
+// that slot: it is computed in place and answered like CMD_SUBMIT_JOB, in completion order, with RESP_SHM_DONE
+// [jobId][slot] and no payload, or RESP_JOB_ERROR / RESP_JOB_BUSY [jobId]. The slot is the server's until then.
+const uint32_t CMD_SHM_ATTACH = 30;
+const uint32_t RESP_SHM_READY = 31;
+const uint32_t CMD_SHM_SUBMIT = 32;
+const uint32_t RESP_SHM_DONE = 33;
+
+// CMD_CONFIG_EX format word
+const uint32_t FORMAT_ENCODING_MASK = 0xFF; // Input element encoding:
+const uint32_t ENCODING_F32 = 0;
+const uint32_t ENCODING_F16 = 1;            // IEEE half
+const uint32_t ENCODING_BF16 = 2;           // Upper half of an f32
+// Element types kept at their own width: reduced by their own kernels, results sent back in the same type
+const uint32_t ENCODING_F64 = 3;
+const uint32_t ENCODING_I32 = 4;
+const uint32_t ENCODING_I16 = 5;
+const uint32_t FORMAT_LZ4 = 1u << 8;        // Payloads, both ways, are byte-shuffled and then LZ4 block compressed
+const uint32_t FORMAT_FULL_RESULT = 1u << 9; // Send the whole matrix back, not just the diagonal
+const uint32_t FORMAT_COLUMNS = 1u << 10;   // Reduce each column instead of each row; f32 input only
+const uint32_t FORMAT_SIDE_VECTOR = 1u << 11; // Leave the matrix as sent; the N results go into a vector of their own
+const uint32_t FORMAT_OP_SHIFT = 16;        // Bits 16-23: the reduction, one of the OP_* values
+const uint32_t FORMAT_OP_MASK = 0xFFu << FORMAT_OP_SHIFT;
+
+// Per-row (or per-column) reductions. Plain CONFIG_DATA jobs and every other command use OP_MAX.
+const uint32_t OP_MAX = 0;
+const uint32_t OP_MIN = 1;
+const uint32_t OP_SUM = 2;
+const uint32_t OP_MEAN = 3;
+const uint32_t OP_COUNT = 4;
+
+// What the kernels compute on; F16 and BF16 input is widened to ELEMENT_F32 first
+const uint32_t ELEMENT_F32 = 0;
+const uint32_t ELEMENT_F64 = 1;
+const uint32_t ELEMENT_I32 = 2;
+const uint32_t ELEMENT_I16 = 3;
+const uint32_t ELEMENT_TYPE_COUNT = 4;
+
+uint32_t element_type(uint32_t encoding) {
+    switch (encoding) {
+        case ENCODING_F64: return ELEMENT_F64;
+        case ENCODING_I32: return ELEMENT_I32;
+        case ENCODING_I16: return ELEMENT_I16;
+        default: return ELEMENT_F32;
+    }
+}
+
+size_t element_bytes(uint32_t elementType) {
+    static const size_t BYTES[ELEMENT_TYPE_COUNT] = {sizeof(float), sizeof(double), sizeof(int32_t), sizeof(int16_t)};
+    return BYTES[elementType];
+}
+
+// rows x size elements of elementSize bytes fit in `limit`. Sizes come straight off the wire, where the
+// plain product wraps (2^31 x 2^31 x 4 is 0 in 64 bits), so this divides instead.
+bool fits_bytes(uint64_t rows, uint64_t size, uint64_t elementSize, uint64_t limit) {
+    if (rows == 0 || size == 0 || elementSize == 0) return true;
+    return rows <= limit / size / elementSize;
+}
+
+// Startup options, parsed once in main()
+struct ServerConfig {
+    std::string kernel = "auto"; // --kernel=auto|scalar|avx2|avx512|neon
+    uint32_t ioThreads = 0;      // --io-threads=N, 0 picks from the core count
+    int sendBufferBytes = 0;     // --sndbuf=BYTES, SO_SNDBUF per client socket, 0 keeps the OS default
+    int recvBufferBytes = 0;     // --rcvbuf=BYTES, SO_RCVBUF (also set on the listener so it applies to the handshake)
+    bool noDelay = true;         // --nodelay=0|1, TCP_NODELAY: responses are whole frames, Nagle only adds latency
+    size_t bufferPoolMB = 256;   // --buffer-pool-mb=N, idle matrix buffers kept for reuse
+    bool hugePages = false;      // --hugepages=0|1, ask for transparent huge pages on buffers of 2 MB and up (Linux)
+    size_t maxMatrixMB = 2048;   // --max-matrix-mb=N, largest whole matrix for CONFIG_DATA / STREAM_COMP
+    size_t windowMB = 256;       // --window-mb=N, row blocks a CHUNKED_COMP connection may hold at once
+    std::string fileRoot;        // --file-root=DIR, the only directory CMD_FILE_COMP may touch; empty disables it.
+                                 // Its files must not be truncated or replaced while a job maps them (SIGBUS on POSIX)
+    size_t cacheMB = 64;         // --cache-mb=N, cached job results (diagonals); 0 disables the cache
+    size_t pipelineDepth = 16;   // --pipeline-depth=N, CMD_SUBMIT_JOB jobs one connection may hold at once
+    size_t maxJobs = 0;          // --max-jobs=N, jobs running at once server-wide; 0 is twice the compute threads
+    size_t maxWaitingJobs = 1024; // --max-waiting-jobs=N, admitted but not yet running; beyond that RESP_BUSY
+    std::string numa = "auto";   // --numa=auto|0|1, node-local workers and buffers; auto turns it on with 2+ nodes
+    std::string affinity = "auto"; // --affinity=auto|none|node|core, pinning of compute workers (I/O threads go to
+                                   // their node unless none); auto is node with NUMA on, none otherwise
+    std::string gpu = "off";     // --gpu=off|auto|any, OpenCL offload: auto takes a GPU or accelerator, any also a CPU device
+    uint32_t gpuMinSize = 2048;  // --gpu-min-size=N, smallest matrix (rows) whose jobs go to the device
+    size_t gpuMaxMB = 1024;      // --gpu-max-mb=N, device memory for matrices uploaded while they arrive
+    uint16_t port = SERVER_PORT; // --port=N
+    std::string shards;          // --shards=HOST:PORT,..., backend servers the rows of large jobs are split across
+    uint32_t shardMinSize = 1024; // --shard-min-size=N, smallest matrix (rows) whose jobs are sharded
+    uint32_t shardConnections = 2; // --shard-connections=N, to every backend, each with one shard in flight
+    uint32_t shardHedgeMs = 50;  // --shard-hedge-ms=N, least time a shard waits before a second backend gets it too
+    std::string sessionDir;      // --session-dir=DIR, where session matrices and the result cache outlive the process
+    size_t maxSessions = 256;    // --max-sessions=N, kept in DIR; the least recently used detached one goes first
+    size_t shmMaxMB = 1024;      // --shm-max-mb=N, largest CMD_SHM_ATTACH ring per connection; 0 disables shared memory
+    bool autoParallelism = true; // --auto-parallelism=0|1, workers per job from the startup cost model; 0 uses numThreads
+};
+
+// --- NUMA Placement ---
+// On a multi-socket machine a job's matrix, the I/O thread filling it and the workers scanning it should
+// all sit on one memory node. Every I/O loop and compute worker belongs to a node; a connection takes the
+// node of its loop, faults its buffers in there and queues its jobs to that node's workers. Workers of
+// other nodes only steal a job's tasks once their own node has nothing left to run.
+struct NumaNode {
+    int osId;                   // For memory binding; -1 on the single fallback node
+    std::vector<unsigned> cpus; // Those this process may run on
+};
+
+enum class Affinity { None, Node, Core };
+
+std::vector<NumaNode> g_numaNodes;     // Set in main() before any thread starts; one entry when NUMA is off
+thread_local int t_numaNode = -1;      // Index into g_numaNodes of the node the current thread works for
+
+// --numa resolved to on: the nodes are real and worth keeping work on
+bool numa_enabled() { return !g_numaNodes.empty() && g_numaNodes[0].osId >= 0; }
+
+#ifndef _WIN32
+// sysfs cpulist syntax: "0-3,8,10-11"
+std::vector<unsigned> parse_cpu_list(const std::string& text) {
+    std::vector<unsigned> cpus;
+    std::stringstream ranges(text);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        try {
+            size_t dash = range.find('-');
+            unsigned first = std::stoul(range.substr(0, dash));
+            unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+            for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) cpus.push_back(cpu);
+        } catch (...) { /* skip malformed ranges */ }
+    }
+    return cpus;
+}
+#endif
+
+// Nodes holding at least one CPU of this process, in OS order. Falls back to a single node with every CPU
+// when the OS reports no topology.
+std::vector<NumaNode> detect_numa_nodes() {
+    std::vector<NumaNode> nodes;
+#ifdef _WIN32
+    ULONG highest = 0;
+    DWORD_PTR processMask = 0, systemMask = 0;
+    if (GetNumaHighestNodeNumber(&highest) && GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        for (ULONG n = 0; n <= highest; ++n) {
+            ULONGLONG nodeMask = 0;
+            if (!GetNumaNodeProcessorMask((UCHAR)n, &nodeMask)) continue;
+            NumaNode node{(int)n, {}};
+            for (unsigned cpu = 0; cpu < 8 * sizeof(DWORD_PTR); ++cpu) {
+                if ((nodeMask & processMask) >> cpu & 1) node.cpus.push_back(cpu);
+            }
+            if (!node.cpus.empty()) nodes.push_back(std::move(node));
+        }
+    }
+    if (nodes.empty()) {
+        NumaNode all{-1, {}};
+        for (unsigned cpu = 0; cpu < 8 * sizeof(DWORD_PTR); ++cpu) if (processMask >> cpu & 1) all.cpus.push_back(cpu);
+        nodes.push_back(std::move(all));
+    }
+#else
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() < 5 || name.compare(0, 4, "node") != 0) continue;
+            if (name.find_first_not_of("0123456789", 4) != std::string::npos) continue;
+            std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+            std::string text;
+            std::getline(file, text);
+            NumaNode node{std::stoi(name.substr(4)), {}};
+            for (unsigned cpu : parse_cpu_list(text)) {
+                if (!haveMask || CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+            }
+            if (!node.cpus.empty()) nodes.push_back(std::move(node));
+        }
+        closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.osId < b.osId; });
+    if (nodes.empty()) {
+        NumaNode all{-1, {}};
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) if (haveMask && CPU_ISSET(cpu, &allowed)) all.cpus.push_back(cpu);
+        nodes.push_back(std::move(all));
+    }
+#endif
+    return nodes;
+}
+
+// Restricts the calling thread to `cpus`; false (thread left as it was) if the OS refuses
+bool pin_current_thread(const std::vector<unsigned>& cpus) {
+    if (cpus.empty()) return false;
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (unsigned cpu : cpus) if (cpu < 8 * sizeof(DWORD_PTR)) mask |= (DWORD_PTR)1 << cpu;
+    return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned cpu : cpus) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+// Asks for the pages of a page-aligned range to be faulted in on `osNode` (other nodes once it is full).
+// Must come before the first touch. Linux only, by raw syscall to avoid a libnuma dependency; on Windows
+// pages land on the node of the thread touching them first.
+void prefer_memory_node(void* block, size_t bytes, int osNode) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MPOL_PREFERRED_MODE = 1; // MPOL_PREFERRED in <linux/mempolicy.h>
+    if (osNode < 0 || osNode >= 64) return;
+    unsigned long nodeMask = 1ul << osNode;
+    syscall(SYS_mbind, block, bytes, MPOL_PREFERRED_MODE, &nodeMask, 8 * sizeof(nodeMask) + 1, 0); // Best effort
+#else
+    (void)block; (void)bytes; (void)osNode;
+#endif
+}
+// ---------------------------
+
+// --- Matrix Buffer Pool ---
+// Server-wide cache of matrix buffers in power-of-two size classes, so connection churn and repeated
+// jobs reuse memory instead of going back to the allocator (and taking fresh page faults) every time.
+// Blocks are 64-byte aligned and never zero-filled: every byte is overwritten by the socket before use.
+// With NUMA on, blocks are page-aligned, bound to the node they are requested for and cached per node.
+const size_t BUFFER_MIN_CLASS = 12;       // 4 KB
+const size_t BUFFER_CLASS_COUNT = 48;
+const size_t BUFFER_ALIGNMENT = 64;       // Cache line, and enough for any SIMD load the kernels use
+const size_t PAGE_BYTES = 4096;           // mbind() works on whole pages
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+class BufferPool {
+public:
+    // `boundNodes`: OS node of each g_numaNodes entry, or empty to leave placement to the OS
+    void configure(size_t maxCachedBytes, bool hugePages, const std::vector<int>& boundNodes = {}) {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxCached = maxCachedBytes;
+        useHugePages = hugePages;
+        osNodes = boundNodes;
+        freeLists.resize(osNodes.size() + 1);
+    }
+
+    ~BufferPool() {
+        for (size_t list = 0; list < freeLists.size(); ++list) {
+            for (size_t c = 0; c < BUFFER_CLASS_COUNT; ++c) {
+                for (void* block : freeLists[list][c]) free_block(block, c);
+            }
+        }
+    }
+
+    // Returns a block of at least `bytes` placed on `node` (an index into g_numaNodes, -1 for anywhere),
+    // and its size class for release()
+    void* acquire(size_t bytes, size_t& sizeClass, int node = -1) {
+        sizeClass = class_for(bytes);
+        size_t list = list_for(node);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!freeLists[list][sizeClass].empty()) {
+                void* block = freeLists[list][sizeClass].back();
+                freeLists[list][sizeClass].pop_back();
+                cachedBytes -= class_bytes(sizeClass);
+                reuses++;
+                return block;
+            }
+            allocations++;
+        }
+        void* block = allocate_block(sizeClass); // Throws std::bad_alloc
+        if (list > 0) prefer_memory_node(block, class_bytes(sizeClass), osNodes[list - 1]);
+        return block;
+    }
+
+    // `node` as passed to acquire()
+    void release(void* block, size_t sizeClass, int node = -1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cachedBytes + class_bytes(sizeClass) <= maxCached) {
+                freeLists[list_for(node)][sizeClass].push_back(block);
+                cachedBytes += class_bytes(sizeClass);
+                return;
+            }
+        }
+        free_block(block, sizeClass);
+    }
+
+    // Counters for the metrics endpoint
+    void stats(uint64_t& reuseCount, uint64_t& allocationCount, size_t& idleBytes) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        reuseCount = reuses;
+        allocationCount = allocations;
+        idleBytes = cachedBytes;
+    }
+
+private:
+    typedef std::array<std::vector<void*>, BUFFER_CLASS_COUNT> ClassLists;
+
+    static size_t class_for(size_t bytes) {
+        size_t c = BUFFER_MIN_CLASS;
+        while (c + 1 < BUFFER_CLASS_COUNT && class_bytes(c) < bytes) ++c;
+        if (class_bytes(c) < bytes) throw std::bad_alloc();
+        return c;
+    }
+    static size_t class_bytes(size_t sizeClass) { return (size_t)1 << sizeClass; }
+
+    // List 0 holds unbound blocks, list n + 1 those bound to node n; fixed after configure()
+    size_t list_for(int node) const { return (node >= 0 && (size_t)node < osNodes.size()) ? node + 1 : 0; }
+
+    size_t alignment_for(size_t sizeClass) const {
+        if (useHugePages && class_bytes(sizeClass) >= HUGE_PAGE_BYTES) return HUGE_PAGE_BYTES;
+        return osNodes.empty() ? BUFFER_ALIGNMENT : PAGE_BYTES;
+    }
+
+    void* allocate_block(size_t sizeClass) {
+        size_t alignment = alignment_for(sizeClass);
+        void* block = ::operator new(class_bytes(sizeClass), std::align_val_t(alignment));
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+        if (alignment == HUGE_PAGE_BYTES) madvise(block, class_bytes(sizeClass), MADV_HUGEPAGE);
+#endif
+        return block;
+    }
+
+    void free_block(void* block, size_t sizeClass) {
+        ::operator delete(block, std::align_val_t(alignment_for(sizeClass)));
+    }
+
+    mutable std::mutex mutex;
+    std::vector<ClassLists> freeLists = std::vector<ClassLists>(1);
+    std::vector<int> osNodes;
+    size_t maxCached = 0;
+    size_t cachedBytes = 0;
+    bool useHugePages = false; // Fixed before the first acquire(), like osNodes
+    uint64_t reuses = 0, allocations = 0;
+};
+
+BufferPool g_bufferPool; // Configured in main(); outlives every connection and pool task
+
+// A matrix borrowed from g_bufferPool. Contents are unspecified after resize().
+class MatrixBuffer {
+public:
+    MatrixBuffer() = default;
+    ~MatrixBuffer() { release(); }
+    MatrixBuffer(const MatrixBuffer&) = delete;
+    MatrixBuffer& operator=(const MatrixBuffer&) = delete;
+
+    // Keeps the current block when it is big enough, so a connection re-sending the same size allocates nothing
+    void resize(size_t newCount) {
+        if (newCount > std::numeric_limits<size_t>::max() / sizeof(float)) throw std::bad_alloc(); // Would wrap the byte count below
+        if (newCount * sizeof(float) > capacityBytes) {
+            release();
+            if (newCount == 0) return;
+            node = t_numaNode; // Callers run on the I/O thread of the connection, so on its node
+            block = static_cast<float*>(g_bufferPool.acquire(newCount * sizeof(float), sizeClass, node));
+            capacityBytes = (size_t)1 << sizeClass;
+        }
+        count = newCount;
+    }
+
+    void release() {
+        if (block) g_bufferPool.release(block, sizeClass, node);
+        block = nullptr;
+        capacityBytes = 0;
+        count = 0;
+    }
+
+    float* data() { return block; }
+    const float* data() const { return block; }
+    size_t size() const { return count; }
+
+private:
+    float* block = nullptr;
+    size_t count = 0;
+    size_t capacityBytes = 0;
+    size_t sizeClass = 0;
+    int node = -1;
+};
+// ---------------------------
+
+// --- Result Cache ---
+// Clients often resubmit the same matrix (benchmarks, retries, a UI re-running a job). Every CONFIG_DATA /
+// CONFIG_EX payload is hashed as it arrives, and the diagonal of each finished job is kept under
+// (size, wire format, hash), so a repeat START_COMP only has to write N floats back into the matrix.
+// The hash is XXH64 with a per-process random seed: a colliding matrix would get a wrong answer, so the
+// seed keeps collisions from being precomputed offline.
+const uint64_t HASH_PRIME1 = 11400714785074694791ULL;
+const uint64_t HASH_PRIME2 = 14029467366897019727ULL;
+const uint64_t HASH_PRIME3 = 1609587929392839161ULL;
+const uint64_t HASH_PRIME4 = 9650029242287828579ULL;
+const uint64_t HASH_PRIME5 = 2870177450012600261ULL;
+const size_t CACHE_ENTRY_OVERHEAD = 128; // List node, map slot and vector header, charged against the budget
+const uint64_t CACHE_LOG_MAGIC = 0x313052433442414CULL; // "LAB4CR01" header word of a persisted cache log
+
+// Incremental XXH64: feed the payload in whatever pieces recv() delivers
+class StreamHash {
+public:
+    void reset(uint64_t seed) {
+        acc[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+        acc[1] = seed + HASH_PRIME2;
+        acc[2] = seed;
+        acc[3] = seed - HASH_PRIME1;
+        this->seed = seed;
+        total = 0;
+        pending = 0;
+    }
+
+    void update(const void* data, size_t bytes) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        total += bytes;
+        if (pending > 0) { // Complete the stripe left over from the previous piece
+            size_t take = std::min(bytes, sizeof(stripe) - pending);
+            std::memcpy(stripe + pending, p, take);
+            pending += take; p += take; bytes -= take;
+            if (pending < sizeof(stripe)) return;
+            consume(stripe);
+            pending = 0;
+        }
+        for (; bytes >= sizeof(stripe); p += sizeof(stripe), bytes -= sizeof(stripe)) consume(p);
+        std::memcpy(stripe, p, bytes);
+        pending = bytes;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= sizeof(stripe)) {
+            h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            for (uint64_t v : acc) h = (h ^ round(0, v)) * HASH_PRIME1 + HASH_PRIME4;
+        } else {
+            h = seed + HASH_PRIME5;
+        }
+        h += total;
+        size_t i = 0;
+        for (; i + 8 <= pending; i += 8) h = rotl(h ^ round(0, read64(stripe + i)), 27) * HASH_PRIME1 + HASH_PRIME4;
+        if (i + 4 <= pending) { h = rotl(h ^ (read32(stripe + i) * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3; i += 4; }
+        for (; i < pending; ++i) h = rotl(h ^ (stripe[i] * HASH_PRIME5), 11) * HASH_PRIME1;
+        h ^= h >> 33; h *= HASH_PRIME2;
+        h ^= h >> 29; h *= HASH_PRIME3;
+        return h ^ (h >> 32);
+    }
+
+private:
+    static uint64_t rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+    static uint64_t round(uint64_t a, uint64_t input) { return rotl(a + input * HASH_PRIME2, 31) * HASH_PRIME1; }
+    static uint64_t read64(const uint8_t* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; } // Little-endian hosts only,
+    static uint64_t read32(const uint8_t* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; } // like the float wire format
+
+    void consume(const uint8_t* p) {
+        for (int lane = 0; lane < 4; ++lane) acc[lane] = round(acc[lane], read64(p + lane * 8));
+    }
+
+    uint64_t acc[4] = {};
+    uint64_t seed = 0;
+    uint64_t total = 0;
+    uint8_t stripe[32];
+    size_t pending = 0;
+};
+
+struct ResultKey {
+    uint32_t size = 0;
+    uint32_t format = 0; // Wire format word: the same matrix sent as f16, or reduced another way, is a different input
+    uint64_t hash = 0;
+    bool operator==(const ResultKey& other) const { return size == other.size && format == other.format && hash == other.hash; }
+};
+
+struct ResultKeyHash {
+    size_t operator()(const ResultKey& key) const { return (size_t)(key.hash ^ ((uint64_t)key.size << 32) ^ key.format); }
+};
+
+// Least-recently-used job results (the N reduced values), bounded by a byte budget; shared by all connections.
+// With persist(), every stored entry is also appended to a log file that the next run replays, so a restart
+// keeps the cache warm. The log holds the hash seed too: keys are only meaningful under the seed they were made with.
+class ResultCache {
+public:
+    void configure(size_t budgetBytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = budgetBytes;
+        seed = std::random_device{}() | ((uint64_t)std::random_device{}() << 32);
+    }
+
+    bool enabled() const { return budget > 0; } // Fixed before the listener opens
+    uint64_t hash_seed() const { return seed; }
+
+    // Replays the log at `path` left by an earlier run (taking its seed), then rewrites it with just the
+    // entries that fit the budget and keeps it open for appends. Call after configure(), before the listener opens.
+    bool persist(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ifstream in(path, std::ios::binary);
+        uint64_t header[2];
+        if (in.read(reinterpret_cast<char*>(header), sizeof(header)) && header[0] == CACHE_LOG_MAGIC) {
+            seed = header[1];
+            LogRecord record;
+            std::vector<uint8_t> results;
+            while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                results.resize(record.resultBytes);
+                if (!in.read(reinterpret_cast<char*>(results.data()), results.size())) break; // Cut short by a crash
+                insert(ResultKey{record.size, record.format, record.hash}, std::move(results));
+            }
+        }
+        in.close();
+        logPath = path;
+        if (!rewrite_log()) {
+            std::cerr << LOG_PREFIX << "Cannot write the result cache log " << path << "; results are not persisted." << std::endl;
+            return false;
+        }
+        std::cout << LOG_PREFIX << "Result cache: " << entries.size() << " entries restored from " << path << std::endl;
+        return true;
+    }
+
+    bool contains(const ResultKey& key) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return index.count(key) != 0;
+    }
+
+    // Copies the cached results, elementSize bytes each, to element i * stride of `values` (stride size + 1:
+    // the matrix's diagonal); true on a hit. The key's format fixes the element type.
+    bool load(const ResultKey& key, void* values, size_t stride, size_t elementSize) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found == index.end()) return false;
+        entries.splice(entries.begin(), entries, found->second); // Now the most recently used
+        const std::vector<uint8_t>& results = found->second->results;
+        for (uint32_t i = 0; i < key.size; ++i) {
+            std::memcpy(static_cast<char*>(values) + i * stride * elementSize, &results[i * elementSize], elementSize);
+        }
+        return true;
+    }
+
+    void store(const ResultKey& key, const void* values, size_t stride, size_t elementSize) {
+        size_t cost = entry_cost((size_t)key.size * elementSize);
+        if (cost > budget) return;
+        std::vector<uint8_t> results((size_t)key.size * elementSize);
+        for (uint32_t i = 0; i < key.size; ++i) {
+            std::memcpy(&results[i * elementSize], static_cast<const char*>(values) + i * stride * elementSize, elementSize);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!insert(key, std::move(results)) || !log.is_open()) return;
+        append_record(entries.front());
+        log.flush(); // A crash loses at most the entry being written
+        if (!log || logBytes > 2 * budget + (1 << 20)) rewrite_log(); // Mostly evicted entries by now
+    }
+
+    void stats(size_t& entryCount, size_t& bytes) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        entryCount = entries.size();
+        bytes = usedBytes;
+    }
+
+private:
+    struct Entry {
+        ResultKey key;
+        std::vector<uint8_t> results;
+    };
+
+    struct LogRecord {
+        uint32_t size;
+        uint32_t format;
+        uint64_t hash;
+        uint64_t resultBytes;
+    };
+
+    static size_t entry_cost(size_t resultBytes) { return resultBytes + CACHE_ENTRY_OVERHEAD; }
+
+    // Caller holds the mutex. False if the key was already there (two connections raced on the same matrix).
+    bool insert(const ResultKey& key, std::vector<uint8_t> results) {
+        size_t cost = entry_cost(results.size());
+        if (cost > budget) return false;
+        auto found = index.find(key);
+        if (found != index.end()) {
+            entries.splice(entries.begin(), entries, found->second);
+            return false;
+        }
+        while (usedBytes + cost > budget) {
+            usedBytes -= entry_cost(entries.back().results.size());
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        entries.push_front(Entry{key, std::move(results)});
+        index[key] = entries.begin();
+        usedBytes += cost;
+        return true;
+    }
+
+    void append_record(const Entry& entry) {
+        LogRecord record{entry.key.size, entry.key.format, entry.key.hash, entry.results.size()};
+        log.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        log.write(reinterpret_cast<const char*>(entry.results.data()), entry.results.size());
+        logBytes += sizeof(record) + entry.results.size();
+    }
+
+    // Caller holds the mutex. Writes the current entries, least recently used first so a replay ends with
+    // the same order, to a new file that then replaces the log. On failure appends stop.
+    bool rewrite_log() {
+        log.close();
+        std::string tempPath = logPath + ".tmp";
+        log.open(tempPath, std::ios::binary | std::ios::trunc);
+        uint64_t header[2] = {CACHE_LOG_MAGIC, seed};
+        log.write(reinterpret_cast<const char*>(header), sizeof(header));
+        logBytes = sizeof(header);
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) append_record(*it);
+        log.flush();
+        bool ok = (bool)log;
+        log.close();
+        std::remove(logPath.c_str()); // rename() will not replace an existing file on Windows
+        if (!ok || std::rename(tempPath.c_str(), logPath.c_str()) != 0) return false;
+        log.open(logPath, std::ios::binary | std::ios::app);
+        return log.is_open();
+    }
+
+    mutable std::mutex mutex;
+    std::list<Entry> entries; // Front is the most recently used
+    std::unordered_map<ResultKey, std::list<Entry>::iterator, ResultKeyHash> index;
+    size_t budget = 0;
+    size_t usedBytes = 0;
+    uint64_t seed = 0;
+    std::string logPath;
+    std::ofstream log; // Open while entries are persisted
+    uint64_t logBytes = 0;
+};
+
+ResultCache g_resultCache; // Configured in main()
+// ---------------------------
+
+class GpuMatrix;
+
+struct ClientState {
+    SOCKET socket = INVALID_SOCKET;
+    uint32_t matrixSize = 0;
+    uint32_t jobRows = 0;      // CMD_SHARD_COMP: rows of matrixSize values held; 0 for a whole square matrix
+    uint32_t numThreads = 1;
+    // Received matrix, also the result: the diagonal is replaced in place. Re-running a max or min job on
+    // it gives the same result, since a row's max does not change when its diagonal is set to that max.
+    // Holds elementType values, not necessarily floats; size() counts floats of storage.
+    MatrixBuffer matrixData;
+    // The current job's reduction (CONFIG_EX format word); every other kind of job is OP_MAX of f32 rows
+    uint32_t reduceOp = OP_MAX;
+    uint32_t elementType = ELEMENT_F32;
+    bool reduceColumns = false;
+    bool sideOutput = false;                   // Results go to sideResults; matrixData is left as received
+    MatrixBuffer sideResults;
+    std::atomic<bool> dataReceived{false};
+    std::atomic<bool> processingStarted{false}; // True if computation thread is active/launched
+    std::atomic<bool> processingDone{false};   // True if computation finished successfully
+    std::atomic<bool> errorOccurred{false};    // True if computation failed
+    std::atomic<uint32_t> pendingTasks{0};     // Row-range tasks of the current job still in the pool
+    std::mutex completionMutex;
+    std::condition_variable completionCv;      // Signalled when processingStarted drops back to false
+    std::function<void()> onProgress;          // Set by the I/O layer; runs on a pool thread after each job,
+                                               // and after every chunk of a streamed job
+    std::unique_ptr<std::atomic<uint8_t>[]> rowsReady; // Streamed jobs only: per-row completion flags
+    std::chrono::steady_clock::time_point jobStarted;  // Set by plan_job, read by the job's last task
+    uint32_t sourceEncoding = ENCODING_F32;            // Of the rows a job widens into matrixData, if any
+    ResultKey cacheKey;                                // Of the received matrix, valid while cacheStore is set
+    bool cacheStore = false;                           // The running job's diagonal goes into g_resultCache
+    bool admitted = false;                             // The running job holds a g_scheduler slot
+    int numaNode = -1;                                 // Of the connection; its jobs' tasks are queued there
+    std::shared_ptr<GpuMatrix> gpuMatrix;              // matrixData being uploaded as it arrives; taken by the next job
+    std::shared_ptr<void> borrowedMatrix;              // Keeps memory the job works on outside matrixData (a shared-memory
+                                                       // ring slot) mapped until its last task is done
+
+    // Takes the next job's reduction from a CONFIG_EX format word; 0 is a row max written to the diagonal
+    void set_reduction(uint32_t format) {
+        reduceOp = (format & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT;
+        elementType = element_type(format & FORMAT_ENCODING_MASK);
+        reduceColumns = (format & FORMAT_COLUMNS) != 0;
+        sideOutput = (format & FORMAT_SIDE_VECTOR) != 0;
+        if (sideOutput) sideResults.resize(((size_t)job_rows() * element_bytes(elementType) + sizeof(float) - 1) / sizeof(float));
+    }
+
+    uint32_t job_rows() const { return jobRows ? jobRows : matrixSize; }
+
+    void* side_results() { return sideOutput ? sideResults.data() : nullptr; }
+
+    // Where result i of the current job lives: element i * results_stride() of results()
+    void* results() { return sideOutput ? sideResults.data() : matrixData.data(); }
+    size_t results_stride() const { return sideOutput ? 1 : (size_t)matrixSize + 1; }
+
+    // Blocks until the pool has finished every task of the current job (if any)
+    void wait_for_computation() {
+        std::unique_lock<std::mutex> lock(completionMutex);
+        completionCv.wait(lock, [this] { return !processingStarted.load(); });
+    }
+
+    // Pool tasks keep the state alive through a shared_ptr, so this is only a safety net
+    ~ClientState() {
+        try { wait_for_computation(); } catch(...) { /* ignore errors on cleanup */ }
+    }
+};
+
+// --- Compute Thread Pool ---
+// Server-wide set of worker threads, created once at startup and shared by all connections.
+// Every worker owns a deque of tasks: it pops its own work from the back and, when that runs dry,
+// steals from the front of the other workers' deques, so a descheduled core only delays its last chunk.
+// Workers are spread over the NUMA nodes like the CPUs are; tasks for a node go to its workers, who steal
+// from each other first and from remote nodes last.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threadCount, const std::vector<NumaNode>& nodes = {}, Affinity affinity = Affinity::None) {
+        if (threadCount == 0) threadCount = 1;
+        std::vector<std::pair<size_t, unsigned>> slots; // (node, cpu) in node order, dealt out to the workers
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            for (unsigned cpu : nodes[n].cpus) slots.emplace_back(n, cpu);
+        }
+        groups.resize(std::max<size_t>(1, nodes.size()));
+        for (auto& group : groups) group = std::make_unique<NodeGroup>();
+        for (size_t i = 0; i < threadCount; ++i) {
+            auto queue = std::make_unique<WorkerQueue>();
+            if (!slots.empty()) {
+                queue->node = slots[i % slots.size()].first;
+                if (affinity == Affinity::Core) queue->cpus = {slots[i % slots.size()].second};
+                if (affinity == Affinity::Node) queue->cpus = nodes[queue->node].cpus;
+            }
+            groups[queue->node]->workers.push_back(i);
+            queues.push_back(std::move(queue));
+        }
+        for (size_t i = 0; i < threadCount; ++i) queues[i]->victims = steal_order(i);
+        workers.reserve(threadCount);
+        for (size_t i = 0; i < threadCount; ++i) workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        for (auto& group : groups) group->wakeCv.notify_all();
+        for (auto& t : workers) { if (t.joinable()) t.join(); }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Workers push onto their own deque when the task is for their node (or any node); other threads
+    // spread tasks round-robin across the deques of `node`, or of the whole pool when it is -1
+    void submit(std::function<void()> task, int node = -1) {
+        size_t index;
+        if (currentPool == this && (node < 0 || (size_t)node == queues[currentWorker]->node)) {
+            index = currentWorker;
+        } else if (node >= 0 && (size_t)node < groups.size() && !groups[node]->workers.empty()) {
+            NodeGroup& group = *groups[node];
+            index = group.workers[group.nextQueue.fetch_add(1) % group.workers.size()];
+        } else {
+            index = nextQueue.fetch_add(1) % queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queuedTasks.fetch_add(1); // Before the task is visible, so a worker's fetch_sub cannot run first and wrap it
+            try {
+                queues[index]->tasks.push_back(std::move(task));
+            } catch (...) {
+                queuedTasks.fetch_sub(1);
+                throw;
+            }
+        }
+        // Pairs with the predicate check in worker_loop. A sleeper on the task's node is woken if there is
+        // one; otherwise any sleeper, which will steal it rather than leave a core idle.
+        NodeGroup* wakeGroup = groups[queues[index]->node].get();
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            if (wakeGroup->sleeping == 0) {
+                for (auto& group : groups) if (group->sleeping > 0) { wakeGroup = group.get(); break; }
+            }
+        }
+        wakeGroup->wakeCv.notify_one();
+    }
+
+    size_t size() const { return workers.size(); }
+    size_t queued() const { return queuedTasks.load(); }
+    size_t nodes() const { return groups.size(); }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        size_t node = 0;              // Index into the constructor's nodes
+        std::vector<unsigned> cpus;   // Affinity of the worker, empty to leave it unpinned
+        std::vector<size_t> victims;  // Other workers, same node first, nearest index first
+    };
+
+    struct NodeGroup {
+        std::vector<size_t> workers;
+        std::atomic<size_t> nextQueue{0};
+        std::condition_variable wakeCv; // Waited on with sleepMutex
+        size_t sleeping = 0;            // Guarded by sleepMutex
+    };
+
+    std::vector<size_t> steal_order(size_t thief) const {
+        std::vector<size_t> order;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t offset = 1; offset < queues.size(); ++offset) {
+                size_t victim = (thief + offset) % queues.size();
+                if ((queues[victim]->node == queues[thief]->node) == (pass == 0)) order.push_back(victim);
+            }
+        }
+        return order;
+    }
+
+    bool try_pop_local(size_t index, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        if (queues[index]->tasks.empty()) return false;
+        task = std::move(queues[index]->tasks.back());
+        queues[index]->tasks.pop_back();
+        return true;
+    }
+
+    bool try_steal(size_t thief, std::function<void()>& task) {
+        for (size_t victimIndex : queues[thief]->victims) {
+            WorkerQueue& victim = *queues[victimIndex];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front()); // Oldest task: usually the largest remaining chunk of a job
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(size_t index) {
+        currentPool = this;
+        currentWorker = index;
+        NodeGroup& group = *groups[queues[index]->node];
+        if (numa_enabled()) t_numaNode = (int)queues[index]->node;
+        if (!queues[index]->cpus.empty() && !pin_current_thread(queues[index]->cpus)) {
+            std::cerr << LOG_PREFIX << "Could not pin compute worker " << index << "; it runs unpinned." << std::endl;
+        }
+        while (true) {
+            std::function<void()> task;
+            if (try_pop_local(index, task) || try_steal(index, task)) {
+                queuedTasks.fetch_sub(1);
+                task(); // Tasks are expected to handle their own exceptions
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            group.sleeping++;
+            group.wakeCv.wait(lock, [this] { return stopping || queuedTasks.load() > 0; });
+            group.sleeping--;
+            if (stopping && queuedTasks.load() == 0) return;
+        }
+    }
+
+    static thread_local ThreadPool* currentPool;
+    static thread_local size_t currentWorker;
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::unique_ptr<NodeGroup>> groups;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> nextQueue{0};
+    std::atomic<size_t> queuedTasks{0};
+    std::mutex sleepMutex;
+    bool stopping = false;
+};
+
+thread_local ThreadPool* ThreadPool::currentPool = nullptr;
+thread_local size_t ThreadPool::currentWorker = 0;
+
+std::unique_ptr<ThreadPool> g_computePool; // Created in main() before accepting clients
+std::atomic<uint32_t> g_jobsInFlight{0};   // Jobs with tasks still in the pool, across all connections
+// ---------------------------
+
+// --- Job Admission ---
+// Jobs are admitted into the pool at most maxRunning at a time; the rest wait here, and once the backlog
+// is full new ones are refused (RESP_BUSY) rather than queued without bound. Waiting jobs start in order of
+// priority class, then by start-time fair queuing across tenants (client addresses): each tenant's jobs
+// are tagged with virtual start times advancing by cost / weight, so a tenant sending a stream of huge
+// jobs only gets its weighted share of the slots, however many connections it opens.
+const uint32_t PRIORITY_CLASSES = 3;     // 0 interactive, 1 normal (default), 2 bulk
+const uint32_t DEFAULT_PRIORITY = 1;
+const uint32_t MAX_CLIENT_WEIGHT = 16;
+const size_t MAX_IDLE_TENANTS = 4096;    // Tenants with nothing waiting are forgotten beyond this
+
+class JobScheduler {
+public:
+    void configure(size_t maxRunningJobs, size_t maxWaitingJobs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxRunning = std::max<size_t>(1, maxRunningJobs);
+        maxWaiting = maxWaitingJobs;
+    }
+
+    // Calls `start` now if a slot is free, or later from finished(). False, without calling it, when the
+    // backlog is full. `cost` is the job's size in elements.
+    bool admit(const std::string& tenant, uint32_t priority, uint32_t weight, uint64_t cost, std::function<void()> start) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bool runNow = running < maxRunning;
+            if (!runNow && waitingJobs.size() >= maxWaiting) return false;
+            double& tenantFinish = tenants[tenant];
+            double startTag = std::max(virtualTime, tenantFinish);
+            tenantFinish = startTag + (double)std::max<uint64_t>(1, cost) / std::max(1u, weight);
+            if (runNow) {
+                running++;
+                virtualTime = std::max(virtualTime, startTag);
+            } else {
+                waitingJobs.push_back(WaitingJob{std::min(priority, PRIORITY_CLASSES - 1), startTag, nextSequence++, std::move(start)});
+                return true;
+            }
+        }
+        start();
+        return true;
+    }
+
+    // An admitted job has completed: its slot goes to the best waiting job
+    void finished() {
+        std::function<void()> start;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            if (waitingJobs.empty()) { forget_idle_tenants(); return; }
+            auto best = std::min_element(waitingJobs.begin(), waitingJobs.end(), [](const WaitingJob& a, const WaitingJob& b) {
+                if (a.priority != b.priority) return a.priority < b.priority;
+                if (a.startTag != b.startTag) return a.startTag < b.startTag;
+                return a.sequence < b.sequence;
+            });
+            start = std::move(best->start);
+            virtualTime = std::max(virtualTime, best->startTag);
+            waitingJobs.erase(best);
+            running++;
+        }
+        start();
+    }
+
+    void stats(size_t& runningJobs, size_t& waitingJobCount) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        runningJobs = running;
+        waitingJobCount = waitingJobs.size();
+    }
+
+private:
+    struct WaitingJob {
+        uint32_t priority;
+        double startTag;
+        uint64_t sequence;            // Arrival order, breaks ties
+        std::function<void()> start;
+    };
+
+    // A tenant whose last job is behind the virtual clock would get the same tag as a new one anyway
+    void forget_idle_tenants() {
+        if (tenants.size() <= MAX_IDLE_TENANTS) return;
+        for (auto it = tenants.begin(); it != tenants.end(); ) {
+            if (it->second <= virtualTime) it = tenants.erase(it);
+            else ++it;
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::vector<WaitingJob> waitingJobs; // Bounded by maxWaiting, so a linear scan is fine
+    std::unordered_map<std::string, double> tenants; // Virtual finish time of each tenant's last job
+    double virtualTime = 0;
+    size_t running = 0;
+    size_t maxRunning = 1;
+    size_t maxWaiting = 0;
+    uint64_t nextSequence = 0;
+};
+
+JobScheduler g_scheduler; // Configured in main()
+// ---------------------------
+
+// --- Server Metrics ---
+// Counters and latency histograms, read with CMD_GET_METRICS. Every thread writes only its own shard,
+// so an update is a relaxed load and store on a cache line no other writer touches; readers sum the shards.
+enum class Counter { BytesIn, BytesOut, ConnectionsAccepted, JobsCompleted, JobsFailed, TasksRun, CacheHits, CacheMisses,
+                     JobsRejected, GpuJobs, GpuFallbacks, ShardsSent, ShardHedges, ShardFailures, ShardsLocal, JobsInline,
+                     ShmJobs, Count };
+enum class Timer { Receive, QueueWait, Compute, Job, Send, AdmissionWait, Count };
+const size_t METRIC_BUCKETS = 32; // Bucket k counts samples below 2^k microseconds; the last one is unbounded
+
+class Metrics {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    void add(Counter counter, uint64_t value = 1) { bump(shard().counters[(size_t)counter], value); }
+
+    void record(Timer timer, Clock::duration elapsed) {
+        uint64_t us = (uint64_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        size_t bucket = 0;
+        while (bucket < METRIC_BUCKETS - 1 && (us >> bucket) != 0) ++bucket;
+        Histogram& h = shard().timers[(size_t)timer];
+        bump(h.buckets[bucket], 1);
+        bump(h.sumUs, us);
+    }
+
+    // Prometheus text exposition format
+    std::string render() const {
+        static const char* counterNames[] = {"lab4_bytes_received_total", "lab4_bytes_sent_total",
+            "lab4_connections_accepted_total", "lab4_jobs_completed_total", "lab4_jobs_failed_total", "lab4_tasks_run_total",
+            "lab4_cache_hits_total", "lab4_cache_misses_total", "lab4_jobs_rejected_total", "lab4_gpu_jobs_total",
+            "lab4_gpu_fallbacks_total", "lab4_shards_sent_total", "lab4_shard_hedges_total", "lab4_shard_failures_total",
+            "lab4_shards_local_total", "lab4_jobs_inline_total",
+            "lab4_shm_jobs_total"};
+        static const char* timerNames[] = {"lab4_receive_seconds", "lab4_queue_wait_seconds", "lab4_task_compute_seconds",
+            "lab4_job_seconds", "lab4_send_seconds", "lab4_admission_wait_seconds"};
+        uint64_t counters[(size_t)Counter::Count] = {};
+        uint64_t buckets[(size_t)Timer::Count][METRIC_BUCKETS] = {};
+        uint64_t sums[(size_t)Timer::Count] = {};
+        {
+            std::lock_guard<std::mutex> lock(shardsMutex);
+            for (const auto& s : shards) {
+                for (size_t c = 0; c < (size_t)Counter::Count; ++c) counters[c] += s->counters[c].load(std::memory_order_relaxed);
+                for (size_t t = 0; t < (size_t)Timer::Count; ++t) {
+                    for (size_t b = 0; b < METRIC_BUCKETS; ++b) buckets[t][b] += s->timers[t].buckets[b].load(std::memory_order_relaxed);
+                    sums[t] += s->timers[t].sumUs.load(std::memory_order_relaxed);
+                }
+            }
+        }
+        std::ostringstream out;
+        for (size_t c = 0; c < (size_t)Counter::Count; ++c) {
+            out << "# TYPE " << counterNames[c] << " counter\n" << counterNames[c] << " " << counters[c] << "\n";
+        }
+        for (size_t t = 0; t < (size_t)Timer::Count; ++t) {
+            out << "# TYPE " << timerNames[t] << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < METRIC_BUCKETS; ++b) {
+                cumulative += buckets[t][b];
+                out << timerNames[t] << "_bucket{le=\"";
+                if (b + 1 < METRIC_BUCKETS) out << (double)(1ull << b) / 1e6; else out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            out << timerNames[t] << "_sum " << sums[t] / 1e6 << "\n" << timerNames[t] << "_count " << cumulative << "\n";
+        }
+        return out.str();
+    }
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[METRIC_BUCKETS] = {};
+        std::atomic<uint64_t> sumUs{0};
+    };
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[(size_t)Counter::Count] = {};
+        Histogram timers[(size_t)Timer::Count];
+    };
+
+    // Single writer per shard, so no atomic read-modify-write is needed
+    static void bump(std::atomic<uint64_t>& value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    // Shards outlive their threads so totals never go backwards
+    Shard& shard() {
+        thread_local Shard* local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(shardsMutex);
+            shards.push_back(std::make_unique<Shard>());
+            local = shards.back().get();
+        }
+        return *local;
+    }
+
+    mutable std::mutex shardsMutex; // Only taken on a thread's first update and by render()
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+Metrics g_metrics;
+std::atomic<uint32_t> g_activeConnections{0};
+
+// Full metrics reply body: the shard totals plus the current gauges
+std::string render_metrics() {
+    std::ostringstream out;
+    out << g_metrics.render()
+        << "# TYPE lab4_active_connections gauge\nlab4_active_connections " << g_activeConnections.load() << "\n"
+        << "# TYPE lab4_jobs_in_flight gauge\nlab4_jobs_in_flight " << g_jobsInFlight.load() << "\n"
+        << "# TYPE lab4_queued_tasks gauge\nlab4_queued_tasks " << (g_computePool ? g_computePool->queued() : 0) << "\n";
+    uint64_t reuses, allocations;
+    size_t idleBytes;
+    g_bufferPool.stats(reuses, allocations, idleBytes);
+    out << "# TYPE lab4_buffer_reuses_total counter\nlab4_buffer_reuses_total " << reuses << "\n"
+        << "# TYPE lab4_buffer_allocations_total counter\nlab4_buffer_allocations_total " << allocations << "\n"
+        << "# TYPE lab4_buffer_pool_idle_bytes gauge\nlab4_buffer_pool_idle_bytes " << idleBytes << "\n";
+    size_t runningJobs, waitingJobs;
+    g_scheduler.stats(runningJobs, waitingJobs);
+    out << "# TYPE lab4_jobs_running gauge\nlab4_jobs_running " << runningJobs << "\n"
+        << "# TYPE lab4_jobs_waiting gauge\nlab4_jobs_waiting " << waitingJobs << "\n";
+    size_t cacheEntries, cacheBytes;
+    g_resultCache.stats(cacheEntries, cacheBytes);
+    out << "# TYPE lab4_cache_entries gauge\nlab4_cache_entries " << cacheEntries << "\n"
+        << "# TYPE lab4_cache_bytes gauge\nlab4_cache_bytes " << cacheBytes << "\n";
+    return out.str();
+}
+// ---------------------------
+
+// --- Helper Functions for Network Error Logging ---
+std::string GetWSAErrorString(int errorCode) {
+#ifdef _WIN32
+    char* s = nullptr;
+    FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                   NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&s, 0, NULL);
+    std::string msg = (s ? s : "Unknown error");
+    if(s) LocalFree(s);
+#else
+    std::string msg = std::strerror(errorCode);
+#endif
+    return msg + " (" + std::to_string(errorCode) + ")";
+}
+
+// Buffer sizes of 0 leave the OS defaults (and autotuning) alone
+void apply_socket_options(SOCKET sock, const ServerConfig& config) {
+    int noDelay = config.noDelay ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay)) == SOCKET_ERROR) {
+        std::cerr << LOG_PREFIX << "[" << sock << "] TCP_NODELAY failed: " << GetWSAErrorString(WSAGetLastError()) << std::endl;
+    }
+    if (config.sendBufferBytes > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&config.sendBufferBytes, sizeof(int)) == SOCKET_ERROR) {
+        std::cerr << LOG_PREFIX << "[" << sock << "] SO_SNDBUF failed: " << GetWSAErrorString(WSAGetLastError()) << std::endl;
+    }
+    if (config.recvBufferBytes > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&config.recvBufferBytes, sizeof(int)) == SOCKET_ERROR) {
+        std::cerr << LOG_PREFIX << "[" << sock << "] SO_RCVBUF failed: " << GetWSAErrorString(WSAGetLastError()) << std::endl;
+    }
+}
+
+// Client IP alone, so every connection from one host shares a fair-share tenant
+std::string peer_address(SOCKET clientSocket) {
+    char clientIpStr[INET_ADDRSTRLEN];
+    sockaddr_in clientAddr;
+    socklen_t clientAddrSize = sizeof(clientAddr);
+    if (getpeername(clientSocket, (struct sockaddr*)&clientAddr, &clientAddrSize) != 0) return std::string();
+    inet_ntop(AF_INET, &clientAddr.sin_addr, clientIpStr, INET_ADDRSTRLEN);
+    return clientIpStr;
+}
+
+std::string describe_client(SOCKET clientSocket) {
+    char clientIpStr[INET_ADDRSTRLEN];
+    sockaddr_in clientAddr;
+    socklen_t clientAddrSize = sizeof(clientAddr);
+    if (getpeername(clientSocket, (struct sockaddr*)&clientAddr, &clientAddrSize) == 0) {
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIpStr, INET_ADDRSTRLEN);
+        return std::string(clientIpStr) + ":" + std::to_string(ntohs(clientAddr.sin_port)) + " (" + std::to_string(clientSocket) + ")";
+    }
+    return "Socket " + std::to_string(clientSocket) + " (getpeername failed: " + std::to_string(WSAGetLastError()) + ")";
+}
+// ---------------------------------------
+
+// --- Reduction Kernels ---
+// Every job reduces each row (or each column) of its matrix to one value with one of the OP_* operations.
+// The kernel for each (ISA, element type, operation, layout) is generated at compile time from three
+// layers: the ISA's vector primitives for that element type, the operation's rules, and a loop per layout.
+// The kernel is picked once per job; nothing inside a loop dispatches on type or operation.
+//
+// Max and min must return exactly what the original scalar loop returned: start from -inf (+inf) and only
+// take values that compare greater (smaller), so NaNs are skipped and an all-NaN row yields -inf (+inf).
+// Sums accumulate in double, which is exact for every integer row the server accepts, and propagate NaN;
+// the mean is the sum over the count. Results have the element type: integer sums saturate, means round.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LAB4_FLATTEN __attribute__((flatten))
+#else
+#define LAB4_FLATTEN
+#endif
+
+// The element type travels with the matrix; `row`, `matrix` and the results all point at that type
+typedef void (*RowReduceKernel)(const void* row, uint32_t count, void* result);
+// Column c's result goes to results[c * resultStride], for c in [firstColumn, endColumn)
+typedef void (*ColumnReduceKernel)(const void* matrix, uint32_t size, uint32_t firstColumn, uint32_t endColumn,
+                                   void* results, size_t resultStride);
+
+// Identity of max (min): -inf (+inf), or the type's extreme for integers
+template <class T> T lowest_value() {
+    return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+}
+template <class T> T highest_value() {
+    return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+}
+
+// A double accumulator as a result of type T
+template <class T> T narrow_result(double value) {
+    if constexpr (std::is_floating_point<T>::value) {
+        return (T)value;
+    } else {
+        if (value <= (double)std::numeric_limits<T>::lowest()) return std::numeric_limits<T>::lowest();
+        if (value >= (double)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+        return (T)std::llround(value);
+    }
+}
+
+// Vector primitives for element type T. F holds LANES values, D LANES double accumulators. Vectors only
+// ever pass by reference: the generic layers below are compiled for the baseline target, and handing an
+// AVX register by value across that boundary would change the calling convention. The per-ISA entry
+// points are LAB4_FLATTEN'ed, so in an optimized build every layer inlines into one function built for that ISA.
+template <class Element> struct ScalarIsa {
+    typedef Element T;
+    static const uint32_t LANES = 1;
+    typedef T F;
+    typedef double D;
+    static void fill(F& v, T x) { v = x; }
+    static void max_into(F& acc, const T* p) { if (*p > acc) acc = *p; }
+    static void min_into(F& acc, const T* p) { if (*p < acc) acc = *p; }
+    static void max_merge(F& acc, const F& other) { if (other > acc) acc = other; }
+    static void min_merge(F& acc, const F& other) { if (other < acc) acc = other; }
+    static void zero(D& v) { v = 0; }
+    static void sum_into(D& acc, const T* p) { acc += (double)*p; }
+    static void sum_merge(D& acc, const D& other) { acc += other; }
+    template <class V> static void store(const V& v, double* lanes) { lanes[0] = (double)v; } // F and D
+};
+
+#if defined(LAB4_X86)
+// MAXPS/MAXPD return their second operand unless the first is strictly greater (smaller for MIN), so
+// max(x, acc) keeps acc when x is NaN - the same as the scalar test. The accumulators never hold NaN.
+template <class T> struct Avx2Isa;
+
+template <> struct Avx2Isa<float> {
+    typedef float T;
+    static const uint32_t LANES = 8;
+    typedef __m256 F;
+    struct D { __m256d lo, hi; };
+    LAB4_TARGET("avx2") static void fill(F& v, T x) { v = _mm256_set1_ps(x); }
+    LAB4_TARGET("avx2") static void max_into(F& acc, const T* p) { acc = _mm256_max_ps(_mm256_loadu_ps(p), acc); }
+    LAB4_TARGET("avx2") static void min_into(F& acc, const T* p) { acc = _mm256_min_ps(_mm256_loadu_ps(p), acc); }
+    LAB4_TARGET("avx2") static void max_merge(F& acc, const F& other) { acc = _mm256_max_ps(other, acc); }
+    LAB4_TARGET("avx2") static void min_merge(F& acc, const F& other) { acc = _mm256_min_ps(other, acc); }
+    LAB4_TARGET("avx2") static void zero(D& v) { v.lo = v.hi = _mm256_setzero_pd(); }
+    LAB4_TARGET("avx2") static void sum_into(D& acc, const T* p) {
+        acc.lo = _mm256_add_pd(acc.lo, _mm256_cvtps_pd(_mm_loadu_ps(p)));
+        acc.hi = _mm256_add_pd(acc.hi, _mm256_cvtps_pd(_mm_loadu_ps(p + 4)));
+    }
+    LAB4_TARGET("avx2") static void sum_merge(D& acc, const D& other) {
+        acc.lo = _mm256_add_pd(acc.lo, other.lo);
+        acc.hi = _mm256_add_pd(acc.hi, other.hi);
+    }
+    LAB4_TARGET("avx2") static void store(const F& v, double* lanes) {
+        alignas(32) T values[LANES];
+        _mm256_store_ps(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    LAB4_TARGET("avx2") static void store(const D& v, double* lanes) {
+        _mm256_storeu_pd(lanes, v.lo);
+        _mm256_storeu_pd(lanes + 4, v.hi);
+    }
+};
+
+template <> struct Avx2Isa<double> {
+    typedef double T;
+    static const uint32_t LANES = 4;
+    typedef __m256d F;
+    typedef __m256d D;
+    LAB4_TARGET("avx2") static void fill(F& v, T x) { v = _mm256_set1_pd(x); }
+    LAB4_TARGET("avx2") static void max_into(F& acc, const T* p) { acc = _mm256_max_pd(_mm256_loadu_pd(p), acc); }
+    LAB4_TARGET("avx2") static void min_into(F& acc, const T* p) { acc = _mm256_min_pd(_mm256_loadu_pd(p), acc); }
+    LAB4_TARGET("avx2") static void max_merge(F& acc, const F& other) { acc = _mm256_max_pd(other, acc); }
+    LAB4_TARGET("avx2") static void min_merge(F& acc, const F& other) { acc = _mm256_min_pd(other, acc); }
+    LAB4_TARGET("avx2") static void zero(D& v) { v = _mm256_setzero_pd(); }
+    LAB4_TARGET("avx2") static void sum_into(D& acc, const T* p) { acc = _mm256_add_pd(acc, _mm256_loadu_pd(p)); }
+    LAB4_TARGET("avx2") static void sum_merge(D& acc, const D& other) { acc = _mm256_add_pd(acc, other); }
+    LAB4_TARGET("avx2") static void store(const F& v, double* lanes) { _mm256_storeu_pd(lanes, v); }
+};
+
+template <> struct Avx2Isa<int32_t> {
+    typedef int32_t T;
+    static const uint32_t LANES = 8;
+    typedef __m256i F;
+    struct D { __m256d lo, hi; };
+    LAB4_TARGET("avx2") static __m256i load(const T* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    LAB4_TARGET("avx2") static void fill(F& v, T x) { v = _mm256_set1_epi32(x); }
+    LAB4_TARGET("avx2") static void max_into(F& acc, const T* p) { acc = _mm256_max_epi32(load(p), acc); }
+    LAB4_TARGET("avx2") static void min_into(F& acc, const T* p) { acc = _mm256_min_epi32(load(p), acc); }
+    LAB4_TARGET("avx2") static void max_merge(F& acc, const F& other) { acc = _mm256_max_epi32(other, acc); }
+    LAB4_TARGET("avx2") static void min_merge(F& acc, const F& other) { acc = _mm256_min_epi32(other, acc); }
+    LAB4_TARGET("avx2") static void zero(D& v) { v.lo = v.hi = _mm256_setzero_pd(); }
+    LAB4_TARGET("avx2") static void sum_into(D& acc, const T* p) {
+        __m256i x = load(p);
+        acc.lo = _mm256_add_pd(acc.lo, _mm256_cvtepi32_pd(_mm256_castsi256_si128(x)));
+        acc.hi = _mm256_add_pd(acc.hi, _mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)));
+    }
+    LAB4_TARGET("avx2") static void sum_merge(D& acc, const D& other) {
+        acc.lo = _mm256_add_pd(acc.lo, other.lo);
+        acc.hi = _mm256_add_pd(acc.hi, other.hi);
+    }
+    LAB4_TARGET("avx2") static void store(const F& v, double* lanes) {
+        alignas(32) T values[LANES];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(values), v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    LAB4_TARGET("avx2") static void store(const D& v, double* lanes) {
+        _mm256_storeu_pd(lanes, v.lo);
+        _mm256_storeu_pd(lanes + 4, v.hi);
+    }
+};
+
+template <> struct Avx2Isa<int16_t> {
+    typedef int16_t T;
+    static const uint32_t LANES = 16;
+    typedef __m256i F;
+    struct D { __m256d d0, d1, d2, d3; };
+    LAB4_TARGET("avx2") static __m256i load(const T* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    LAB4_TARGET("avx2") static void fill(F& v, T x) { v = _mm256_set1_epi16(x); }
+    LAB4_TARGET("avx2") static void max_into(F& acc, const T* p) { acc = _mm256_max_epi16(load(p), acc); }
+    LAB4_TARGET("avx2") static void min_into(F& acc, const T* p) { acc = _mm256_min_epi16(load(p), acc); }
+    LAB4_TARGET("avx2") static void max_merge(F& acc, const F& other) { acc = _mm256_max_epi16(other, acc); }
+    LAB4_TARGET("avx2") static void min_merge(F& acc, const F& other) { acc = _mm256_min_epi16(other, acc); }
+    LAB4_TARGET("avx2") static void zero(D& v) { v.d0 = v.d1 = v.d2 = v.d3 = _mm256_setzero_pd(); }
+    LAB4_TARGET("avx2") static void sum_into(D& acc, const T* p) {
+        __m256i x = load(p);
+        __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        acc.d0 = _mm256_add_pd(acc.d0, _mm256_cvtepi32_pd(_mm256_castsi256_si128(lo)));
+        acc.d1 = _mm256_add_pd(acc.d1, _mm256_cvtepi32_pd(_mm256_extracti128_si256(lo, 1)));
+        acc.d2 = _mm256_add_pd(acc.d2, _mm256_cvtepi32_pd(_mm256_castsi256_si128(hi)));
+        acc.d3 = _mm256_add_pd(acc.d3, _mm256_cvtepi32_pd(_mm256_extracti128_si256(hi, 1)));
+    }
+    LAB4_TARGET("avx2") static void sum_merge(D& acc, const D& other) {
+        acc.d0 = _mm256_add_pd(acc.d0, other.d0);
+        acc.d1 = _mm256_add_pd(acc.d1, other.d1);
+        acc.d2 = _mm256_add_pd(acc.d2, other.d2);
+        acc.d3 = _mm256_add_pd(acc.d3, other.d3);
+    }
+    LAB4_TARGET("avx2") static void store(const F& v, double* lanes) {
+        alignas(32) T values[LANES];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(values), v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    LAB4_TARGET("avx2") static void store(const D& v, double* lanes) {
+        _mm256_storeu_pd(lanes, v.d0);
+        _mm256_storeu_pd(lanes + 4, v.d1);
+        _mm256_storeu_pd(lanes + 8, v.d2);
+        _mm256_storeu_pd(lanes + 12, v.d3);
+    }
+};
+
+// AVX-512F only: int16 is widened to int32 lanes as it is loaded, since 16-bit compares need AVX-512BW
+template <class T> struct Avx512Isa;
+
+template <> struct Avx512Isa<float> {
+    typedef float T;
+    static const uint32_t LANES = 16;
+    typedef __m512 F;
+    struct D { __m512d lo, hi; };
+    LAB4_TARGET("avx512f") static void fill(F& v, T x) { v = _mm512_set1_ps(x); }
+    LAB4_TARGET("avx512f") static void max_into(F& acc, const T* p) { acc = _mm512_max_ps(_mm512_loadu_ps(p), acc); }
+    LAB4_TARGET("avx512f") static void min_into(F& acc, const T* p) { acc = _mm512_min_ps(_mm512_loadu_ps(p), acc); }
+    LAB4_TARGET("avx512f") static void max_merge(F& acc, const F& other) { acc = _mm512_max_ps(other, acc); }
+    LAB4_TARGET("avx512f") static void min_merge(F& acc, const F& other) { acc = _mm512_min_ps(other, acc); }
+    LAB4_TARGET("avx512f") static void zero(D& v) { v.lo = v.hi = _mm512_setzero_pd(); }
+    LAB4_TARGET("avx512f") static void sum_into(D& acc, const T* p) {
+        acc.lo = _mm512_add_pd(acc.lo, _mm512_cvtps_pd(_mm256_loadu_ps(p)));
+        acc.hi = _mm512_add_pd(acc.hi, _mm512_cvtps_pd(_mm256_loadu_ps(p + 8)));
+    }
+    LAB4_TARGET("avx512f") static void sum_merge(D& acc, const D& other) {
+        acc.lo = _mm512_add_pd(acc.lo, other.lo);
+        acc.hi = _mm512_add_pd(acc.hi, other.hi);
+    }
+    LAB4_TARGET("avx512f") static void store(const F& v, double* lanes) {
+        alignas(64) T values[LANES];
+        _mm512_store_ps(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    LAB4_TARGET("avx512f") static void store(const D& v, double* lanes) {
+        _mm512_storeu_pd(lanes, v.lo);
+        _mm512_storeu_pd(lanes + 8, v.hi);
+    }
+};
+
+template <> struct Avx512Isa<double> {
+    typedef double T;
+    static const uint32_t LANES = 8;
+    typedef __m512d F;
+    typedef __m512d D;
+    LAB4_TARGET("avx512f") static void fill(F& v, T x) { v = _mm512_set1_pd(x); }
+    LAB4_TARGET("avx512f") static void max_into(F& acc, const T* p) { acc = _mm512_max_pd(_mm512_loadu_pd(p), acc); }
+    LAB4_TARGET("avx512f") static void min_into(F& acc, const T* p) { acc = _mm512_min_pd(_mm512_loadu_pd(p), acc); }
+    LAB4_TARGET("avx512f") static void max_merge(F& acc, const F& other) { acc = _mm512_max_pd(other, acc); }
+    LAB4_TARGET("avx512f") static void min_merge(F& acc, const F& other) { acc = _mm512_min_pd(other, acc); }
+    LAB4_TARGET("avx512f") static void zero(D& v) { v = _mm512_setzero_pd(); }
+    LAB4_TARGET("avx512f") static void sum_into(D& acc, const T* p) { acc = _mm512_add_pd(acc, _mm512_loadu_pd(p)); }
+    LAB4_TARGET("avx512f") static void sum_merge(D& acc, const D& other) { acc = _mm512_add_pd(acc, other); }
+    LAB4_TARGET("avx512f") static void store(const F& v, double* lanes) { _mm512_storeu_pd(lanes, v); }
+};
+
+// Shared by int32 and int16, which differ only in how 16 values are loaded into int32 lanes
+template <class Element> struct Avx512IntIsa {
+    typedef Element T;
+    static const uint32_t LANES = 16;
+    typedef __m512i F;
+    struct D { __m512d lo, hi; };
+    LAB4_TARGET("avx512f") static __m512i load(const T* p) {
+        if constexpr (sizeof(T) == sizeof(int32_t)) return _mm512_loadu_si512(p);
+        else return _mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+    }
+    LAB4_TARGET("avx512f") static void fill(F& v, T x) { v = _mm512_set1_epi32(x); }
+    LAB4_TARGET("avx512f") static void max_into(F& acc, const T* p) { acc = _mm512_max_epi32(load(p), acc); }
+    LAB4_TARGET("avx512f") static void min_into(F& acc, const T* p) { acc = _mm512_min_epi32(load(p), acc); }
+    LAB4_TARGET("avx512f") static void max_merge(F& acc, const F& other) { acc = _mm512_max_epi32(other, acc); }
+    LAB4_TARGET("avx512f") static void min_merge(F& acc, const F& other) { acc = _mm512_min_epi32(other, acc); }
+    LAB4_TARGET("avx512f") static void zero(D& v) { v.lo = v.hi = _mm512_setzero_pd(); }
+    LAB4_TARGET("avx512f") static void sum_into(D& acc, const T* p) {
+        __m512i x = load(p);
+        acc.lo = _mm512_add_pd(acc.lo, _mm512_cvtepi32_pd(_mm512_castsi512_si256(x)));
+        acc.hi = _mm512_add_pd(acc.hi, _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(x, 1)));
+    }
+    LAB4_TARGET("avx512f") static void sum_merge(D& acc, const D& other) {
+        acc.lo = _mm512_add_pd(acc.lo, other.lo);
+        acc.hi = _mm512_add_pd(acc.hi, other.hi);
+    }
+    LAB4_TARGET("avx512f") static void store(const F& v, double* lanes) {
+        alignas(64) int32_t values[LANES];
+        _mm512_store_si512(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    LAB4_TARGET("avx512f") static void store(const D& v, double* lanes) {
+        _mm512_storeu_pd(lanes, v.lo);
+        _mm512_storeu_pd(lanes + 8, v.hi);
+    }
+};
+
+template <> struct Avx512Isa<int32_t> : Avx512IntIsa<int32_t> {};
+template <> struct Avx512Isa<int16_t> : Avx512IntIsa<int16_t> {};
+
+void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    for (int i = 0; i < 4; ++i) regs[i] = (unsigned int)r[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// XCR0: which register state the OS saves on context switch
+unsigned long long read_xcr0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+bool cpu_has_avx2() {
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 7) return false;
+    cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0, avx = (regs[2] & (1u << 28)) != 0;
+    if (!osxsave || !avx || (read_xcr0() & 0x6) != 0x6) return false; // XMM and YMM state
+    cpuid(7, 0, regs);
+    return (regs[1] & (1u << 5)) != 0;
+}
+
+bool cpu_has_avx512() {
+    if (!cpu_has_avx2()) return false;
+    if ((read_xcr0() & 0xE6) != 0xE6) return false; // Plus opmask and ZMM state
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[1] & (1u << 16)) != 0; // AVX512F
+}
+#endif
+
+#if defined(LAB4_NEON)
+// vmaxq_f32 propagates NaN, so floating-point lanes select on an explicit x > acc compare instead
+template <class T> struct NeonIsa;
+
+template <> struct NeonIsa<float> {
+    typedef float T;
+    static const uint32_t LANES = 4;
+    typedef float32x4_t F;
+    struct D { float64x2_t lo, hi; };
+    static void fill(F& v, T x) { v = vdupq_n_f32(x); }
+    static void max_into(F& acc, const T* p) { F x = vld1q_f32(p); acc = vbslq_f32(vcgtq_f32(x, acc), x, acc); }
+    static void min_into(F& acc, const T* p) { F x = vld1q_f32(p); acc = vbslq_f32(vcltq_f32(x, acc), x, acc); }
+    static void max_merge(F& acc, const F& other) { acc = vbslq_f32(vcgtq_f32(other, acc), other, acc); }
+    static void min_merge(F& acc, const F& other) { acc = vbslq_f32(vcltq_f32(other, acc), other, acc); }
+    static void zero(D& v) { v.lo = v.hi = vdupq_n_f64(0.0); }
+    static void sum_into(D& acc, const T* p) {
+        F x = vld1q_f32(p);
+        acc.lo = vaddq_f64(acc.lo, vcvt_f64_f32(vget_low_f32(x)));
+        acc.hi = vaddq_f64(acc.hi, vcvt_high_f64_f32(x));
+    }
+    static void sum_merge(D& acc, const D& other) {
+        acc.lo = vaddq_f64(acc.lo, other.lo);
+        acc.hi = vaddq_f64(acc.hi, other.hi);
+    }
+    static void store(const F& v, double* lanes) {
+        T values[LANES];
+        vst1q_f32(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    static void store(const D& v, double* lanes) {
+        vst1q_f64(lanes, v.lo);
+        vst1q_f64(lanes + 2, v.hi);
+    }
+};
+
+template <> struct NeonIsa<double> {
+    typedef double T;
+    static const uint32_t LANES = 2;
+    typedef float64x2_t F;
+    typedef float64x2_t D;
+    static void fill(F& v, T x) { v = vdupq_n_f64(x); }
+    static void max_into(F& acc, const T* p) { F x = vld1q_f64(p); acc = vbslq_f64(vcgtq_f64(x, acc), x, acc); }
+    static void min_into(F& acc, const T* p) { F x = vld1q_f64(p); acc = vbslq_f64(vcltq_f64(x, acc), x, acc); }
+    static void max_merge(F& acc, const F& other) { acc = vbslq_f64(vcgtq_f64(other, acc), other, acc); }
+    static void min_merge(F& acc, const F& other) { acc = vbslq_f64(vcltq_f64(other, acc), other, acc); }
+    static void zero(D& v) { v = vdupq_n_f64(0.0); }
+    static void sum_into(D& acc, const T* p) { acc = vaddq_f64(acc, vld1q_f64(p)); }
+    static void sum_merge(D& acc, const D& other) { acc = vaddq_f64(acc, other); }
+    static void store(const F& v, double* lanes) { vst1q_f64(lanes, v); }
+};
+
+template <> struct NeonIsa<int32_t> {
+    typedef int32_t T;
+    static const uint32_t LANES = 4;
+    typedef int32x4_t F;
+    struct D { float64x2_t lo, hi; };
+    static void fill(F& v, T x) { v = vdupq_n_s32(x); }
+    static void max_into(F& acc, const T* p) { acc = vmaxq_s32(vld1q_s32(p), acc); }
+    static void min_into(F& acc, const T* p) { acc = vminq_s32(vld1q_s32(p), acc); }
+    static void max_merge(F& acc, const F& other) { acc = vmaxq_s32(other, acc); }
+    static void min_merge(F& acc, const F& other) { acc = vminq_s32(other, acc); }
+    static void zero(D& v) { v.lo = v.hi = vdupq_n_f64(0.0); }
+    static void sum_into(D& acc, const T* p) {
+        F x = vld1q_s32(p);
+        acc.lo = vaddq_f64(acc.lo, vcvtq_f64_s64(vmovl_s32(vget_low_s32(x))));
+        acc.hi = vaddq_f64(acc.hi, vcvtq_f64_s64(vmovl_high_s32(x)));
+    }
+    static void sum_merge(D& acc, const D& other) {
+        acc.lo = vaddq_f64(acc.lo, other.lo);
+        acc.hi = vaddq_f64(acc.hi, other.hi);
+    }
+    static void store(const F& v, double* lanes) {
+        T values[LANES];
+        vst1q_s32(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    static void store(const D& v, double* lanes) {
+        vst1q_f64(lanes, v.lo);
+        vst1q_f64(lanes + 2, v.hi);
+    }
+};
+
+template <> struct NeonIsa<int16_t> {
+    typedef int16_t T;
+    static const uint32_t LANES = 8;
+    typedef int16x8_t F;
+    struct D { float64x2_t d0, d1, d2, d3; };
+    static void fill(F& v, T x) { v = vdupq_n_s16(x); }
+    static void max_into(F& acc, const T* p) { acc = vmaxq_s16(vld1q_s16(p), acc); }
+    static void min_into(F& acc, const T* p) { acc = vminq_s16(vld1q_s16(p), acc); }
+    static void max_merge(F& acc, const F& other) { acc = vmaxq_s16(other, acc); }
+    static void min_merge(F& acc, const F& other) { acc = vminq_s16(other, acc); }
+    static void zero(D& v) { v.d0 = v.d1 = v.d2 = v.d3 = vdupq_n_f64(0.0); }
+    static void sum_into(D& acc, const T* p) {
+        F x = vld1q_s16(p);
+        int32x4_t lo = vmovl_s16(vget_low_s16(x)), hi = vmovl_high_s16(x);
+        acc.d0 = vaddq_f64(acc.d0, vcvtq_f64_s64(vmovl_s32(vget_low_s32(lo))));
+        acc.d1 = vaddq_f64(acc.d1, vcvtq_f64_s64(vmovl_high_s32(lo)));
+        acc.d2 = vaddq_f64(acc.d2, vcvtq_f64_s64(vmovl_s32(vget_low_s32(hi))));
+        acc.d3 = vaddq_f64(acc.d3, vcvtq_f64_s64(vmovl_high_s32(hi)));
+    }
+    static void sum_merge(D& acc, const D& other) {
+        acc.d0 = vaddq_f64(acc.d0, other.d0);
+        acc.d1 = vaddq_f64(acc.d1, other.d1);
+        acc.d2 = vaddq_f64(acc.d2, other.d2);
+        acc.d3 = vaddq_f64(acc.d3, other.d3);
+    }
+    static void store(const F& v, double* lanes) {
+        T values[LANES];
+        vst1q_s16(values, v);
+        for (uint32_t i = 0; i < LANES; ++i) lanes[i] = values[i];
+    }
+    static void store(const D& v, double* lanes) {
+        vst1q_f64(lanes, v.d0);
+        vst1q_f64(lanes + 2, v.d1);
+        vst1q_f64(lanes + 4, v.d2);
+        vst1q_f64(lanes + 6, v.d3);
+    }
+};
+#endif
+
+// Operation rules: the vector side (init/add/merge on Acc), and the scalar side, which folds the spilled
+// lanes and any leftover tail with step() and turns the accumulator into the result with finish()
+template <class Isa> struct MaxOp {
+    typedef typename Isa::T T;
+    typedef typename Isa::F Acc;
+    static void init(Acc& acc) { Isa::fill(acc, lowest_value<T>()); }
+    static void add(Acc& acc, const T* p) { Isa::max_into(acc, p); }
+    static void merge(Acc& acc, const Acc& other) { Isa::max_merge(acc, other); }
+    static double identity() { return (double)lowest_value<T>(); }
+    static double step(double acc, double x) { return x > acc ? x : acc; }
+    static T finish(double acc, uint32_t) { return narrow_result<T>(acc); }
+};
+
+template <class Isa> struct MinOp {
+    typedef typename Isa::T T;
+    typedef typename Isa::F Acc;
+    static void init(Acc& acc) { Isa::fill(acc, highest_value<T>()); }
+    static void add(Acc& acc, const T* p) { Isa::min_into(acc, p); }
+    static void merge(Acc& acc, const Acc& other) { Isa::min_merge(acc, other); }
+    static double identity() { return (double)highest_value<T>(); }
+    static double step(double acc, double x) { return x < acc ? x : acc; }
+    static T finish(double acc, uint32_t) { return narrow_result<T>(acc); }
+};
+
+template <class Isa> struct SumOp {
+    typedef typename Isa::T T;
+    typedef typename Isa::D Acc;
+    static void init(Acc& acc) { Isa::zero(acc); }
+    static void add(Acc& acc, const T* p) { Isa::sum_into(acc, p); }
+    static void merge(Acc& acc, const Acc& other) { Isa::sum_merge(acc, other); }
+    static double identity() { return 0.0; }
+    static double step(double acc, double x) { return acc + x; }
+    static T finish(double acc, uint32_t) { return narrow_result<T>(acc); }
+};
+
+template <class Isa> struct MeanOp : SumOp<Isa> {
+    static typename Isa::T finish(double acc, uint32_t count) { return narrow_result<typename Isa::T>(acc / count); }
+};
+
+// Row layout: four independent accumulators to hide the add/compare latency
+template <class Isa, template <class> class Op>
+typename Isa::T reduce_row(const typename Isa::T* row, uint32_t count) {
+    typedef Op<Isa> O;
+    const uint32_t L = Isa::LANES;
+    typename O::Acc acc0, acc1, acc2, acc3;
+    O::init(acc0); O::init(acc1); O::init(acc2); O::init(acc3);
+    uint32_t j = 0;
+    for (; j + 4 * L <= count; j += 4 * L) {
+        O::add(acc0, row + j);
+        O::add(acc1, row + j + L);
+        O::add(acc2, row + j + 2 * L);
+        O::add(acc3, row + j + 3 * L);
+    }
+    for (; j + L <= count; j += L) O::add(acc0, row + j);
+    O::merge(acc0, acc1);
+    O::merge(acc2, acc3);
+    O::merge(acc0, acc2);
+    double lanes[L];
+    Isa::store(acc0, lanes);
+    double result = O::identity();
+    for (uint32_t i = 0; i < L; ++i) result = O::step(result, lanes[i]);
+    for (; j < count; ++j) result = O::step(result, (double)row[j]);
+    return O::finish(result, count);
+}
+
+const uint32_t COLUMN_BLOCK = 256; // Columns reduced side by side: their accumulators stay in L1 while rows stream past
+
+// Column layout: the matrix is still read row by row, one COLUMN_BLOCK-wide strip at a time. A column's
+// result is written once the whole strip is done, so a diagonal target is never read after it changes.
+template <class Isa, template <class> class Op>
+void reduce_columns(const typename Isa::T* matrix, uint32_t size, uint32_t firstColumn, uint32_t endColumn,
+                    typename Isa::T* results, size_t resultStride) {
+    typedef Op<Isa> O;
+    const uint32_t L = Isa::LANES;
+    typename O::Acc acc[COLUMN_BLOCK / L];
+    double tail[L];
+    double lanes[L];
+    for (uint32_t block = firstColumn; block < endColumn; block += COLUMN_BLOCK) {
+        uint32_t width = std::min(COLUMN_BLOCK, endColumn - block);
+        uint32_t vectors = width / L, tailCount = width % L;
+        for (uint32_t v = 0; v < vectors; ++v) O::init(acc[v]);
+        for (uint32_t t = 0; t < tailCount; ++t) tail[t] = O::identity();
+        for (uint32_t r = 0; r < size; ++r) {
+            const typename Isa::T* strip = matrix + (size_t)r * size + block;
+            for (uint32_t v = 0; v < vectors; ++v) O::add(acc[v], strip + v * L);
+            for (uint32_t t = 0; t < tailCount; ++t) tail[t] = O::step(tail[t], (double)strip[vectors * L + t]);
+        }
+        for (uint32_t v = 0; v < vectors; ++v) {
+            Isa::store(acc[v], lanes);
+            for (uint32_t i = 0; i < L; ++i) results[(size_t)(block + v * L + i) * resultStride] = O::finish(lanes[i], size);
+        }
+        for (uint32_t t = 0; t < tailCount; ++t) results[(size_t)(block + vectors * L + t) * resultStride] = O::finish(tail[t], size);
+    }
+}
+
+// Entry points, one pair per ISA, each compiled for that ISA
+#define LAB4_REDUCTION_ENTRY_POINTS(isa, Isa, target)                                                           \
+    template <class T, template <class> class Op> target LAB4_FLATTEN                                           \
+    void reduce_row_##isa(const void* row, uint32_t count, void* result) {                                    \
+        *static_cast<T*>(result) = reduce_row<Isa<T>, Op>(static_cast<const T*>(row), count);                     \
+    }                                                                                                           \
+    template <class T, template <class> class Op> target LAB4_FLATTEN                                           \
+    void reduce_columns_##isa(const void* m, uint32_t size, uint32_t first, uint32_t end, void* results, size_t stride) { \
+        reduce_columns<Isa<T>, Op>(static_cast<const T*>(m), size, first, end, static_cast<T*>(results), stride); \
+    }
+
+LAB4_REDUCTION_ENTRY_POINTS(scalar, ScalarIsa, )
+#if defined(LAB4_X86)
+LAB4_REDUCTION_ENTRY_POINTS(avx2, Avx2Isa, LAB4_TARGET("avx2"))
+// GCC 12's avx512fintrin.h passes _mm512_undefined_*() (a self-initialised variable) as the unused source
+// of its builtins, which -Wmaybe-uninitialized flags in every kernel it is inlined into
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+LAB4_REDUCTION_ENTRY_POINTS(avx512, Avx512Isa, LAB4_TARGET("avx512f"))
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+#if defined(LAB4_NEON)
+LAB4_REDUCTION_ENTRY_POINTS(neon, NeonIsa, )
+#endif
+
+// One ISA's kernels, indexed by ELEMENT_* and OP_*
+struct ReductionKernels {
+    const char* name;
+    bool (*supported)();
+    RowReduceKernel rows[ELEMENT_TYPE_COUNT][OP_COUNT];
+    ColumnReduceKernel columns[ELEMENT_TYPE_COUNT][OP_COUNT];
+};
+
+bool always_supported() { return true; }
+
+#define LAB4_OP_KERNELS(kernel, T) {kernel<T, MaxOp>, kernel<T, MinOp>, kernel<T, SumOp>, kernel<T, MeanOp>}
+#define LAB4_TYPE_KERNELS(kernel) \
+    {LAB4_OP_KERNELS(kernel, float), LAB4_OP_KERNELS(kernel, double), LAB4_OP_KERNELS(kernel, int32_t), LAB4_OP_KERNELS(kernel, int16_t)}
+#define LAB4_REDUCTION_KERNELS(isa) LAB4_TYPE_KERNELS(reduce_row_##isa), LAB4_TYPE_KERNELS(reduce_columns_##isa)
+
+// Ordered from most to least preferred for auto-selection
+const ReductionKernels REDUCTION_KERNELS[] = {
+#if defined(LAB4_X86)
+    {"avx512", cpu_has_avx512, LAB4_REDUCTION_KERNELS(avx512)},
+    {"avx2", cpu_has_avx2, LAB4_REDUCTION_KERNELS(avx2)},
+#endif
+#if defined(LAB4_NEON)
+    {"neon", always_supported, LAB4_REDUCTION_KERNELS(neon)},
+#endif
+    {"scalar", always_supported, LAB4_REDUCTION_KERNELS(scalar)},
+};
+
+const ReductionKernels* g_kernels = &REDUCTION_KERNELS[sizeof(REDUCTION_KERNELS) / sizeof(REDUCTION_KERNELS[0]) - 1];
+
+// Picks the kernels once at startup; "auto" takes the best ones the CPU supports
+bool select_kernels(const std::string& requested) {
+    for (const ReductionKernels& kernels : REDUCTION_KERNELS) {
+        if (requested != "auto" && requested != kernels.name) continue;
+        if (!kernels.supported()) {
+            if (requested == "auto") continue;
+            std::cerr << LOG_PREFIX << "Kernel '" << requested << "' is not supported by this CPU." << std::endl;
+            return false;
+        }
+        g_kernels = &kernels;
+        return true;
+    }
+    std::cerr << LOG_PREFIX << "Unknown or unavailable kernel '" << requested << "' for this build." << std::endl;
+    return false;
+}
+// ----------------------------
+
+// --- Wire Encodings ---
+// CMD_CONFIG_EX payloads: half-size input encodings, element types other than f32, and an optional
+// shuffle + LZ4 stage, with no dependency outside this file.
+size_t encoding_bytes(uint32_t encoding) {
+    switch (encoding) {
+        case ENCODING_F16: case ENCODING_BF16: return sizeof(uint16_t);
+        default: return element_bytes(element_type(encoding));
+    }
+}
+
+// F16 and BF16 arrive in a buffer of their own and are widened to f32 by the job's tasks
+bool encoding_widened(uint32_t encoding) { return encoding == ENCODING_F16 || encoding == ENCODING_BF16; }
+
+// A CONFIG_EX format word this build can run: known flags and encoding, an op it has kernels for, and no
+// column reduction of a widened encoding (column tasks widen nothing). Also checked on session images,
+// which may come from another build.
+bool valid_wire_format(uint32_t format) {
+    uint32_t encoding = format & FORMAT_ENCODING_MASK;
+    uint32_t knownBits = FORMAT_ENCODING_MASK | FORMAT_LZ4 | FORMAT_FULL_RESULT | FORMAT_COLUMNS | FORMAT_SIDE_VECTOR | FORMAT_OP_MASK;
+    return encoding <= ENCODING_I16 && (format & ~knownBits) == 0 && ((format & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT) < OP_COUNT &&
+           (!(format & FORMAT_COLUMNS) || !encoding_widened(encoding));
+}
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F, mantissa = h & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) bits = sign | 0x7F800000 | (mantissa << 13); // Inf / NaN
+    else if (exponent != 0) bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0) bits = sign;
+    else { // Subnormal half: normalize it
+        exponent = 113;
+        while (!(mantissa & 0x400)) { mantissa <<= 1; --exponent; }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Round to nearest even, like the hardware conversions
+uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t absBits = bits & 0x7FFFFFFF;
+    if (absBits > 0x7F800000) return sign | 0x7E00;  // NaN stays a (quiet) NaN
+    if (absBits >= 0x477FF000) return sign | 0x7C00; // Rounds past 65504: infinity
+    if (absBits < 0x38800000) {                      // Below 2^-14: subnormal half or zero
+        if (absBits < 0x33000000) return sign;
+        uint32_t full = (absBits & 0x7FFFFF) | 0x800000;
+        uint32_t shift = 126 - (absBits >> 23);
+        uint32_t half = full >> shift, rest = full & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+        return sign | (uint16_t)half;
+    }
+    uint32_t half = (absBits - 0x38000000) >> 13, rest = absBits & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return sign | (uint16_t)half;
+}
+
+float bf16_to_float(uint16_t b) {
+    uint32_t bits = (uint32_t)b << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) return (uint16_t)((bits >> 16) | 0x40);
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+// Groups byte k of every element together, so slowly varying exponents form long runs
+void byte_shuffle(const uint8_t* src, uint8_t* dst, size_t count, size_t elementSize) {
+    for (size_t e = 0; e < count; ++e)
+        for (size_t b = 0; b < elementSize; ++b) dst[b * count + e] = src[e * elementSize + b];
+}
+
+void byte_unshuffle(const uint8_t* src, uint8_t* dst, size_t count, size_t elementSize) {
+    for (size_t e = 0; e < count; ++e)
+        for (size_t b = 0; b < elementSize; ++b) dst[e * elementSize + b] = src[b * count + e];
+}
+
+// LZ4 block format (no frame header), so any LZ4 implementation can produce or read the payloads
+size_t lz4_bound(size_t size) { return size + size / 255 + 16; }
+
+static void lz4_put_length(std::vector<uint8_t>& out, size_t length) {
+    for (; length >= 255; length -= 255) out.push_back(255);
+    out.push_back((uint8_t)length);
+}
+
+void lz4_compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out) {
+    const int HASH_BITS = 16;
+    const size_t MAX_OFFSET = 65535, MIN_MATCH = 4;
+    out.clear();
+    out.reserve(lz4_bound(size));
+    std::vector<uint32_t> table((size_t)1 << HASH_BITS, 0);
+    auto read32 = [src](size_t pos) { uint32_t v; std::memcpy(&v, src + pos, sizeof(v)); return v; };
+    auto emit = [&out, src](size_t literalStart, size_t literals, size_t offset, size_t matchLength) {
+        uint8_t token = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+        if (matchLength) token |= (uint8_t)std::min<size_t>(matchLength - MIN_MATCH, 15);
+        out.push_back(token);
+        if (literals >= 15) lz4_put_length(out, literals - 15);
+        out.insert(out.end(), src + literalStart, src + literalStart + literals);
+        if (!matchLength) return;
+        out.push_back((uint8_t)offset);
+        out.push_back((uint8_t)(offset >> 8));
+        if (matchLength - MIN_MATCH >= 15) lz4_put_length(out, matchLength - MIN_MATCH - 15);
+    };
+    size_t anchor = 0, pos = 0;
+    if (size > 12) {
+        size_t matchLimit = size - 12; // The format ends with at least 5 literals; matches start 12+ bytes before the end
+        while (pos < matchLimit) {
+            uint32_t sequence = read32(pos);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t)pos;
+            if (candidate < pos && pos - candidate <= MAX_OFFSET && read32(candidate) == sequence) {
+                size_t end = pos + MIN_MATCH;
+                while (end < size - 5 && src[end] == src[candidate + (end - pos)]) ++end;
+                emit(anchor, pos - anchor, pos - candidate, end - pos);
+                pos = anchor = end;
+            } else {
+                pos += 1 + ((pos - anchor) >> 6); // Skip faster through data that does not compress
+            }
+        }
+    }
+    emit(anchor, size - anchor, 0, 0);
+}
+
+// Fails on any malformed input instead of reading or writing out of bounds
+bool lz4_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dstSize) {
+    size_t in = 0, out = 0;
+    auto read_length = [&](size_t& length) {
+        uint8_t b;
+        do {
+            if (in >= size) return false;
+            b = src[in++];
+            length += b;
+        } while (b == 255);
+        return true;
+    };
+    while (in < size) {
+        uint8_t token = src[in++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(literals)) return false;
+        if (literals > size - in || literals > dstSize - out) return false;
+        std::memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if (in == size) break; // Last sequence: literals only
+        if (size - in < 2) return false;
+        size_t offset = src[in] | ((size_t)src[in + 1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !read_length(matchLength)) return false;
+        matchLength += 4;
+        if (offset == 0 || offset > out || matchLength > dstSize - out) return false;
+        for (size_t i = 0; i < matchLength; ++i, ++out) dst[out] = dst[out - offset]; // May overlap itself
+    }
+    return out == dstSize;
+}
+
+// Widens `count` input values of `encoding` (host byte order) into floats
+void decode_values(float* dst, const void* src, size_t count, uint32_t encoding) {
+    if (encoding == ENCODING_F32) { std::memcpy(dst, src, count * sizeof(float)); return; }
+    const uint8_t* bytes = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t value;
+        std::memcpy(&value, bytes + i * sizeof(value), sizeof(value));
+        dst[i] = (encoding == ENCODING_F16) ? half_to_float(value) : bf16_to_float(value);
+    }
+}
+
+void compress_payload(const void* data, size_t bytes, size_t elementSize, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> shuffled(bytes);
+    byte_shuffle(static_cast<const uint8_t*>(data), shuffled.data(), bytes / elementSize, elementSize);
+    lz4_compress(shuffled.data(), bytes, out);
+}
+
+bool decompress_payload(const void* src, size_t srcBytes, void* dst, size_t dstBytes, size_t elementSize) {
+    MatrixBuffer shuffled; // Pooled scratch, so a large payload does not zero-fill a fresh allocation
+    shuffled.resize((dstBytes + sizeof(float) - 1) / sizeof(float));
+    uint8_t* scratch = reinterpret_cast<uint8_t*>(shuffled.data());
+    if (!lz4_decompress(static_cast<const uint8_t*>(src), srcBytes, scratch, dstBytes)) return false;
+    byte_unshuffle(scratch, static_cast<uint8_t*>(dst), dstBytes / elementSize, elementSize);
+    return true;
+}
+// ----------------------------
+
+// --- GPU Offload ---
+// Optional OpenCL backend (--gpu) for jobs of at least --gpu-min-size rows. libOpenCL is loaded at run
+// time, so the server builds without an SDK and runs unchanged where there is no driver or no device;
+// jobs then stay on the CPU. One thread owns the device and runs its jobs one after another. Rows go up
+// through two pinned staging buffers on a copy queue while the kernels run on a compute queue, so the
+// copy of one block overlaps the reduction of the previous one. A raw CONFIG_DATA / CONFIG_EX matrix is
+// uploaded the same way while it is still arriving, and its job then only runs the kernel.
+#ifdef _WIN32
+#define LAB4_CL_API __stdcall
+#else
+#define LAB4_CL_API
+#endif
+
+// The few OpenCL 1.2 types and values used here, as declared by CL/cl.h
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_ulong;
+typedef struct _cl_platform_id* cl_platform_id;
+typedef struct _cl_device_id* cl_device_id;
+typedef struct _cl_context* cl_context;
+typedef struct _cl_command_queue* cl_command_queue;
+typedef struct _cl_mem* cl_mem;
+typedef struct _cl_program* cl_program;
+typedef struct _cl_kernel* cl_kernel;
+typedef struct _cl_event* cl_event;
+
+const cl_int CL_SUCCESS = 0;
+const cl_uint CL_FALSE = 0;
+const cl_uint CL_TRUE = 1;
+const cl_ulong CL_DEVICE_TYPE_CPU = 1 << 1;
+const cl_ulong CL_DEVICE_TYPE_GPU = 1 << 2;
+const cl_ulong CL_DEVICE_TYPE_ACCELERATOR = 1 << 3;
+const cl_uint CL_DEVICE_MAX_MEM_ALLOC_SIZE = 0x1010;
+const cl_uint CL_DEVICE_NAME = 0x102B;
+const cl_uint CL_DEVICE_EXTENSIONS = 0x1030;
+const cl_ulong CL_MEM_READ_WRITE = 1 << 0;
+const cl_ulong CL_MEM_ALLOC_HOST_PTR = 1 << 4;
+const cl_ulong CL_MAP_READ = 1 << 0;
+const cl_ulong CL_MAP_WRITE = 1 << 1;
+const cl_uint CL_PROGRAM_BUILD_LOG = 0x1183;
+
+struct OpenClApi {
+    cl_int (LAB4_CL_API* GetPlatformIDs)(cl_uint, cl_platform_id*, cl_uint*);
+    cl_int (LAB4_CL_API* GetDeviceIDs)(cl_platform_id, cl_ulong, cl_uint, cl_device_id*, cl_uint*);
+    cl_int (LAB4_CL_API* GetDeviceInfo)(cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_context (LAB4_CL_API* CreateContext)(const intptr_t*, cl_uint, const cl_device_id*,
+                                            void (LAB4_CL_API*)(const char*, const void*, size_t, void*), void*, cl_int*);
+    cl_command_queue (LAB4_CL_API* CreateCommandQueue)(cl_context, cl_device_id, cl_ulong, cl_int*);
+    cl_mem (LAB4_CL_API* CreateBuffer)(cl_context, cl_ulong, size_t, void*, cl_int*);
+    void* (LAB4_CL_API* EnqueueMapBuffer)(cl_command_queue, cl_mem, cl_uint, cl_ulong, size_t, size_t, cl_uint,
+                                          const cl_event*, cl_event*, cl_int*);
+    cl_int (LAB4_CL_API* EnqueueUnmapMemObject)(cl_command_queue, cl_mem, void*, cl_uint, const cl_event*, cl_event*);
+    cl_program (LAB4_CL_API* CreateProgramWithSource)(cl_context, cl_uint, const char**, const size_t*, cl_int*);
+    cl_int (LAB4_CL_API* BuildProgram)(cl_program, cl_uint, const cl_device_id*, const char*,
+                                       void (LAB4_CL_API*)(cl_program, void*), void*);
+    cl_int (LAB4_CL_API* GetProgramBuildInfo)(cl_program, cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_kernel (LAB4_CL_API* CreateKernel)(cl_program, const char*, cl_int*);
+    cl_int (LAB4_CL_API* SetKernelArg)(cl_kernel, cl_uint, size_t, const void*);
+    cl_int (LAB4_CL_API* EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t, const void*, cl_uint,
+                                             const cl_event*, cl_event*);
+    cl_int (LAB4_CL_API* EnqueueReadBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t, void*, cl_uint,
+                                            const cl_event*, cl_event*);
+    cl_int (LAB4_CL_API* EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint, const size_t*, const size_t*,
+                                               const size_t*, cl_uint, const cl_event*, cl_event*);
+    cl_int (LAB4_CL_API* WaitForEvents)(cl_uint, const cl_event*);
+    cl_int (LAB4_CL_API* Flush)(cl_command_queue);
+    cl_int (LAB4_CL_API* Finish)(cl_command_queue);
+    cl_int (LAB4_CL_API* RetainEvent)(cl_event);
+    cl_int (LAB4_CL_API* ReleaseEvent)(cl_event);
+    cl_int (LAB4_CL_API* ReleaseMemObject)(cl_mem);
+    cl_int (LAB4_CL_API* ReleaseKernel)(cl_kernel);
+    cl_int (LAB4_CL_API* ReleaseProgram)(cl_program);
+    cl_int (LAB4_CL_API* ReleaseCommandQueue)(cl_command_queue);
+    cl_int (LAB4_CL_API* ReleaseContext)(cl_context);
+
+    // Opens the system's OpenCL library (an ICD loader, normally) and resolves every entry point above.
+    // The library stays loaded for the life of the process.
+    bool load(std::string& error) {
+#ifdef _WIN32
+        HMODULE library = LoadLibraryA("OpenCL.dll");
+        auto symbol = [library](const char* name) { return GetProcAddress(library, name); };
+#else
+        void* library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!library) library = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+        auto symbol = [library](const char* name) { return dlsym(library, name); };
+#endif
+        if (!library) { error = "no OpenCL library"; return false; }
+#define LAB4_CL_LOAD(name) \
+        if (!(name = reinterpret_cast<decltype(name)>(symbol("cl" #name)))) { error = "cl" #name " is missing"; return false; }
+        LAB4_CL_LOAD(GetPlatformIDs) LAB4_CL_LOAD(GetDeviceIDs) LAB4_CL_LOAD(GetDeviceInfo) LAB4_CL_LOAD(CreateContext)
+        LAB4_CL_LOAD(CreateCommandQueue) LAB4_CL_LOAD(CreateBuffer) LAB4_CL_LOAD(EnqueueMapBuffer)
+        LAB4_CL_LOAD(EnqueueUnmapMemObject) LAB4_CL_LOAD(CreateProgramWithSource) LAB4_CL_LOAD(BuildProgram)
+        LAB4_CL_LOAD(GetProgramBuildInfo) LAB4_CL_LOAD(CreateKernel) LAB4_CL_LOAD(SetKernelArg)
+        LAB4_CL_LOAD(EnqueueWriteBuffer) LAB4_CL_LOAD(EnqueueReadBuffer) LAB4_CL_LOAD(EnqueueNDRangeKernel)
+        LAB4_CL_LOAD(WaitForEvents) LAB4_CL_LOAD(Flush) LAB4_CL_LOAD(Finish) LAB4_CL_LOAD(RetainEvent)
+        LAB4_CL_LOAD(ReleaseEvent) LAB4_CL_LOAD(ReleaseMemObject) LAB4_CL_LOAD(ReleaseKernel) LAB4_CL_LOAD(ReleaseProgram)
+        LAB4_CL_LOAD(ReleaseCommandQueue) LAB4_CL_LOAD(ReleaseContext)
+#undef LAB4_CL_LOAD
+        return true;
+    }
+};
+
+OpenClApi g_cl;
+
+// One work-group per row, reduced in local memory; one work-item per column, carried across row blocks in
+// `acc`. Max and min keep the element type, so they are exact; sums accumulate in double like the CPU
+// kernels, which needs cl_khr_fp64 (so do f64 matrices). NaN never wins a comparison, as on the CPU.
+const char* const GPU_KERNEL_SOURCE = R"CLC(
+#ifdef LAB4_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#define GROUP 64
+#define MAX_STEP(a, x) ((x) > (a) ? (x) : (a))
+#define MIN_STEP(a, x) ((x) < (a) ? (x) : (a))
+#define SUM_STEP(a, x) ((a) + (x))
+#define KERNELS(name, T, A, IDENTITY, STEP) \
+__kernel __attribute__((reqd_work_group_size(GROUP, 1, 1))) \
+void rows_##name(__global const T* m, uint size, __global A* out, uint outOffset) { \
+    __local A partial[GROUP]; \
+    uint lane = get_local_id(0); \
+    __global const T* row = m + (size_t)get_group_id(0) * size; \
+    A acc = IDENTITY; \
+    for (uint c = lane; c < size; c += GROUP) acc = STEP(acc, (A)row[c]); \
+    partial[lane] = acc; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (uint s = GROUP / 2; s > 0; s >>= 1) { \
+        if (lane < s) partial[lane] = STEP(partial[lane], partial[lane + s]); \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+    } \
+    if (lane == 0) out[outOffset + get_group_id(0)] = partial[0]; \
+} \
+__kernel void columns_##name(__global const T* m, uint size, uint rowCount, __global A* acc, uint first) { \
+    uint c = get_global_id(0); \
+    if (c >= size) return; \
+    A a = first ? IDENTITY : acc[c]; \
+    for (uint r = 0; r < rowCount; ++r) a = STEP(a, (A)m[(size_t)r * size + c]); \
+    acc[c] = a; \
+}
+KERNELS(f32_max, float, float, -INFINITY, MAX_STEP)
+KERNELS(f32_min, float, float, INFINITY, MIN_STEP)
+KERNELS(i32_max, int, int, INT_MIN, MAX_STEP)
+KERNELS(i32_min, int, int, INT_MAX, MIN_STEP)
+KERNELS(i16_max, short, short, SHRT_MIN, MAX_STEP)
+KERNELS(i16_min, short, short, SHRT_MAX, MIN_STEP)
+#ifdef LAB4_FP64
+KERNELS(f64_max, double, double, -INFINITY, MAX_STEP)
+KERNELS(f64_min, double, double, INFINITY, MIN_STEP)
+KERNELS(f32_sum, float, double, 0.0, SUM_STEP)
+KERNELS(f64_sum, double, double, 0.0, SUM_STEP)
+KERNELS(i32_sum, int, double, 0.0, SUM_STEP)
+KERNELS(i16_sum, short, double, 0.0, SUM_STEP)
+#endif
+)CLC";
+
+const size_t GPU_GROUP = 64;                 // GROUP in GPU_KERNEL_SOURCE
+const size_t GPU_STAGING_BYTES = 8u << 20;   // Per staging buffer; a block of rows is at most this much
+const char* const GPU_TYPE_NAMES[ELEMENT_TYPE_COUNT] = {"f32", "f64", "i32", "i16"};
+const char* const GPU_OP_NAMES[OP_COUNT] = {"max", "min", "sum", "sum"}; // A mean is a sum divided on the host
+
+// Row i's accumulator from the device as result i of type T, at results[i * stride]
+template <class T> void store_gpu_results(const void* accumulators, uint32_t op, uint32_t size, void* results, size_t stride) {
+    T* out = static_cast<T*>(results);
+    for (uint32_t i = 0; i < size; ++i) {
+        if (op == OP_SUM || op == OP_MEAN) {
+            double sum = static_cast<const double*>(accumulators)[i];
+            out[i * stride] = narrow_result<T>(op == OP_MEAN ? sum / size : sum);
+        } else {
+            out[i * stride] = static_cast<const T*>(accumulators)[i];
+        }
+    }
+}
+
+// Device copy of a matrix that is still arriving. The I/O thread hands each received stretch to the GPU
+// thread, which copies it out of the receive buffer under `mutex`; cancel() waits for a copy in progress,
+// so once it returns the receive buffer may be reused or freed.
+class GpuMatrix {
+public:
+    GpuMatrix(cl_mem buffer, size_t bytes, uint32_t size, uint32_t elementType, std::atomic<size_t>& budgetUsed)
+        : buffer(buffer), bytes(bytes), size(size), elementType(elementType), budgetUsed(budgetUsed) {}
+    ~GpuMatrix() {
+        if (lastWrite) g_cl.ReleaseEvent(lastWrite);
+        g_cl.ReleaseMemObject(buffer); // Freed by the driver once queued copies into it are done
+        budgetUsed.fetch_sub(bytes);
+    }
+
+    GpuMatrix(const GpuMatrix&) = delete;
+    GpuMatrix& operator=(const GpuMatrix&) = delete;
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+    }
+
+private:
+    friend class GpuBackend;
+    cl_mem buffer;
+    size_t bytes;
+    uint32_t size, elementType;
+    std::atomic<size_t>& budgetUsed;
+    size_t queuedBytes = 0;      // I/O thread: handed to the GPU thread so far
+    std::mutex mutex;            // Held by the GPU thread while it reads the receive buffer
+    bool cancelled = false;
+    size_t uploadedBytes = 0;    // GPU thread only, like failed and lastWrite
+    bool failed = false;
+    cl_event lastWrite = nullptr; // Of the latest copy; the job's kernel waits for it
+};
+
+class GpuBackend {
+public:
+    ~GpuBackend() { stop(); }
+
+    // False only on a bad option; a missing library or device is logged and leaves the backend off
+    bool start(const ServerConfig& config) {
+        if (config.gpu == "off") { std::cout << LOG_PREFIX << "GPU offload off." << std::endl; return true; }
+        if (config.gpu != "auto" && config.gpu != "any") {
+            std::cerr << LOG_PREFIX << "Unknown --gpu value: " << config.gpu << std::endl;
+            return false;
+        }
+        std::string error;
+        if (!open_device(config.gpu == "any", error)) {
+            release_device();
+            std::cout << LOG_PREFIX << "GPU backend unavailable: " << error << "; jobs run on the CPU." << std::endl;
+            return true;
+        }
+        minSize = std::max<uint32_t>(1, config.gpuMinSize);
+        budgetBytes = config.gpuMaxMB << 20;
+        enabled = true;
+        worker = std::thread(&GpuBackend::worker_loop, this);
+        std::cout << LOG_PREFIX << "GPU backend: " << deviceName << ", jobs of " << minSize << "+ rows"
+                  << (hasFp64 ? "" : ", max and min of f32/i32/i16 only (no cl_khr_fp64)") << "." << std::endl;
+        return true;
+    }
+
+    // Runs the queued work, then releases the device; later jobs stay on the CPU
+    void stop() {
+        if (!worker.joinable()) return;
+        enabled = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeCv.notify_one();
+        worker.join();
+        release_device();
+    }
+
+    // Whether a job of this shape goes to the device
+    bool accepts(uint32_t size, uint32_t elementType, uint32_t op) const {
+        return enabled && size >= minSize && rowKernels[elementType][op] != nullptr &&
+               (size_t)size * element_bytes(elementType) <= GPU_STAGING_BYTES;
+    }
+
+    // A device buffer for a matrix about to be received, or nullptr if its job will not run on the device
+    // or it does not fit in --gpu-max-mb next to the matrices already held
+    std::shared_ptr<GpuMatrix> begin_upload(uint32_t size, uint32_t elementType, uint32_t op) {
+        if (!accepts(size, elementType, op)) return nullptr;
+        size_t bytes = (size_t)size * size * element_bytes(elementType);
+        if (bytes > maxAllocBytes || budgetUsed.fetch_add(bytes) + bytes > budgetBytes) {
+            if (bytes <= maxAllocBytes) budgetUsed.fetch_sub(bytes);
+            return nullptr;
+        }
+        cl_int status;
+        cl_mem buffer = g_cl.CreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &status);
+        if (status != CL_SUCCESS) { budgetUsed.fetch_sub(bytes); return nullptr; }
+        return std::make_shared<GpuMatrix>(buffer, bytes, size, elementType, budgetUsed);
+    }
+
+    // I/O thread, after every read into `data`: once a staging buffer's worth more has arrived (or all of
+    // it), that stretch is queued for upload. `owner` keeps `data` alive until it has been copied.
+    void received(const std::shared_ptr<void>& owner, const std::shared_ptr<GpuMatrix>& matrix, const void* data,
+                  size_t receivedBytes) {
+        if (receivedBytes - matrix->queuedBytes < GPU_STAGING_BYTES && receivedBytes < matrix->bytes) return;
+        size_t offset = matrix->queuedBytes, bytes = receivedBytes - offset;
+        matrix->queuedBytes = receivedBytes;
+        const char* from = static_cast<const char*>(data) + offset;
+        post([this, owner, matrix, from, offset, bytes] { upload(*matrix, from, offset, bytes); });
+    }
+
+    // Runs the job held by `state` (rows or columns of `matrix`, results where the CPU path would put them)
+    // on the device thread. done(true) once the results are stored; done(false) if the device failed, in
+    // which case the backend is off from then on and the job is the caller's to run on the CPU.
+    void submit(const std::shared_ptr<ClientState>& state, void* matrix, std::function<void(bool)> done) {
+        post([this, state, matrix, done = std::move(done)] {
+            auto started = std::chrono::steady_clock::now();
+            std::shared_ptr<GpuMatrix> resident = std::move(state->gpuMatrix);
+            bool computed = false;
+            if (enabled) {
+                try {
+                    run_job(*state, matrix, resident);
+                    computed = true;
+                } catch (const std::exception& e) {
+                    disable(e.what());
+                }
+            }
+            resident.reset();
+            if (computed) {
+                g_metrics.record(Timer::Compute, std::chrono::steady_clock::now() - started);
+                g_metrics.add(Counter::GpuJobs);
+            } else {
+                g_metrics.add(Counter::GpuFallbacks);
+            }
+            done(computed);
+        });
+    }
+
+private:
+    // A pinned host buffer (mapped once, for good) and the device block it is copied to
+    struct Slot {
+        cl_mem pinned = nullptr;
+        void* host = nullptr;
+        cl_mem device = nullptr;
+        cl_event written = nullptr;  // Copy out of `host`; the host waits for it before refilling
+        cl_event consumed = nullptr; // Kernel reading `device`; the next copy into it waits for it
+    };
+
+    static void check(cl_int status, const char* what) {
+        if (status != CL_SUCCESS) throw std::runtime_error(std::string(what) + " failed with OpenCL error " + std::to_string(status));
+    }
+
+    static void release(cl_event& event) {
+        if (event) g_cl.ReleaseEvent(event);
+        event = nullptr;
+    }
+
+    static void wait(cl_event& event) {
+        if (!event) return;
+        cl_int status = g_cl.WaitForEvents(1, &event);
+        release(event);
+        check(status, "clWaitForEvents");
+    }
+
+    static std::string device_string(cl_device_id device, cl_uint param) {
+        size_t length = 0;
+        if (g_cl.GetDeviceInfo(device, param, 0, nullptr, &length) != CL_SUCCESS || length == 0) return "";
+        std::string value(length, '\0');
+        if (g_cl.GetDeviceInfo(device, param, length, &value[0], nullptr) != CL_SUCCESS) return "";
+        value.resize(std::strlen(value.c_str()));
+        return value;
+    }
+
+    bool open_device(bool anyDevice, std::string& error) {
+        if (!g_cl.load(error)) return false;
+        cl_uint platformCount = 0;
+        if (g_cl.GetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) {
+            error = "no OpenCL platform";
+            return false;
+        }
+        std::vector<cl_platform_id> platforms(platformCount);
+        g_cl.GetPlatformIDs(platformCount, platforms.data(), nullptr);
+        cl_ulong types = CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR | (anyDevice ? CL_DEVICE_TYPE_CPU : 0);
+        for (cl_platform_id platform : platforms) {
+            cl_uint count = 0;
+            if (g_cl.GetDeviceIDs(platform, types, 1, &device, &count) == CL_SUCCESS && count > 0) break;
+            device = nullptr;
+        }
+        if (!device) { error = anyDevice ? "no OpenCL device" : "no GPU or accelerator (--gpu=any also takes CPU devices)"; return false; }
+        deviceName = device_string(device, CL_DEVICE_NAME);
+        hasFp64 = device_string(device, CL_DEVICE_EXTENSIONS).find("cl_khr_fp64") != std::string::npos;
+        cl_ulong maxAlloc = 0;
+        g_cl.GetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, nullptr);
+        maxAllocBytes = (size_t)maxAlloc;
+
+        cl_int status;
+        context = g_cl.CreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+        if (status != CL_SUCCESS) { error = "clCreateContext failed with " + std::to_string(status); return false; }
+        copyQueue = g_cl.CreateCommandQueue(context, device, 0, &status);
+        if (status == CL_SUCCESS) computeQueue = g_cl.CreateCommandQueue(context, device, 0, &status);
+        if (status != CL_SUCCESS) { error = "clCreateCommandQueue failed with " + std::to_string(status); return false; }
+
+        const char* source = GPU_KERNEL_SOURCE;
+        program = g_cl.CreateProgramWithSource(context, 1, &source, nullptr, &status);
+        if (status != CL_SUCCESS) { error = "clCreateProgramWithSource failed with " + std::to_string(status); return false; }
+        if (g_cl.BuildProgram(program, 1, &device, hasFp64 ? "-DLAB4_FP64" : "", nullptr, nullptr) != CL_SUCCESS) {
+            size_t length = 0;
+            g_cl.GetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &length);
+            std::string log(length, '\0');
+            if (length) g_cl.GetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, length, &log[0], nullptr);
+            log.resize(std::strlen(log.c_str()));
+            error = "kernel build failed: " + log.substr(0, 500);
+            return false;
+        }
+        for (uint32_t type = 0; type < ELEMENT_TYPE_COUNT; ++type) {
+            for (uint32_t op = 0; op < OP_COUNT; ++op) {
+                if (!hasFp64 && (type == ELEMENT_F64 || op == OP_SUM || op == OP_MEAN)) continue;
+                std::string name = std::string(GPU_TYPE_NAMES[type]) + "_" + GPU_OP_NAMES[op];
+                rowKernels[type][op] = g_cl.CreateKernel(program, ("rows_" + name).c_str(), &status);
+                if (status == CL_SUCCESS) columnKernels[type][op] = g_cl.CreateKernel(program, ("columns_" + name).c_str(), &status);
+                if (status != CL_SUCCESS) { error = "clCreateKernel " + name + " failed with " + std::to_string(status); return false; }
+            }
+        }
+        for (Slot& slot : slots) {
+            slot.pinned = g_cl.CreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, GPU_STAGING_BYTES, nullptr, &status);
+            if (status == CL_SUCCESS) {
+                slot.host = g_cl.EnqueueMapBuffer(copyQueue, slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, GPU_STAGING_BYTES,
+                                                  0, nullptr, nullptr, &status);
+            }
+            if (status == CL_SUCCESS) slot.device = g_cl.CreateBuffer(context, CL_MEM_READ_WRITE, GPU_STAGING_BYTES, nullptr, &status);
+            if (status != CL_SUCCESS) { error = "staging buffers: OpenCL error " + std::to_string(status); return false; }
+        }
+        return true;
+    }
+
+    void release_device() {
+        for (Slot& slot : slots) {
+            release(slot.written);
+            release(slot.consumed);
+            if (slot.host) g_cl.EnqueueUnmapMemObject(copyQueue, slot.pinned, slot.host, 0, nullptr, nullptr);
+            if (slot.pinned) g_cl.ReleaseMemObject(slot.pinned);
+            if (slot.device) g_cl.ReleaseMemObject(slot.device);
+            slot = Slot();
+        }
+        release_results();
+        for (uint32_t type = 0; type < ELEMENT_TYPE_COUNT; ++type) {
+            for (uint32_t op = 0; op < OP_COUNT; ++op) {
+                if (rowKernels[type][op]) g_cl.ReleaseKernel(rowKernels[type][op]);
+                if (columnKernels[type][op]) g_cl.ReleaseKernel(columnKernels[type][op]);
+                rowKernels[type][op] = columnKernels[type][op] = nullptr;
+            }
+        }
+        if (program) g_cl.ReleaseProgram(program);
+        if (copyQueue) { g_cl.Finish(copyQueue); g_cl.ReleaseCommandQueue(copyQueue); }
+        if (computeQueue) { g_cl.Finish(computeQueue); g_cl.ReleaseCommandQueue(computeQueue); }
+        if (context) g_cl.ReleaseContext(context);
+        program = nullptr; copyQueue = computeQueue = nullptr; context = nullptr; device = nullptr;
+    }
+
+    void release_results() {
+        if (resultsHost) g_cl.EnqueueUnmapMemObject(copyQueue, resultsPinned, resultsHost, 0, nullptr, nullptr);
+        if (resultsPinned) g_cl.ReleaseMemObject(resultsPinned);
+        if (resultsDevice) g_cl.ReleaseMemObject(resultsDevice);
+        resultsHost = nullptr; resultsPinned = resultsDevice = nullptr; resultsBytes = 0;
+    }
+
+    // Device accumulators and their pinned host copy, grown to `bytes` when a job needs more
+    void reserve_results(size_t bytes) {
+        if (bytes <= resultsBytes) return;
+        release_results();
+        cl_int status;
+        resultsDevice = g_cl.CreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &status);
+        check(status, "clCreateBuffer (results)");
+        resultsPinned = g_cl.CreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, nullptr, &status);
+        check(status, "clCreateBuffer (pinned results)");
+        resultsHost = g_cl.EnqueueMapBuffer(copyQueue, resultsPinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, nullptr,
+                                            nullptr, &status);
+        check(status, "clEnqueueMapBuffer (results)");
+        resultsBytes = bytes;
+    }
+
+    Slot& next_slot() {
+        Slot& slot = slots[nextSlot];
+        nextSlot ^= 1;
+        return slot;
+    }
+
+    // GPU thread: one received stretch into the matrix's device buffer, a staging buffer at a time
+    void upload(GpuMatrix& matrix, const char* from, size_t offset, size_t bytes) {
+        std::lock_guard<std::mutex> lock(matrix.mutex);
+        if (!enabled || matrix.cancelled || matrix.failed) return;
+        try {
+            for (size_t done = 0; done < bytes; ) {
+                size_t part = std::min(GPU_STAGING_BYTES, bytes - done);
+                Slot& slot = next_slot();
+                wait(slot.written);
+                std::memcpy(slot.host, from + done, part);
+                check(g_cl.EnqueueWriteBuffer(copyQueue, matrix.buffer, CL_FALSE, offset + done, part, slot.host, 0, nullptr,
+                                              &slot.written), "clEnqueueWriteBuffer");
+                release(matrix.lastWrite);
+                g_cl.RetainEvent(slot.written);
+                matrix.lastWrite = slot.written;
+                done += part;
+            }
+            check(g_cl.Flush(copyQueue), "clFlush");
+            matrix.uploadedBytes += bytes;
+        } catch (const std::exception& e) {
+            matrix.failed = true; // Its job copies the rows up itself
+            std::cerr << LOG_PREFIX << "GPU upload during receive failed: " << e.what() << std::endl;
+        }
+    }
+
+    // One kernel over `rowCount` rows of `rows` (row `firstRow` of the matrix), after `after`
+    void launch(const ClientState& state, cl_mem rows, uint32_t firstRow, uint32_t rowCount, cl_event after, cl_event* done) {
+        uint32_t size = state.matrixSize;
+        size_t global, local = GPU_GROUP;
+        if (state.reduceColumns) {
+            cl_kernel kernel = columnKernels[state.elementType][state.reduceOp];
+            cl_uint first = firstRow == 0;
+            check(g_cl.SetKernelArg(kernel, 0, sizeof(cl_mem), &rows), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 1, sizeof(cl_uint), &size), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 2, sizeof(cl_uint), &rowCount), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 3, sizeof(cl_mem), &resultsDevice), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 4, sizeof(cl_uint), &first), "clSetKernelArg");
+            global = (size + GPU_GROUP - 1) / GPU_GROUP * GPU_GROUP;
+            check(g_cl.EnqueueNDRangeKernel(computeQueue, kernel, 1, nullptr, &global, &local, after ? 1 : 0,
+                                            after ? &after : nullptr, done), "clEnqueueNDRangeKernel");
+        } else {
+            cl_kernel kernel = rowKernels[state.elementType][state.reduceOp];
+            check(g_cl.SetKernelArg(kernel, 0, sizeof(cl_mem), &rows), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 1, sizeof(cl_uint), &size), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 2, sizeof(cl_mem), &resultsDevice), "clSetKernelArg");
+            check(g_cl.SetKernelArg(kernel, 3, sizeof(cl_uint), &firstRow), "clSetKernelArg");
+            global = (size_t)rowCount * GPU_GROUP;
+            check(g_cl.EnqueueNDRangeKernel(computeQueue, kernel, 1, nullptr, &global, &local, after ? 1 : 0,
+                                            after ? &after : nullptr, done), "clEnqueueNDRangeKernel");
+        }
+    }
+
+    void run_job(ClientState& state, void* matrix, const std::shared_ptr<GpuMatrix>& resident) {
+        uint32_t size = state.matrixSize;
+        size_t elementSize = element_bytes(state.elementType), rowBytes = (size_t)size * elementSize;
+        bool sum = state.reduceOp == OP_SUM || state.reduceOp == OP_MEAN;
+        size_t accumulatorBytes = (size_t)size * (sum ? sizeof(double) : elementSize);
+        reserve_results(accumulatorBytes);
+        bool onDevice = false;
+        if (resident) {
+            std::lock_guard<std::mutex> lock(resident->mutex);
+            onDevice = !resident->cancelled && !resident->failed && resident->uploadedBytes == resident->bytes &&
+                       resident->size == size && resident->elementType == state.elementType;
+        }
+        if (onDevice) {
+            launch(state, resident->buffer, 0, size, resident->lastWrite, nullptr);
+        } else {
+            // Block k's copy (copy queue) waits for the kernel that last read its device buffer; its kernel
+            // (compute queue) waits for the copy. The host fills one staging buffer while the other is in flight.
+            uint32_t blockRows = (uint32_t)std::max<size_t>(1, GPU_STAGING_BYTES / rowBytes);
+            for (uint32_t firstRow = 0; firstRow < size; firstRow += blockRows) {
+                uint32_t rowCount = std::min(blockRows, size - firstRow);
+                size_t bytes = (size_t)rowCount * rowBytes;
+                Slot& slot = next_slot();
+                wait(slot.written);
+                std::memcpy(slot.host, static_cast<const char*>(matrix) + (size_t)firstRow * rowBytes, bytes);
+                check(g_cl.EnqueueWriteBuffer(copyQueue, slot.device, CL_FALSE, 0, bytes, slot.host,
+                    slot.consumed ? 1 : 0, slot.consumed ? &slot.consumed : nullptr, &slot.written), "clEnqueueWriteBuffer");
+                release(slot.consumed);
+                launch(state, slot.device, firstRow, rowCount, slot.written, &slot.consumed);
+                check(g_cl.Flush(copyQueue), "clFlush");
+                check(g_cl.Flush(computeQueue), "clFlush");
+            }
+        }
+        cl_event read = nullptr;
+        check(g_cl.EnqueueReadBuffer(computeQueue, resultsDevice, CL_FALSE, 0, accumulatorBytes, resultsHost, 0, nullptr, &read),
+              "clEnqueueReadBuffer");
+        wait(read);
+        void* results = state.sideOutput ? state.side_results() : matrix;
+        size_t stride = state.sideOutput ? 1 : (size_t)size + 1;
+        switch (state.elementType) {
+            case ELEMENT_F32: store_gpu_results<float>(resultsHost, state.reduceOp, size, results, stride); break;
+            case ELEMENT_F64: store_gpu_results<double>(resultsHost, state.reduceOp, size, results, stride); break;
+            case ELEMENT_I32: store_gpu_results<int32_t>(resultsHost, state.reduceOp, size, results, stride); break;
+            case ELEMENT_I16: store_gpu_results<int16_t>(resultsHost, state.reduceOp, size, results, stride); break;
+        }
+    }
+
+    // After a device error nothing more is sent to it; what is queued drains so its events can go
+    void disable(const std::string& reason) {
+        enabled = false;
+        std::cerr << LOG_PREFIX << "GPU backend disabled: " << reason << "; jobs run on the CPU from now on." << std::endl;
+        g_cl.Finish(copyQueue);
+        g_cl.Finish(computeQueue);
+        for (Slot& slot : slots) { release(slot.written); release(slot.consumed); }
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wakeCv.notify_one();
+    }
+
+    void worker_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeCv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return; // Stopping, and everything queued has run
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::atomic<bool> enabled{false};
+    uint32_t minSize = 0;
+    size_t budgetBytes = 0, maxAllocBytes = 0;
+    std::atomic<size_t> budgetUsed{0}; // Device bytes of the GpuMatrix buffers alive
+
+    // Set up by start(); used by the GPU thread only from then on
+    cl_device_id device = nullptr;
+    std::string deviceName;
+    bool hasFp64 = false;
+    cl_context context = nullptr;
+    cl_command_queue copyQueue = nullptr, computeQueue = nullptr;
+    cl_program program = nullptr;
+    cl_kernel rowKernels[ELEMENT_TYPE_COUNT][OP_COUNT] = {};
+    cl_kernel columnKernels[ELEMENT_TYPE_COUNT][OP_COUNT] = {};
+    Slot slots[2];
+    size_t nextSlot = 0;
+    cl_mem resultsDevice = nullptr, resultsPinned = nullptr;
+    void* resultsHost = nullptr;
+    size_t resultsBytes = 0;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wakeCv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+};
+
+GpuBackend g_gpu;
+// ----------------------------
+
+// --- Shard Coordinator ---
+// With --shards, the rows of a large job are split into shards and sent to other lab4 servers as
+// CMD_SHARD_COMP, so one job gets the memory bandwidth of several boxes. Every backend has
+// --shard-connections blocking connections, each served by a thread of its own that takes the oldest
+// queued shard it may run, sends it and waits for the reply. A shard still unanswered after its hedge
+// delay is sent to a second backend as well, and the first reply wins; a failed or refused shard is
+// retried on a backend it has not been tried on yet, and one that no backend can take is reduced on the
+// local pool. The results are stored once every shard has its reply and no connection is still sending
+// rows, so the matrix is the client's again as soon as the job is done.
+const uint32_t SHARDS_PER_CONNECTION = 2; // Shards of a job per backend connection, so faster nodes take more of them
+const size_t MIN_SHARD_BYTES = 1 << 20;   // Smaller shards cost more in round trips than they gain
+const double SHARD_HEDGE_FACTOR = 3.0;    // Hedge delay over the time the backends have been taking for that many bytes
+const double SHARD_EWMA_WEIGHT = 0.2;     // Of the latest reply, in that expected time per byte
+const size_t SHARD_SEND_PIECE = 1 << 20;  // Rows go out in pieces, so a send stops soon after another backend answered
+const int SHARD_IO_TIMEOUT_MS = 30000;    // A backend that neither reads nor answers for this long has failed
+const int SHARD_RETRY_MS = 1000;          // A failed backend gets no shards for this long
+const size_t MAX_SHARD_BACKENDS = 64;     // Bits of Shard::tried
+
+// The encoding a matrix of `elementType` is held in, so its rows are sent as they are
+uint32_t native_encoding(uint32_t elementType) {
+    static const uint32_t ENCODINGS[ELEMENT_TYPE_COUNT] = {ENCODING_F32, ENCODING_F64, ENCODING_I32, ENCODING_I16};
+    return ENCODINGS[elementType];
+}
+
+class ShardCoordinator {
+public:
+    ~ShardCoordinator() { stop(); }
+
+    // False on a malformed --shards list; without one every job stays local
+    bool start(const ServerConfig& config) {
+        if (config.shards.empty()) return true;
+        std::stringstream list(config.shards);
+        std::string entry;
+        while (std::getline(list, entry, ',')) {
+            size_t colon = entry.rfind(':');
+            unsigned long port = 0;
+            try {
+                if (colon != std::string::npos && colon > 0) port = std::stoul(entry.substr(colon + 1));
+            } catch (...) {
+                port = 0;
+            }
+            if (port == 0 || port > 65535 || backends.size() == MAX_SHARD_BACKENDS) {
+                std::cerr << LOG_PREFIX << "Invalid --shards entry: " << entry << " (expected HOST:PORT, at most "
+                          << MAX_SHARD_BACKENDS << " of them)" << std::endl;
+                backends.clear();
+                return false;
+            }
+            backends.push_back(Backend{entry.substr(0, colon), std::to_string(port), entry, {}});
+        }
+        if (backends.empty()) { std::cerr << LOG_PREFIX << "Empty --shards list" << std::endl; return false; }
+        minSize = std::max<uint32_t>(1, config.shardMinSize);
+        hedgeFloor = std::chrono::milliseconds(config.shardHedgeMs);
+        for (size_t b = 0; b < backends.size(); ++b) {
+            for (uint32_t c = 0; c < config.shardConnections; ++c) {
+                links.push_back(std::make_unique<Link>());
+                links.back()->backend = b;
+            }
+        }
+        for (size_t i = 0; i < links.size(); ++i) links[i]->thread = std::thread(&ShardCoordinator::link_loop, this, i);
+        hedger = std::thread(&ShardCoordinator::hedge_loop, this);
+        std::cout << LOG_PREFIX << "Sharding jobs of " << minSize << "+ rows across " << backends.size() << " backend(s), "
+                  << config.shardConnections << " connection(s) each:";
+        for (const Backend& backend : backends) std::cout << " " << backend.name;
+        std::cout << std::endl;
+        return true;
+    }
+
+    // Hangs up on the backends; shards still unanswered are not retried
+    void stop() {
+        if (!hedger.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto& link : links) {
+                if (link->socket != INVALID_SOCKET) shutdown(link->socket, SD_BOTH); // Wakes a blocked send or recv
+            }
+        }
+        workCv.notify_all();
+        hedgeCv.notify_all();
+        hedger.join();
+        for (auto& link : links) link->thread.join();
+        for (auto& link : links) close_link(*link);
+        links.clear();
+    }
+
+    // Row jobs of whole matrices of --shard-min-size rows and up, while some backend has not failed lately
+    bool accepts(const ClientState& state) const {
+        if (links.empty() || state.reduceColumns || state.jobRows != 0 || state.matrixSize < minSize) return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        return std::any_of(backends.begin(), backends.end(), [&](const Backend& b) { return b.downUntil <= now; });
+    }
+
+    // Reduces the rows of `matrix` (the job held by `state`, in its element type) across the backends and
+    // stores the results where the pool would have put them, then calls done() on some coordinator or pool thread
+    void submit(const std::shared_ptr<ClientState>& state, void* matrix, std::function<void()> done) {
+        auto job = std::make_shared<Job>();
+        job->state = state;
+        job->matrix = static_cast<char*>(matrix);
+        job->size = state->matrixSize;
+        job->elementType = state->elementType;
+        job->op = state->reduceOp;
+        job->threads = state->numThreads;
+        job->elementSize = element_bytes(state->elementType);
+        job->done = std::move(done);
+        uint32_t rows = job->size;
+        size_t rowBytes = (size_t)job->size * job->elementSize;
+        uint32_t minRows = (uint32_t)std::max<size_t>(1, MIN_SHARD_BYTES / rowBytes);
+        uint32_t count = std::max(1u, std::min<uint32_t>((uint32_t)links.size() * SHARDS_PER_CONNECTION, (rows + minRows - 1) / minRows));
+        uint32_t shardRows = (rows + count - 1) / count;
+        for (uint32_t first = 0; first < rows; first += shardRows) {
+            job->shards.emplace_back();
+            job->shards.back().firstRow = first;
+            job->shards.back().rowCount = std::min(rows - first, shardRows);
+        }
+        job->shardsLeft = (uint32_t)job->shards.size();
+        job->results.resize((size_t)rows * job->elementSize);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            activeJobs.push_back(job);
+            for (uint32_t i = 0; i < job->shards.size(); ++i) {
+                job->shards[i].queued = 1;
+                queue.push_back(Attempt{job, i});
+            }
+        }
+        workCv.notify_all();
+        hedgeCv.notify_one();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Shard {
+        uint32_t firstRow = 0, rowCount = 0;
+        bool done = false;
+        bool hedged = false;
+        uint32_t queued = 0, running = 0; // Attempts waiting for a connection, and being sent or waited for
+        uint64_t tried = 0;               // Backends it has been sent to
+        Clock::time_point sentAt;         // Of the latest attempt
+    };
+
+    struct Job {
+        std::shared_ptr<ClientState> state;
+        char* matrix = nullptr;
+        uint32_t size = 0, elementType = ELEMENT_F32, op = OP_MAX, threads = 1;
+        size_t elementSize = 0;
+        std::vector<Shard> shards;
+        std::vector<char> results;   // Row i's result at i * elementSize, copied out when the job is done
+        uint32_t shardsLeft = 0;
+        uint32_t readers = 0;        // Attempts still reading `matrix`: sending its rows or reducing them here
+        bool finished = false;
+        std::function<void()> done;
+    };
+
+    struct Attempt {
+        std::shared_ptr<Job> job;
+        uint32_t shard;
+    };
+
+    struct Backend {
+        std::string host, port, name;
+        Clock::time_point downUntil; // Guarded by mutex
+    };
+
+    struct Link {
+        size_t backend = 0;
+        SOCKET socket = INVALID_SOCKET; // Replaced and closed under mutex, so stop() can shut it down
+        const Shard* sending = nullptr; // Whose rows are going out, under mutex; cut off once it is answered elsewhere
+        uint32_t nextId = 0;
+        std::thread thread;
+    };
+
+    enum class Outcome { Result, Abandoned, Refused, Failed };
+
+    static bool send_all(SOCKET sock, const char* data, size_t bytes) {
+        while (bytes > 0) {
+            int sent = send(sock, data, (int)std::min(bytes, SHARD_SEND_PIECE), MSG_NOSIGNAL);
+            if (sent <= 0) return false;
+            data += sent;
+            bytes -= (size_t)sent;
+        }
+        return true;
+    }
+
+    static bool recv_all(SOCKET sock, char* data, size_t bytes) {
+        while (bytes > 0) {
+            int received = recv(sock, data, (int)std::min(bytes, SHARD_SEND_PIECE), 0);
+            if (received <= 0) return false;
+            data += received;
+            bytes -= (size_t)received;
+        }
+        return true;
+    }
+
+    static SOCKET connect_backend(const Backend& backend, std::string& error) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* found = nullptr;
+        int status = getaddrinfo(backend.host.c_str(), backend.port.c_str(), &hints, &found);
+        if (status != 0) { error = gai_strerror(status); return INVALID_SOCKET; }
+        SOCKET sock = INVALID_SOCKET;
+        for (addrinfo* address = found; address; address = address->ai_next) {
+            sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (sock == INVALID_SOCKET) { error = GetWSAErrorString(WSAGetLastError()); continue; }
+            if (connect(sock, address->ai_addr, (int)address->ai_addrlen) == 0) break;
+            error = GetWSAErrorString(WSAGetLastError());
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+        freeaddrinfo(found);
+        if (sock == INVALID_SOCKET) return sock;
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+#ifdef _WIN32
+        DWORD timeout = SHARD_IO_TIMEOUT_MS;
+#else
+        timeval timeout{SHARD_IO_TIMEOUT_MS / 1000, (SHARD_IO_TIMEOUT_MS % 1000) * 1000};
+#endif
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+        return sock;
+    }
+
+    void close_link(Link& link) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (link.socket != INVALID_SOCKET) closesocket(link.socket);
+        link.socket = INVALID_SOCKET;
+    }
+
+    // Sends one shard on `link` and reads the reply into `reply`. The attempt stops counting as a reader
+    // of the matrix as soon as its rows are out (or the send is given up), not when the reply is in.
+    Outcome run_attempt(Link& link, const Attempt& attempt, std::vector<char>& reply, std::string& error) {
+        Job& job = *attempt.job;
+        const Shard& shard = job.shards[attempt.shard];
+        bool reading = true, ok = true, abandoned = false;
+        auto stop_reading = [&] {
+            if (!reading) return;
+            reading = false;
+            std::shared_ptr<Job> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                link.sending = nullptr;
+                job.readers--;
+                if (shard.done) abandoned = true; // Answered elsewhere, and settle() may have shut the socket down
+                finished = take_finished(attempt.job);
+            }
+            if (finished) finish_job(*finished);
+        };
+        if (link.socket == INVALID_SOCKET) {
+            SOCKET sock = connect_backend(backends[link.backend], error);
+            if (sock == INVALID_SOCKET) { stop_reading(); return Outcome::Failed; }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) closesocket(sock);
+            else link.socket = sock;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            link.sending = &shard;
+        }
+        SOCKET sock = link.socket;
+        uint32_t id = link.nextId++;
+        uint32_t format = native_encoding(job.elementType) | (job.op << FORMAT_OP_SHIFT);
+        uint32_t header[6] = {htonl(CMD_SHARD_COMP), htonl(id), htonl(shard.rowCount), htonl(job.size), htonl(job.threads), htonl(format)};
+        const char* rows = job.matrix + (size_t)shard.firstRow * job.size * job.elementSize;
+        size_t remaining = (size_t)shard.rowCount * job.size * job.elementSize;
+        ok = sock != INVALID_SOCKET && send_all(sock, (const char*)header, sizeof(header));
+        while (ok && remaining > 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (shard.done) { abandoned = true; break; }
+            }
+            size_t piece = std::min(remaining, SHARD_SEND_PIECE);
+            ok = send_all(sock, rows, piece);
+            rows += piece;
+            remaining -= piece;
+        }
+        if (!ok) error = "send failed: " + GetWSAErrorString(WSAGetLastError());
+        stop_reading();
+        if (abandoned) { close_link(link); return Outcome::Abandoned; } // The frame is cut short
+        if (!ok) return Outcome::Failed;
+        uint32_t answer[3];
+        if (!recv_all(sock, (char*)answer, 2 * sizeof(uint32_t))) {
+            error = "no reply: " + GetWSAErrorString(WSAGetLastError());
+            return Outcome::Failed;
+        }
+        uint32_t code = ntohl(answer[0]);
+        if (ntohl(answer[1]) != id) { error = "reply for another shard"; return Outcome::Failed; }
+        if (code == RESP_JOB_BUSY) { error = "busy"; return Outcome::Refused; }
+        if (code == RESP_JOB_ERROR) { error = "shard rejected"; close_link(link); return Outcome::Refused; }
+        if (code != RESP_SHARD_RESULT || !recv_all(sock, (char*)&answer[2], sizeof(uint32_t)) || ntohl(answer[2]) != shard.rowCount) {
+            error = "unexpected reply " + std::to_string(code);
+            return Outcome::Failed;
+        }
+        reply.resize((size_t)shard.rowCount * job.elementSize);
+        if (!recv_all(sock, reply.data(), reply.size())) {
+            error = "reply cut short: " + GetWSAErrorString(WSAGetLastError());
+            return Outcome::Failed;
+        }
+        return Outcome::Result;
+    }
+
+    void link_loop(size_t index) {
+        Link& link = *links[index];
+        Backend& backend = backends[link.backend];
+        uint64_t bit = 1ull << link.backend;
+        std::vector<char> reply;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (backend.downUntil > Clock::now()) { workCv.wait_until(lock, backend.downUntil); continue; }
+            auto next = std::find_if(queue.begin(), queue.end(), [bit](const Attempt& a) { return !(a.job->shards[a.shard].tried & bit); });
+            if (next == queue.end()) { workCv.wait(lock); continue; }
+            Attempt attempt = std::move(*next);
+            queue.erase(next);
+            Shard& shard = attempt.job->shards[attempt.shard];
+            shard.queued--;
+            if (shard.done) continue; // A hedge or retry the shard no longer needs
+            shard.running++;
+            shard.tried |= bit;
+            shard.sentAt = Clock::now();
+            attempt.job->readers++;
+            lock.unlock();
+
+            g_metrics.add(Counter::ShardsSent);
+            auto started = Clock::now();
+            std::string error;
+            Outcome outcome = run_attempt(link, attempt, reply, error);
+            if (outcome == Outcome::Failed) close_link(link);
+            lock.lock();
+            if (outcome == Outcome::Failed && !stopping) {
+                auto now = Clock::now();
+                if (backend.downUntil <= now) { // Its other connections fail too, but once is enough to say so
+                    std::cerr << LOG_PREFIX << "Shard backend " << backend.name << " failed (" << error << "), leaving it out for "
+                              << SHARD_RETRY_MS << " ms." << std::endl;
+                }
+                backend.downUntil = now + std::chrono::milliseconds(SHARD_RETRY_MS);
+            }
+            if (outcome == Outcome::Result) {
+                double perByte = std::chrono::duration<double>(Clock::now() - started).count() /
+                                 ((double)shard.rowCount * attempt.job->size * attempt.job->elementSize);
+                secondsPerByte = secondsPerByte == 0 ? perByte : secondsPerByte + SHARD_EWMA_WEIGHT * (perByte - secondsPerByte);
+            }
+            std::shared_ptr<Job> finished = settle(attempt, outcome, reply.data());
+            if (finished) {
+                lock.unlock();
+                finish_job(*finished);
+                lock.lock();
+            }
+        }
+    }
+
+    // Records how an attempt ended, under the lock. Returns the job if that was the last thing it waited for.
+    std::shared_ptr<Job> settle(const Attempt& attempt, Outcome outcome, const char* results) {
+        Job& job = *attempt.job;
+        Shard& shard = job.shards[attempt.shard];
+        shard.running--;
+        if (outcome == Outcome::Result && !shard.done) {
+            shard.done = true;
+            job.shardsLeft--;
+            std::memcpy(&job.results[(size_t)shard.firstRow * job.elementSize], results, (size_t)shard.rowCount * job.elementSize);
+            for (auto& link : links) { // A slower copy still being sent would hold the job up
+                if (link->sending == &shard && link->socket != INVALID_SOCKET) shutdown(link->socket, SD_BOTH);
+            }
+        } else if ((outcome == Outcome::Refused || outcome == Outcome::Failed) && !shard.done) {
+            g_metrics.add(Counter::ShardFailures);
+            if (untried_backend(shard)) {
+                shard.queued++;
+                queue.push_front(attempt);
+                workCv.notify_all();
+            } else if (shard.queued + shard.running == 0) {
+                run_local(attempt);
+            }
+        }
+        return take_finished(attempt.job);
+    }
+
+    bool untried_backend(const Shard& shard) const {
+        auto now = Clock::now();
+        for (size_t b = 0; b < backends.size(); ++b) {
+            if (!(shard.tried & (1ull << b)) && backends[b].downUntil <= now) return true;
+        }
+        return false;
+    }
+
+    // The shard on the local pool, as the last resort; settled like a reply
+    void run_local(const Attempt& attempt) {
+        Job& job = *attempt.job;
+        Shard& shard = job.shards[attempt.shard];
+        shard.running++;
+        job.readers++;
+        g_metrics.add(Counter::ShardsLocal);
+        auto task = [this, attempt] {
+            Job& job = *attempt.job;
+            const Shard& shard = job.shards[attempt.shard];
+            std::vector<char> results((size_t)shard.rowCount * job.elementSize);
+            RowReduceKernel kernel = g_kernels->rows[job.elementType][job.op];
+            size_t rowBytes = (size_t)job.size * job.elementSize;
+            const char* rows = job.matrix + (size_t)shard.firstRow * rowBytes;
+            for (uint32_t i = 0; i < shard.rowCount; ++i) kernel(rows + i * rowBytes, job.size, &results[i * job.elementSize]);
+            std::shared_ptr<Job> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job.readers--;
+                finished = settle(attempt, Outcome::Result, results.data());
+            }
+            if (finished) finish_job(*finished);
+        };
+        try {
+            g_computePool->submit(task, job.state->numaNode);
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "[" << job.state->socket << "] EXCEPTION while scheduling a shard: " << e.what() << std::endl;
+            job.state->errorOccurred = true;
+            job.readers--;
+            shard.running--;
+            shard.done = true;
+            job.shardsLeft--;
+        }
+    }
+
+    // Under the lock: the job, taken off the active list, once every shard is answered and nothing reads the matrix
+    std::shared_ptr<Job> take_finished(const std::shared_ptr<Job>& job) {
+        if (job->finished || job->shardsLeft > 0 || job->readers > 0) return nullptr;
+        job->finished = true;
+        activeJobs.erase(std::remove(activeJobs.begin(), activeJobs.end(), job), activeJobs.end());
+        queue.erase(std::remove_if(queue.begin(), queue.end(), [&](const Attempt& a) { return a.job == job; }), queue.end());
+        return job;
+    }
+
+    // Results go where process_matrix_rows would have written them: the side vector, or the diagonal
+    static void finish_job(Job& job) {
+        ClientState& state = *job.state;
+        char* results = state.sideOutput ? static_cast<char*>(state.side_results()) : job.matrix;
+        size_t stride = (state.sideOutput ? 1 : (size_t)job.size + 1) * job.elementSize;
+        for (uint32_t i = 0; i < job.size; ++i) std::memcpy(results + i * stride, &job.results[i * job.elementSize], job.elementSize);
+        job.done();
+    }
+
+    // Shards answered neither by their first backend nor within a few times the usual time for their size
+    // are queued again for some other backend, ahead of everything else. At most one hedge per shard.
+    void hedge_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (activeJobs.empty()) { hedgeCv.wait(lock); continue; }
+            auto now = Clock::now();
+            auto wake = now + std::max<Clock::duration>(hedgeFloor, std::chrono::milliseconds(1));
+            bool queuedAny = false;
+            for (const std::shared_ptr<Job>& job : activeJobs) {
+                for (uint32_t i = 0; i < job->shards.size(); ++i) {
+                    Shard& shard = job->shards[i];
+                    if (shard.done || shard.hedged || shard.running != 1 || shard.queued != 0) continue;
+                    double bytes = (double)shard.rowCount * job->size * job->elementSize;
+                    auto expected = std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(SHARD_HEDGE_FACTOR * secondsPerByte * bytes));
+                    auto deadline = shard.sentAt + std::max<Clock::duration>(hedgeFloor, expected);
+                    if (deadline > now) { wake = std::min(wake, deadline); continue; }
+                    if (!untried_backend(shard)) continue;
+                    shard.hedged = true;
+                    shard.queued++;
+                    queue.push_front(Attempt{job, i});
+                    queuedAny = true;
+                    g_metrics.add(Counter::ShardHedges);
+                }
+            }
+            if (queuedAny) workCv.notify_all();
+            hedgeCv.wait_until(lock, wake);
+        }
+    }
+
+    std::vector<Backend> backends;
+    std::vector<std::unique_ptr<Link>> links;
+    uint32_t minSize = 0;
+    Clock::duration hedgeFloor{};
+
+    mutable std::mutex mutex;
+    std::condition_variable workCv, hedgeCv;
+    std::deque<Attempt> queue;              // Shards waiting for a connection; hedges and retries at the front
+    std::vector<std::shared_ptr<Job>> activeJobs;
+    double secondsPerByte = 0;             // Send to reply, averaged over recent shards (0: none answered yet)
+    bool stopping = false;
+    std::thread hedger;
+};
+
+ShardCoordinator g_shards;
+// ----------------------------
+
+// --- Matrix Processing Logic ---
+// `rows` points at row `startRow`, which need not be the start of the matrix (CHUNKED_COMP blocks), and
+// holds values of `elementType`. Row i's result replaces its diagonal element, or goes to sideResults[i]
+// if that is set.
+void process_matrix_rows(void* rows, uint32_t size, uint32_t startRow, uint32_t endRow, uint32_t op = OP_MAX,
+                         uint32_t elementType = ELEMENT_F32, void* sideResults = nullptr) {
+    RowReduceKernel kernel = g_kernels->rows[elementType][op];
+    size_t elementSize = element_bytes(elementType);
+    for (uint32_t i = startRow; i < endRow; ++i) {
+        char* row = static_cast<char*>(rows) + (size_t)(i - startRow) * size * elementSize;
+        kernel(row, size, (sideResults ? static_cast<char*>(sideResults) : row) + i * elementSize);
+    }
+}
+
+// Columns [firstColumn, endColumn) of the whole matrix, with the same choice of destination
+void process_matrix_columns(void* matrix, uint32_t size, uint32_t firstColumn, uint32_t endColumn, uint32_t op = OP_MAX,
+                            uint32_t elementType = ELEMENT_F32, void* sideResults = nullptr) {
+    ColumnReduceKernel kernel = g_kernels->columns[elementType][op];
+    if (sideResults) kernel(matrix, size, firstColumn, endColumn, sideResults, 1);
+    else kernel(matrix, size, firstColumn, endColumn, matrix, (size_t)size + 1);
+}
+
+// Called by the last task of a job to publish the outcome and release waiters
+void finish_row_task(ClientState* state) {
+    if (state->pendingTasks.fetch_sub(1) != 1) return; // Other tasks of this job are still running
+    g_jobsInFlight.fetch_sub(1);
+    g_metrics.record(Timer::Job, std::chrono::steady_clock::now() - state->jobStarted);
+    g_metrics.add(state->errorOccurred ? Counter::JobsFailed : Counter::JobsCompleted);
+    if (state->cacheStore && !state->errorOccurred) {
+        g_resultCache.store(state->cacheKey, state->results(), state->results_stride(), element_bytes(state->elementType));
+    }
+    state->cacheStore = false;
+    bool releaseSlot = state->admitted; // Read before processingStarted drops: the next job may set it again
+    state->admitted = false;
+    state->processingDone = !state->errorOccurred; // Mark as done *only* on success
+    {
+        std::lock_guard<std::mutex> lock(state->completionMutex);
+        state->processingStarted = false; // Computation attempt is over (success or fail)
+        state->completionCv.notify_all();
+    }
+    if (state->onProgress) state->onProgress(); // Safe: the caller holds a reference to the state
+    if (releaseSlot) g_scheduler.finished();   // May start a waiting job on this thread
+}
+
+// `source`, if set, holds the input rows in state->sourceEncoding; they are widened into `rows` first
+// (FILE_COMP with an output file, CONFIG_EX with a half-precision encoding)
+void run_row_task(ClientState* state, void* rows, const void* source, uint32_t startRow, uint32_t endRow,
+                  std::chrono::steady_clock::time_point queuedAt) {
+    auto started = std::chrono::steady_clock::now();
+    g_metrics.record(Timer::QueueWait, started - queuedAt);
+    try {
+        if (source) decode_values(static_cast<float*>(rows), source, (size_t)(endRow - startRow) * state->matrixSize, state->sourceEncoding);
+        process_matrix_rows(rows, state->matrixSize, startRow, endRow, state->reduceOp, state->elementType, state->side_results());
+        if (state->rowsReady) {
+            for (uint32_t i = startRow; i < endRow; ++i) state->rowsReady[i].store(1, std::memory_order_release);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] EXCEPTION during computation: " << e.what() << std::endl;
+        state->errorOccurred = true;
+    } catch (...) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] UNKNOWN EXCEPTION during computation." << std::endl;
+        state->errorOccurred = true;
+    }
+    g_metrics.record(Timer::Compute, std::chrono::steady_clock::now() - started);
+    g_metrics.add(Counter::TasksRun);
+    if (state->rowsReady && state->onProgress) state->onProgress(); // Lets the I/O thread send these rows now
+    finish_row_task(state);
+}
+
+// A slice of columns of a FORMAT_COLUMNS job; every task reads all rows of the matrix
+void run_column_task(ClientState* state, void* matrix, uint32_t firstColumn, uint32_t endColumn,
+                     std::chrono::steady_clock::time_point queuedAt) {
+    auto started = std::chrono::steady_clock::now();
+    g_metrics.record(Timer::QueueWait, started - queuedAt);
+    try {
+        process_matrix_columns(matrix, state->matrixSize, firstColumn, endColumn, state->reduceOp, state->elementType,
+                               state->side_results());
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] EXCEPTION during computation: " << e.what() << std::endl;
+        state->errorOccurred = true;
+    } catch (...) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] UNKNOWN EXCEPTION during computation." << std::endl;
+        state->errorOccurred = true;
+    }
+    g_metrics.record(Timer::Compute, std::chrono::steady_clock::now() - started);
+    g_metrics.add(Counter::TasksRun);
+    finish_row_task(state);
+}
+
+const size_t MIN_CHUNK_ELEMENTS = 16 * 1024; // Below ~64 KB of floats per chunk, scheduling overhead dominates
+const uint32_t CHUNKS_PER_WORKER = 4;        // Spare chunks per worker so idle workers have something to steal
+
+// How much a job costs, from calibrate_cost_model() at startup. Until then (and in bench/, which never
+// calibrates) jobs are split by MIN_CHUNK_ELEMENTS and the client's numThreads as before.
+struct CostModel {
+    bool automatic = false;        // --auto-parallelism: pick parallelism from this model, not from numThreads
+    bool calibrated = false;
+    double nsPerByte = 0.1;        // One worker scanning a matrix that is not in cache
+    double dispatchNs = 20000;     // Pool round trip of an empty task: queue, wake a worker, report back
+    uint32_t bandwidthWorkers = 0; // Workers past which a large scan gets no faster; 0 is no limit
+};
+
+CostModel g_costModel;
+thread_local bool t_inlineJob = false; // This thread is running a job inline, see job_runs_inline()
+
+const uint32_t DISPATCHES_PER_TASK = 4;           // A task should cost at least this many pool round trips
+const double INLINE_MAX_NS = 50000;               // Longest job an I/O thread runs itself instead of serving sockets
+const size_t BANDWIDTH_BOUND_BYTES = 16u << 20;   // Jobs this large miss the cache and share memory bandwidth
+
+double job_ns(uint64_t elements, size_t elementSize) { return (double)elements * elementSize * g_costModel.nsPerByte; }
+
+// Smallest task worth queueing; the fixed MIN_CHUNK_ELEMENTS unless --auto-parallelism is on
+size_t min_chunk_elements(size_t elementSize) {
+    if (!g_costModel.automatic || !g_costModel.calibrated) return MIN_CHUNK_ELEMENTS;
+    double bytes = DISPATCHES_PER_TASK * g_costModel.dispatchNs / std::max(1e-6, g_costModel.nsPerByte);
+    return std::max<size_t>(1024, (size_t)(bytes / elementSize));
+}
+
+// Workers a job of `elements` values is spread over. With --auto-parallelism every worker gets at least a
+// minimum task and a large job stops where memory bandwidth does; otherwise the client's numThreads caps it.
+uint32_t job_parallelism(uint64_t elements, size_t elementSize, uint32_t numThreads) {
+    uint32_t poolSize = (uint32_t)g_computePool->size();
+    if (!g_costModel.automatic || !g_costModel.calibrated) return std::min(std::max(1u, numThreads), poolSize);
+    double workers = job_ns(elements, elementSize) / (DISPATCHES_PER_TASK * g_costModel.dispatchNs);
+    uint32_t parallelism = (uint32_t)std::max(1.0, std::min<double>(poolSize, workers));
+    if (g_costModel.bandwidthWorkers && elements * elementSize >= BANDWIDTH_BOUND_BYTES) {
+        parallelism = std::min(parallelism, g_costModel.bandwidthWorkers);
+    }
+    return parallelism;
+}
+
+// A job costing less than one pool round trip is run by the thread starting it. Never nested: finishing a
+// job may start a waiting one on the same thread, and a queue of small jobs would otherwise recurse.
+bool job_runs_inline(uint64_t elements, size_t elementSize) {
+    if (!g_costModel.automatic || !g_costModel.calibrated || t_inlineJob) return false;
+    return job_ns(elements, elementSize) < std::min(g_costModel.dispatchNs, INLINE_MAX_NS);
+}
+
+// Counts the job and runs `task` (one of the run_*_task functions, given its queue time) as its only task
+template <typename Task>
+void run_job_inline(ClientState* state, Task task) {
+    g_jobsInFlight.fetch_add(1);
+    state->pendingTasks = 1;
+    state->jobStarted = std::chrono::steady_clock::now();
+    g_metrics.add(Counter::JobsInline);
+    t_inlineJob = true;
+    task(state->jobStarted);
+    t_inlineJob = false;
+}
+
+// Rows per chunk of a job of `rows` rows of `size` values: a few chunks per usable worker when the server
+// is quiet, fewer and larger ones when other jobs are already queued and the pool is kept busy by them anyway.
+uint32_t choose_chunk_rows(uint32_t rows, uint32_t size, uint32_t parallelism, uint32_t jobsInFlight,
+                           size_t elementSize = sizeof(float)) {
+    uint32_t targetChunks = std::max(1u, parallelism * CHUNKS_PER_WORKER / std::max(1u, jobsInFlight));
+    uint32_t chunkRows = (rows + targetChunks - 1) / targetChunks;
+    uint32_t minRows = (uint32_t)std::max<size_t>(1, min_chunk_elements(elementSize) / size);
+    return std::min(rows, std::max(chunkRows, minRows));
+}
+
+// Registers a job and returns chunkRows. Tasks never span a block of `blockRows` rows (0: the whole
+// matrix is one block), so each block is split into ceil(rows / chunkRows) tasks of its own.
+// The client's numThreads is only a hint capping parallelism (unless the cost model picks it); it never
+// creates threads.
+uint32_t plan_job(ClientState* state, uint32_t blockRows = 0) {
+    uint32_t rows = state->job_rows();
+    if (blockRows == 0 || blockRows > rows) blockRows = rows;
+    size_t elementSize = element_bytes(state->elementType);
+    uint32_t parallelism = job_parallelism((uint64_t)rows * state->matrixSize, elementSize, state->numThreads);
+    uint32_t chunkRows = std::min(blockRows, choose_chunk_rows(rows, state->matrixSize, parallelism,
+                                                               g_jobsInFlight.fetch_add(1) + 1, elementSize));
+    uint32_t lastRows = rows % blockRows;
+    state->pendingTasks = (rows / blockRows) * ((blockRows + chunkRows - 1) / chunkRows) + (lastRows + chunkRows - 1) / chunkRows;
+    state->jobStarted = std::chrono::steady_clock::now();
+    return chunkRows;
+}
+
+// Every task keeps the state alive, so a client may disconnect while its job is running
+void submit_row_chunk(const std::shared_ptr<ClientState>& statePtr, void* rows, uint32_t startRow, uint32_t endRow,
+                      const void* source = nullptr) {
+    try {
+        auto queuedAt = std::chrono::steady_clock::now();
+        g_computePool->submit([statePtr, rows, source, startRow, endRow, queuedAt] {
+            run_row_task(statePtr.get(), rows, source, startRow, endRow, queuedAt);
+        }, statePtr->numaNode);
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << statePtr->socket << "] EXCEPTION while scheduling computation: " << e.what() << std::endl;
+        statePtr->errorOccurred = true;
+        finish_row_task(statePtr.get()); // Account for the task that never made it into the pool
+    }
+}
+
+const uint32_t COLUMN_CHUNK_ALIGN = 16; // Column slices start on a whole vector of the widest kernel
+
+void submit_column_chunk(const std::shared_ptr<ClientState>& statePtr, void* matrix, uint32_t firstColumn, uint32_t endColumn) {
+    try {
+        auto queuedAt = std::chrono::steady_clock::now();
+        g_computePool->submit([statePtr, matrix, firstColumn, endColumn, queuedAt] {
+            run_column_task(statePtr.get(), matrix, firstColumn, endColumn, queuedAt);
+        }, statePtr->numaNode);
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << statePtr->socket << "] EXCEPTION while scheduling computation: " << e.what() << std::endl;
+        statePtr->errorOccurred = true;
+        finish_row_task(statePtr.get());
+    }
+}
+
+// Splits the job on `matrix` (optionally widened from `source` first) into row chunks on the shared pool
+// and returns immediately. A column job is split into column slices of the same area instead; its input
+// is never widened.
+void split_computation(const std::shared_ptr<ClientState>& statePtr, float* matrix, const void* source) {
+    uint32_t size = statePtr->matrixSize;
+    ClientState* state = statePtr.get();
+    if (job_runs_inline((uint64_t)state->job_rows() * size, element_bytes(state->elementType))) {
+        run_job_inline(state, [state, matrix, source, size](std::chrono::steady_clock::time_point queuedAt) {
+            if (state->reduceColumns) run_column_task(state, matrix, 0, size, queuedAt);
+            else run_row_task(state, matrix, source, 0, state->job_rows(), queuedAt);
+        });
+        return;
+    }
+    uint32_t chunkRows = plan_job(state);
+    if (statePtr->reduceColumns) {
+        uint32_t chunkColumns = std::min(size, (chunkRows + COLUMN_CHUNK_ALIGN - 1) / COLUMN_CHUNK_ALIGN * COLUMN_CHUNK_ALIGN);
+        statePtr->pendingTasks = (size + chunkColumns - 1) / chunkColumns;
+        for (uint32_t first = 0; first < size; first += chunkColumns) {
+            submit_column_chunk(statePtr, matrix, first, std::min(size, first + chunkColumns));
+        }
+        return;
+    }
+    uint32_t jobRows = statePtr->job_rows();
+    size_t sourceElement = encoding_bytes(statePtr->sourceEncoding);
+    size_t element = element_bytes(statePtr->elementType);
+    for (uint32_t startRow = 0; startRow < jobRows; startRow += chunkRows) {
+        size_t offset = (size_t)startRow * size;
+        const void* sourceRows = source ? static_cast<const char*>(source) + offset * sourceElement : nullptr;
+        void* rows = reinterpret_cast<char*>(matrix) + offset * element;
+        submit_row_chunk(statePtr, rows, startRow, std::min(jobRows, startRow + chunkRows), sourceRows);
+    }
+}
+
+// Starts the job on `matrix` and returns immediately: across the --shards backends when g_shards takes it,
+// on the GPU when g_gpu takes jobs of its size, type and reduction (and nothing needs widening first),
+// otherwise, or if the device fails, on the pool. A shard received from a coordinator always runs here.
+void perform_computation(const std::shared_ptr<ClientState>& statePtr, float* matrix, const void* source = nullptr) {
+    if (!source && g_shards.accepts(*statePtr)) {
+        g_jobsInFlight.fetch_add(1);
+        statePtr->pendingTasks = 1;
+        statePtr->jobStarted = std::chrono::steady_clock::now();
+        g_shards.submit(statePtr, matrix, [statePtr] { finish_row_task(statePtr.get()); });
+        return;
+    }
+    if (source || statePtr->jobRows != 0 || !g_gpu.accepts(statePtr->matrixSize, statePtr->elementType, statePtr->reduceOp)) {
+        split_computation(statePtr, matrix, source);
+        return;
+    }
+    g_jobsInFlight.fetch_add(1);
+    statePtr->pendingTasks = 1;
+    statePtr->jobStarted = std::chrono::steady_clock::now();
+    g_gpu.submit(statePtr, matrix, [statePtr, matrix](bool computed) {
+        if (computed) { finish_row_task(statePtr.get()); return; }
+        g_jobsInFlight.fetch_sub(1); // plan_job counts the job again
+        split_computation(statePtr, matrix, nullptr);
+    });
+}
+
+// CMD_BATCH: many matrices back to back in one buffer. Small ones are packed whole into tasks of at least
+// min_chunk_elements(), so a batch of thousands of 8x8 matrices is a few pool tasks rather than one per
+// matrix; a large one is split into row chunks like a job of its own.
+struct BatchSegment {
+    float* rows;        // Row startRow of the segment's matrix
+    uint32_t size;
+    uint32_t startRow, endRow;
+};
+
+void run_batch_task(ClientState* state, const std::vector<BatchSegment>& segments, std::chrono::steady_clock::time_point queuedAt) {
+    auto started = std::chrono::steady_clock::now();
+    g_metrics.record(Timer::QueueWait, started - queuedAt);
+    try {
+        for (const BatchSegment& segment : segments) process_matrix_rows(segment.rows, segment.size, segment.startRow, segment.endRow);
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] EXCEPTION during batch computation: " << e.what() << std::endl;
+        state->errorOccurred = true;
+    } catch (...) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] UNKNOWN EXCEPTION during batch computation." << std::endl;
+        state->errorOccurred = true;
+    }
+    g_metrics.record(Timer::Compute, std::chrono::steady_clock::now() - started);
+    g_metrics.add(Counter::TasksRun);
+    finish_row_task(state);
+}
+
+// `data` holds the matrices of `sizes` (at least one) in order; counts as one job. Returns once the tasks are queued.
+void perform_batch(const std::shared_ptr<ClientState>& statePtr, float* data, const std::vector<uint32_t>& sizes) {
+    size_t totalElements = 0;
+    for (uint32_t size : sizes) totalElements += (size_t)size * size;
+    if (job_runs_inline(totalElements, sizeof(float))) {
+        std::vector<BatchSegment> segments;
+        for (uint32_t size : sizes) {
+            segments.push_back(BatchSegment{data, size, 0, size});
+            data += (size_t)size * size;
+        }
+        ClientState* state = statePtr.get();
+        run_job_inline(state, [state, &segments](std::chrono::steady_clock::time_point queuedAt) {
+            run_batch_task(state, segments, queuedAt);
+        });
+        return;
+    }
+    uint32_t parallelism = job_parallelism(totalElements, sizeof(float), statePtr->numThreads);
+    uint32_t jobsInFlight = g_jobsInFlight.fetch_add(1) + 1;
+    size_t targetChunks = std::max(1u, parallelism * CHUNKS_PER_WORKER / jobsInFlight);
+    size_t targetElements = std::max(min_chunk_elements(sizeof(float)), (totalElements + targetChunks - 1) / targetChunks);
+
+    std::vector<std::vector<BatchSegment>> tasks(1);
+    size_t packedElements = 0; // In tasks.back()
+    for (uint32_t size : sizes) {
+        size_t elements = (size_t)size * size;
+        if (elements <= targetElements) {
+            if (packedElements + elements > targetElements && !tasks.back().empty()) { tasks.emplace_back(); packedElements = 0; }
+            tasks.back().push_back(BatchSegment{data, size, 0, size});
+            packedElements += elements;
+        } else {
+            uint32_t chunkRows = (uint32_t)std::max<size_t>(1, targetElements / size);
+            for (uint32_t startRow = 0; startRow < size; startRow += chunkRows) {
+                tasks.push_back({BatchSegment{data + (size_t)startRow * size, size, startRow, std::min(size, startRow + chunkRows)}});
+            }
+            tasks.emplace_back(); // Small matrices after this one start a new task
+            packedElements = 0;
+        }
+        data += elements;
+    }
+    tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [](const std::vector<BatchSegment>& t) { return t.empty(); }), tasks.end());
+    statePtr->pendingTasks = (uint32_t)tasks.size();
+    statePtr->jobStarted = std::chrono::steady_clock::now();
+    for (std::vector<BatchSegment>& segments : tasks) {
+        try {
+            auto queuedAt = std::chrono::steady_clock::now();
+            g_computePool->submit([statePtr, segments = std::move(segments), queuedAt] {
+                run_batch_task(statePtr.get(), segments, queuedAt);
+            }, statePtr->numaNode);
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "[" << statePtr->socket << "] EXCEPTION while scheduling batch: " << e.what() << std::endl;
+            statePtr->errorOccurred = true;
+            finish_row_task(statePtr.get());
+        }
+    }
+}
+
+// CMD_UPDATE_ROWS: reduces only `rows` (distinct, any order) of the state's matrix. Rows are packed into
+// tasks of at least min_chunk_elements() like a batch, so a handful of changed rows is a single task.
+void run_update_task(ClientState* state, const std::vector<uint32_t>& rows, std::chrono::steady_clock::time_point queuedAt) {
+    auto started = std::chrono::steady_clock::now();
+    g_metrics.record(Timer::QueueWait, started - queuedAt);
+    try {
+        size_t rowBytes = (size_t)state->matrixSize * element_bytes(state->elementType);
+        for (uint32_t row : rows) {
+            void* data = reinterpret_cast<char*>(state->matrixData.data()) + row * rowBytes;
+            process_matrix_rows(data, state->matrixSize, row, row + 1, state->reduceOp, state->elementType, state->side_results());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] EXCEPTION during row update: " << e.what() << std::endl;
+        state->errorOccurred = true;
+    } catch (...) {
+        std::cerr << LOG_PREFIX << "[" << state->socket << "] UNKNOWN EXCEPTION during row update." << std::endl;
+        state->errorOccurred = true;
+    }
+    g_metrics.record(Timer::Compute, std::chrono::steady_clock::now() - started);
+    g_metrics.add(Counter::TasksRun);
+    finish_row_task(state);
+}
+
+// Counts as one job; returns once the tasks are queued
+void perform_row_update(const std::shared_ptr<ClientState>& statePtr, std::vector<uint32_t> rows) {
+    std::sort(rows.begin(), rows.end()); // Each task then walks the matrix forwards
+    uint64_t elements = (uint64_t)rows.size() * statePtr->matrixSize;
+    size_t elementSize = element_bytes(statePtr->elementType);
+    if (job_runs_inline(elements, elementSize)) {
+        ClientState* state = statePtr.get();
+        run_job_inline(state, [state, &rows](std::chrono::steady_clock::time_point queuedAt) {
+            run_update_task(state, rows, queuedAt);
+        });
+        return;
+    }
+    uint32_t parallelism = job_parallelism(elements, elementSize, statePtr->numThreads);
+    uint32_t chunkRows = choose_chunk_rows((uint32_t)rows.size(), statePtr->matrixSize, parallelism,
+                                           g_jobsInFlight.fetch_add(1) + 1, elementSize);
+    statePtr->pendingTasks = (uint32_t)((rows.size() + chunkRows - 1) / chunkRows);
+    statePtr->jobStarted = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < rows.size(); first += chunkRows) {
+        std::vector<uint32_t> taskRows(rows.begin() + first, rows.begin() + std::min(rows.size(), first + chunkRows));
+        try {
+            auto queuedAt = std::chrono::steady_clock::now();
+            g_computePool->submit([statePtr, taskRows = std::move(taskRows), queuedAt] {
+                run_update_task(statePtr.get(), taskRows, queuedAt);
+            }, statePtr->numaNode);
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "[" << statePtr->socket << "] EXCEPTION while scheduling row update: " << e.what() << std::endl;
+            statePtr->errorOccurred = true;
+            finish_row_task(statePtr.get());
+        }
+    }
+}
+// Fills g_costModel from a short self-benchmark (~0.1 s) on the started pool: one worker scanning a matrix
+// too large for the cache, empty pool round trips, and the same scan split over 2, 4, ... workers.
+void calibrate_cost_model(bool automatic) {
+    typedef std::chrono::steady_clock Clock;
+    const uint32_t SIZE = 4096; // 64 MB of floats
+    std::vector<float> matrix((size_t)SIZE * SIZE);
+    for (size_t i = 0; i < matrix.size(); ++i) matrix[i] = (float)(i % 1021);
+    std::vector<float> results(SIZE);
+    RowReduceKernel kernel = g_kernels->rows[ELEMENT_F32][OP_MAX];
+
+    // Seconds for `tasks` pool tasks, task i scanning rows [i * SIZE / tasks, (i + 1) * SIZE / tasks) if `scan`
+    auto run = [&](uint32_t tasks, bool scan) {
+        std::mutex mutex;
+        std::condition_variable done;
+        uint32_t left = tasks;
+        auto started = Clock::now();
+        for (uint32_t t = 0; t < tasks; ++t) {
+            g_computePool->submit([&, t] {
+                if (scan) {
+                    for (uint32_t r = t * SIZE / tasks; r < (t + 1) * SIZE / tasks; ++r) kernel(&matrix[(size_t)r * SIZE], SIZE, &results[r]);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--left == 0) done.notify_one();
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return left == 0; });
+        return std::chrono::duration<double>(Clock::now() - started).count();
+    };
+
+    std::vector<double> roundTrips;
+    for (int i = 0; i < 31; ++i) roundTrips.push_back(run(1, false));
+    std::nth_element(roundTrips.begin(), roundTrips.begin() + 15, roundTrips.end());
+    g_costModel.dispatchNs = std::max(1000.0, roundTrips[15] * 1e9); // The median: a sleeping worker's wakeup counts
+
+    double single = std::min(run(1, true), run(1, true));
+    g_costModel.nsPerByte = single * 1e9 / ((double)matrix.size() * sizeof(float));
+
+    // The fewest workers within 10% of the fastest split
+    std::vector<std::pair<uint32_t, double>> splits{{1, single}};
+    uint32_t poolSize = (uint32_t)g_computePool->size();
+    for (uint32_t workers = 2; workers < 2 * poolSize; workers *= 2) {
+        uint32_t w = std::min(workers, poolSize);
+        splits.push_back({w, std::min(run(w, true), run(w, true))});
+        if (w == poolSize) break;
+    }
+    double fastest = single;
+    for (const auto& split : splits) fastest = std::min(fastest, split.second);
+    for (const auto& split : splits) {
+        if (split.second <= fastest * 1.1) { g_costModel.bandwidthWorkers = split.first; break; }
+    }
+    g_costModel.automatic = automatic;
+    g_costModel.calibrated = true;
+
+    std::cout << LOG_PREFIX << "Cost model: " << (uint64_t)(1000 / g_costModel.nsPerByte) << " MB/s per worker, "
+              << (uint64_t)(g_costModel.dispatchNs / 1000) << " us per pool task, scans stop scaling at "
+              << g_costModel.bandwidthWorkers << " worker(s); parallelism "
+              << (automatic ? "automatic" : "from numThreads") << "." << std::endl;
+}
+
+// ----------------------------
+
+// --- File Mappings ---
+// CMD_FILE_COMP works directly on mapped files: no socket copy and no heap buffer for the matrix.
+class FileMapping {
+public:
+    FileMapping() = default;
+    ~FileMapping() { close(); }
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+
+    // Maps `bytes` at `offset`. `create` makes (or truncates) the file to offset + bytes and implies writable;
+    // it fails, leaving the file alone, if the path names the file `distinctFrom` maps (under any spelling).
+    bool open(const std::string& path, uint64_t offset, uint64_t bytes, bool writable, bool create, std::string& error,
+              const FileMapping* distinctFrom = nullptr) {
+        if ((uint64_t)(size_t)bytes != bytes) { error = "mapping too large for this platform"; return false; }
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        uint64_t aligned = offset - offset % info.dwAllocationGranularity; // View offsets must be granularity-aligned
+        file = CreateFileA(path.c_str(), writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, NULL,
+                           create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) { error = "cannot open " + path + ": " + GetWSAErrorString(GetLastError()); return false; }
+        BY_HANDLE_FILE_INFORMATION fileInfo;
+        if (!GetFileInformationByHandle(file, &fileInfo)) { error = "cannot stat " + path + ": " + GetWSAErrorString(GetLastError()); return false; }
+        fileDevice = fileInfo.dwVolumeSerialNumber;
+        fileIndex = ((uint64_t)fileInfo.nFileIndexHigh << 32) | fileInfo.nFileIndexLow;
+        if (distinctFrom && distinctFrom->same_file(*this)) { error = path + " is the input file"; return false; }
+        if (create && !SetEndOfFile(file)) { error = "cannot truncate " + path + ": " + GetWSAErrorString(GetLastError()); return false; }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        if (!create && (uint64_t)fileSize.QuadPart < offset + bytes) { error = path + " is smaller than the matrix"; return false; }
+        uint64_t mapEnd = offset + bytes;
+        mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD)(mapEnd >> 32), (DWORD)mapEnd, NULL);
+        if (!mapping) { error = "CreateFileMapping failed: " + GetWSAErrorString(GetLastError()); return false; }
+        mapLength = (size_t)(mapEnd - aligned);
+        view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(aligned >> 32), (DWORD)aligned, mapLength);
+        if (!view) { error = "MapViewOfFile failed: " + GetWSAErrorString(GetLastError()); return false; }
+#else
+        uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t aligned = offset - offset % pageSize; // mmap offsets must be page-aligned
+        int flags = writable ? O_RDWR : O_RDONLY;
+        if (create) flags |= O_CREAT; // Truncated only once it is known not to be distinctFrom's file
+        fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) { error = "cannot open " + path + ": " + GetWSAErrorString(errno); return false; }
+        struct stat st;
+        if (fstat(fd, &st) != 0) { error = "cannot stat " + path + ": " + GetWSAErrorString(errno); return false; }
+        fileDevice = (uint64_t)st.st_dev;
+        fileIndex = (uint64_t)st.st_ino;
+        if (distinctFrom && distinctFrom->same_file(*this)) { error = path + " is the input file"; return false; }
+        if (create) {
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)(offset + bytes)) != 0) {
+                error = "cannot size " + path + ": " + GetWSAErrorString(errno);
+                return false;
+            }
+        } else if ((uint64_t)st.st_size < offset + bytes) {
+            error = path + " is smaller than the matrix";
+            return false;
+        }
+        mapLength = (size_t)(offset + bytes - aligned);
+        view = mmap(nullptr, mapLength, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, (off_t)aligned);
+        if (view == MAP_FAILED) { view = nullptr; error = "mmap failed: " + GetWSAErrorString(errno); return false; }
+#endif
+        data = reinterpret_cast<float*>(static_cast<char*>(view) + (offset - aligned));
+        return true;
+    }
+
+    // Changes reach the page cache (and so every reader on this host) as soon as a task writes them;
+    // unmapping leaves the write-back to the OS
+    void close() {
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (view) munmap(view, mapLength);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        view = nullptr;
+        data = nullptr;
+    }
+
+    bool same_file(const FileMapping& other) const {
+        return data && fileDevice == other.fileDevice && fileIndex == other.fileIndex;
+    }
+
+    float* data = nullptr;
+
+private:
+    void* view = nullptr;
+    size_t mapLength = 0;
+    uint64_t fileDevice = 0; // With fileIndex, identifies the file whatever path it was opened by
+    uint64_t fileIndex = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+// Joins a client-supplied relative path onto `root`; rejects absolute paths and any ".." component
+bool resolve_under_root(const std::string& root, const std::string& relative, std::string& resolved) {
+    if (root.empty() || relative.empty() || relative[0] == '/' || relative[0] == '\\' ||
+        relative.find(':') != std::string::npos || relative.find('\0') != std::string::npos) return false;
+    size_t start = 0;
+    while (start <= relative.size()) {
+        size_t end = relative.find_first_of("/\\", start);
+        if (end == std::string::npos) end = relative.size();
+        if (relative.compare(start, end - start, "..") == 0 && end - start == 2) return false;
+        start = end + 1;
+    }
+    resolved = root + "/" + relative;
+    return true;
+}
+// ----------------------------
+
+// --- Sessions ---
+// A client that opened a session has its connection's matrix mirrored into a file under --session-dir:
+// written through a shared mapping whenever the connection is idle after a new matrix or a finished job, so
+// the copy lives in the page cache and survives a restart of the process (not necessarily a power loss).
+// A restarted server finds the files again and maps one back in when its client resumes, instead of
+// waiting for every client to upload its matrix at once. Tokens are random; file names are derived from
+// them, so clients never name paths.
+const uint64_t SESSION_MAGIC = 0x313053533442414CULL; // "LAB4SS01", written last, once the image is complete
+const size_t SESSION_HEADER_BYTES = 64;               // Keeps the matrix that follows 64-byte aligned
+const uint64_t SESSION_INLINE_BYTES = 1 << 20;        // Larger images are copied into the file by a pool task
+
+struct SessionHeader {
+    uint64_t magic;
+    uint32_t matrixSize;
+    uint32_t wireFormat;
+    uint32_t flags;          // SESSION_HAS_* of the image
+    uint32_t keySize;        // Result cache key of the matrix, if keyHash is set
+    uint32_t keyFormat;
+    uint32_t keyValid;
+    uint64_t keyHash;
+    uint64_t matrixBytes;    // Follows the header; 0 when no matrix is held
+    uint64_t sideBytes;      // Side vector of results after the matrix, if the result is held and went there
+    uint64_t reserved;
+};
+static_assert(sizeof(SessionHeader) == SESSION_HEADER_BYTES, "session header layout");
+
+class SessionStore {
+public:
+    // Indexes the session files an earlier run left in `dir`; their contents are only read on resume
+    bool configure(const std::string& dir, size_t maxSessionCount) {
+        std::lock_guard<std::mutex> lock(mutex);
+        directory = dir;
+        maxSessions = maxSessionCount;
+        std::vector<std::string> names;
+#ifdef _WIN32
+        WIN32_FIND_DATAA found;
+        HANDLE search = FindFirstFileA((dir + "/*.session").c_str(), &found);
+        if (search == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PATH_NOT_FOUND) {
+            std::cerr << LOG_PREFIX << "Cannot open --session-dir " << dir << std::endl;
+            return false;
+        }
+        if (search != INVALID_HANDLE_VALUE) {
+            do names.push_back(found.cFileName); while (FindNextFileA(search, &found));
+            FindClose(search);
+        }
+#else
+        DIR* listing = opendir(dir.c_str());
+        if (!listing) {
+            std::cerr << LOG_PREFIX << "Cannot open --session-dir " << dir << ": " << GetWSAErrorString(errno) << std::endl;
+            return false;
+        }
+        while (dirent* entry = readdir(listing)) names.push_back(entry->d_name);
+        closedir(listing);
+#endif
+        for (const std::string& name : names) {
+            uint64_t token;
+            if (parse_file_name(name, token)) sessions[token] = Entry{false, clock++};
+        }
+        std::cout << LOG_PREFIX << "Sessions: " << sessions.size() << " found in " << dir << std::endl;
+        return true;
+    }
+
+    bool enabled() const { return !directory.empty(); } // Fixed before the listener opens
+
+    // A new session, attached to the caller. Beyond --max-sessions the least recently used detached one is deleted.
+    uint64_t create() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t token;
+        std::random_device random; // Not a seeded generator: a token is all it takes to resume a session
+        do token = ((uint64_t)random() << 32) | random(); while (token == 0 || sessions.count(token));
+        sessions[token] = Entry{true, clock++};
+        while (sessions.size() > maxSessions) {
+            auto oldest = sessions.end();
+            for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+                if (!it->second.attached && (oldest == sessions.end() || it->second.lastUsed < oldest->second.lastUsed)) oldest = it;
+            }
+            if (oldest == sessions.end()) break; // Every one is in use
+            std::remove(path_for(oldest->first).c_str());
+            sessions.erase(oldest);
+        }
+        return token;
+    }
+
+    // False if the token is unknown or another connection holds it
+    bool attach(uint64_t token) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = sessions.find(token);
+        if (found == sessions.end() || found->second.attached) return false;
+        found->second = Entry{true, clock++};
+        return true;
+    }
+
+    void detach(uint64_t token) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = sessions.find(token);
+        if (found != sessions.end()) found->second = Entry{false, clock++};
+    }
+
+    // The caller has closed its mapping of the file
+    void remove(uint64_t token) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.erase(token);
+        std::remove(path_for(token).c_str());
+    }
+
+    std::string path_for(uint64_t token) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.session", (unsigned long long)token);
+        return directory + "/" + name;
+    }
+
+private:
+    struct Entry {
+        bool attached;
+        uint64_t lastUsed; // Of `clock`
+    };
+
+    static bool parse_file_name(const std::string& name, uint64_t& token) {
+        if (name.size() != 16 + 8 || name.compare(16, 8, ".session") != 0) return false;
+        if (name.find_first_not_of("0123456789abcdef") != 16) return false;
+        token = std::stoull(name.substr(0, 16), nullptr, 16);
+        return token != 0;
+    }
+
+    mutable std::mutex mutex;
+    std::string directory;
+    size_t maxSessions = 0;
+    std::unordered_map<uint64_t, Entry> sessions;
+    uint64_t clock = 0;
+};
+
+SessionStore g_sessions; // Configured in main() when --session-dir is set
+// ----------------------------
+
+// --- Shared Memory Rings ---
+// CMD_SHM_ATTACH: a client on this host gets a named region of equal slots that both sides map. It writes a
+// matrix into a free slot and rings with a CMD_SHM_SUBMIT frame on its socket, which the I/O loop is
+// already waiting on; the job runs in place and the reply names the slot. Matrices never cross the socket.
+// The region is created owner-only, so the client must run as the server's user. On POSIX its name is
+// removed once the first job proves the client has it mapped (or when the ring goes); on Windows it goes
+// with the last handle.
+const uint64_t SHM_RING_MAGIC = 0x31304D533442414CULL; // "LAB4SM01"
+const uint64_t SHM_SLOT_ALIGN = 4096;                  // Slots start on a page; the header takes the first one
+const uint32_t MAX_SHM_SLOTS = 1024;
+
+// At offset 0 of the region, in host byte order (both ends are on one host)
+struct ShmRingHeader {
+    uint64_t magic;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotBytes;      // Rounded up to SHM_SLOT_ALIGN
+    uint64_t firstSlot;      // Offset of slot 0; slot i follows at firstSlot + i * slotBytes
+};
+
+class SharedRing {
+public:
+    SharedRing() = default;
+    ~SharedRing() { close(); }
+    SharedRing(const SharedRing&) = delete;
+    SharedRing& operator=(const SharedRing&) = delete;
+
+    bool create(uint32_t slotCount, uint64_t slotBytes, std::string& error) {
+        slotBytes = (slotBytes + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+        uint64_t total = SHM_SLOT_ALIGN + slotCount * slotBytes;
+        if ((uint64_t)(size_t)total != total) { error = "ring too large for this platform"; return false; }
+        std::random_device rd;
+        char token[32];
+        snprintf(token, sizeof(token), "lab4-%08x%08x", (unsigned)rd(), (unsigned)rd());
+#ifdef _WIN32
+        ringName = std::string("Local\\") + token;
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(total >> 32), (DWORD)total, ringName.c_str());
+        if (!mapping) { error = "CreateFileMapping failed: " + GetWSAErrorString(GetLastError()); return false; }
+        if (GetLastError() == ERROR_ALREADY_EXISTS) { error = ringName + " already exists"; return false; }
+        view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (size_t)total);
+        if (!view) { error = "MapViewOfFile failed: " + GetWSAErrorString(GetLastError()); return false; }
+#else
+        ringName = std::string("/") + token;
+        fd = shm_open(ringName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) { error = "cannot create " + ringName + ": " + GetWSAErrorString(errno); return false; }
+        linked = true;
+        if (ftruncate(fd, (off_t)total) != 0) { error = "cannot size " + ringName + ": " + GetWSAErrorString(errno); return false; }
+        view = mmap(nullptr, (size_t)total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (view == MAP_FAILED) { view = nullptr; error = "mmap failed: " + GetWSAErrorString(errno); return false; }
+#endif
+        length = (size_t)total;
+        ShmRingHeader* header = static_cast<ShmRingHeader*>(view);
+        header->slotCount = slotCount;
+        header->reserved = 0;
+        header->slotBytes = slotBytes;
+        header->firstSlot = SHM_SLOT_ALIGN;
+        header->magic = SHM_RING_MAGIC;
+        count = slotCount;
+        bytesPerSlot = slotBytes;
+        return true;
+    }
+
+    // The client has mapped the region: nobody else needs to find it by name
+    void unlink_name() {
+#ifndef _WIN32
+        if (linked) shm_unlink(ringName.c_str());
+        linked = false;
+#endif
+    }
+
+    float* slot(uint32_t i) const { return reinterpret_cast<float*>(static_cast<char*>(view) + SHM_SLOT_ALIGN + i * bytesPerSlot); }
+    uint32_t slots() const { return count; }
+    uint64_t slot_bytes() const { return bytesPerSlot; }
+    const std::string& name() const { return ringName; }
+
+private:
+    void close() {
+        unlink_name();
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        mapping = NULL;
+#else
+        if (view) munmap(view, length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        view = nullptr;
+    }
+
+    std::string ringName;
+    void* view = nullptr;
+    size_t length = 0;
+    uint32_t count = 0;
+    uint64_t bytesPerSlot = 0;
+#ifdef _WIN32
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+    bool linked = false;     // ringName still exists in the shm namespace
+#endif
+};
+// ----------------------------
+
+// --- Connection State Machine ---
+// Protocol state of one client. The I/O layer only moves bytes: it asks where the next received bytes
+// should go, reports how many arrived and drains the output queue. Callers hold `mutex` throughout.
+const size_t IO_MAX_TRANSFER = 1 << 20;  // Per recv/send call, so one big transfer cannot hog an I/O thread
+const int IO_MAX_READS_PER_EVENT = 16;
+const size_t IO_MAX_GATHER = 16;         // Output chunks written by one gather call (WSASend / sendmsg)
+
+struct IoSlice {
+    const char* data;
+    size_t size;
+};
+
+struct OutChunk {
+    std::vector<char> bytes;         // Owned data (command codes, sizes)
+    const char* borrowed = nullptr;  // Or a view of matrixData, valid because reads pause until output drains,
+    size_t borrowedSize = 0;         // or of a CHUNKED_COMP row block, kept until this chunk is sent
+    bool endsBlock = false;          // Sending this chunk releases the oldest row block
+    std::shared_ptr<ClientState> job; // Set on every chunk of a CMD_SUBMIT_JOB reply: keeps the result alive until sent
+    bool endsJob = false;            // Last chunk of that reply
+
+    const char* data() const { return borrowed ? borrowed : bytes.data(); }
+    size_t size() const { return borrowed ? borrowedSize : bytes.size(); }
+};
+
+enum class ReadPhase { Command, ConfigHeader, WaitingForJob, MatrixData, WaitingForResult, StreamData, StreamDrain,
+                       BlockHeader, BlockData, FileHeader, FilePaths, JobHeader, JobData, BatchHeader, BatchSizes, BatchData,
+                       PriorityArgs, ShardHeader, UpdateHeader, UpdateIndices, UpdateRowData,
+                       SessionArgs, ShmAttachArgs, ShmSubmitArgs, SavingSession };
+
+// A CHUNKED_COMP row block: received, computed in place and sent back, then returned to the buffer pool
+struct RowBlock {
+    uint32_t firstRow = 0;
+    uint32_t rowCount = 0;
+    MatrixBuffer rows;
+};
+
+struct Connection : std::enable_shared_from_this<Connection> {
+    SOCKET socket = INVALID_SOCKET;
+    std::string clientId;
+    const ServerConfig& config;
+    ClientState state;
+    std::mutex mutex;
+
+    ReadPhase phase = ReadPhase::Command;
+    uint32_t scratch[6] = {};      // Command, config or block header fields, network byte order
+    char* readPtr = nullptr;
+    size_t readRemaining = 0;
+    std::deque<OutChunk> outQueue;
+    size_t outOffset = 0;          // Bytes of outQueue.front() already sent
+    bool closeAfterFlush = false;
+    bool closed = false;
+    std::chrono::steady_clock::time_point receiveStarted; // Matrix payload expected from here on
+    std::chrono::steady_clock::time_point sendStarted;    // First payload queued since the output was last empty
+    bool sendTimed = false;
+
+    // CMD_STREAM_COMP / CMD_CHUNKED_COMP progress, in rows
+    bool streaming = false;
+    bool chunked = false;          // The matrix arrives in row blocks instead of into matrixData
+    uint32_t streamChunkRows = 0;
+    uint32_t streamDispatched = 0; // Handed to the pool
+    uint32_t streamSent = 0;       // Queued for sending
+    uint32_t undispatchedTasks = 0;
+
+    // CMD_CHUNKED_COMP blocks still held: the front `blocksQueued` are queued for sending
+    uint32_t blockRows = 0;
+    uint32_t blockReceivedRows = 0; // Rows of every block whose header has been read
+    std::deque<RowBlock> blocks;
+    size_t blocksQueued = 0;
+    size_t windowUsed = 0;          // Bytes of `blocks`, bounded by config.windowMB
+
+    // A config header read while the previous job still runs; it only takes effect in begin_matrix_receive(),
+    // since that job's tasks read state.matrixSize (and a chunked job's dispatch reads blockRows) until done
+    uint32_t pendingSize = 0;
+    uint32_t pendingThreads = 0;
+    uint32_t pendingBlockRows = 0;  // CHUNKED_COMP
+    uint32_t pendingFormat = 0;     // CONFIG_EX
+    uint64_t pendingPayloadBytes = 0;
+
+    // CMD_CONFIG_EX: format of the current matrix (0 after plain CONFIG_DATA: f32 in, full f32 matrix out)
+    bool extendedConfig = false;
+    uint32_t wireFormat = 0;
+    uint64_t payloadBytes = 0;
+    MatrixBuffer encodedInput;      // f16/bf16 rows, widened by the pool tasks of every job
+    MatrixBuffer compressedInput;
+
+    // Result cache: the payload is hashed as it arrives; the key stays valid until the next config
+    bool hashingInput = false;
+    bool inputKeyValid = false;
+    StreamHash inputHash;
+    ResultKey inputKey;
+
+    // CMD_SUBMIT_JOB and CMD_SHARD_COMP: every job has its own state, so one connection can have many in the pool at once
+    struct PipelinedJob {
+        uint32_t id;
+        std::shared_ptr<ClientState> state;
+        bool shard = false;  // Answered with its side vector of results, not the matrix
+        int64_t shmSlot = -1; // CMD_SHM_SUBMIT: computed in this slot of shmRing, answered without a payload
+    };
+    std::vector<PipelinedJob> pipelinedJobs; // Queued in the pool, reply not yet queued
+    PipelinedJob receivingJob;               // Payload still arriving
+    size_t jobsHeld = 0;                     // From header received until reply sent, bounded by config.pipelineDepth
+    size_t jobChunksQueued = 0;              // Chunks of outQueue that belong to job replies
+
+    // CMD_SHM_ATTACH: the ring this connection's CMD_SHM_SUBMIT jobs run in; each running job also holds it
+    std::shared_ptr<SharedRing> shmRing;
+    std::vector<uint8_t> shmSlotBusy;        // Per slot: a job is running in it or its reply is not queued yet
+
+    // Admission (CMD_SET_PRIORITY); fair share is per tenant, the client's address
+    std::string tenant;
+    uint32_t priority = DEFAULT_PRIORITY;
+    uint32_t weight = 1;
+
+    // CMD_BATCH: the current batch, kept (with its buffer) for the next one once the reply has gone out
+    std::shared_ptr<ClientState> batch;
+    std::vector<uint32_t> batchSizes;
+    bool batchJob = false;                   // The job being waited for is a batch
+
+    // CMD_UPDATE_ROWS: indices of the rows being replaced, in the order their data arrives
+    std::vector<uint32_t> updateRows;
+    size_t updateRowsReceived = 0;
+    bool updateJob = false;                  // The job being waited for is a row update
+    bool updateHadResult = false;            // matrixData held a whole result before the update
+
+    // CMD_SESSION: `state`'s matrix is mirrored into the session's file, mapped while the session is attached
+    uint64_t sessionToken = 0;               // 0 without a session
+    bool sessionDirty = false;               // The matrix or its result changed since the file was written
+    std::shared_ptr<FileMapping> sessionFile; // Shared with a save in flight, so a disconnect cannot unmap it
+    std::atomic<bool> sessionSaving{false};  // A pool task is copying `state` into the file; reads are paused
+    uint64_t sessionFileBytes = 0;
+
+    // CMD_FILE_COMP, kept mapped until the job's tasks are done
+    bool fileJob = false;
+    std::string filePaths;          // Input path followed by output path, as received
+    FileMapping fileInput, fileOutput;
+
+#ifdef _WIN32
+    struct IoOp { OVERLAPPED overlapped; };
+    IoOp recvOp, sendOp;
+    bool recvPosted = false, sendPosted = false, released = false;
+#else
+    size_t loopIndex = 0;
+    uint32_t epollEvents = 0;      // Interest currently registered with epoll
+#endif
+
+    Connection(SOCKET s, std::string id, const ServerConfig& config) : socket(s), clientId(std::move(id)), config(config) {
+        state.socket = s;
+        tenant = peer_address(s);
+        expect_command();
+    }
+
+    void expect(void* target, size_t bytes, ReadPhase next) {
+        readPtr = static_cast<char*>(target);
+        readRemaining = bytes;
+        phase = next;
+    }
+    void expect_command() { expect(&scratch[0], sizeof(uint32_t), ReadPhase::Command); }
+
+    // Each command is answered before the next one is read, exactly like the blocking handler did.
+    // The exception is a streamed payload, which keeps arriving while finished rows go out;
+    // a chunked one also pauses whenever the next block would not fit in the window.
+    // Pipelined job replies do not hold reads back either: they own their memory, and their number is bounded.
+    bool want_read(char*& ptr, size_t& len) const {
+        if (closed || closeAfterFlush) return false;
+        if (phase == ReadPhase::BlockHeader) {
+            if (windowUsed + next_block_bytes() > config.windowMB << 20) return false;
+        } else if (phase != ReadPhase::StreamData && phase != ReadPhase::BlockData) {
+            if (outQueue.size() > jobChunksQueued || phase == ReadPhase::WaitingForJob || phase == ReadPhase::WaitingForResult ||
+                phase == ReadPhase::StreamDrain || phase == ReadPhase::SavingSession) return false;
+            if (phase == ReadPhase::Command && jobsHeld >= config.pipelineDepth) return false;
+        }
+        ptr = readPtr;
+        len = std::min(readRemaining, IO_MAX_TRANSFER);
+        return true;
+    }
+
+    void on_received(size_t bytes) {
+        g_metrics.add(Counter::BytesIn, bytes);
+        if (hashingInput && (phase == ReadPhase::MatrixData || phase == ReadPhase::JobData)) inputHash.update(readPtr, bytes);
+        readPtr += bytes;
+        readRemaining -= bytes;
+        if (phase == ReadPhase::MatrixData && state.gpuMatrix) { // No job of this state runs in this phase
+            char* base = reinterpret_cast<char*>(state.matrixData.data());
+            g_gpu.received(std::shared_ptr<ClientState>(shared_from_this(), &state), state.gpuMatrix, base, readPtr - base);
+        }
+        if (phase == ReadPhase::StreamData || phase == ReadPhase::BlockData) dispatch_stream_rows();
+        if (readRemaining == 0) on_field_complete();
+        if (streaming) advance_stream();
+        if (sessionDirty) save_session();
+    }
+
+    bool has_output() const { return !outQueue.empty(); }
+
+    // Fills `slices` with the head of the output queue, so a response header and its payload
+    // go out in one call; returns the number of slices used
+    size_t gather_output(IoSlice* slices, size_t maxSlices, size_t maxBytes) const {
+        size_t count = 0, total = 0, offset = outOffset;
+        for (auto it = outQueue.begin(); it != outQueue.end() && count < maxSlices && total < maxBytes; ++it) {
+            size_t size = std::min(it->size() - offset, maxBytes - total);
+            slices[count++] = IoSlice{it->data() + offset, size};
+            total += size;
+            offset = 0;
+        }
+        return count;
+    }
+
+    void on_sent(size_t bytes) {
+        g_metrics.add(Counter::BytesOut, bytes);
+        while (bytes > 0) {
+            size_t inFront = outQueue.front().size() - outOffset;
+            if (bytes < inFront) { outOffset += bytes; return; }
+            bytes -= inFront;
+            if (outQueue.front().endsBlock) release_block();
+            if (outQueue.front().job) {
+                jobChunksQueued--;
+                if (outQueue.front().endsJob) jobsHeld--;
+            }
+            outQueue.pop_front();
+            outOffset = 0;
+        }
+        if (sendTimed && outQueue.empty()) {
+            g_metrics.record(Timer::Send, std::chrono::steady_clock::now() - sendStarted);
+            sendTimed = false;
+        }
+    }
+
+    void queue_uint32(uint32_t value) {
+        uint32_t netValue = htonl(value);
+        OutChunk chunk;
+        chunk.bytes.assign((const char*)&netValue, (const char*)&netValue + sizeof(netValue));
+        outQueue.push_back(std::move(chunk));
+    }
+
+    void queue_bytes(const std::string& text) {
+        OutChunk chunk;
+        chunk.bytes.assign(text.begin(), text.end());
+        outQueue.push_back(std::move(chunk));
+    }
+
+    void start_send_timer() {
+        if (sendTimed) return;
+        sendStarted = std::chrono::steady_clock::now();
+        sendTimed = true;
+    }
+
+    void queue_floats(const float* data, size_t count) { queue_borrowed(data, count * sizeof(float)); }
+
+    void queue_borrowed(const void* data, size_t bytes) {
+        if (bytes == 0) return; // Nothing to send
+        start_send_timer();
+        OutChunk chunk;
+        chunk.borrowed = static_cast<const char*>(data);
+        chunk.borrowedSize = bytes;
+        outQueue.push_back(std::move(chunk));
+    }
+
+    // Called on every wake-up from the compute pool
+    void resume() {
+        resume_jobs();
+        if (sessionDirty) save_session(); // The job that just finished may have been the session's
+    }
+
+    void resume_jobs() {
+        queue_finished_jobs();
+        if (phase == ReadPhase::SavingSession) {
+            if (!sessionSaving) expect_command();
+            return;
+        }
+        if (phase == ReadPhase::WaitingForJob) { // Before `streaming`: the new stream has not begun yet
+            if (!state.processingStarted) begin_matrix_receive();
+            return;
+        }
+        if (streaming) { advance_stream(); return; }
+        if (phase == ReadPhase::WaitingForResult && batchJob) { // Runs on its own state, independent of `state`'s job
+            if (batch->processingStarted) return;
+            finish_batch();
+            expect_command();
+            return;
+        }
+        if (state.processingStarted) return;
+        if (phase == ReadPhase::WaitingForResult) {
+            if (fileJob) finish_file_job();
+            else if (updateJob) finish_row_update();
+            else queue_status_response(); // Pushed as soon as the job is done, no polling needed
+            expect_command();
+        }
+    }
+
+    // The I/O layer is closing the socket. A stream cut short still has chunks that were never
+    // handed to the pool; account for them so the job completes and the state can be released.
+    // Row blocks stay allocated until the connection is destroyed, since tasks may still be writing them.
+    void on_close() {
+        leave_session(); // A job still running finishes after the file is closed; its result is not saved
+        if (!streaming) return;
+        if (undispatchedTasks > 0) state.errorOccurred = true;
+        for (; undispatchedTasks > 0; --undispatchedTasks) finish_row_task(&state);
+        streaming = false;
+    }
+
+    // Partial command or payload at disconnect time, for logging
+    bool mid_message() const {
+        return !((phase == ReadPhase::Command || phase == ReadPhase::SavingSession) && readRemaining == sizeof(uint32_t));
+    }
+
+private:
+    void on_field_complete() {
+        switch (phase) {
+            case ReadPhase::Command: handle_command(ntohl(scratch[0])); break;
+            case ReadPhase::ConfigHeader: handle_config_header(); break;
+            case ReadPhase::MatrixData: handle_matrix_data(); break;
+            case ReadPhase::StreamData: // Every row is dispatched by now
+                g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+                phase = ReadPhase::StreamDrain;
+                break;
+            case ReadPhase::BlockHeader: handle_block_header(); break;
+            case ReadPhase::FileHeader: handle_file_header(); break;
+            case ReadPhase::FilePaths: start_file_job(); break;
+            case ReadPhase::JobHeader: handle_job_header(); break;
+            case ReadPhase::JobData: start_pipelined_job(); break;
+            case ReadPhase::BatchHeader: handle_batch_header(); break;
+            case ReadPhase::BatchSizes: handle_batch_sizes(); break;
+            case ReadPhase::BatchData: start_batch(); break;
+            case ReadPhase::PriorityArgs: set_priority(); break;
+            case ReadPhase::ShardHeader: handle_shard_header(); break;
+            case ReadPhase::UpdateHeader: handle_update_header(); break;
+            case ReadPhase::UpdateIndices: handle_update_indices(); break;
+            case ReadPhase::UpdateRowData: handle_update_row(); break;
+            case ReadPhase::SessionArgs: handle_session(); break;
+            case ReadPhase::ShmAttachArgs: handle_shm_attach(); break;
+            case ReadPhase::ShmSubmitArgs: start_shm_job(); break;
+            case ReadPhase::BlockData:
+                if (blockReceivedRows < state.matrixSize) { expect_block_header(); break; }
+                g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+                phase = ReadPhase::StreamDrain;
+                break;
+            case ReadPhase::WaitingForJob:
+            case ReadPhase::WaitingForResult:
+            case ReadPhase::StreamDrain:
+            case ReadPhase::SavingSession: break;
+        }
+    }
+
+    // The GPU thread may still be copying out of matrixData; once this returns it never reads it again
+    void drop_gpu_upload() {
+        if (!state.gpuMatrix) return;
+        state.gpuMatrix->cancel();
+        state.gpuMatrix.reset();
+    }
+
+    void begin_matrix_receive() {
+        state.matrixSize = pendingSize;
+        state.numThreads = pendingThreads;
+        if (chunked) blockRows = pendingBlockRows;
+        wireFormat = pendingFormat;
+        payloadBytes = pendingPayloadBytes;
+        drop_gpu_upload();
+        receiveStarted = std::chrono::steady_clock::now();
+        inputKeyValid = false;
+        hashingInput = !chunked && !streaming && g_resultCache.enabled(); // Streamed rows are computed before the hash is known
+        if (hashingInput) inputHash.reset(g_resultCache.hash_seed());
+        if (chunked) { begin_chunked(); return; }
+        uint32_t encoding = wireFormat & FORMAT_ENCODING_MASK;
+        size_t dataBytes = (size_t)state.matrixSize * state.matrixSize * element_bytes(element_type(encoding));
+        // Pooled and uninitialized: the socket (or a job's tasks) fill every byte
+        state.matrixData.resize((dataBytes + sizeof(float) - 1) / sizeof(float));
+        if (streaming) { begin_stream(); return; }
+        if (wireFormat & FORMAT_LZ4) {
+            compressedInput.resize((size_t)((payloadBytes + sizeof(float) - 1) / sizeof(float)));
+            expect(compressedInput.data(), (size_t)payloadBytes, ReadPhase::MatrixData);
+        } else if (encoding_widened(encoding)) {
+            encodedInput.resize((size_t)((payloadBytes + sizeof(float) - 1) / sizeof(float)));
+            expect(encodedInput.data(), (size_t)payloadBytes, ReadPhase::MatrixData);
+        } else {
+            expect(state.matrixData.data(), dataBytes, ReadPhase::MatrixData);
+            // Goes up to the device while the rest arrives, if the job is going to run there
+            state.gpuMatrix = g_gpu.begin_upload(state.matrixSize, element_type(encoding), (wireFormat & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT);
+        }
+    }
+
+    // The result header goes out first; rows follow in order as soon as each one is computed
+    void begin_stream() {
+        uint32_t size = state.matrixSize;
+        state.dataReceived = false;
+        state.rowsReady.reset(new std::atomic<uint8_t>[size]()); // No job is running, so no task can see the swap
+        state.processingStarted = true; state.processingDone = false; state.errorOccurred = false;
+        state.set_reduction(0);
+        streamChunkRows = plan_job(&state);
+        undispatchedTasks = state.pendingTasks;
+        streamDispatched = 0;
+        streamSent = 0;
+        queue_uint32(RESP_RESULT);
+        queue_uint32(size);
+        expect(state.matrixData.data(), state.matrixData.size() * sizeof(float), ReadPhase::StreamData);
+    }
+
+    // Hands every complete chunk of received rows to the pool (and the partial last one of the
+    // matrix, or of the current row block)
+    void dispatch_stream_rows() {
+        uint32_t size = state.matrixSize;
+        size_t rowBytes = (size_t)size * sizeof(float);
+        float* base = state.matrixData.data();
+        uint32_t baseRow = 0, endRow = size;
+        size_t bufferBytes = state.matrixData.size() * sizeof(float);
+        if (chunked) {
+            RowBlock& block = blocks.back();
+            base = block.rows.data();
+            baseRow = block.firstRow;
+            endRow = block.firstRow + block.rowCount;
+            bufferBytes = block.rows.size() * sizeof(float);
+        }
+        uint32_t receivedRows = baseRow + (uint32_t)((bufferBytes - readRemaining) / rowBytes);
+        auto self = std::shared_ptr<ClientState>(shared_from_this(), &state);
+        while (streamDispatched < receivedRows &&
+               (receivedRows - streamDispatched >= streamChunkRows || receivedRows == endRow)) {
+            uint32_t chunkEnd = std::min(endRow, streamDispatched + streamChunkRows);
+            --undispatchedTasks;
+            submit_row_chunk(self, base + (size_t)(streamDispatched - baseRow) * size, streamDispatched, chunkEnd);
+            streamDispatched = chunkEnd;
+        }
+    }
+
+    // Queues the finished rows that directly follow the ones already sent
+    void advance_stream() {
+        uint32_t size = state.matrixSize;
+        if (state.errorOccurred) { // The header is already out, so the only way to signal failure is to hang up
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Streamed computation failed, closing connection." << std::endl;
+            closeAfterFlush = true;
+            return;
+        }
+        uint32_t ready = streamSent;
+        while (ready < size && state.rowsReady[ready].load(std::memory_order_acquire)) ++ready;
+        if (chunked) {
+            queue_finished_blocks(ready);
+        } else if (ready > streamSent) {
+            queue_floats(state.matrixData.data() + (size_t)streamSent * size, (size_t)(ready - streamSent) * size);
+            streamSent = ready;
+        }
+        if (streamSent == size && phase == ReadPhase::StreamDrain && !state.processingStarted) {
+            streaming = false;
+            state.dataReceived = !chunked; // GET_STATUS / START_COMP work on a streamed matrix afterwards
+            if (chunked) state.processingDone = false; // Nothing is left to send again
+            chunked = false;
+            sessionDirty = true;
+            expect_command();
+            queue_finished_jobs(); // Held back while the streamed reply was going out
+        }
+    }
+
+    // --- CMD_CHUNKED_COMP ---
+    size_t next_block_bytes() const {
+        uint32_t rows = std::min(blockRows, state.matrixSize - blockReceivedRows);
+        return (size_t)rows * state.matrixSize * sizeof(float);
+    }
+
+    void expect_block_header() { expect(&scratch[0], 4 * sizeof(uint32_t), ReadPhase::BlockHeader); }
+
+    void begin_chunked() {
+        uint32_t size = state.matrixSize;
+        state.matrixData.release(); // This connection's whole-matrix buffer is not needed for a chunked job
+        state.dataReceived = false;
+        state.rowsReady.reset(new std::atomic<uint8_t>[size]());
+        state.processingStarted = true; state.processingDone = false; state.errorOccurred = false;
+        state.set_reduction(0);
+        streamChunkRows = plan_job(&state, blockRows);
+        undispatchedTasks = state.pendingTasks;
+        streamDispatched = 0;
+        streamSent = 0;
+        blockReceivedRows = 0;
+        queue_uint32(RESP_ACK);
+        expect_block_header();
+    }
+
+    // Only the next block in order, of exactly the size the header announced, is accepted
+    void handle_block_header() {
+        uint32_t size = state.matrixSize;
+        uint32_t firstRow = ntohl(scratch[0]);
+        uint32_t rowCount = ntohl(scratch[1]);
+        uint64_t bytes = ((uint64_t)ntohl(scratch[2]) << 32) | ntohl(scratch[3]);
+        uint32_t expectedRows = std::min(blockRows, size - blockReceivedRows);
+        if (firstRow != blockReceivedRows || rowCount != expectedRows || bytes != next_block_bytes()) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid row block: rows " << firstRow << "+" << rowCount
+                      << ", " << bytes << " bytes; expected rows " << blockReceivedRows << "+" << expectedRows << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
+        }
+        blocks.emplace_back();
+        RowBlock& block = blocks.back();
+        block.firstRow = firstRow;
+        block.rowCount = rowCount;
+        block.rows.resize((size_t)rowCount * size);
+        windowUsed += (size_t)bytes;
+        blockReceivedRows += rowCount;
+        expect(block.rows.data(), (size_t)bytes, ReadPhase::BlockData);
+    }
+
+    // Queues a RESP_BLOCK frame for every block whose rows are all computed, oldest first
+    void queue_finished_blocks(uint32_t readyRows) {
+        while (blocksQueued < blocks.size()) {
+            RowBlock& block = blocks[blocksQueued];
+            uint32_t endRow = block.firstRow + block.rowCount;
+            if (readyRows < endRow) return;
+            uint64_t bytes = (uint64_t)block.rows.size() * sizeof(float);
+            queue_uint32(RESP_BLOCK);
+            queue_uint32(block.firstRow);
+            queue_uint32(block.rowCount);
+            queue_uint32((uint32_t)(bytes >> 32));
+            queue_uint32((uint32_t)bytes);
+            queue_floats(block.rows.data(), block.rows.size());
+            outQueue.back().endsBlock = true;
+            streamSent = endRow;
+            ++blocksQueued;
+        }
+    }
+
+    void release_block() {
+        windowUsed -= blocks.front().rows.size() * sizeof(float);
+        blocks.pop_front();
+        --blocksQueued;
+    }
+
+    // --- CMD_FILE_COMP ---
+    void handle_file_header() {
+        uint32_t inputLen = ntohl(scratch[4]), outputLen = ntohl(scratch[5]);
+        if (inputLen == 0 || inputLen > 4096 || outputLen > 4096) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid file path lengths: " << inputLen << ", " << outputLen << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true; // The paths that follow cannot be skipped reliably
+            return;
+        }
+        filePaths.assign((size_t)inputLen + outputLen, '\0');
+        expect(&filePaths[0], filePaths.size(), ReadPhase::FilePaths);
+    }
+
+    void start_file_job() {
+        uint32_t size = ntohl(scratch[0]);
+        uint32_t numThreads = ntohl(scratch[1]);
+        uint64_t offset = ((uint64_t)ntohl(scratch[2]) << 32) | ntohl(scratch[3]);
+        uint32_t inputLen = ntohl(scratch[4]);
+        std::string inputPath, outputPath, error;
+        bool inPlace = filePaths.size() == inputLen;
+        uint64_t mappable = std::min<uint64_t>(std::numeric_limits<size_t>::max(), std::numeric_limits<uint64_t>::max() - offset);
+        uint64_t bytes = (uint64_t)size * size * sizeof(float); // Only used once fits_bytes() has ruled out a wrap
+        if (config.fileRoot.empty()) error = "file mode is disabled (no --file-root)";
+        else if (size == 0 || !fits_bytes(size, size, sizeof(float), mappable)) error = "invalid matrix size";
+        else if (offset % sizeof(float) != 0) error = "offset is not a multiple of 4 bytes";
+        else if (state.processingStarted) error = "a job is still running on this connection";
+        else if (!resolve_under_root(config.fileRoot, filePaths.substr(0, inputLen), inputPath) ||
+                 (!inPlace && !resolve_under_root(config.fileRoot, filePaths.substr(inputLen), outputPath))) {
+            error = "paths must be relative to the file root";
+        } else if (fileInput.open(inputPath, offset, bytes, inPlace, false, error) &&
+                   (inPlace || fileOutput.open(outputPath, 0, bytes, true, true, error, &fileInput))) {
+            error.clear();
+        }
+        if (!error.empty()) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] FILE_COMP rejected: " << error << std::endl;
+            fileInput.close();
+            fileOutput.close();
+            queue_uint32(RESP_ERROR);
+            expect_command();
+            return;
+        }
+        state.matrixSize = size;
+        state.numThreads = numThreads;
+        state.dataReceived = false; // matrixData no longer matches matrixSize
+        inputKeyValid = false;
+        sessionDirty = true;
+        fileJob = true;
+        state.processingStarted = true; state.processingDone = false; state.errorOccurred = false;
+        state.rowsReady.reset();
+        state.sourceEncoding = ENCODING_F32;
+        state.set_reduction(0);
+        auto self = std::shared_ptr<ClientState>(shared_from_this(), &state); // Also keeps the mappings alive
+        float* input = fileInput.data;
+        float* output = inPlace ? nullptr : fileOutput.data;
+        auto start = [self, input, output] {
+            if (output) perform_computation(self, output, input);
+            else perform_computation(self, input);
+        };
+        if (!admit_job(self, (uint64_t)size * size, start)) {
+            state.processingStarted = false;
+            fileJob = false;
+            fileInput.close();
+            fileOutput.close();
+            queue_uint32(RESP_BUSY);
+            expect_command();
+            return;
+        }
+        phase = ReadPhase::WaitingForResult; // resume() replies once every row is written
+    }
+
+    void finish_file_job() {
+        fileInput.close();
+        fileOutput.close();
+        fileJob = false;
+        queue_uint32(state.errorOccurred ? RESP_ERROR : RESP_ACK);
+        state.processingDone = false; // matrixData was not part of this job
+    }
+    // ----------------------
+
+    // --- CMD_SUBMIT_JOB ---
+    void handle_job_header() {
+        uint32_t id = ntohl(scratch[0]);
+        uint32_t size = ntohl(scratch[1]);
+        if (size == 0 || !fits_bytes(size, size, sizeof(float), (uint64_t)config.maxMatrixMB << 20)) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid size for job " << id << ": " << size << std::endl;
+            queue_uint32(RESP_JOB_ERROR);
+            queue_uint32(id);
+            closeAfterFlush = true; // The payload length is unknown, so the stream cannot be resynchronised
+            return;
+        }
+        auto job = std::make_shared<ClientState>();
+        job->socket = socket;
+        job->matrixSize = size;
+        job->numThreads = ntohl(scratch[2]);
+        job->onProgress = state.onProgress;
+        job->numaNode = state.numaNode;
+        job->matrixData.resize((size_t)size * size);
+        receivingJob = PipelinedJob{id, job};
+        jobsHeld++;
+        receiveStarted = std::chrono::steady_clock::now();
+        hashingInput = g_resultCache.enabled();
+        if (hashingInput) inputHash.reset(g_resultCache.hash_seed());
+        expect(job->matrixData.data(), job->matrixData.size() * sizeof(float), ReadPhase::JobData);
+    }
+
+    // Rows of a coordinator's job; from here on it is a pipelined job whose results go into a side vector.
+    // Never cached: the shard is rarely sent twice, and its rows are not a matrix of their own.
+    void handle_shard_header() {
+        uint32_t id = ntohl(scratch[0]);
+        uint32_t rowCount = ntohl(scratch[1]);
+        uint32_t size = ntohl(scratch[2]);
+        uint32_t format = ntohl(scratch[4]);
+        uint32_t encoding = format & FORMAT_ENCODING_MASK;
+        uint32_t op = (format & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT;
+        bool native = encoding == ENCODING_F32 || encoding == ENCODING_F64 || encoding == ENCODING_I32 || encoding == ENCODING_I16;
+        uint64_t elementSize = element_bytes(element_type(encoding));
+        if (rowCount == 0 || size == 0 || !native || op >= OP_COUNT || (format & ~(FORMAT_ENCODING_MASK | FORMAT_OP_MASK)) ||
+            !fits_bytes(rowCount, size, elementSize, (uint64_t)config.maxMatrixMB << 20)) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid shard " << id << ": " << rowCount << " rows of " << size
+                      << ", format " << format << std::endl;
+            queue_uint32(RESP_JOB_ERROR);
+            queue_uint32(id);
+            closeAfterFlush = true;
+            return;
+        }
+        auto job = std::make_shared<ClientState>();
+        job->socket = socket;
+        job->matrixSize = size;
+        job->jobRows = rowCount;
+        job->numThreads = ntohl(scratch[3]);
+        job->onProgress = state.onProgress;
+        job->numaNode = state.numaNode;
+        job->set_reduction(format | FORMAT_SIDE_VECTOR);
+        uint64_t bytes = (uint64_t)rowCount * size * elementSize;
+        job->matrixData.resize((size_t)((bytes + sizeof(float) - 1) / sizeof(float)));
+        receivingJob = PipelinedJob{id, job, true};
+        jobsHeld++;
+        receiveStarted = std::chrono::steady_clock::now();
+        hashingInput = false;
+        expect(job->matrixData.data(), (size_t)bytes, ReadPhase::JobData);
+    }
+
+    void start_pipelined_job() {
+        g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+        PipelinedJob job = std::move(receivingJob);
+        expect_command();
+        if (hashingInput) {
+            hashingInput = false;
+            ResultKey key{job.state->matrixSize, 0, inputHash.digest()};
+            if (g_resultCache.load(key, job.state->matrixData.data(), (size_t)job.state->matrixSize + 1, sizeof(float))) {
+                g_metrics.add(Counter::CacheHits);
+                queue_job_reply(job);
+                return;
+            }
+            g_metrics.add(Counter::CacheMisses);
+            job.state->cacheKey = key;
+            job.state->cacheStore = true;
+        }
+        job.state->processingStarted = true;
+        pipelinedJobs.push_back(job); // Before the tasks: the last one may finish before perform_computation returns
+        auto jobState = job.state;
+        uint64_t cost = (uint64_t)jobState->job_rows() * jobState->matrixSize;
+        if (admit_job(jobState, cost, [jobState] { perform_computation(jobState, jobState->matrixData.data()); })) return;
+        pipelinedJobs.pop_back();
+        jobState->processingStarted = false;
+        jobState->cacheStore = false;
+        queue_job_reply(job, true);
+    }
 
-#define SERVER_PORT 65001
-#define LOG_PREFIX "[Server] "
+    // Replies for every job the pool has finished, in that order. A streamed reply is sent as a run of
+    // frames, so nothing may come between them; finished jobs wait for the stream to end.
+    void queue_finished_jobs() {
+        if (streaming) return;
+        for (size_t i = 0; i < pipelinedJobs.size(); ) {
+            if (pipelinedJobs[i].state->processingStarted) { ++i; continue; }
+            queue_job_reply(pipelinedJobs[i]);
+            pipelinedJobs.erase(pipelinedJobs.begin() + i);
+        }
+    }
 
-// Protocol Commands
-const uint32_t CMD_CONFIG_DATA = 1;
-const uint32_t CMD_START_COMP = 2;
-const uint32_t CMD_GET_STATUS = 3;
-const uint32_t RESP_ACK = 10;
-const uint32_t RESP_STATUS_PENDING = 11;
-const uint32_t RESP_RESULT = 12;
-const uint32_t RESP_ERROR = 13;
+    void queue_job_reply(const PipelinedJob& job, bool busy = false) {
+        bool failed = busy || job.state->errorOccurred;
+        bool shm = job.shmSlot >= 0;
+        uint32_t code = busy ? RESP_JOB_BUSY : (failed ? RESP_JOB_ERROR : (job.shard ? RESP_SHARD_RESULT : shm ? RESP_SHM_DONE : RESP_JOB_RESULT));
+        uint32_t header[3] = {htonl(code), htonl(job.id), htonl(shm ? (uint32_t)job.shmSlot : job.state->job_rows())};
+        OutChunk head;
+        head.bytes.assign((const char*)header, (const char*)header + (failed ? 2 : 3) * sizeof(uint32_t));
+        head.job = job.state;
+        head.endsJob = failed || shm;
+        outQueue.push_back(std::move(head));
+        jobChunksQueued++;
+        if (shm) shmSlotBusy[(size_t)job.shmSlot] = 0; // The client owns the slot again once it reads this
+        if (failed || shm) return;
+        start_send_timer();
+        OutChunk payload;
+        payload.borrowed = static_cast<const char*>(job.state->results());
+        payload.borrowedSize = job.shard ? (size_t)job.state->jobRows * element_bytes(job.state->elementType)
+                                         : job.state->matrixData.size() * sizeof(float);
+        payload.job = job.state;
+        payload.endsJob = true;
+        outQueue.push_back(std::move(payload));
+        jobChunksQueued++;
+    }
+    // ----------------------
 
-struct ClientState {
-    SOCKET socket = INVALID_SOCKET;
-    uint32_t matrixSize = 0;
-    uint32_t numThreads = 1;
-    std::vector<float> matrixData;
-    std::vector<float> resultData;
-    std::atomic<bool> dataReceived{false};
-    std::atomic<bool> processingStarted{false}; // True if computation thread is active/launched
-    std::atomic<bool> processingDone{false};   // True if computation finished successfully
-    std::atomic<bool> errorOccurred{false};    // True if computation failed
-    std::thread workerThread;
+    // --- CMD_SHM_ATTACH / CMD_SHM_SUBMIT ---
+    void handle_shm_attach() {
+        uint32_t slots = ntohl(scratch[0]);
+        uint64_t slotBytes = ((uint64_t)ntohl(scratch[1]) << 32) | ntohl(scratch[2]);
+        expect_command();
+        std::string error;
+        if (config.shmMaxMB == 0) error = "shared memory is disabled (--shm-max-mb=0)";
+        else if (slots == 0 || slots > MAX_SHM_SLOTS || slotBytes == 0) error = "invalid slot count or size";
+        else if (slotBytes > ((uint64_t)config.shmMaxMB << 20) / slots) error = "ring larger than --shm-max-mb";
+        else if (std::find(shmSlotBusy.begin(), shmSlotBusy.end(), 1) != shmSlotBusy.end()) error = "jobs are still running in the current ring";
+        else {
+            auto ring = std::make_shared<SharedRing>();
+            if (ring->create(slots, slotBytes, error)) {
+                shmRing = std::move(ring);
+                shmSlotBusy.assign(slots, 0);
+            }
+        }
+        if (!error.empty()) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] SHM_ATTACH rejected: " << error << std::endl;
+            queue_uint32(RESP_ERROR);
+            return;
+        }
+        std::cout << LOG_PREFIX << "[" << clientId << "] Shared-memory ring " << shmRing->name() << ": " << slots << " slots of "
+                  << shmRing->slot_bytes() << " bytes." << std::endl;
+        queue_uint32(RESP_SHM_READY);
+        queue_uint32((uint32_t)shmRing->name().size());
+        queue_bytes(shmRing->name());
+    }
 
-    // Destructor to ensure thread is joined if needed (basic safety)
-    ~ClientState() {
-        if (workerThread.joinable()) {
-            // In a real-world scenario, you might need to signal the thread to stop first
-            // For simplicity here, we just join, hoping it finishes.
-            try { workerThread.join(); } catch(...) { /* ignore errors on cleanup */ }
+    // Pipelined like CMD_SUBMIT_JOB, but the matrix already sits in the slot; never cached, since the client
+    // may rewrite the slot as soon as the reply is out
+    void start_shm_job() {
+        uint32_t id = ntohl(scratch[0]);
+        uint32_t slot = ntohl(scratch[1]);
+        uint32_t size = ntohl(scratch[2]);
+        expect_command();
+        const char* error = nullptr;
+        if (!shmRing) error = "no shared-memory ring attached";
+        else if (slot >= shmRing->slots() || shmSlotBusy[slot]) error = "slot out of range or still in use";
+        else if (size == 0 || !fits_bytes(size, size, sizeof(float), shmRing->slot_bytes())) error = "matrix does not fit the slot";
+        if (error) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] SHM_SUBMIT " << id << " rejected: " << error << std::endl;
+            queue_uint32(RESP_JOB_ERROR);
+            queue_uint32(id);
+            return;
         }
+        shmRing->unlink_name(); // The client mapped it before ringing
+        auto job = std::make_shared<ClientState>();
+        job->socket = socket;
+        job->matrixSize = size;
+        job->numThreads = ntohl(scratch[3]);
+        job->onProgress = state.onProgress;
+        job->numaNode = state.numaNode;
+        job->borrowedMatrix = shmRing;
+        job->processingStarted = true;
+        shmSlotBusy[slot] = 1;
+        jobsHeld++;
+        g_metrics.add(Counter::ShmJobs);
+        PipelinedJob pipelined{id, job, false, (int64_t)slot};
+        pipelinedJobs.push_back(pipelined); // Before the tasks: the last one may finish before perform_computation returns
+        float* matrix = shmRing->slot(slot);
+        if (admit_job(job, (uint64_t)size * size, [job, matrix] { perform_computation(job, matrix); })) return;
+        pipelinedJobs.pop_back();
+        job->processingStarted = false;
+        queue_job_reply(pipelined, true);
     }
-};
+    // ----------------------
 
-// --- Helper Functions for Network I/O with Error Logging ---
-std::string GetWSAErrorString(int errorCode) {
-    char* s = nullptr;
-    FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                   NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&s, 0, NULL);
-    std::string msg = (s ? s : "Unknown error");
-    if(s) LocalFree(s);
-    return msg + " (" + std::to_string(errorCode) + ")";
-}
+    void set_priority() {
+        uint32_t priorityClass = ntohl(scratch[0]);
+        uint32_t newWeight = ntohl(scratch[1]);
+        expect_command();
+        if (priorityClass >= PRIORITY_CLASSES || newWeight == 0 || newWeight > MAX_CLIENT_WEIGHT) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid priority " << priorityClass << " / weight " << newWeight << std::endl;
+            queue_uint32(RESP_ERROR);
+            return;
+        }
+        priority = priorityClass;
+        weight = newWeight;
+        queue_uint32(RESP_ACK);
+    }
 
-bool send_uint32(SOCKET sock, uint32_t value, const std::string& context) {
-    uint32_t netValue = htonl(value);
-    int bytesSent = send(sock, (const char*)&netValue, sizeof(netValue), 0);
-    if (bytesSent == SOCKET_ERROR) {
-        int error_code = WSAGetLastError();
-        std::cerr << LOG_PREFIX << "[" << sock << "] send_uint32 failed (" << context << "): " << GetWSAErrorString(error_code) << std::endl;
-        return false;
+    // --- CMD_BATCH ---
+    void handle_batch_header() {
+        uint32_t count = ntohl(scratch[0]);
+        if (count == 0 || count > MAX_BATCH_MATRICES) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid batch count: " << count << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
+        }
+        batchSizes.resize(count);
+        expect(batchSizes.data(), count * sizeof(uint32_t), ReadPhase::BatchSizes);
     }
-    if (bytesSent != sizeof(netValue)) {
-        std::cerr << LOG_PREFIX << "[" << sock << "] send_uint32 sent incomplete data (" << context << "): " << bytesSent << "/" << sizeof(netValue) << std::endl;
-        return false; // Treat incomplete send as error
+
+    void handle_batch_sizes() {
+        uint64_t limit = (uint64_t)config.maxMatrixMB << 20, totalBytes = 0;
+        bool valid = true;
+        for (uint32_t& size : batchSizes) {
+            size = ntohl(size);
+            if (size == 0 || (uint64_t)size * size > (limit - totalBytes) / sizeof(float)) valid = false;
+            else totalBytes += (uint64_t)size * size * sizeof(float);
+        }
+        if (!valid) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid batch: empty matrix or over "
+                      << config.maxMatrixMB << " MB in total" << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
+        }
+        if (!batch) {
+            batch = std::make_shared<ClientState>();
+            batch->socket = socket;
+            batch->onProgress = state.onProgress;
+            batch->numaNode = state.numaNode;
+        }
+        batch->numThreads = ntohl(scratch[1]);
+        batch->matrixData.resize((size_t)(totalBytes / sizeof(float)));
+        receiveStarted = std::chrono::steady_clock::now();
+        expect(batch->matrixData.data(), (size_t)totalBytes, ReadPhase::BatchData);
     }
-    return true;
-}
 
-bool recv_uint32(SOCKET sock, uint32_t& value, const std::string& context) {
-    int bytesReceived = recv(sock, (char*)&value, sizeof(value), MSG_WAITALL); // Wait for exactly 4 bytes
-    if (bytesReceived == sizeof(value)) {
-        value = ntohl(value);
-        return true;
+    void start_batch() {
+        g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+        batch->processingStarted = true; batch->processingDone = false; batch->errorOccurred = false;
+        auto batchState = batch;
+        auto sizes = std::make_shared<std::vector<uint32_t>>(batchSizes); // The connection may be gone once admitted
+        uint64_t cost = batch->matrixData.size();
+        if (!admit_job(batchState, cost, [batchState, sizes] { perform_batch(batchState, batchState->matrixData.data(), *sizes); })) {
+            batch->processingStarted = false;
+            queue_uint32(RESP_BUSY);
+            expect_command();
+            return;
+        }
+        batchJob = true;
+        phase = ReadPhase::WaitingForResult; // resume() replies once every matrix is done
     }
-    if (bytesReceived == 0) {
-        std::cerr << LOG_PREFIX << "[" << sock << "] recv_uint32 (" << context << "): Client disconnected gracefully." << std::endl;
-    } else if (bytesReceived == SOCKET_ERROR) {
-        int error_code = WSAGetLastError();
-        std::cerr << LOG_PREFIX << "[" << sock << "] recv_uint32 failed (" << context << "): " << GetWSAErrorString(error_code) << std::endl;
-        if (error_code == WSAECONNRESET) {
-            // This specifically means the client likely crashed or force-closed
-            std::cerr << LOG_PREFIX << "[" << sock << "] Connection reset by peer." << std::endl;
+
+    void finish_batch() {
+        batchJob = false;
+        if (batch->errorOccurred) { queue_uint32(RESP_ERROR); return; }
+        queue_uint32(RESP_BATCH);
+        queue_uint32((uint32_t)batchSizes.size());
+        queue_floats(batch->matrixData.data(), batch->matrixData.size()); // Valid: the next batch is not read until this is sent
+    }
+    // ----------------------
+
+    // --- CMD_UPDATE_ROWS ---
+    // Rows are received straight into their place in matrixData, so only the changed rows cross the socket,
+    // and only they are reduced again
+    void handle_update_header() {
+        uint32_t count = ntohl(scratch[0]);
+        uint32_t encoding = wireFormat & FORMAT_ENCODING_MASK;
+        uint32_t op = (wireFormat & FORMAT_OP_MASK) >> FORMAT_OP_SHIFT;
+        const char* error = nullptr;
+        if (!state.dataReceived || streaming) error = "no matrix held";
+        else if (state.processingStarted) error = "a job is still running on this connection";
+        else if (encoding_widened(encoding) || (wireFormat & FORMAT_COLUMNS)) error = "the matrix is widened or reduced by columns";
+        else if ((op == OP_SUM || op == OP_MEAN) && !(wireFormat & FORMAT_SIDE_VECTOR)) error = "sum and mean need a side vector";
+        else if (count == 0 || count > state.matrixSize) error = "invalid row count";
+        if (error) { // The row data cannot be sized without a matrix, so the stream cannot be resynchronised
+            std::cerr << LOG_PREFIX << "[" << clientId << "] UPDATE_ROWS rejected: " << error << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
         }
-    } else {
-        std::cerr << LOG_PREFIX << "[" << sock << "] recv_uint32 received incomplete data (" << context << "): " << bytesReceived << "/" << sizeof(value) << std::endl;
+        state.numThreads = ntohl(scratch[1]);
+        updateRows.resize(count);
+        expect(updateRows.data(), count * sizeof(uint32_t), ReadPhase::UpdateIndices);
     }
-    return false; // Any outcome other than receiving exactly sizeof(value) bytes is failure
-}
 
-bool send_floats(SOCKET sock, const std::vector<float>& data, const std::string& context) {
-    size_t totalBytes = data.size() * sizeof(float);
-    if (totalBytes == 0) return true; // Nothing to send
-    size_t bytesSent = 0;
-    const char* buffer = reinterpret_cast<const char*>(data.data());
-    while (bytesSent < totalBytes) {
-        int result = send(sock, buffer + bytesSent, (int)(totalBytes - bytesSent), 0);
-        if (result == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            std::cerr << LOG_PREFIX << "[" << sock << "] send_floats failed (" << context << "): " << GetWSAErrorString(error_code) << std::endl;
-            return false;
+    void handle_update_indices() {
+        for (uint32_t& row : updateRows) row = ntohl(row);
+        std::vector<uint32_t> sorted(updateRows);
+        std::sort(sorted.begin(), sorted.end());
+        if (sorted.back() >= state.matrixSize || std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] UPDATE_ROWS rejected: row index out of range or repeated" << std::endl;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
         }
-        bytesSent += result;
+        drop_gpu_upload();     // Its copy of the matrix is about to go stale
+        inputKeyValid = false; // Neither is the matrix the cached one any more
+        sessionDirty = true;
+        updateHadResult = state.processingDone;
+        state.processingDone = false; // Until the changed rows are reduced again
+        updateRowsReceived = 0;
+        receiveStarted = std::chrono::steady_clock::now();
+        expect_update_row();
     }
-    return true;
-}
 
-bool recv_floats(SOCKET sock, std::vector<float>& data, size_t count, const std::string& context) {
-    if (count == 0) { data.clear(); return true; } // Nothing to receive
-    data.resize(count); // Allocate space
-    size_t totalBytes = count * sizeof(float);
-    size_t bytesReceived = 0;
-    char* buffer = reinterpret_cast<char*>(data.data());
-    while (bytesReceived < totalBytes) {
-        int result = recv(sock, buffer + bytesReceived, (int)(totalBytes - bytesReceived), 0); // Read remaining bytes
-        if (result == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            std::cerr << LOG_PREFIX << "[" << sock << "] recv_floats failed (" << context << "): " << GetWSAErrorString(error_code) << std::endl;
-            if (error_code == WSAECONNRESET) {
-                std::cerr << LOG_PREFIX << "[" << sock << "] Connection reset by peer during float receive." << std::endl;
+    void expect_update_row() {
+        size_t rowBytes = (size_t)state.matrixSize * element_bytes(element_type(wireFormat & FORMAT_ENCODING_MASK));
+        expect(reinterpret_cast<char*>(state.matrixData.data()) + updateRows[updateRowsReceived] * rowBytes, rowBytes,
+               ReadPhase::UpdateRowData);
+    }
+
+    void handle_update_row() {
+        if (++updateRowsReceived < updateRows.size()) { expect_update_row(); return; }
+        g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+        state.rowsReady.reset();
+        state.set_reduction(wireFormat);
+        state.cacheStore = false;
+        state.processingStarted = true; state.errorOccurred = false;
+        auto self = std::shared_ptr<ClientState>(shared_from_this(), &state);
+        auto rows = std::make_shared<std::vector<uint32_t>>(updateRows);
+        uint64_t cost = (uint64_t)rows->size() * state.matrixSize;
+        if (!admit_job(self, cost, [self, rows] { perform_row_update(self, *rows); })) {
+            state.processingStarted = false; // The new rows stay; a retry (or START_COMP) reduces them
+            queue_uint32(RESP_BUSY);
+            expect_command();
+            return;
+        }
+        updateJob = true;
+        phase = ReadPhase::WaitingForResult; // resume() replies once the rows are done
+    }
+
+    void finish_row_update() {
+        updateJob = false;
+        if (state.errorOccurred) { queue_uint32(RESP_ERROR); state.processingDone = false; return; }
+        state.processingDone = updateHadResult; // The other rows still hold their results, if they had any
+        size_t elementSize = element_bytes(state.elementType);
+        size_t stride = state.results_stride() * elementSize;
+        const char* results = static_cast<const char*>(state.results());
+        OutChunk chunk;
+        chunk.bytes.resize(updateRows.size() * elementSize);
+        for (size_t i = 0; i < updateRows.size(); ++i) std::memcpy(&chunk.bytes[i * elementSize], results + updateRows[i] * stride, elementSize);
+        queue_uint32(RESP_ROWS_RESULT);
+        queue_uint32((uint32_t)updateRows.size());
+        start_send_timer();
+        outQueue.push_back(std::move(chunk));
+    }
+    // ----------------------
+
+    // --- CMD_SESSION ---
+    void handle_session() {
+        uint32_t op = ntohl(scratch[0]);
+        uint64_t token = ((uint64_t)ntohl(scratch[1]) << 32) | ntohl(scratch[2]);
+        expect_command();
+        const char* error = nullptr;
+        if (!g_sessions.enabled()) error = "sessions are disabled (no --session-dir)";
+        else if (state.processingStarted || streaming) error = "a job is still running on this connection";
+        else if (op == SESSION_OPEN) {
+            leave_session();
+            sessionToken = g_sessions.create();
+            sessionDirty = true; // Whatever this connection already holds goes into the new session
+            save_session();
+        } else if (op == SESSION_RESUME) {
+            if (token != sessionToken) {
+                leave_session();
+                if (!g_sessions.attach(token)) error = "unknown session, or in use by another connection";
+                else { sessionToken = token; restore_session(); }
             }
-            return false;
+        } else if (op == SESSION_CLOSE) {
+            if (!sessionToken) error = "no session open";
+            else {
+                sessionFile.reset();
+                sessionFileBytes = 0;
+                g_sessions.remove(sessionToken);
+                sessionToken = 0;
+                sessionDirty = false;
+                queue_uint32(RESP_ACK);
+                return;
+            }
+        } else {
+            error = "unknown session operation";
         }
-        if (result == 0) {
-            std::cerr << LOG_PREFIX << "[" << sock << "] recv_floats (" << context << "): Client disconnected before all data received." << std::endl;
-            return false; // Client disconnected prematurely
+        if (error) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] CMD_SESSION " << op << " rejected: " << error << std::endl;
+            queue_uint32(RESP_ERROR);
+            return;
         }
-        bytesReceived += result;
+        queue_uint32(RESP_SESSION);
+        queue_uint32((uint32_t)(sessionToken >> 32));
+        queue_uint32((uint32_t)sessionToken);
+        queue_uint32(state.dataReceived || state.processingDone ? state.matrixSize : 0);
+        queue_uint32(wireFormat);
+        queue_uint32(session_flags());
     }
-    return true;
-}
-// ---------------------------------------
 
-// --- Matrix Processing Logic ---
-void process_matrix_rows(std::vector<float>* matrixPtr, uint32_t size, int startRow, int endRow) {
-    std::vector<float>& matrix = *matrixPtr;
-    for (int i = startRow; i < endRow; ++i) {
-        float maxVal = -std::numeric_limits<float>::infinity();
-        size_t rowStartIndex = (size_t)i * size;
-        for (uint32_t j = 0; j < size; ++j) {
-            if (matrix[rowStartIndex + j] > maxVal) maxVal = matrix[rowStartIndex + j];
+    uint32_t session_flags() const {
+        return (state.dataReceived ? SESSION_HAS_MATRIX : 0) | (state.processingDone ? SESSION_HAS_RESULT : 0) |
+               (extendedConfig ? SESSION_EXTENDED : 0);
+    }
+
+    void leave_session() {
+        if (!sessionToken) return;
+        sessionFile.reset(); // A save in flight keeps its own reference and still completes the image
+        sessionFileBytes = 0;
+        g_sessions.detach(sessionToken);
+        sessionToken = 0;
+        sessionDirty = false;
+    }
+
+    // Writes state's matrix (and result) into the session file, once nothing is reading into or computing on
+    // it. A large matrix is copied by a pool task, with reads paused (SavingSession) so no command can touch
+    // the matrix meanwhile; a small one is not worth the round trip and is copied here.
+    void save_session() {
+        if (!sessionToken || state.processingStarted || streaming || phase != ReadPhase::Command || mid_message()) return;
+        sessionDirty = false;
+        size_t elementSize = element_bytes(element_type(wireFormat & FORMAT_ENCODING_MASK));
+        bool hasMatrix = (state.dataReceived || state.processingDone) && !encoding_widened(wireFormat & FORMAT_ENCODING_MASK);
+        uint64_t matrixBytes = hasMatrix ? (uint64_t)state.matrixSize * state.matrixSize * elementSize : 0;
+        uint64_t sideBytes = hasMatrix && state.processingDone && state.sideOutput ? (uint64_t)state.matrixSize * elementSize : 0;
+        uint64_t fileBytes = SESSION_HEADER_BYTES + matrixBytes + sideBytes;
+        if (fileBytes != sessionFileBytes) {
+            sessionFile.reset();
+            sessionFileBytes = 0;
+            auto file = std::make_shared<FileMapping>();
+            std::string error;
+            if (!file->open(g_sessions.path_for(sessionToken), 0, fileBytes, true, true, error)) {
+                std::cerr << LOG_PREFIX << "[" << clientId << "] Session not saved: " << error << std::endl;
+                return;
+            }
+            sessionFile = std::move(file);
+            sessionFileBytes = fileBytes;
+        }
+        char* image = reinterpret_cast<char*>(sessionFile->data);
+        SessionHeader* header = reinterpret_cast<SessionHeader*>(image);
+        header->magic = 0; // A crash while the image is written leaves it invalid rather than torn
+        header->matrixSize = hasMatrix ? state.matrixSize : 0;
+        header->wireFormat = wireFormat;
+        header->flags = hasMatrix ? session_flags() : (extendedConfig ? SESSION_EXTENDED : 0);
+        header->keyValid = inputKeyValid && hasMatrix;
+        header->keySize = inputKey.size;
+        header->keyFormat = inputKey.format;
+        header->keyHash = inputKey.hash;
+        header->matrixBytes = matrixBytes;
+        header->sideBytes = sideBytes;
+        header->reserved = 0;
+        const char* matrix = reinterpret_cast<const char*>(state.matrixData.data());
+        const char* side = reinterpret_cast<const char*>(state.sideResults.data());
+        auto copy = [image, header, matrix, side, matrixBytes, sideBytes] {
+            if (matrixBytes) std::memcpy(image + SESSION_HEADER_BYTES, matrix, (size_t)matrixBytes);
+            if (sideBytes) std::memcpy(image + SESSION_HEADER_BYTES + matrixBytes, side, (size_t)sideBytes);
+            header->magic = SESSION_MAGIC;
+        };
+        if (matrixBytes + sideBytes <= SESSION_INLINE_BYTES) { copy(); return; }
+        // The task holds the connection (and so `state`'s buffers) and the mapping until the copy is done
+        auto statePtr = std::shared_ptr<ClientState>(shared_from_this(), &state);
+        sessionSaving = true;
+        phase = ReadPhase::SavingSession;
+        try {
+            g_computePool->submit([this, statePtr, file = sessionFile, copy] {
+                copy();
+                sessionSaving = false;
+                if (statePtr->onProgress) statePtr->onProgress();
+            }, state.numaNode);
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] EXCEPTION while scheduling session save: " << e.what() << std::endl;
+            copy();
+            sessionSaving = false;
+            expect_command();
         }
-        if (i < size) matrix[rowStartIndex + i] = maxVal;
     }
-}
 
-void perform_computation(ClientState* state) {
-    // Run in a separate function to easily capture exceptions
-    try {
-        // Use resultData as the working copy
-        if (state->resultData.size() != state->matrixData.size()) {
-            state->resultData = state->matrixData; // Initial copy
-        } else {
-            std::copy(state->matrixData.begin(), state->matrixData.end(), state->resultData.begin()); // Recopy if needed
+    // Takes the session file's image as state's matrix. An incomplete or unusable image leaves the
+    // connection without a matrix, so the client just uploads it again.
+    void restore_session() {
+        drop_gpu_upload();
+        state.dataReceived = false;
+        state.processingDone = false;
+        state.errorOccurred = false;
+        inputKeyValid = false;
+        std::string path = g_sessions.path_for(sessionToken), error;
+        SessionHeader header{};
+        {
+            FileMapping headerFile;
+            if (headerFile.open(path, 0, SESSION_HEADER_BYTES, false, false, error)) header = *reinterpret_cast<SessionHeader*>(headerFile.data);
+        }
+        extendedConfig = (header.flags & SESSION_EXTENDED) != 0;
+        wireFormat = header.wireFormat;
+        uint32_t encoding = header.wireFormat & FORMAT_ENCODING_MASK;
+        uint64_t matrixBytes = valid_wire_format(header.wireFormat) ?
+                               (uint64_t)header.matrixSize * header.matrixSize * element_bytes(element_type(encoding)) : 0;
+        bool usable = header.magic == SESSION_MAGIC && header.matrixBytes > 0 && header.matrixBytes == matrixBytes &&
+                      !encoding_widened(encoding) && matrixBytes <= (uint64_t)config.maxMatrixMB << 20 &&
+                      (header.sideBytes == 0 || header.sideBytes == matrixBytes / header.matrixSize);
+        uint64_t fileBytes = SESSION_HEADER_BYTES + header.matrixBytes + header.sideBytes;
+        auto file = std::make_shared<FileMapping>();
+        if (!usable || !file->open(path, 0, fileBytes, true, false, error)) {
+            if (!error.empty()) std::cerr << LOG_PREFIX << "[" << clientId << "] Session image unusable: " << error << std::endl;
+            wireFormat = 0;
+            extendedConfig = false;
+            sessionDirty = true; // Rewrites the file to match
+            return;
+        }
+        sessionFile = std::move(file);
+        sessionFileBytes = fileBytes;
+        const char* image = reinterpret_cast<const char*>(sessionFile->data);
+        state.matrixSize = header.matrixSize;
+        state.matrixData.resize((size_t)((matrixBytes + sizeof(float) - 1) / sizeof(float)));
+        std::memcpy(state.matrixData.data(), image + SESSION_HEADER_BYTES, (size_t)matrixBytes);
+        state.set_reduction(wireFormat);
+        bool resultKept = (header.flags & SESSION_HAS_RESULT) && (!state.sideOutput || header.sideBytes > 0);
+        if (resultKept && header.sideBytes) std::memcpy(state.sideResults.data(), image + SESSION_HEADER_BYTES + matrixBytes, (size_t)header.sideBytes);
+        state.dataReceived = (header.flags & SESSION_HAS_MATRIX) != 0;
+        state.processingDone = resultKept;
+        inputKey = ResultKey{header.keySize, header.keyFormat, header.keyHash};
+        inputKeyValid = header.keyValid != 0;
+    }
+    // ----------------------
+
+    void handle_chunked_header() {
+        pendingSize = ntohl(scratch[0]);
+        pendingThreads = ntohl(scratch[1]);
+        pendingBlockRows = ntohl(scratch[2]);
+        pendingFormat = 0; // Row blocks are plain f32
+        pendingPayloadBytes = 0;
+        size_t windowBytes = config.windowMB << 20;
+        if (pendingSize == 0 || pendingBlockRows == 0 ||
+            !fits_bytes(std::min(pendingBlockRows, pendingSize), pendingSize, sizeof(float), windowBytes)) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid chunked config: Size=" << pendingSize
+                      << ", BlockRows=" << pendingBlockRows << " (window " << config.windowMB << " MB)" << std::endl;
+            streaming = chunked = false;
+            queue_uint32(RESP_ERROR);
+            closeAfterFlush = true;
+            return;
+        }
+        if (state.processingStarted) { // Pool tasks may still be reading the previous matrix
+            phase = ReadPhase::WaitingForJob;
+            return;
         }
+        begin_matrix_receive();
+    }
+    // ----------------------
 
-        uint32_t size = state->matrixSize;
-        uint32_t threads_to_use = std::max(1u, state->numThreads);
-        std::vector<std::thread> workers;
-        int rowsPerThread = size / threads_to_use;
-        int extraRows = size % threads_to_use;
-        int startRow = 0;
+    void handle_config_header() {
+        if (chunked) { handle_chunked_header(); return; }
+        pendingSize = ntohl(scratch[0]);
+        pendingThreads = ntohl(scratch[1]);
+        pendingFormat = 0;
+        pendingPayloadBytes = 0;
+        if (extendedConfig) {
+            pendingFormat = ntohl(scratch[2]);
+            pendingPayloadBytes = ((uint64_t)ntohl(scratch[3]) << 32) | ntohl(scratch[4]);
+        }
+        bool validFormat = valid_wire_format(pendingFormat);
+        uint64_t elementSize = validFormat ? element_bytes(element_type(pendingFormat & FORMAT_ENCODING_MASK)) : sizeof(float);
+        bool validSize = pendingSize > 0 && fits_bytes(pendingSize, pendingSize, elementSize, (uint64_t)config.maxMatrixMB << 20);
+        if (extendedConfig && validFormat && validSize) { // An encoding is never wider than its element, so this cannot wrap
+            uint64_t encodedBytes = (uint64_t)pendingSize * pendingSize * encoding_bytes(pendingFormat & FORMAT_ENCODING_MASK);
+            validFormat = (pendingFormat & FORMAT_LZ4) ? pendingPayloadBytes <= lz4_bound(encodedBytes) : pendingPayloadBytes == encodedBytes;
+        }
+        if (!validSize || !validFormat) { // Larger ones need CHUNKED_COMP
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid matrix size or format received: " << pendingSize
+                      << ", format " << pendingFormat << std::endl;
+            streaming = false;
+            queue_uint32(RESP_ERROR);  // Try to send error
+            closeAfterFlush = true;    // Terminate connection on bad config
+            return;
+        }
+        // std::cout << LOG_PREFIX << "[" << clientId << "] Receiving config: Size=" << pendingSize << ", Threads=" << pendingThreads << std::endl;
+        if (state.processingStarted) { // Pool tasks may still be reading the previous matrix
+            phase = ReadPhase::WaitingForJob; // resume() continues once the job has finished
+            return;
+        }
+        begin_matrix_receive();
+    }
 
-        for (uint32_t i = 0; i < threads_to_use; ++i) {
-            int rowsForThisThread = rowsPerThread + (i < extraRows ? 1 : 0);
-            if (rowsForThisThread > 0 && startRow < size) {
-                int endRow = std::min((uint32_t)(startRow + rowsForThisThread), size);
-                workers.emplace_back(process_matrix_rows, &(state->resultData), size, startRow, endRow);
-                startRow = endRow;
+    void handle_matrix_data() {
+        g_metrics.record(Timer::Receive, std::chrono::steady_clock::now() - receiveStarted);
+        // Reset state for new data
+        state.processingDone = false; state.errorOccurred = false;
+        if (wireFormat & FORMAT_LZ4) {
+            uint32_t encoding = wireFormat & FORMAT_ENCODING_MASK;
+            size_t count = (size_t)state.matrixSize * state.matrixSize;
+            void* target = state.matrixData.data();
+            if (encoding_widened(encoding)) {
+                encodedInput.resize((count * encoding_bytes(encoding) + sizeof(float) - 1) / sizeof(float));
+                target = encodedInput.data();
+            }
+            bool ok = decompress_payload(compressedInput.data(), (size_t)payloadBytes, target, count * encoding_bytes(encoding), encoding_bytes(encoding));
+            compressedInput.release();
+            if (!ok) {
+                std::cerr << LOG_PREFIX << "[" << clientId << "] Corrupt compressed matrix payload." << std::endl;
+                state.dataReceived = false;
+                queue_uint32(RESP_ERROR);
+                expect_command();
+                return;
             }
         }
-        for (auto& t : workers) { if (t.joinable()) t.join(); }
+        if (hashingInput) {
+            // Where the results go does not change them
+            inputKey = ResultKey{state.matrixSize, wireFormat & ~(FORMAT_FULL_RESULT | FORMAT_SIDE_VECTOR), inputHash.digest()};
+            inputKeyValid = true;
+            hashingInput = false;
+        }
+        state.dataReceived = true;
+        sessionDirty = true;
+        queue_uint32(RESP_ACK);
+        expect_command();
+    }
 
-        state->processingDone = true; // Mark as done *only* on success
-        state->errorOccurred = false;
-        // std::cout << LOG_PREFIX << "[" << state->socket << "] Computation finished successfully." << std::endl;
+    // Returns with processingStarted still false when the result came from g_resultCache; false when
+    // the scheduler's backlog is full
+    bool start_job() {
+        sessionDirty = true;     // Saved once the result is in
+        state.rowsReady.reset(); // Left over from a streamed job; none of its tasks are running any more
+        state.sourceEncoding = wireFormat & FORMAT_ENCODING_MASK;
+        state.set_reduction(wireFormat);
+        // A sum written to the diagonal changes the row it came from, so the matrix cannot be run again
+        bool consumesInput = !state.sideOutput && (state.reduceOp == OP_SUM || state.reduceOp == OP_MEAN);
+        // A hit only restores the results, so a half-precision matrix must still be widened if it goes back whole
+        bool resultsSuffice = !encoding_widened(state.sourceEncoding) || !(wireFormat & FORMAT_FULL_RESULT);
+        // A hit writes into matrixData, which an upload may still be reading
+        if (state.gpuMatrix && inputKeyValid && resultsSuffice && g_resultCache.contains(inputKey)) drop_gpu_upload();
+        if (inputKeyValid && resultsSuffice && g_resultCache.load(inputKey, state.results(), state.results_stride(), element_bytes(state.elementType))) {
+            g_metrics.add(Counter::CacheHits);
+            state.errorOccurred = false;
+            state.processingDone = true;
+            if (consumesInput) state.dataReceived = false;
+            return true;
+        }
+        if (inputKeyValid) g_metrics.add(Counter::CacheMisses);
+        state.cacheKey = inputKey;
+        state.cacheStore = inputKeyValid;
+        // Set flags *before* handing tasks to the pool
+        state.processingStarted = true; state.processingDone = false; state.errorOccurred = false;
+        const void* source = encoding_widened(state.sourceEncoding) ? encodedInput.data() : nullptr;
+        auto self = std::shared_ptr<ClientState>(shared_from_this(), &state);
+        uint64_t cost = (uint64_t)state.matrixSize * state.matrixSize;
+        if (admit_job(self, cost, [self, source] { perform_computation(self, self->matrixData.data(), source); })) {
+            if (consumesInput) state.dataReceived = false;
+            return true;
+        }
+        state.processingStarted = false;
+        state.cacheStore = false;
+        return false;
+    }
 
-    } catch (const std::exception& e) {
-        std::cerr << LOG_PREFIX << "[" << state->socket << "] EXCEPTION during computation: " << e.what() << std::endl;
-        state->errorOccurred = true;
-        state->processingDone = false; // Indicate it didn't finish correctly
-    } catch (...) {
-        std::cerr << LOG_PREFIX << "[" << state->socket << "] UNKNOWN EXCEPTION during computation." << std::endl;
-        state->errorOccurred = true;
-        state->processingDone = false;
+    // Hands the job to g_scheduler; `start` (which queues its tasks) runs once it is admitted, possibly on a
+    // pool thread. False, with `start` dropped, when the backlog is full.
+    bool admit_job(const std::shared_ptr<ClientState>& jobState, uint64_t cost, std::function<void()> start) {
+        auto queuedAt = std::chrono::steady_clock::now();
+        bool accepted = g_scheduler.admit(tenant, priority, weight, cost, [jobState, start = std::move(start), queuedAt] {
+            g_metrics.record(Timer::AdmissionWait, std::chrono::steady_clock::now() - queuedAt);
+            jobState->admitted = true;
+            start();
+        });
+        if (!accepted) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Job rejected: server busy." << std::endl;
+            g_metrics.add(Counter::JobsRejected);
+        }
+        return accepted;
     }
-    state->processingStarted = false; // Computation attempt is over (success or fail)
-}
-// ----------------------------
 
-// --- Client Handler ---
-void handle_client(SOCKET clientSocket) {
-    char clientIpStr[INET_ADDRSTRLEN];
-    sockaddr_in clientAddr;
-    int clientAddrSize = sizeof(clientAddr);
-    std::string clientId = "Socket " + std::to_string(clientSocket); // Default ID
+    // CONFIG_EX result payload: the N results, or the whole matrix (then the side vector, if any) when asked
+    // for; in the job's element type, compressed if negotiated
+    void queue_extended_result() {
+        uint32_t size = state.matrixSize;
+        size_t elementSize = element_bytes(state.elementType);
+        std::vector<uint8_t> packed; // Set unless the payload is just matrixData
+        const void* payload = state.matrixData.data();
+        size_t bytes = (size_t)size * size * elementSize;
+        size_t resultBytes = (size_t)size * elementSize;
+        if (!(wireFormat & FORMAT_FULL_RESULT)) {
+            packed.resize(resultBytes);
+            const char* results = static_cast<const char*>(state.results());
+            size_t stride = state.results_stride() * elementSize;
+            for (uint32_t i = 0; i < size; ++i) std::memcpy(&packed[i * elementSize], results + i * stride, elementSize);
+        } else if (state.sideOutput) {
+            packed.resize(bytes + resultBytes);
+            std::memcpy(packed.data(), state.matrixData.data(), bytes);
+            std::memcpy(packed.data() + bytes, state.sideResults.data(), resultBytes);
+        }
+        if (!packed.empty()) {
+            payload = packed.data();
+            bytes = packed.size();
+        }
+        OutChunk chunk;
+        if (wireFormat & FORMAT_LZ4) {
+            std::vector<uint8_t> compressed;
+            compress_payload(payload, bytes, elementSize, compressed);
+            chunk.bytes.assign(compressed.begin(), compressed.end());
+        } else if (!packed.empty()) {
+            chunk.bytes.assign(packed.begin(), packed.end());
+        }
+        uint64_t wireBytes = chunk.bytes.empty() ? bytes : chunk.bytes.size();
+        queue_uint32(size);
+        queue_uint32(wireFormat);
+        queue_uint32((uint32_t)(wireBytes >> 32));
+        queue_uint32((uint32_t)wireBytes);
+        if (chunk.bytes.empty()) { queue_borrowed(state.matrixData.data(), bytes); return; }
+        start_send_timer();
+        outQueue.push_back(std::move(chunk));
+    }
 
-    if (getpeername(clientSocket, (struct sockaddr*)&clientAddr, &clientAddrSize) == 0) {
-        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIpStr, INET_ADDRSTRLEN);
-        clientId = std::string(clientIpStr) + ":" + std::to_string(ntohs(clientAddr.sin_port)) + " (" + std::to_string(clientSocket) + ")";
+    void queue_status_response() {
+        uint32_t response_code;
+        bool send_data = false;
+
+        if (state.errorOccurred)       response_code = RESP_ERROR;
+        else if (state.processingDone) { response_code = RESP_RESULT; send_data = true; }
+        else if (state.processingStarted) response_code = RESP_STATUS_PENDING;
+        else                           response_code = RESP_ERROR; // Error if no data/not started
+
+        queue_uint32(response_code);
+        if (send_data && extendedConfig) {
+            queue_extended_result();
+        } else if (send_data) {
+            queue_uint32(state.matrixSize);
+            queue_floats(state.matrixData.data(), state.matrixData.size());
+        }
+    }
+
+    void handle_command(uint32_t command) {
+        // std::cout << LOG_PREFIX << "[" << clientId << "] Received command: " << command << std::endl;
+        switch (command) {
+            case CMD_CONFIG_DATA:
+            case CMD_STREAM_COMP:
+            case CMD_CONFIG_EX:
+                streaming = (command == CMD_STREAM_COMP);
+                chunked = false;
+                extendedConfig = (command == CMD_CONFIG_EX);
+                expect(&scratch[0], (extendedConfig ? 5 : 2) * sizeof(uint32_t), ReadPhase::ConfigHeader);
+                return;
+            case CMD_CHUNKED_COMP:
+                streaming = chunked = true;
+                extendedConfig = false;
+                expect(&scratch[0], 3 * sizeof(uint32_t), ReadPhase::ConfigHeader);
+                return;
+            case CMD_FILE_COMP:
+                expect(&scratch[0], 6 * sizeof(uint32_t), ReadPhase::FileHeader);
+                return;
+            case CMD_SUBMIT_JOB:
+                expect(&scratch[0], 3 * sizeof(uint32_t), ReadPhase::JobHeader);
+                return;
+            case CMD_BATCH:
+                expect(&scratch[0], 2 * sizeof(uint32_t), ReadPhase::BatchHeader);
+                return;
+            case CMD_SET_PRIORITY:
+                expect(&scratch[0], 2 * sizeof(uint32_t), ReadPhase::PriorityArgs);
+                return;
+            case CMD_SHARD_COMP:
+                expect(&scratch[0], 5 * sizeof(uint32_t), ReadPhase::ShardHeader);
+                return;
+            case CMD_UPDATE_ROWS:
+                expect(&scratch[0], 2 * sizeof(uint32_t), ReadPhase::UpdateHeader);
+                return;
+            case CMD_SESSION:
+                expect(&scratch[0], 3 * sizeof(uint32_t), ReadPhase::SessionArgs);
+                return;
+            case CMD_SHM_ATTACH:
+                expect(&scratch[0], 3 * sizeof(uint32_t), ReadPhase::ShmAttachArgs);
+                return;
+            case CMD_SHM_SUBMIT:
+                expect(&scratch[0], 4 * sizeof(uint32_t), ReadPhase::ShmSubmitArgs);
+                return;
+            case CMD_START_COMP: {
+                if (!state.dataReceived && !state.processingStarted) { // A running sum job has consumed its input
+                    std::cerr << LOG_PREFIX << "[" << clientId << "] Error: START_COMP received before CONFIG_DATA." << std::endl;
+                    queue_uint32(RESP_ERROR); // Don't disconnect, just signal error for this command
+                    break;
+                }
+                if (state.processingStarted) { // Check atomic flag
+                    std::cerr << LOG_PREFIX << "[" << clientId << "] Warning: START_COMP received while already processing." << std::endl;
+                    queue_uint32(RESP_ACK); // Send ACK, but don't restart computation
+                    break;
+                }
+                queue_uint32(start_job() ? RESP_ACK : RESP_BUSY);
+                break;
+            }
+            case CMD_START_AND_WAIT: {
+                if (!state.dataReceived && !state.processingStarted) { // A running sum job has consumed its input
+                    std::cerr << LOG_PREFIX << "[" << clientId << "] Error: START_AND_WAIT received before CONFIG_DATA." << std::endl;
+                    queue_uint32(RESP_ERROR);
+                    break;
+                }
+                if (!state.processingStarted) {
+                    if (!start_job()) { queue_uint32(RESP_BUSY); break; }
+                    if (!state.processingStarted) { queue_status_response(); break; } // Answered from the cache
+                } // Otherwise just wait for the running job
+                phase = ReadPhase::WaitingForResult; // resume() queues the outcome once the job is done
+                return;
+            }
+            case CMD_GET_STATUS:
+                queue_status_response();
+                break;
+            case CMD_GET_METRICS: {
+                std::string text = render_metrics();
+                queue_uint32(RESP_METRICS);
+                queue_uint32((uint32_t)text.size());
+                queue_bytes(text);
+                break;
+            }
+            default:
+                std::cerr << LOG_PREFIX << "[" << clientId << "] Received unknown command: " << command << std::endl;
+                queue_uint32(RESP_ERROR); // Don't disconnect on unknown command, just report error
+                break;
+        }
+        expect_command();
+    }
+};
+// ----------------------
+
+// --- Event-Driven I/O ---
+// A small fixed set of I/O threads drives every connection, so idle clients cost no thread stacks.
+// Linux: one epoll instance per I/O thread, each connection pinned to one of them. With NUMA on, the
+// loops are dealt out over the nodes and their threads may be pinned there.
+// Windows: one completion port shared by all I/O threads, with at most one receive and one send
+// posted per connection at any time; connections are dealt out over the nodes for their compute only.
+class IoService {
+public:
+    IoService(size_t threadCount, const ServerConfig& config, bool pinToNodes = false)
+        : config(config), threadCount(std::max<size_t>(1, threadCount)), pinToNodes(pinToNodes) {}
+    ~IoService() {
+        stop();
+#ifdef _WIN32
+        if (port) CloseHandle(port);
+#else
+        for (auto& loop : loops) {
+            if (loop->epollFd >= 0) close(loop->epollFd);
+            if (loop->wakeFd >= 0) close(loop->wakeFd);
+        }
+#endif
+    }
+
+    IoService(const IoService&) = delete;
+    IoService& operator=(const IoService&) = delete;
+
+    size_t size() const { return threadCount; }
+
+    bool start() {
+#ifdef _WIN32
+        port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, (DWORD)threadCount);
+        if (!port) {
+            std::cerr << LOG_PREFIX << "CreateIoCompletionPort failed: " << GetWSAErrorString(GetLastError()) << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < threadCount; ++i) threads.emplace_back(&IoService::run_iocp, this);
+#else
+        for (size_t i = 0; i < threadCount; ++i) {
+            auto loop = std::make_unique<Loop>();
+            if (numa_enabled()) loop->node = (int)(i % g_numaNodes.size());
+            loop->epollFd = epoll_create1(0);
+            loop->wakeFd = eventfd(0, EFD_NONBLOCK);
+            if (loop->epollFd < 0 || loop->wakeFd < 0) {
+                std::cerr << LOG_PREFIX << "epoll/eventfd setup failed: " << GetWSAErrorString(errno) << std::endl;
+                loops.push_back(std::move(loop));
+                return false;
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr; // Marks the wake-up descriptor
+            epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &ev);
+            loops.push_back(std::move(loop));
+        }
+        for (auto& loop : loops) loop->thread = std::thread(&IoService::run_epoll, this, loop.get());
+#endif
+        return true;
+    }
+
+    void stop() {
+        if (stopping.exchange(true)) return;
+#ifdef _WIN32
+        for (size_t i = 0; i < threads.size(); ++i) PostQueuedCompletionStatus(port, 0, STOP_KEY, NULL);
+        for (auto& t : threads) { if (t.joinable()) t.join(); }
+        close_all(connections);
+#else
+        for (auto& loop : loops) {
+            signal_loop(*loop);
+            if (loop->thread.joinable()) loop->thread.join();
+            close_all(loop->connections);
+        }
+#endif
+    }
+
+    // Called from the accept thread; takes ownership of the socket
+    void add_client(SOCKET clientSocket) {
+        std::string clientId = describe_client(clientSocket);
+        apply_socket_options(clientSocket, config);
+        auto conn = std::make_shared<Connection>(clientSocket, clientId, config);
+        std::weak_ptr<Connection> weakConn = conn;
+        conn->state.onProgress = [this, weakConn] { if (auto c = weakConn.lock()) wake(c); };
         std::cout << LOG_PREFIX << "Client connected: " << clientId << std::endl;
-    } else {
-        std::cout << LOG_PREFIX << "Client connected: " << clientId << " (getpeername failed: " << WSAGetLastError() << ")" << std::endl;
+        g_metrics.add(Counter::ConnectionsAccepted);
+        g_activeConnections.fetch_add(1);
+
+#ifdef _WIN32
+        if (numa_enabled()) conn->state.numaNode = (int)(nextNode.fetch_add(1) % g_numaNodes.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections[conn.get()] = conn;
+        }
+        bool attached = CreateIoCompletionPort((HANDLE)clientSocket, port, (ULONG_PTR)conn.get(), 0) != NULL;
+        if (!attached) {
+            std::cerr << LOG_PREFIX << "[" << clientId << "] Failed to attach socket to completion port: " << GetWSAErrorString(GetLastError()) << std::endl;
+        }
+        run_round(conn.get(), [&] { if (!attached) close_connection(*conn); }); // Posts the first receive
+#else
+        int flags = fcntl(clientSocket, F_GETFL, 0);
+        fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK);
+        conn->loopIndex = nextLoop.fetch_add(1) % loops.size();
+        Loop& loop = *loops[conn->loopIndex];
+        conn->state.numaNode = loop.node;
+        {
+            std::lock_guard<std::mutex> lock(loop.mutex);
+            loop.connections[conn.get()] = conn;
+        }
+        bool added;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            conn->epollEvents = EPOLLIN;
+            epoll_event ev{};
+            ev.events = conn->epollEvents;
+            ev.data.ptr = conn.get();
+            added = epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, clientSocket, &ev) == 0;
+            if (!added) {
+                std::cerr << LOG_PREFIX << "[" << clientId << "] epoll_ctl ADD failed: " << GetWSAErrorString(errno) << std::endl;
+                close_connection(*conn);
+            }
+        }
+        if (!added) {
+            std::lock_guard<std::mutex> lock(loop.mutex);
+            loop.connections.erase(conn.get());
+        }
+#endif
     }
 
-    ClientState state;
-    state.socket = clientSocket;
-    bool keep_connection = true;
+    // Thread-safe; asks the connection's I/O thread to re-examine it (e.g. after its job finished)
+    void wake(const std::shared_ptr<Connection>& conn) {
+#ifdef _WIN32
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            woken.push_back(conn);
+        }
+        PostQueuedCompletionStatus(port, 0, WAKE_KEY, NULL);
+#else
+        Loop& loop = *loops[conn->loopIndex];
+        {
+            std::lock_guard<std::mutex> lock(loop.mutex);
+            loop.woken.push_back(conn);
+        }
+        signal_loop(loop);
+#endif
+    }
 
-    try {
-        while (keep_connection) {
-            uint32_t command;
-            // std::cout << LOG_PREFIX << "[" << clientId << "] Waiting for command..." << std::endl;
-            if (!recv_uint32(clientSocket, command, "waiting for command")) {
-                keep_connection = false; break; // Exit loop if recv fails
-            }
-            // std::cout << LOG_PREFIX << "[" << clientId << "] Received command: " << command << std::endl;
-
-            switch (command) {
-                case CMD_CONFIG_DATA: {
-                    if (!recv_uint32(clientSocket, state.matrixSize, "recv matrix size") ||
-                        !recv_uint32(clientSocket, state.numThreads, "recv num threads")) {
-                        keep_connection = false; break;
-                    }
-                    if (state.matrixSize == 0 || state.matrixSize > 3000) { // Increased limit slightly
-                        std::cerr << LOG_PREFIX << "[" << clientId << "] Invalid matrix size received: " << state.matrixSize << std::endl;
-                        send_uint32(clientSocket, RESP_ERROR, "send invalid size error"); // Try to send error
-                        keep_connection = false; break; // Terminate connection on bad config
-                    }
-                    size_t dataSize = (size_t)state.matrixSize * state.matrixSize;
-                    // std::cout << LOG_PREFIX << "[" << clientId << "] Receiving config: Size=" << state.matrixSize << ", Threads=" << state.numThreads << ", Elements=" << dataSize << std::endl;
-                    if (!recv_floats(clientSocket, state.matrixData, dataSize, "recv matrix data")) {
-                        keep_connection = false; break;
-                    }
-                    // Reset state for new data
-                    state.dataReceived = true; state.processingStarted = false;
-                    state.processingDone = false; state.errorOccurred = false;
-                    if (state.workerThread.joinable()) state.workerThread.join(); // Clean up previous thread if any
+private:
+    typedef std::unordered_map<Connection*, std::shared_ptr<Connection>> ConnectionMap;
 
-                    if (!send_uint32(clientSocket, RESP_ACK, "send config ACK")) keep_connection = false;
-                    break;
+    // Caller holds conn.mutex
+    void close_connection(Connection& conn) {
+        if (conn.closed) return;
+        std::cout << LOG_PREFIX << "Disconnecting client: " << conn.clientId << std::endl;
+#ifndef _WIN32
+        epoll_ctl(loops[conn.loopIndex]->epollFd, EPOLL_CTL_DEL, conn.socket, nullptr);
+#endif
+        shutdown(conn.socket, SD_BOTH); // Signal close intent
+        closesocket(conn.socket);       // Close the socket; on Windows this also cancels posted operations
+        conn.closed = true;
+        conn.outQueue.clear();
+        conn.on_close();
+        g_activeConnections.fetch_sub(1);
+    }
+
+    void close_all(ConnectionMap& map) {
+        ConnectionMap remaining;
+        {
+#ifdef _WIN32
+            std::lock_guard<std::mutex> lock(mutex);
+#endif
+            remaining.swap(map);
+        }
+        for (auto& entry : remaining) {
+            std::lock_guard<std::mutex> lock(entry.second->mutex);
+            close_connection(*entry.second);
+        }
+    }
+
+    void log_receive_end(const Connection& conn) {
+        if (conn.mid_message()) {
+            std::cerr << LOG_PREFIX << "[" << conn.clientId << "] Client disconnected before all data received." << std::endl;
+        } else {
+            std::cerr << LOG_PREFIX << "[" << conn.clientId << "] Client disconnected gracefully." << std::endl;
+        }
+    }
+
+    void log_socket_error(const Connection& conn, const char* operation, int error_code) {
+        std::cerr << LOG_PREFIX << "[" << conn.clientId << "] " << operation << " failed: " << GetWSAErrorString(error_code) << std::endl;
+        if (error_code == WSAECONNRESET) {
+            std::cerr << LOG_PREFIX << "[" << conn.clientId << "] Connection reset by peer." << std::endl;
+        }
+    }
+
+#ifdef _WIN32
+    static const ULONG_PTR STOP_KEY = 0;
+    static const ULONG_PTR WAKE_KEY = 1; // Connection keys are pointers, so never 0 or 1
+
+    // Posts whatever the connection needs next. Caller holds conn.mutex.
+    void drive(Connection& conn) {
+        if (conn.closed) return;
+        if (conn.has_output() && !conn.sendPosted) {
+            IoSlice slices[IO_MAX_GATHER];
+            WSABUF bufs[IO_MAX_GATHER]; // Winsock captures the array before WSASend returns
+            size_t count = conn.gather_output(slices, IO_MAX_GATHER, IO_MAX_TRANSFER);
+            for (size_t i = 0; i < count; ++i) {
+                bufs[i].buf = const_cast<CHAR*>(slices[i].data);
+                bufs[i].len = (ULONG)slices[i].size;
+            }
+            ZeroMemory(&conn.sendOp.overlapped, sizeof(OVERLAPPED));
+            if (WSASend(conn.socket, bufs, (DWORD)count, NULL, 0, &conn.sendOp.overlapped, NULL) == SOCKET_ERROR &&
+                WSAGetLastError() != WSA_IO_PENDING) {
+                log_socket_error(conn, "WSASend", WSAGetLastError());
+                close_connection(conn);
+                return;
+            }
+            conn.sendPosted = true;
+        }
+        if (!conn.has_output() && conn.closeAfterFlush) { close_connection(conn); return; }
+        char* ptr;
+        size_t len;
+        if (!conn.recvPosted && conn.want_read(ptr, len)) {
+            WSABUF buf;
+            buf.buf = ptr;
+            buf.len = (ULONG)len;
+            DWORD flags = 0;
+            ZeroMemory(&conn.recvOp.overlapped, sizeof(OVERLAPPED));
+            if (WSARecv(conn.socket, &buf, 1, NULL, &flags, &conn.recvOp.overlapped, NULL) == SOCKET_ERROR &&
+                WSAGetLastError() != WSA_IO_PENDING) {
+                log_socket_error(conn, "WSARecv", WSAGetLastError());
+                close_connection(conn);
+                return;
+            }
+            conn.recvPosted = true;
+        }
+    }
+
+    // Applies `step` and drives the connection under its lock, then drops it once no operation refers to it
+    template <typename Step>
+    void run_round(Connection* conn, Step step) {
+        bool release = false;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            t_numaNode = conn->state.numaNode; // Buffers are pooled per node even though this thread is not on it
+            step();
+            drive(*conn);
+            release = conn->closed && !conn->recvPosted && !conn->sendPosted && !conn->released;
+            if (release) conn->released = true;
+        }
+        if (release) {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.erase(conn); // May destroy the connection
+        }
+    }
+
+    void run_iocp() {
+        while (true) {
+            DWORD bytes = 0;
+            ULONG_PTR key = 0;
+            OVERLAPPED* overlapped = nullptr;
+            BOOL ok = GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, INFINITE);
+            if (overlapped == nullptr) {
+                if (!ok) {
+                    std::cerr << LOG_PREFIX << "GetQueuedCompletionStatus failed: " << GetWSAErrorString(GetLastError()) << std::endl;
+                    return;
                 }
-                case CMD_START_COMP: {
-                    if (!state.dataReceived) {
-                        std::cerr << LOG_PREFIX << "[" << clientId << "] Error: START_COMP received before CONFIG_DATA." << std::endl;
-                        if (!send_uint32(clientSocket, RESP_ERROR, "send start-before-config error")) keep_connection = false;
-                        break; // Don't disconnect, just signal error for this command
-                    }
-                    if (state.processingStarted) { // Check atomic flag
-                        std::cerr << LOG_PREFIX << "[" << clientId << "] Warning: START_COMP received while already processing." << std::endl;
-                        // Send ACK, but don't restart computation
-                        if (!send_uint32(clientSocket, RESP_ACK, "send duplicate start ACK")) keep_connection = false;
-                        break;
-                    }
-                    // Join previous thread just in case (should be done, but safety)
-                    if (state.workerThread.joinable()) state.workerThread.join();
+                if (key == STOP_KEY) return;
+                std::vector<std::shared_ptr<Connection>> batch;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    batch.swap(woken);
+                }
+                for (auto& conn : batch) run_round(conn.get(), [&] { if (!conn->closed) conn->resume(); });
+                continue;
+            }
+
+            Connection* conn = reinterpret_cast<Connection*>(key);
+            int error_code = ok ? 0 : (int)GetLastError();
+            if (overlapped == &conn->recvOp.overlapped) {
+                run_round(conn, [&] {
+                    conn->recvPosted = false;
+                    if (conn->closed) return;
+                    if (!ok) { log_socket_error(*conn, "WSARecv", error_code); close_connection(*conn); }
+                    else if (bytes == 0) { log_receive_end(*conn); close_connection(*conn); }
+                    else conn->on_received(bytes);
+                });
+            } else {
+                run_round(conn, [&] {
+                    conn->sendPosted = false;
+                    if (conn->closed) return;
+                    if (!ok) { log_socket_error(*conn, "WSASend", error_code); close_connection(*conn); }
+                    else conn->on_sent(bytes);
+                });
+            }
+        }
+    }
 
-                    // Set flags *before* starting thread
-                    state.processingStarted = true; state.processingDone = false; state.errorOccurred = false;
-                    // std::cout << LOG_PREFIX << "[" << clientId << "] Starting computation thread..." << std::endl;
-                    state.workerThread = std::thread(perform_computation, &state); // Pass pointer to state
+    HANDLE port = NULL;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextNode{0};
+    std::mutex mutex; // Guards connections and woken
+    ConnectionMap connections;
+    std::vector<std::shared_ptr<Connection>> woken;
+#else
+    struct Loop {
+        int epollFd = -1;
+        int wakeFd = -1;
+        int node = -1; // Index into g_numaNodes, -1 with NUMA off
+        std::thread thread;
+        std::mutex mutex; // Guards connections and woken
+        ConnectionMap connections;
+        std::vector<std::shared_ptr<Connection>> woken;
+    };
 
-                    if (!send_uint32(clientSocket, RESP_ACK, "send start ACK")) keep_connection = false;
-                    break;
+    void signal_loop(Loop& loop) {
+        uint64_t one = 1;
+        ssize_t ignored = write(loop.wakeFd, &one, sizeof(one));
+        (void)ignored; // A full counter still wakes the loop
+    }
+
+    // Reads and writes until the socket would block. Caller holds conn.mutex.
+    void drive(Connection& conn, uint32_t events) {
+        if (conn.closed) return;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            int error_code = 0;
+            socklen_t len = sizeof(error_code);
+            getsockopt(conn.socket, SOL_SOCKET, SO_ERROR, &error_code, &len);
+            if (error_code) log_socket_error(conn, "socket", error_code);
+            else log_receive_end(conn);
+            close_connection(conn);
+            return;
+        }
+        int reads = 0;
+        bool writable = true;
+        while (true) {
+            // Flush first: each command is answered before the next one is read
+            while (writable && conn.has_output()) {
+                IoSlice slices[IO_MAX_GATHER];
+                iovec iov[IO_MAX_GATHER];
+                size_t count = conn.gather_output(slices, IO_MAX_GATHER, IO_MAX_TRANSFER);
+                for (size_t i = 0; i < count; ++i) {
+                    iov[i].iov_base = const_cast<char*>(slices[i].data);
+                    iov[i].iov_len = slices[i].size;
                 }
-                case CMD_GET_STATUS: {
-                    uint32_t response_code;
-                    bool send_data = false;
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+                ssize_t sent = sendmsg(conn.socket, &msg, MSG_NOSIGNAL); // writev, but without SIGPIPE
+                if (sent > 0) { conn.on_sent((size_t)sent); continue; }
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { writable = false; break; }
+                log_socket_error(conn, "send", errno);
+                close_connection(conn);
+                return;
+            }
+            if (conn.closeAfterFlush && !conn.has_output()) { close_connection(conn); return; }
 
-                    if (state.errorOccurred)       response_code = RESP_ERROR;
-                    else if (state.processingDone) { response_code = RESP_RESULT; send_data = true; }
-                    else if (state.processingStarted) response_code = RESP_STATUS_PENDING;
-                    else                           response_code = RESP_ERROR; // Error if no data/not started
+            char* ptr;
+            size_t len;
+            if (reads >= IO_MAX_READS_PER_EVENT || !conn.want_read(ptr, len)) break;
+            ssize_t received = recv(conn.socket, ptr, len, 0);
+            ++reads;
+            if (received > 0) { conn.on_received((size_t)received); continue; }
+            if (received == 0) { log_receive_end(conn); close_connection(conn); return; }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_socket_error(conn, "recv", errno);
+            close_connection(conn);
+            return;
+        }
 
-                    if (!send_uint32(clientSocket, response_code, "send status response")) {
-                        keep_connection = false; break;
-                    }
-                    if (send_data) {
-                        // std::cout << LOG_PREFIX << "[" << clientId << "] Sending RESULT data (Size="<< state.matrixSize <<")..." << std::endl;
-                        if (!send_uint32(clientSocket, state.matrixSize, "send result size") ||
-                            !send_floats(clientSocket, state.resultData, "send result data")) {
-                            keep_connection = false; // Error during result sending
-                        }
+        char* ptr;
+        size_t len;
+        uint32_t wanted = (conn.has_output() ? (uint32_t)EPOLLOUT : 0u) | (conn.want_read(ptr, len) ? (uint32_t)EPOLLIN : 0u);
+        if (wanted != conn.epollEvents) {
+            epoll_event ev{};
+            ev.events = wanted;
+            ev.data.ptr = &conn;
+            epoll_ctl(loops[conn.loopIndex]->epollFd, EPOLL_CTL_MOD, conn.socket, &ev);
+            conn.epollEvents = wanted;
+        }
+    }
 
+    void run_epoll(Loop* loop) {
+        const int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        std::vector<Connection*> closedNow;
+        std::vector<std::shared_ptr<Connection>> keepUntilRoundEnd; // Later events of a batch may still name them
+        t_numaNode = loop->node;
+        if (loop->node >= 0 && pinToNodes && !pin_current_thread(g_numaNodes[loop->node].cpus)) {
+            std::cerr << LOG_PREFIX << "Could not pin an I/O thread to node " << g_numaNodes[loop->node].osId << "." << std::endl;
+        }
+        while (!stopping) {
+            int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << LOG_PREFIX << "epoll_wait failed: " << GetWSAErrorString(errno) << std::endl;
+                return;
+            }
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.ptr == nullptr) {
+                    uint64_t counter;
+                    ssize_t ignored = read(loop->wakeFd, &counter, sizeof(counter));
+                    (void)ignored;
+                    std::vector<std::shared_ptr<Connection>> batch;
+                    {
+                        std::lock_guard<std::mutex> lock(loop->mutex);
+                        batch.swap(loop->woken);
                     }
-                    break;
+                    for (auto& conn : batch) {
+                        std::lock_guard<std::mutex> lock(conn->mutex);
+                        if (conn->closed) continue;
+                        conn->resume();
+                        drive(*conn, 0);
+                        if (conn->closed) closedNow.push_back(conn.get());
+                    }
+                    keepUntilRoundEnd.insert(keepUntilRoundEnd.end(), batch.begin(), batch.end());
+                    continue;
                 }
-                default:
-                    std::cerr << LOG_PREFIX << "[" << clientId << "] Received unknown command: " << command << std::endl;
-                    if (!send_uint32(clientSocket, RESP_ERROR, "send unknown command error")) keep_connection = false;
-                    // Don't disconnect on unknown command, just report error
-                    break;
-            } // end switch
-        } // end while(keep_connection)
-
-    } catch (const std::exception& e) {
-        std::cerr << LOG_PREFIX << "[" << clientId << "] Exception in client handler: " << e.what() << std::endl;
-    } catch (...) {
-        std::cerr << LOG_PREFIX << "[" << clientId << "] Unknown exception in client handler." << std::endl;
+                Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+                std::lock_guard<std::mutex> lock(conn->mutex);
+                if (conn->closed) continue;
+                drive(*conn, events[i].events);
+                if (conn->closed) closedNow.push_back(conn);
+            }
+            // Connections still referenced by pool tasks live on until those tasks finish
+            {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                for (Connection* conn : closedNow) {
+                    auto it = loop->connections.find(conn);
+                    if (it == loop->connections.end()) continue;
+                    keepUntilRoundEnd.push_back(std::move(it->second));
+                    loop->connections.erase(it);
+                }
+            }
+            closedNow.clear();
+            keepUntilRoundEnd.clear();
+        }
     }
 
-    // --- Cleanup for this client ---
-    std::cout << LOG_PREFIX << "Disconnecting client: " << clientId << std::endl;
-    // State object destructor will handle joining the thread if needed.
-    shutdown(clientSocket, SD_BOTH); // Signal close intent
-    closesocket(clientSocket);       // Close the socket
-}
+    std::vector<std::unique_ptr<Loop>> loops;
+    std::atomic<size_t> nextLoop{0};
+#endif
+
+    const ServerConfig& config;
+    size_t threadCount;
+    bool pinToNodes;
+    std::atomic<bool> stopping{false};
+};
 // ----------------------
 
 // --- Main Server Logic ---
-int main() {
+bool parse_server_args(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg.rfind("--kernel=", 0) == 0) { config.kernel = arg.substr(9); continue; }
+            if (arg.rfind("--io-threads=", 0) == 0) { config.ioThreads = std::stoul(arg.substr(13)); continue; }
+            if (arg.rfind("--sndbuf=", 0) == 0) { config.sendBufferBytes = std::stoi(arg.substr(9)); continue; }
+            if (arg.rfind("--rcvbuf=", 0) == 0) { config.recvBufferBytes = std::stoi(arg.substr(9)); continue; }
+            if (arg.rfind("--nodelay=", 0) == 0) { config.noDelay = std::stoi(arg.substr(10)) != 0; continue; }
+            if (arg.rfind("--buffer-pool-mb=", 0) == 0) { config.bufferPoolMB = std::stoul(arg.substr(17)); continue; }
+            if (arg.rfind("--hugepages=", 0) == 0) { config.hugePages = std::stoi(arg.substr(12)) != 0; continue; }
+            if (arg.rfind("--max-matrix-mb=", 0) == 0) { config.maxMatrixMB = std::stoul(arg.substr(16)); continue; }
+            if (arg.rfind("--window-mb=", 0) == 0) { config.windowMB = std::stoul(arg.substr(12)); continue; }
+            if (arg.rfind("--file-root=", 0) == 0) { config.fileRoot = arg.substr(12); continue; }
+            if (arg.rfind("--cache-mb=", 0) == 0) { config.cacheMB = std::stoul(arg.substr(11)); continue; }
+            if (arg.rfind("--max-jobs=", 0) == 0) { config.maxJobs = std::stoul(arg.substr(11)); continue; }
+            if (arg.rfind("--max-waiting-jobs=", 0) == 0) { config.maxWaitingJobs = std::stoul(arg.substr(19)); continue; }
+            if (arg.rfind("--numa=", 0) == 0) { config.numa = arg.substr(7); continue; }
+            if (arg.rfind("--affinity=", 0) == 0) { config.affinity = arg.substr(11); continue; }
+            if (arg.rfind("--gpu=", 0) == 0) { config.gpu = arg.substr(6); continue; }
+            if (arg.rfind("--gpu-min-size=", 0) == 0) { config.gpuMinSize = std::stoul(arg.substr(15)); continue; }
+            if (arg.rfind("--gpu-max-mb=", 0) == 0) { config.gpuMaxMB = std::stoul(arg.substr(13)); continue; }
+            if (arg.rfind("--port=", 0) == 0) { config.port = (uint16_t)std::stoul(arg.substr(7)); continue; }
+            if (arg.rfind("--shards=", 0) == 0) { config.shards = arg.substr(9); continue; }
+            if (arg.rfind("--shard-min-size=", 0) == 0) { config.shardMinSize = std::stoul(arg.substr(17)); continue; }
+            if (arg.rfind("--shard-connections=", 0) == 0) { config.shardConnections = std::max(1ul, std::stoul(arg.substr(20))); continue; }
+            if (arg.rfind("--shard-hedge-ms=", 0) == 0) { config.shardHedgeMs = std::stoul(arg.substr(17)); continue; }
+            if (arg.rfind("--session-dir=", 0) == 0) { config.sessionDir = arg.substr(14); continue; }
+            if (arg.rfind("--max-sessions=", 0) == 0) { config.maxSessions = std::max(1ul, std::stoul(arg.substr(15))); continue; }
+            if (arg.rfind("--shm-max-mb=", 0) == 0) { config.shmMaxMB = std::stoul(arg.substr(13)); continue; }
+            if (arg.rfind("--auto-parallelism=", 0) == 0) { config.autoParallelism = std::stoi(arg.substr(19)) != 0; continue; }
+            if (arg.rfind("--pipeline-depth=", 0) == 0) { config.pipelineDepth = std::max(1ul, std::stoul(arg.substr(17))); continue; }
+        } catch (...) {
+            std::cerr << LOG_PREFIX << "Invalid value in option: " << arg << std::endl;
+            return false;
+        }
+        {
+            std::cerr << LOG_PREFIX << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fills g_numaNodes from --numa and returns the worker affinity from --affinity; false on a bad value
+bool configure_numa(const ServerConfig& config, Affinity& affinity) {
+    std::vector<NumaNode> detected = detect_numa_nodes();
+    bool enabled;
+    if (config.numa == "auto") enabled = detected.size() > 1;
+    else if (config.numa == "0" || config.numa == "1") enabled = config.numa == "1";
+    else { std::cerr << LOG_PREFIX << "Unknown --numa value: " << config.numa << std::endl; return false; }
+
+    if (config.affinity == "auto") affinity = enabled ? Affinity::Node : Affinity::None;
+    else if (config.affinity == "none") affinity = Affinity::None;
+    else if (config.affinity == "node") affinity = Affinity::Node;
+    else if (config.affinity == "core") affinity = Affinity::Core;
+    else { std::cerr << LOG_PREFIX << "Unknown --affinity value: " << config.affinity << std::endl; return false; }
+
+    if (enabled) {
+        g_numaNodes = detected;
+    } else {
+        NumaNode all{-1, {}};
+        for (const NumaNode& node : detected) all.cpus.insert(all.cpus.end(), node.cpus.begin(), node.cpus.end());
+        std::sort(all.cpus.begin(), all.cpus.end());
+        g_numaNodes.push_back(std::move(all));
+    }
+    std::cout << LOG_PREFIX << "NUMA " << (enabled ? "on" : "off") << ": " << detected.size() << " node(s) detected";
+    if (enabled) {
+        for (const NumaNode& node : g_numaNodes) std::cout << ", node " << node.osId << " with " << node.cpus.size() << " CPUs";
+    }
+    std::cout << "." << std::endl;
+    return true;
+}
+
+#ifndef LAB4_NO_MAIN // bench/server_bench.cpp includes this file and brings its own main()
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+    if (!parse_server_args(argc, argv, config)) return 1;
+    if (!select_kernels(config.kernel)) return 1;
+    std::cout << LOG_PREFIX << "Reduction kernels: " << g_kernels->name << std::endl;
+    Affinity affinity;
+    if (!configure_numa(config, affinity)) return 1;
+    std::vector<int> boundNodes;
+    if (numa_enabled()) {
+        for (const NumaNode& node : g_numaNodes) boundNodes.push_back(node.osId);
+    }
+    g_bufferPool.configure(config.bufferPoolMB << 20, config.hugePages, boundNodes);
+    g_resultCache.configure(config.cacheMB << 20);
+    if (!config.sessionDir.empty()) {
+        if (!g_sessions.configure(config.sessionDir, config.maxSessions)) return 1;
+        if (g_resultCache.enabled()) g_resultCache.persist(config.sessionDir + "/results.cache");
+    }
+    if (!g_gpu.start(config)) return 1;
+    if (!g_shards.start(config)) return 1;
+
+    int iResult;
+#ifdef _WIN32
     WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (iResult != 0) {
         std::cerr << LOG_PREFIX << "WSAStartup failed: " << iResult << std::endl; return 1;
     }
+#endif
 
     SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (listenSocket == INVALID_SOCKET) {
@@ -324,14 +5982,18 @@ int main() {
     }
 
     // Allow address reuse - helps prevent "address already in use" errors on quick restarts
-    char optval = 1;
-    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    int optval = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&optval, sizeof(optval));
+    // Accepted sockets inherit the receive buffer, and the TCP window scale is fixed during the handshake
+    if (config.recvBufferBytes > 0) {
+        setsockopt(listenSocket, SOL_SOCKET, SO_RCVBUF, (const char*)&config.recvBufferBytes, sizeof(int));
+    }
 
 
     sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(SERVER_PORT);
+    serverAddr.sin_port = htons(config.port);
 
     iResult = bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
     if (iResult == SOCKET_ERROR) {
@@ -345,11 +6007,27 @@ int main() {
         closesocket(listenSocket); WSACleanup(); return 1;
     }
 
-    std::cout << LOG_PREFIX << "Server listening on port " << SERVER_PORT << "..." << std::endl;
+    unsigned int hwThreads = std::thread::hardware_concurrency();
+    g_computePool = std::make_unique<ThreadPool>(hwThreads ? hwThreads : 4, g_numaNodes, affinity);
+    std::cout << LOG_PREFIX << "Compute pool started with " << g_computePool->size() << " worker threads on "
+              << g_computePool->nodes() << " node(s)." << std::endl;
+    calibrate_cost_model(config.autoParallelism);
+    g_scheduler.configure(config.maxJobs ? config.maxJobs : 2 * g_computePool->size(), config.maxWaitingJobs);
+
+    // A few I/O threads are plenty: they only move bytes, compute runs on the pool
+    size_t ioThreads = config.ioThreads ? config.ioThreads : std::max(1u, std::min(4u, hwThreads / 4));
+    if (!config.ioThreads && numa_enabled()) ioThreads = std::max(ioThreads, g_numaNodes.size()); // A loop on every node
+    IoService ioService(ioThreads, config, affinity != Affinity::None);
+    if (!ioService.start()) {
+        closesocket(listenSocket); WSACleanup(); return 1;
+    }
+    std::cout << LOG_PREFIX << "I/O service started with " << ioService.size() << " threads." << std::endl;
+
+    std::cout << LOG_PREFIX << "Server listening on port " << config.port << "..." << std::endl;
 
     while (true) {
         sockaddr_in clientAddrInfo; // To get client info for logging
-        int clientAddrSize = sizeof(clientAddrInfo);
+        socklen_t clientAddrSize = sizeof(clientAddrInfo);
         SOCKET clientSocket = accept(listenSocket, (struct sockaddr*)&clientAddrInfo, &clientAddrSize);
 
         if (clientSocket == INVALID_SOCKET) {
@@ -364,19 +6042,23 @@ int main() {
                 break; // Exit loop on critical accept error
             }
         }
-        // Create and detach thread for the new client
+        // Hand the socket to the I/O threads
         try {
-            std::thread clientThread(handle_client, clientSocket);
-            clientThread.detach();
-        } catch (const std::system_error& e) {
-            std::cerr << LOG_PREFIX << "Failed to create thread for client: " << e.what() << ". Closing socket." << std::endl;
-            closesocket(clientSocket); // Clean up the socket if thread creation failed
+            ioService.add_client(clientSocket);
+        } catch (const std::exception& e) {
+            std::cerr << LOG_PREFIX << "Failed to register client: " << e.what() << ". Closing socket." << std::endl;
+            closesocket(clientSocket);
         }
     }
 
     std::cout << LOG_PREFIX << "Shutting down listener socket." << std::endl;
     closesocket(listenSocket);
+    ioService.stop();      // No new jobs after this
+    g_shards.stop();       // Shards no backend can take run on the pool
+    g_gpu.stop();          // Its fallbacks may still queue pool tasks
+    g_computePool.reset(); // Joins the workers once queued tasks are done
     WSACleanup();
     std::cout << LOG_PREFIX << "Server shut down complete." << std::endl;
     return 0;
 }
+#endif